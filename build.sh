@@ -26,7 +26,24 @@ then
 #    echo "$(tput setaf 3)Previous compile result: renamed for now.$(tput sgr0)"
 fi
 
-gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 -o $daemon_name $daemon_name.c
+# static tracepoints for bpftrace, if sys/sdt.h is there (systemtap-sdt-dev) - see hpm_trace.h
+usdt=""
+if [ -e /usr/include/sys/sdt.h ]
+then
+    usdt="-DHPM_USDT"
+    echo "Static tracepoints... $(tput setaf 3)BUILT IN$(tput sgr0)."
+fi
+
+# the control core goes in a static library of its own, with the sensors filter and
+# statistics, so simulations and tools can use them too; tools/hpm-alive, which monit
+# checks hpm with, has no dependencies and is built with the daemon
+gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 ${usdt} -c -o ${daemon_name}_core.o ${daemon_name}_core.c && \
+gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -c -o ${daemon_name}_stats.o ${daemon_name}_stats.c && \
+gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -c -o ${daemon_name}_filter.o ${daemon_name}_filter.c && \
+ar rcs lib${daemon_name}core.a ${daemon_name}_core.o ${daemon_name}_stats.o ${daemon_name}_filter.o && \
+gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 ${usdt} -o $daemon_name $daemon_name.c \
+    -L. -l${daemon_name}core -lm -ldl -lpthread && \
+gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -I. -o tools/${daemon_name}-alive tools/${daemon_name}-alive.c
 if (( $? > 0 ))
 then
     mv $daemon_name.prev $daemon_name
@@ -40,4 +57,35 @@ else
 #  on success, update the permissions of the update-executable script
     chmod +x scripts/update-hpm-executable.sh
 fi
+
+# the plant simulator and the tools using it are only built when asked for: ./build.sh tools
+# (the shared control core hpm-ab loads is hpm_core.so, not libhpmcore.so, so the daemon
+# above never links to it)
+if [ "$1" == "tools" ]
+then
+    echo "$(tput setaf 3)Starting $(tput setaf 6)tools$(tput setaf 3) compilation...$(tput sgr0)"
+    gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -c -o ${daemon_name}_sim.o ${daemon_name}_sim.c && \
+    gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -c -o ${daemon_name}_log.o ${daemon_name}_log.c && \
+    ar rcs lib${daemon_name}sim.a ${daemon_name}_sim.o ${daemon_name}_log.o && \
+    gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -I. -o tools/${daemon_name}-sim tools/${daemon_name}-sim.c \
+        -L. -l${daemon_name}sim -l${daemon_name}core -lm && \
+    gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -I. -o tools/${daemon_name}-replay tools/${daemon_name}-replay.c \
+        -L. -l${daemon_name}sim -l${daemon_name}core -lm && \
+    gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -I. -o tools/${daemon_name}-sweep tools/${daemon_name}-sweep.c \
+        -L. -l${daemon_name}sim -l${daemon_name}core -lm -lpthread && \
+    gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 -I. -o tools/${daemon_name}-bench \
+        tools/${daemon_name}-bench.c -L. -l${daemon_name}core -lm -ldl -lpthread && \
+    gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 ${usdt} -fPIC -shared -o ${daemon_name}_core.so ${daemon_name}_core.c && \
+    gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -I. -o tools/${daemon_name}-ab tools/${daemon_name}-ab.c \
+        -L. -l${daemon_name}sim -l${daemon_name}core -lm -ldl -lpthread && \
+    gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -o tools/hwwm-standin tools/hwwm-standin.c && \
+    gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 -I. -o tools/hwwm-emu tools/hwwm-emu.c \
+        -L. -l${daemon_name}sim -l${daemon_name}core -lm -ldl -lpthread
+    if (( $? > 0 ))
+    then
+        echo "$(tput setaf 7)$(tput setab 1)ERROR: Tools compilation failed!$(tput sgr0)"
+        exit 254
+    fi
+    echo "$(tput setaf 2)$(tput smso)Tools compilation SUCCESS!$(tput rmso)$(tput sgr0)"
+fi
 #EOF
\ No newline at end of file
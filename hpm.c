@@ -17,6 +17,8 @@
 * sending SIGUSR1 signal to the daemon process. The event is noted in the log file.
 * The logfile itself can be "grep"-ed for "ALARM" and "INFO" to catch and notify
 * of notable events, recorded by the daemon.
+* The decisions themselves are made by the control core in hpm_core.c, which has
+* no I/O of its own - this file does the reading, writing and logging around it.
 */
 
 #ifndef PGMVER
@@ -26,6 +28,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,9 +39,23 @@
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <math.h>
 #include <ctype.h>
 #include <time.h>
-
+#include <pthread.h>
+#include <dlfcn.h>
+#include <errno.h>
+
+#include "hpm_core.h"
+#include "hpm_stats.h"
+#include "hpm_filter.h"
+#include "hpm_trace.h"
+#include "hpm_heartbeat.h"
+
+/* Paths of the files and sysfs trees hpm uses; a build can set all of them itself by
+   defining HPM_PATHS_SET - the tools built on hpm.c do, in tools/hpm_whitebox.h, to run
+   against fixtures. A new one goes there too */
+#ifndef HPM_PATHS_SET
 #define RUNNING_DIR     "/tmp"
 #define LOCK_FILE       "/run/hpm.pid"
 #define LOG_FILE        "/run/shm/hpm.log"
@@ -43,11 +63,31 @@
 #define TABLE_FILE      "/run/shm/hpm_current"
 #define JSON_FILE	"/run/shm/hpm_current_json"
 #define CFG_TABLE_FILE  "/run/shm/hpm_cur_cfg"
+#define COUNTERS_FILE   "/run/shm/hpm_counters"
+#define DEFROST_FILE    "/run/shm/hpm_defrost"
+#define STATS_FILE      "/run/shm/hpm_stats"
+#define HEAT_FILE       "/run/shm/hpm_heat"
+#define SHADOW_FILE     "/run/shm/hpm_shadow"
+#define LATENCY_FILE    "/run/shm/hpm_latency"
+#define WRITES_FILE     "/run/shm/hpm_writes"
+#define HEARTBEAT_FILE  "/run/shm/hpm_heartbeat"
 #define CONFIG_FILE     "/etc/hpm.cfg"
-#define PRSSTNC_FILE      "/var/log/hpm_prsstnc"
+#define PRSSTNC_DIR     "/var/log"
+#define PRSSTNC_FILE      PRSSTNC_DIR"/hpm_prsstnc"
+#define JOURNAL_FILE    PRSSTNC_DIR"/hpm_prsstnc.jrnl"
+#define STATE_FILE      "/run/shm/hpm_state"
+#define BOOT_ID_FILE    "/proc/sys/kernel/random/boot_id"
+#define GPIO_ROOT       "/sys/class/gpio"
+#endif
+
+/* Pause after every sensor read, in microseconds - 1 second is 1000000, so 50000 is
+   1/20th of a second */
+#ifndef SENSOR_PAUSE
+#define SENSOR_PAUSE    50000
+#endif
 
 #define BUFFER_MAX 3
-#define DIRECTION_MAX 35
+#define GPIO_PATH_MAX (sizeof(GPIO_ROOT)+20)
 #define VALUE_MAX 50
 #define MAXLEN 80
 
@@ -57,11 +97,39 @@
 #define LOW  0
 #define HIGH 1
 
-/* Number of all sensors to be used by the system */
-#define TOTALSENSORS         7
+/* Number of persistence journal records after which it gets compacted - at most
+   one record per 10 minutes, so this is about a day worth of compressor work */
+#define JOURNAL_MAX_RECORDS  144
+
+/* Longest persistence journal record - one line, all the persisted counters changed */
+#define JOURNAL_RECORD_LEN   4096
+
+/* Seconds per control cycle - all control state timers count these */
+#define CYCLE_SECONDS        5
+
+/* Longest defrost sequence accepted from the config file, in cycles - 20 minutes */
+#define DEFROST_MAX_CYCLES   240
+
+/* Most control settings the shadow control instance can have changed */
+#define SHADOW_MAXSETS       16
 
-/* The temp at which a compressor is considered overheating */
-#define COMP_MAX_TEMP        63
+/* Warm restart state snapshot format version and maximum age in seconds
+   for it to be trusted on start-up */
+#define STATE_VERSION        4
+#define STATE_MAX_AGE        900
+
+/* Total number of temperature sensors: compressor and fin stack of every AC, plus
+   water in, water out and environment */
+#define TOTALSENSORS         (2*MAXUNITS+3)
+
+/* Sensor numbers of AC unit u (counting from 0) - AC1 and AC2 keep the numbers they
+   always had, the ones of the ACs added later come after the environment sensor */
+#define SENS_CMP(u)          ((u)<2 ? 2*(u)+1 : 2*(u)+4)
+#define SENS_CND(u)          (SENS_CMP(u)+1)
+/* ...and of the water in, water out and environment sensors */
+#define SENS_WI              5
+#define SENS_WO              6
+#define SENS_ENV             7
 
 /* Array of char* holding the paths to temperature DS18B20 sensors */
 char* sensor_paths[TOTALSENSORS+1];
@@ -71,86 +139,125 @@ char* sensor_paths[TOTALSENSORS+1];
     initialised with borderline value to trigger immediately on errors during
     start-up; the program logic tolerates 1 minute of missing sensor data
 */
-unsigned short sensor_read_errors[TOTALSENSORS+1] = { 0, 3, 3, 3, 3, 3, 3, 3 };
+unsigned short sensor_read_errors[TOTALSENSORS+1] = { 0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3 };
 
 /* current sensors temperatures - e.g. values from last read */
-float sensors[TOTALSENSORS+1] = { 0, -200, -200, -200, -200, -200, -200, -200 };
+float sensors[TOTALSENSORS+1] = { 0, -200, -200, -200, -200, -200, -200, -200, -200, -200, -200, -200 };
 
 /* previous sensors temperatures - e.g. values from previous to last read */
-float sensors_prv[TOTALSENSORS+1] = { 0, -200, -200, -200, -200, -200, -200, -200 };
+float sensors_prv[TOTALSENSORS+1] = { 0, -200, -200, -200, -200, -200, -200, -200, -200, -200, -200, -200 };
 
-/* per sensor maximum allowed temp difference from last read */
-float mtd[TOTALSENSORS+1] = { 0, 1, 2.5, 1, 2.5, 0.25, 0.25, 0.3 };
+/* per sensor readings filters - see hpm_filter.h; and their default gates, the most a
+   reading may move from the filtered value before it has to be confirmed */
+struct hpm_filter sfilter[TOTALSENSORS+1];
+float filter_gate_default[TOTALSENSORS+1] = { 0, 3, 4, 3, 4, 1, 1, 1, 3, 4, 3, 4 };
 
 /* per sensor corrections to apply upon read */
-float scorr[TOTALSENSORS+1] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+float scorr[TOTALSENSORS+1] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
 const char *sensor_names[TOTALSENSORS+1] = { "zero", "AC1 compressor", "AC1 fin stack", 
-              "AC2 compressor", "AC2 fin stack", "water in", "water out", "environment" };
+              "AC2 compressor", "AC2 fin stack", "water in", "water out", "environment",
+              "AC3 compressor", "AC3 fin stack", "AC4 compressor", "AC4 fin stack" };
 /* and sensor name mappings */
-#define   Tac1cmp            sensors[1]
-#define   Tac1cnd             sensors[2]
-#define   Tac2cmp            sensors[3]
-#define   Tac2cnd             sensors[4]
-#define   Twi                    sensors[5]
-#define   Two                   sensors[6]
-#define   Tenv                  sensors[7]
-
-#define   Tac1cmpPrev            sensors_prv[1]
-#define   Tac1cndPrev             sensors_prv[2]
-#define   Tac2cmpPrev            sensors_prv[3]
-#define   Tac2cndPrev             sensors_prv[4]
-#define   TwiPrev                    sensors_prv[5]
-#define   TwoPrev                   sensors_prv[6]
-#define   TenvPrev                  sensors_prv[7]
-
-/* TenvArr == Array of last minute or so environment temp readings, used
-to calculate an average, which gets used to decide to heat, cool or stay idle */
-float TenvArr[12] = { 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20 };
-/* TenvArr_lu holds the index of the last updated TenvArr element */
-unsigned short TenvArr_lu = 0;
-/* and the average environment temp var itself */
+#define   Tcmp(u)             sensors[SENS_CMP(u)]
+#define   Tcnd(u)             sensors[SENS_CND(u)]
+#define   Twi                    sensors[SENS_WI]
+#define   Two                   sensors[SENS_WO]
+#define   Tenv                  sensors[SENS_ENV]
+
+#define   TwiPrev                    sensors_prv[SENS_WI]
+#define   TwoPrev                   sensors_prv[SENS_WO]
+#define   TenvPrev                  sensors_prv[SENS_ENV]
+
+/* rolling window statistics of every sensor's readings - see hpm_stats.h; the windows
+   are stats_window long, except the environment one, which is tenv_window */
+struct hpm_stats sstats[TOTALSENSORS+1];
+#define   TenvStats             sstats[SENS_ENV]
+
+/* the average environment temp over its window, which gets used to decide to heat, cool
+   or stay idle */
 float TenvAvrg = 20;
 
 /* HPmode var which uses inverse to hwwm values */
-#define HEAT 1
-#define COOL 0
-
 unsigned short HPmode = HEAT;
 
-/* current controls state - e.g. set on last decision making */
-short controls[9] = { -1, 0, 0, 0, 0, 0, 0, 0, 0 };
-
-/* and control name mappings */
-#define   Cac1cmp             controls[1]
-#define   Cac1fan               controls[2]
-#define   Cac1fv                 controls[3]
-#define   Cac1mode            controls[4]
-#define   Cac2cmp              controls[5]
-#define   Cac2fan                controls[6]
-#define   Cac2fv                  controls[7]
-#define   Cac2mode            controls[8]
-
-/* AC mode states:
-            0 - off; 
-            1 - starting; 
-            2 - compressor cooling; 
-            3 - fin stack heating up */
-
-/* controls state cycles - zeroed on change to state */
-unsigned long ctrlstatecycles[9] = { 1234567890, 45, 0, 0, 0, 45, 0, 0, 0 };
-
-#define   SCac1cmp             ctrlstatecycles[1]
-#define   SCac1fan               ctrlstatecycles[2]
-#define   SCac1fv                 ctrlstatecycles[3]
-#define   SCac1mode           ctrlstatecycles[4]
-#define   SCac2cmp             ctrlstatecycles[5]
-#define   SCac2fan               ctrlstatecycles[6]
-#define   SCac2fv                 ctrlstatecycles[7]
-#define   SCac2mode           ctrlstatecycles[8]
-
-unsigned long C1RunCs = 0;
-unsigned long C2RunCs = 0;
+/* control state, as kept by the control core - see hpm_core.h */
+struct hpm_state hs;
+
+/* control parameters for the control core - set from the config file */
+struct hpm_params hp;
+
+/* control state of AC unit u (counting from 0) */
+#define   AC(u)               hs.unit[(u)]
+
+/* Operational counters - kept per AC, each rolled up for the current and previous
+   hour and day, and for the lifetime of the unit; the counted events come from
+   the control core */
+
+const char *counter_kinds[CNT_PER_AC] = { "starts", "runCycles", "fanToggles", "valveToggles",
+              "defrosts", "defrostCycles", "OHPtrips", "mode0Cycles", "mode1Cycles",
+              "mode2Cycles", "mode3Cycles", "mode4Cycles", "mode5Cycles", "OHPpreempts" };
+
+struct op_counter
+{
+    char             name[20];
+    unsigned long    hour;
+    unsigned long    day;
+    unsigned long    life;
+    unsigned long    prev_hour;
+    unsigned long    prev_day;
+};
+
+struct op_counter counters[TOTALCOUNTERS];
+
+/* Defrost phases statistics since start-up, per AC and phase: how many times a phase
+   ended, how many of those on its exit condition, and the phase cycles it took */
+struct defrost_stat
+{
+    unsigned long    runs;
+    unsigned long    early;
+    unsigned long    cycles;
+    unsigned long    min;
+    unsigned long    max;
+};
+
+struct defrost_stat dstats[MAXUNITS][DEFROST_MAXPHASES];
+
+/* Heat output estimation: the heat the water loop takes is worked out every cycle from
+   the water that went through it and the water OUT to IN temp difference, and shared
+   between the ACs running. It is kept per AC in whole Wh, by AC mode and by environment
+   temp band, together with the compressor run cycles per band - so units, settings and
+   the heat per run hour at different outdoor temps can be compared; all of it persisted */
+#define HEAT_BANDS           6      /* below -10 C, 5 C wide bands, 10 C and above */
+#define WATER_HEAT           4186   /* J per litre of water and C */
+#define HEAT_PER_AC          (5+2*HEAT_BANDS)   /* persisted counters */
+
+struct heat_meter
+{
+    unsigned long    mode[6];           /* Wh delivered in every AC mode */
+    unsigned long    back;              /* Wh taken back from the water - as DEFROST does */
+    unsigned long    band[HEAT_BANDS];  /* Wh delivered per environment temp band */
+    unsigned long    runs[HEAT_BANDS];  /* compressor run cycles per environment temp band */
+    double           part;              /* the parts of a Wh delivered and taken back, not counted yet */
+    double           part_back;
+};
+
+struct heat_meter heat[MAXUNITS];
+
+/* water flow: a pulse flow meter's count read from flow_meter, if set, else flow_rate */
+float flow_rate = 0;                    /* litres per minute; 0 - not known */
+float flow_pulses = 0;                  /* flow meter pulses per litre */
+unsigned long flow_count = 0;           /* the last flow meter count read */
+short flow_meter_ok = 0;
+
+/* the heat the water loop takes now, in W */
+float heat_power = 0;
+
+/* the defrost in progress of every AC: phase cycles as logged at its end, total cycles
+   and the last phase that ended */
+char dprogress[MAXUNITS][100];
+unsigned long dcycles[MAXUNITS];
+short dlast_phase[MAXUNITS];
 
 /* Nubmer of cycles (~5 seconds each) that the program has run */
 unsigned long ProgramRunCycles  = 0;
@@ -162,17 +269,11 @@ unsigned short current_month = 0;
 /* a var to be non-zero if it is winter time - so furnace should not be allowed to go too cold */
 unsigned short now_is_winter = 0;
 
-/* If other than zero - low mode is enabled, i.e. one AC can be run */
-unsigned short HPL = 0;
-
-/* If other than zero - HIGH mode is enabled, i.e. both ACs can be run */
-unsigned short HPH = 0;
-
 /* Comms buffer - sent by hwwm over dedicate wire
     States:
     0 == ALL OFF
     1 == 1 AC ON a.k.a. Heat Pump Low mode
-    2 == 2 ACs ON a.k.a. Heat Pump HIGH mode
+    2 == all ACs ON a.k.a. Heat Pump HIGH mode
     3 == 3 all is OFF, because we are powered by BATTERY  */
 unsigned short COMMS = 0;
 
@@ -181,32 +282,27 @@ unsigned short COMMS = 0;
     0 == busy; no changes to state allowed/will be honered
     1 == busy; can ADD an AC
     2 == busy; can REMOVE an AC
-    3 == done/request is fullfilled; can change state as desired */
+    3 == done/request is fullfilled; can change state as desired
+    The control core works these out for any number of ACs */
 unsigned short sendBits = 0;
 
 struct cfg_struct
 {
-    char    ac1cmp_sensor[MAXLEN];
-    char    ac1cnd_sensor[MAXLEN];
-    char    ac2cmp_sensor[MAXLEN];
-    char    ac2cnd_sensor[MAXLEN];
+    char    units_str[MAXLEN];
+    int     units;
+    char    accmp_sensor[MAXUNITS][MAXLEN];
+    char    accnd_sensor[MAXUNITS][MAXLEN];
     char    wi_sensor[MAXLEN];
     char    wo_sensor[MAXLEN];
     char    tenv_sensor[MAXLEN];
     char    invert_output_str[MAXLEN];
     int      invert_output;
-    char    ac1cmp_pin_str[MAXLEN];
-    int     ac1cmp_pin;
-    char    ac1fan_pin_str[MAXLEN];
-    int     ac1fan_pin;
-    char    ac1v_pin_str[MAXLEN];
-    int     ac1v_pin;
-    char    ac2cmp_pin_str[MAXLEN];
-    int     ac2cmp_pin;
-    char    ac2fan_pin_str[MAXLEN];
-    int     ac2fan_pin;
-    char    ac2v_pin_str[MAXLEN];
-    int     ac2v_pin;
+    char    accmp_pin_str[MAXUNITS][MAXLEN];
+    int     accmp_pin[MAXUNITS];
+    char    acfan_pin_str[MAXUNITS][MAXLEN];
+    int     acfan_pin[MAXUNITS];
+    char    acv_pin_str[MAXUNITS][MAXLEN];
+    int     acv_pin[MAXUNITS];
     char    commspin1_pin_str[MAXLEN];
     int     commspin1_pin;
     char    commspin2_pin_str[MAXLEN];
@@ -217,16 +313,42 @@ struct cfg_struct
     int     commspin4_pin;
     char    mode_str[MAXLEN];
     int     mode;
-    char    use_ac1_str[MAXLEN];
-    int     use_ac1;
-    char    use_ac2_str[MAXLEN];
-    int     use_ac2;
+    char    use_ac_str[MAXUNITS][MAXLEN];
+    int     use_ac[MAXUNITS];
+    char    acmax_temp_str[MAXUNITS][MAXLEN];
+    float  acmax_temp[MAXUNITS];
+    char    accool_temp_str[MAXUNITS][MAXLEN];
+    float  accool_temp[MAXUNITS];
     char    wicorr_str[MAXLEN];
     float  wicorr;
     char    wocorr_str[MAXLEN];
     float  wocorr;
     char    tenvcorr_str[MAXLEN];
     float  tenvcorr;
+    char    filter_str[TOTALSENSORS+1][MAXLEN];
+    char    stats_window_str[MAXLEN];
+    int     stats_window;
+    char    tenv_window_str[MAXLEN];
+    int     tenv_window;
+    char    defrost_phase_str[DEFROST_MAXPHASES][MAXLEN];
+    char    frost_predict_str[MAXLEN];
+    char    ohp_predict_str[MAXLEN];
+    char    flow_rate_str[MAXLEN];
+    char    flow_meter[MAXLEN];
+    char    flow_pulses_str[MAXLEN];
+    char    hwwm_socket[MAXLEN];
+    char    hpm_socket[MAXLEN];
+    char    hwwm_timeout_str[MAXLEN];
+    int     hwwm_timeout;
+    char    sd_budget_str[MAXLEN];
+    int     sd_budget;
+    char    shadow_str[MAXLEN];
+    int     shadow;
+    char    shadow_core[MAXLEN];
+    char    shadow_set[SHADOW_MAXSETS][2][MAXLEN];
+    short   shadow_sets;
+    char    frost_spread_str[MAXLEN];
+    char    frost_below_str[MAXLEN];
 }
 cfg_struct;
 
@@ -236,9 +358,32 @@ short need_to_read_cfg = 0;
 
 short just_started = 0;
 
+/* non-zero if this run resumed from a valid warm restart state snapshot */
+short warm_started = 0;
+/* the sensors filters came from the snapshot - the first read goes through them */
+short filters_restored = 0;
+
+/* the safety rules checker of the control outputs - see hpm_core.h */
+struct hpm_check hchk;
+
+/* non-zero once a safety rule got broken: all ACs are kept OFF until hpm is restarted */
+short failsafe = 0;
+
+/* non-zero when started with -f: not to fork away from the terminal or the supervisor */
+short foreground = 0;
+
+/* GPIO reads and writes failed since the start */
+unsigned long gpio_errors = 0;
+
 /* FORWARD DECLARATIONS so functions can be used in preceding ones */
 short
 DisableGPIOpins();
+void
+RegisterPersistentCounter(const char *name, unsigned long *value);
+short
+SensorInUse(short i);
+void
+SdNotify(const char *state);
 /* end of forward-declared functions */
 
 void
@@ -251,52 +396,20 @@ rangecheck_GPIO_pin( int p )
 short
 not_every_GPIO_pin_is_UNIQUE()
 {
-	short result=0;
-	if (cfg.ac1cmp_pin == cfg.ac1fan_pin) result++;
-	if (cfg.ac1cmp_pin == cfg.ac1v_pin) result++;
-	if (cfg.ac1cmp_pin == cfg.ac2cmp_pin) result++;
-	if (cfg.ac1cmp_pin == cfg.ac2fan_pin) result++;
-	if (cfg.ac1cmp_pin == cfg.ac2v_pin) result++;
-	if (cfg.ac1cmp_pin == cfg.commspin1_pin) result++;
-	if (cfg.ac1cmp_pin == cfg.commspin2_pin) result++;
-	if (cfg.ac1cmp_pin == cfg.commspin3_pin) result++;
-	if (cfg.ac1cmp_pin == cfg.commspin4_pin) result++;
-	if (cfg.ac1fan_pin == cfg.ac1v_pin) result++;
-	if (cfg.ac1fan_pin == cfg.ac2cmp_pin) result++;
-	if (cfg.ac1fan_pin == cfg.ac2fan_pin) result++;
-	if (cfg.ac1fan_pin == cfg.ac2v_pin) result++;
-	if (cfg.ac1fan_pin == cfg.commspin1_pin) result++;
-	if (cfg.ac1fan_pin == cfg.commspin2_pin) result++;
-	if (cfg.ac1fan_pin == cfg.commspin3_pin) result++;
-	if (cfg.ac1fan_pin == cfg.commspin4_pin) result++;
-	if (cfg.ac1v_pin == cfg.ac2cmp_pin) result++;
-	if (cfg.ac1v_pin == cfg.ac2fan_pin) result++;
-	if (cfg.ac1v_pin == cfg.ac2v_pin) result++;
-	if (cfg.ac1v_pin == cfg.commspin1_pin) result++;
-	if (cfg.ac1v_pin == cfg.commspin2_pin) result++;
-	if (cfg.ac1v_pin == cfg.commspin3_pin) result++;
-	if (cfg.ac1v_pin == cfg.commspin4_pin) result++;
-	if (cfg.ac2cmp_pin == cfg.ac2fan_pin) result++;
-	if (cfg.ac2cmp_pin == cfg.ac2v_pin) result++;
-	if (cfg.ac2cmp_pin == cfg.commspin1_pin) result++;
-	if (cfg.ac2cmp_pin == cfg.commspin2_pin) result++;
-	if (cfg.ac2cmp_pin == cfg.commspin3_pin) result++;
-	if (cfg.ac2cmp_pin == cfg.commspin4_pin) result++;
-	if (cfg.ac2fan_pin == cfg.ac2v_pin) result++;
-	if (cfg.ac2fan_pin == cfg.commspin1_pin) result++;
-	if (cfg.ac2fan_pin == cfg.commspin2_pin) result++;
-	if (cfg.ac2fan_pin == cfg.commspin3_pin) result++;
-	if (cfg.ac2fan_pin == cfg.commspin4_pin) result++;
-	if (cfg.ac2v_pin == cfg.commspin1_pin) result++;
-	if (cfg.ac2v_pin == cfg.commspin2_pin) result++;
-	if (cfg.ac2v_pin == cfg.commspin3_pin) result++;
-	if (cfg.ac2v_pin == cfg.commspin4_pin) result++;
-	if (cfg.commspin1_pin == cfg.commspin2_pin) result++;
-	if (cfg.commspin1_pin == cfg.commspin3_pin) result++;
-	if (cfg.commspin1_pin == cfg.commspin4_pin) result++;
-	if (cfg.commspin2_pin == cfg.commspin3_pin) result++;
-	if (cfg.commspin2_pin == cfg.commspin4_pin) result++;
-	if (cfg.commspin3_pin == cfg.commspin4_pin) result++;
+	int pins[3*MAXUNITS+4];
+	short result=0, n=0, i, k;
+	for (i=0;i<cfg.units;i++) {
+		pins[n++] = cfg.accmp_pin[i];
+		pins[n++] = cfg.acfan_pin[i];
+		pins[n++] = cfg.acv_pin[i];
+	}
+	pins[n++] = cfg.commspin1_pin;
+	pins[n++] = cfg.commspin2_pin;
+	pins[n++] = cfg.commspin3_pin;
+	pins[n++] = cfg.commspin4_pin;
+	for (i=0;i<n;i++)
+		for (k=i+1;k<n;k++)
+			if (pins[i] == pins[k]) result++;
 	return result;
 }
 
@@ -307,14 +420,23 @@ rangecheck_mode( int m )
     if (m > 8) m = 0;
 }
 
+/* rangecheck_units: 0 (not set) or out of range number of ACs means the default of 2 */
+void
+rangecheck_units( int *n )
+{
+    if ((*n < 1) || (*n > MAXUNITS)) *n = 2;
+}
+
 void
 SetDefaultPINs() {
-    cfg.ac1cmp_pin = 5;
-    cfg.ac1fan_pin = 6;
-    cfg.ac1v_pin = 13;
-    cfg.ac1cmp_pin = 16;
-    cfg.ac1fan_pin = 19;
-    cfg.ac1v_pin = 20;
+    /* compressor, fan and fourway valve pins of AC1..AC4 */
+    const int default_pins[MAXUNITS][3] = { { 5, 6, 13 }, { 16, 19, 20 }, { 23, 24, 25 }, { 12, 26, 21 } };
+    short i;
+    for (i=0;i<MAXUNITS;i++) {
+        cfg.accmp_pin[i] = default_pins[i][0];
+        cfg.acfan_pin[i] = default_pins[i][1];
+        cfg.acv_pin[i] = default_pins[i][2];
+    }
     cfg.commspin1_pin = 17;
     cfg.commspin2_pin = 18;
     cfg.commspin3_pin = 27;
@@ -323,47 +445,120 @@ SetDefaultPINs() {
 
 void
 SetDefaultCfg() {
-    strcpy( cfg.ac1cmp_sensor, "/dev/zero/1");
-    strcpy( cfg.ac1cnd_sensor, "/dev/zero/2");
-    strcpy( cfg.ac2cmp_sensor, "/dev/zero/3");
-    strcpy( cfg.ac2cnd_sensor, "/dev/zero/4");
+    short i;
+    cfg.units = 2;
+    for (i=0;i<MAXUNITS;i++) {
+        sprintf( cfg.accmp_sensor[i], "/dev/zero/%d", SENS_CMP(i) );
+        sprintf( cfg.accnd_sensor[i], "/dev/zero/%d", SENS_CND(i) );
+        cfg.use_ac[i] = 1;
+        cfg.acmax_temp[i] = 63;
+        cfg.accool_temp[i] = 56;
+    }
     strcpy( cfg.wi_sensor, "/dev/zero/5");
     strcpy( cfg.wo_sensor, "/dev/zero/6");
     strcpy( cfg.tenv_sensor, "/dev/zero/8");
     SetDefaultPINs();
     cfg.invert_output = 1;
     cfg.mode = 1;
-    cfg.use_ac1 = 1;
-    cfg.use_ac2 = 1;
     cfg.wicorr = 0;
     cfg.wocorr = 0;
     cfg.tenvcorr = 0;
+    cfg.stats_window = 300;
+    cfg.tenv_window = 60;
+
+    sensor_paths[0] = cfg.accmp_sensor[0];
+    for (i=0;i<MAXUNITS;i++) {
+        sensor_paths[SENS_CMP(i)] = cfg.accmp_sensor[i];
+        sensor_paths[SENS_CND(i)] = cfg.accnd_sensor[i];
+    }
+    sensor_paths[SENS_WI] = (char *) &cfg.wi_sensor;
+    sensor_paths[SENS_WO] = (char *) &cfg.wo_sensor;
+    sensor_paths[SENS_ENV] = (char *) &cfg.tenv_sensor;
+}
+
+/* SD card write budget: the bytes and syncs of every file hpm writes are added up per
+   day, by where they end up -
+     RAM        the files on the RAM disk that stay there;
+     SD hourly  hpm.log and the data log, on the RAM disk too, but the hourly cron job
+                appends them to /var/log - so they reach the card, once;
+     SD         the persistence file and journal, written to the card directly.
+   The last two are what hpm costs the card a day. With a daily budget for them set in
+   sd_budget, the optional writes get cut down before it is spent: while the day is on
+   pace to go over it, the data log gets a line on every change of the devices state or
+   AC modes and every 30 seconds in between - each with the number of cycles left out
+   before it - and the persistence journal a record every 30 minutes; once 90% of it is
+   spent, a line every 5 minutes in between and a record every hour. hpm.log is never
+   cut down */
+#define WR_RAM               0
+#define WR_SD_HOURLY         1
+#define WR_SD                2
+#define WR_TIERS             3
+
+struct write_tier
+{
+    unsigned long long  bytes;
+    unsigned long       writes;
+    unsigned long       syncs;
+};
+
+struct write_budget
+{
+    long                day;                /* year*1000 + day of the year counted, -1 until known */
+    time_t              day_start;
+    struct write_tier   today[WR_TIERS];
+    struct write_tier   yesterday[WR_TIERS];
+    short               level;              /* 0 - all written, 1 - over pace, 2 - 90% spent */
+}
+wbudget = { .day = -1 };
+
+const char *wr_tier_names[WR_TIERS] = { "RAM", "SD hourly", "SD" };
+
+/* per budget level: a data log line at least every that many cycles, and a persistence
+   journal record every that many 5 minute periods */
+const unsigned short wr_data_every[3] = { 1, 30/CYCLE_SECONDS, 300/CYCLE_SECONDS };
+const unsigned short wr_prsst_every[3] = { 2, 6, 12 };
+
+/* the day t is in, as counted; and when it started, if asked */
+long
+WriteDay(time_t t, time_t *start) {
+    struct tm *tm = localtime( &t );
+
+    if (start) *start = t - (tm->tm_hour*3600 + tm->tm_min*60 + tm->tm_sec);
+    return tm->tm_year*1000L + tm->tm_yday;
+}
+
+/* the day's totals of where a write to path ends up */
+struct write_tier *
+WriteTier(const char *path) {
+    if (!strncmp( path, PRSSTNC_DIR, sizeof(PRSSTNC_DIR)-1 )) return &wbudget.today[WR_SD];
+    if (!strcmp( path, LOG_FILE ) || !strcmp( path, DATA_FILE )) return &wbudget.today[WR_SD_HOURLY];
+    return &wbudget.today[WR_RAM];
+}
+
+/* account a write of bytes to path, and the syncs that made it durable; main thread only */
+void
+WriteAccount(const char *path, long bytes, unsigned short syncs) {
+    struct write_tier *t = WriteTier( path );
 
-    sensor_paths[0] = (char *) &cfg.ac1cmp_sensor;
-    sensor_paths[1] = (char *) &cfg.ac1cmp_sensor;
-    sensor_paths[2] = (char *) &cfg.ac1cnd_sensor;
-    sensor_paths[3] = (char *) &cfg.ac2cmp_sensor;
-    sensor_paths[4] = (char *) &cfg.ac2cnd_sensor;
-    sensor_paths[5] = (char *) &cfg.wi_sensor;
-    sensor_paths[6] = (char *) &cfg.wo_sensor;
-    sensor_paths[7] = (char *) &cfg.tenv_sensor;
+    if (bytes > 0) t->bytes += bytes;
+    t->writes++;
+    t->syncs += syncs;
 }
 
 short
 log_message(char *filename, char *message) {
     FILE *logfile;
-    char file_string[300];
     char timestamp[30];
     time_t t;
     struct tm *t_struct;
 
+    HPM_TRACE2(log_write, filename, message);
     t = time(NULL);
     t_struct = localtime( &t );
     strftime( timestamp, sizeof timestamp, "%F %T", t_struct );
-    sprintf( file_string, "%s %s", timestamp, message );
     logfile = fopen( filename, "a" );
     if ( !logfile ) return -1;
-    fprintf( logfile, "%s\n", file_string );
+    WriteAccount( filename, fprintf( logfile, "%s %s\n", timestamp, message ), 0 );
     fclose( logfile );
     return 0;
 }
@@ -372,18 +567,17 @@ log_message(char *filename, char *message) {
 void
 log_msg_ovr(char *filename, char *message) {
     FILE *logfile;
-    char file_string[300];
     char timestamp[30];
     time_t t;
     struct tm *t_struct;
 
+    HPM_TRACE2(log_write, filename, message);
     t = time(NULL);
     t_struct = localtime( &t );
     strftime( timestamp, sizeof timestamp, "%F %T", t_struct );
-    sprintf( file_string, "%s%s", timestamp, message );
     logfile = fopen( filename, "w" );
     if ( !logfile ) return;
-    fprintf( logfile, "%s\n", file_string );
+    WriteAccount( filename, fprintf( logfile, "%s%s\n", timestamp, message ), 0 );
     fclose( logfile );
 }
 
@@ -391,12 +585,12 @@ log_msg_ovr(char *filename, char *message) {
 void
 log_msg_cln(char *filename, char *message) {
     FILE *logfile;
-    char file_string[300];
 
-    sprintf( file_string, "%s", message );
+    HPM_TRACE2(log_write, filename, message);
     logfile = fopen( filename, "w" );
     if ( !logfile ) return;
-    fprintf( logfile, "%s", file_string );
+    fputs( message, logfile );
+    WriteAccount( filename, strlen( message ), 0 );
     fclose( logfile );
 }
 
@@ -423,13 +617,487 @@ trim (char * s)
     return s;
 }
 
+/* The defrost sequence is the control core default one, unless the config file has
+   defrost_phase1, defrost_phase2... - these replace the whole sequence, if all are valid */
+void
+SetDefrostSequence()
+{
+    struct hpm_params def;
+    struct hpm_defrost_phase phases[DEFROST_MAXPHASES];
+    unsigned long total = 0;
+    char buff[150];
+    short n;
+
+    hpm_params_default( &def );
+    hp.defrost_phases = def.defrost_phases;
+    memcpy( hp.defrost, def.defrost, sizeof(hp.defrost) );
+    if (!cfg.defrost_phase_str[0][0]) return;
+
+    for (n=0; (n<DEFROST_MAXPHASES) && cfg.defrost_phase_str[n][0]; n++) {
+        if (hpm_defrost_phase_parse( cfg.defrost_phase_str[n], &phases[n] )) {
+            sprintf( buff, "WARNING: Bad defrost_phase%d in config - using the default defrost sequence.", n+1 );
+            log_message(LOG_FILE, buff);
+            return;
+        }
+        total += phases[n].max_cycles;
+    }
+    if (total > DEFROST_MAX_CYCLES) {
+        sprintf( buff, "WARNING: Configured defrost sequence takes up to %lu cycles, more than %d - using the default one.",
+            total, DEFROST_MAX_CYCLES );
+        log_message(LOG_FILE, buff);
+        return;
+    }
+    hp.defrost_phases = n;
+    memcpy( hp.defrost, phases, n*sizeof(phases[0]) );
+    sprintf( buff, "INFO: Using configured defrost sequence of %d phases, %lu cycles at most.", n, total );
+    log_message(LOG_FILE, buff);
+}
+
+/* The sensors filters: the default gate, and 2 readings to confirm a step, unless the config
+   file has <sensor>_filter=gate,confirm - like wi_filter=1,2 or ac1cnd_filter=4,2 */
+void
+SetSensorFilters()
+{
+    char buff[200];
+    float gate;
+    int confirm;
+    short i;
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        sfilter[i].gate = filter_gate_default[i];
+        sfilter[i].confirm = 2;
+        if (!cfg.filter_str[i][0]) continue;
+        if ((sscanf( cfg.filter_str[i], "%f,%d", &gate, &confirm ) == 2) && (gate >= 0) && (gate < 50) &&
+            (confirm >= 1) && (confirm <= 12)) {
+            sfilter[i].gate = gate;
+            sfilter[i].confirm = confirm;
+            if (gate > 0) sprintf( buff, "INFO: Sensor '%s' filter: gate %5.3f C, steps confirmed by %d readings.",
+                sensor_names[i], gate, confirm );
+            else sprintf( buff, "INFO: Sensor '%s' filter is OFF.", sensor_names[i] );
+        }
+        else sprintf( buff, "WARNING: Bad filter setting '%s' for sensor '%s' - using the default.",
+            cfg.filter_str[i], sensor_names[i] );
+        log_message(LOG_FILE, buff);
+    }
+}
+
+/* The sensors statistics windows, in cycles; a window that changes length starts over,
+   full of the last reading if there is one */
+void
+SetStatsWindows()
+{
+    unsigned short len;
+    short i;
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        len = ((i == SENS_ENV) ? cfg.tenv_window : cfg.stats_window) / CYCLE_SECONDS;
+        if (sstats[i].len == len) continue;
+        hpm_stats_init( &sstats[i], len );
+        if (sensors[i] != -200) hpm_stats_fill( &sstats[i], sensors[i] );
+    }
+}
+
+/* The predictive defrost works with the control core defaults, unless the config file has
+   frost_predict (minutes ahead, 0 turns it off), frost_spread or frost_below */
+void
+SetFrostPrediction()
+{
+    struct hpm_params def;
+    char buff[200];
+    float f;
+
+    hpm_params_default( &def );
+    hp.frost_horizon = def.frost_horizon;
+    hp.frost_spread = def.frost_spread;
+    hp.frost_below = def.frost_below;
+    if (cfg.frost_predict_str[0]) {
+        f = atof( cfg.frost_predict_str );
+        if ((f >= 0) && (f <= 60)) hp.frost_horizon = f * 60 / CYCLE_SECONDS;
+    }
+    if (cfg.frost_spread_str[0]) {
+        f = atof( cfg.frost_spread_str );
+        if ((f < 0) && (f > -40)) hp.frost_spread = f;
+    }
+    if (cfg.frost_below_str[0]) {
+        f = atof( cfg.frost_below_str );
+        if ((f < 10) && (f > -40)) hp.frost_below = f;
+    }
+    if (!(cfg.frost_predict_str[0] || cfg.frost_spread_str[0] || cfg.frost_below_str[0])) return;
+    if (hp.frost_horizon) {
+        sprintf( buff, "INFO: Predictive defrost: fin stack below %5.3f C, and %5.3f C colder than environment in %lu minutes.",
+            hp.frost_below, -hp.frost_spread, hp.frost_horizon * CYCLE_SECONDS / 60 );
+    }
+    else sprintf( buff, "INFO: Predictive defrost is OFF - the fin stack trend is only tracked." );
+    log_message(LOG_FILE, buff);
+}
+
+/* The predictive overheating protection works with the control core default, unless the
+   config file has ohp_predict (seconds ahead, 0 turns it off) */
+void
+SetOverheatPrediction()
+{
+    struct hpm_params def;
+    char buff[200];
+    float f;
+
+    hpm_params_default( &def );
+    hp.ohp_horizon = def.ohp_horizon;
+    if (!cfg.ohp_predict_str[0]) return;
+    f = atof( cfg.ohp_predict_str );
+    if ((f >= 0) && (f <= 600)) hp.ohp_horizon = f / CYCLE_SECONDS;
+    if (hp.ohp_horizon) {
+        sprintf( buff, "INFO: Predictive overheating protection: COMP COOLING if overheating within %lu seconds.",
+            hp.ohp_horizon * CYCLE_SECONDS );
+    }
+    else sprintf( buff, "INFO: Predictive overheating protection is OFF - the compressor trend is only tracked." );
+    log_message(LOG_FILE, buff);
+}
+
+/* The water flow for the heat output estimation: a pulse flow meter's count file as
+   flow_meter, with flow_pulses pulses per litre; or a fixed flow_rate in litres per minute */
+void
+SetWaterFlow()
+{
+    char buff[200];
+    float f;
+
+    flow_rate = 0;
+    flow_pulses = 0;
+    flow_meter_ok = 0;
+    if (cfg.flow_rate_str[0]) {
+        f = atof( cfg.flow_rate_str );
+        if ((f > 0) && (f <= 500)) flow_rate = f;
+    }
+    if (cfg.flow_meter[0] && cfg.flow_pulses_str[0]) {
+        f = atof( cfg.flow_pulses_str );
+        if ((f > 0) && (f <= 100000)) flow_pulses = f;
+    }
+    if (flow_pulses) sprintf( buff, "INFO: Heat output from the flow meter at '%s', %.1f pulses per litre.",
+        cfg.flow_meter, flow_pulses );
+    else if (flow_rate) sprintf( buff, "INFO: Heat output at a water flow of %.1f litres per minute.", flow_rate );
+    else sprintf( buff, "INFO: Water flow not known - heat output is not estimated." );
+    log_message(LOG_FILE, buff);
+}
+
+/* Shadow mode: a second control instance - the same core with some control settings
+   changed, or another build of the core loaded from shadow_core - decides on the same
+   inputs every cycle, but never drives the GPIO pins. Production posts the cycle's inputs,
+   the control state it stepped from and its decision to a mailbox, and the shadow thread
+   steps from that same state, so every cycle shows what the shadow would have decided in
+   production's place. Production only copies into the mailbox - it never waits for the
+   shadow, which writes the cycles it decided otherwise to SHADOW_FILE */
+struct shadow_mailbox
+{
+    pthread_mutex_t     lock;
+    pthread_cond_t      posted;
+    unsigned long       seq;                /* cycles posted */
+    struct hpm_state    state;              /* production's state before the step */
+    struct hpm_inputs   in;
+    struct hpm_outputs  out;                /* production's decision */
+    short               mode[MAXUNITS];     /* and the AC modes it left */
+    struct hpm_params   params;             /* the shadow's control settings */
+    unsigned long       trace_bytes;        /* written to SHADOW_FILE, for the main thread */
+    unsigned long       trace_writes;       /* to account in the write budget */
+};
+
+struct shadow_mailbox shadow = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* non-zero while the shadow instance gets the cycles */
+short shadow_on = 0;
+pthread_t shadow_thread;
+short shadow_started = 0;
+
+/* the shadow's control step - production's own, unless shadow_core has another */
+void (*shadow_step)(struct hpm_state *, const struct hpm_inputs *, const struct hpm_params *,
+    struct hpm_outputs *) = hpm_step;
+
+/* a decision in short: wanted and actual devices state bits, the answer to hwwm and the AC modes */
+void
+ShadowDecision(char *buff, const struct hpm_outputs *out, const short *mode) {
+    short i;
+    sprintf( buff, "W%03x A%03x S%d M", out->wanted, out->actual, out->sendBits );
+    for (i=0;i<cfg.units;i++) sprintf( buff + strlen(buff), "%d", mode[i] );
+}
+
+/* append a line to SHADOW_FILE */
+void
+ShadowTrace(const char *line) {
+    char timestamp[30];
+    struct tm tm;
+    time_t t;
+    FILE *fp;
+    int n;
+
+    t = time(NULL);
+    /* on the shadow thread - localtime() would share its buffer with the main thread */
+    strftime( timestamp, sizeof timestamp, "%F %T", localtime_r( &t, &tm ) );
+    fp = fopen( SHADOW_FILE, "a" );
+    if ( !fp ) return;
+    n = fprintf( fp, "%s %s\n", timestamp, line );
+    fclose( fp );
+    /* the write budget is only touched on the main thread - it takes these in ShadowPost() */
+    pthread_mutex_lock( &shadow.lock );
+    if (n > 0) shadow.trace_bytes += n;
+    shadow.trace_writes++;
+    pthread_mutex_unlock( &shadow.lock );
+}
+
+/* the shadow instance: steps every cycle posted, and traces the ones it decided otherwise;
+   the same difference cycle after cycle is traced once, with how long it lasted */
+void *
+ShadowThread(void *arg) {
+    struct hpm_state s;
+    struct hpm_inputs in;
+    struct hpm_outputs prod, out;
+    struct hpm_params p;
+    short prod_mode[MAXUNITS], mode[MAXUNITS];
+    char prod_text[60], text[60], line[150], last[150] = "";
+    unsigned long seen = 0, seq, repeat = 0, missed = 0;
+    short i;
+
+    for (;;) {
+        pthread_mutex_lock( &shadow.lock );
+        while (shadow.seq == seen) pthread_cond_wait( &shadow.posted, &shadow.lock );
+        seq = shadow.seq;
+        s = shadow.state;
+        in = shadow.in;
+        prod = shadow.out;
+        memcpy( prod_mode, shadow.mode, sizeof(prod_mode) );
+        p = shadow.params;
+        pthread_mutex_unlock( &shadow.lock );
+        /* cycles posted while the shadow was busy are only counted */
+        if (seen && (seq - seen > 1)) missed += seq - seen - 1;
+        seen = seq;
+
+        shadow_step( &s, &in, &p, &out );
+        for (i=0;i<cfg.units;i++) mode[i] = s.unit[i].mode;
+        ShadowDecision( prod_text, &prod, prod_mode );
+        ShadowDecision( text, &out, mode );
+        if (strcmp( prod_text, text )) sprintf( line, "prod %s | shadow %s", prod_text, text );
+        else line[0] = 0;
+        if (strcmp( line, last ) == 0) {
+            if (line[0]) repeat++;
+            continue;
+        }
+        if (repeat) {
+            sprintf( last, "  ...and the same for %lu more cycles", repeat );
+            ShadowTrace( last );
+            repeat = 0;
+        }
+        if (missed) {
+            sprintf( last, "  (%lu cycles missed)", missed );
+            ShadowTrace( last );
+            missed = 0;
+        }
+        if (line[0]) ShadowTrace( line );
+        else ShadowTrace( "agree" );
+        strcpy( last, line );
+    }
+    return NULL;
+}
+
+/* load the control core of shadow_core; returns 0 on success */
+short
+LoadShadowCore() {
+    char path[MAXLEN+2], buff[300];
+    int (*abi)();
+    void *h;
+
+    /* a bare file name is taken from the running directory, not the library path */
+    sprintf( path, "%s%s", strchr( cfg.shadow_core, '/' ) ? "" : "./", cfg.shadow_core );
+    h = dlopen( path, RTLD_NOW | RTLD_LOCAL );
+    if (!h) {
+        sprintf( buff, "WARNING: Shadow control core not loaded: %.250s", dlerror() );
+        log_message(LOG_FILE, buff);
+        return -1;
+    }
+    abi = (int (*)())dlsym( h, "hpm_core_abi" );
+    shadow_step = (void (*)(struct hpm_state *, const struct hpm_inputs *, const struct hpm_params *,
+        struct hpm_outputs *))dlsym( h, "hpm_step" );
+    if (!abi || !shadow_step || (abi() != HPM_CORE_ABI)) {
+        sprintf( buff, "WARNING: Shadow control core '%s' does not match this hpm build (ABI %d) - not used.",
+            cfg.shadow_core, HPM_CORE_ABI );
+        log_message(LOG_FILE, buff);
+        shadow_step = hpm_step;
+        dlclose( h );
+        return -1;
+    }
+    return 0;
+}
+
+/* The shadow instance: on with shadow=1, with production's control settings, but the
+   shadow.<setting> ones - named as in this file - and the core of shadow_core, if set; the
+   core can only be loaded once, at the first start of the shadow */
+void
+SetShadow()
+{
+    struct hpm_params p = hp;
+    sigset_t all, old;
+    char buff[250];
+    short k, n = 0;
+    int err;
+
+    cfg.shadow = atoi( cfg.shadow_str );
+    for (k=0;k<cfg.shadow_sets;k++) {
+        if (hpm_params_set( &p, cfg.shadow_set[k][0], cfg.shadow_set[k][1] )) {
+            sprintf( buff, "WARNING: Bad shadow setting %.80s=%.80s - ignored.", cfg.shadow_set[k][0], cfg.shadow_set[k][1] );
+            log_message(LOG_FILE, buff);
+        }
+        else n++;
+    }
+    pthread_mutex_lock( &shadow.lock );
+    shadow.params = p;
+    pthread_mutex_unlock( &shadow.lock );
+
+    if (!cfg.shadow) {
+        if (shadow_on) log_message(LOG_FILE, "INFO: Shadow mode is OFF.");
+        shadow_on = 0;
+        return;
+    }
+    if (!shadow_started) {
+        if (cfg.shadow_core[0]) LoadShadowCore();
+        /* the thread starts with all signals blocked, so the handlers - which save the
+           persistent data, unexport the GPIO pins and exit - only ever run on the main
+           thread, between or in its cycles as before */
+        sigfillset( &all );
+        pthread_sigmask( SIG_SETMASK, &all, &old );
+        err = pthread_create( &shadow_thread, NULL, ShadowThread, NULL );
+        pthread_sigmask( SIG_SETMASK, &old, NULL );
+        if (err) {
+            log_message(LOG_FILE, "WARNING: Shadow mode thread could not be started!");
+            return;
+        }
+        pthread_detach( shadow_thread );
+        shadow_started = 1;
+    }
+    else if (cfg.shadow_core[0] && (shadow_step == hpm_step)) {
+        log_message(LOG_FILE, "WARNING: Shadow control core can only be loaded on start-up - restart hpm to use it.");
+    }
+    shadow_on = 1;
+    sprintf( buff, "INFO: Shadow mode is ON: %s core, %d settings changed - decisions in "SHADOW_FILE".",
+        (shadow_step == hpm_step) ? "the same" : "another", n );
+    log_message(LOG_FILE, buff);
+}
+
+/* hand a cycle to the shadow instance: the state production stepped from, and its decision */
+void
+ShadowPost(const struct hpm_state *before, const struct hpm_inputs *in, const struct hpm_outputs *out) {
+    short i;
+    pthread_mutex_lock( &shadow.lock );
+    shadow.state = *before;
+    shadow.in = *in;
+    shadow.out = *out;
+    for (i=0;i<cfg.units;i++) shadow.mode[i] = AC(i).mode;
+    shadow.seq++;
+    WriteTier( SHADOW_FILE )->bytes += shadow.trace_bytes;
+    WriteTier( SHADOW_FILE )->writes += shadow.trace_writes;
+    shadow.trace_bytes = shadow.trace_writes = 0;
+    pthread_cond_signal( &shadow.posted );
+    pthread_mutex_unlock( &shadow.lock );
+}
+
+/* The command channel with hwwm: with hpm_socket set, hpm takes hwwm's commands as
+   datagrams on that UNIX socket, a line each:
+     hwwm cmd <seq> power=<ACs> [avoid=<mask>] [battery=1]
+     hwwm hb <seq>
+   - the ACs hwwm wants running, the ones it would rather were not (bit 0 for AC1), and if
+   power went to battery; or a heartbeat. Every command says it all, so a lost one is made
+   good by the next. Each datagram is answered to the socket it came from as soon as it is
+   in, while hpm waits for the next cycle:
+     hpm ack <seq> <ms>         taken, and acted on in the next cycle, <ms> from now
+     hpm nak <seq> <reason>     not taken
+   A repeated seq is answered again, but not counted again. While hwwm is heard from at
+   least every hwwm_timeout seconds its commands stand instead of the comms pins; when it
+   goes silent, hpm goes back to the pins and forgets the command, and answers heartbeats
+   with "no command" until it gets a new one. The availability sent every cycle to
+   hwwm_socket is hpm's heartbeat the other way */
+#define HWWM_TIMEOUT         15
+
+struct hwwm_channel
+{
+    int             sock;           /* -1 until there is one; bound to bound[], if set */
+    char            bound[MAXLEN];
+    short           live;           /* hwwm's command stands, not the pins */
+    struct timespec heard;          /* the last heartbeat or command taken */
+    struct timespec taken;          /* when the last command was taken, */
+    unsigned long   seq;            /* its seq, */
+    unsigned short  power;          /* and what it asked for */
+    unsigned short  avoid;
+    unsigned short  battery;
+    unsigned long   cmds;           /* commands taken, repeated and not taken */
+    unsigned long   dups;
+    unsigned long   bad;
+    unsigned long   avail_seq;
+    short           avail_ok;
+}
+hwwm = { .sock = -1, .avail_ok = 1 };
+
+/* when the next cycle is due */
+struct timespec next_cycle;
+
+void
+SetHwwmChannel()
+{
+    struct sockaddr_un addr;
+    char buff[250];
+
+    cfg.hwwm_timeout = cfg.hwwm_timeout_str[0] ? atoi( cfg.hwwm_timeout_str ) : HWWM_TIMEOUT;
+    if (cfg.hwwm_timeout < 2*CYCLE_SECONDS) cfg.hwwm_timeout = 2*CYCLE_SECONDS;
+    if ((hwwm.sock != -1) && !strcmp( cfg.hpm_socket, hwwm.bound )) return;
+
+    if (hwwm.sock != -1) close( hwwm.sock );
+    if (hwwm.bound[0]) unlink( hwwm.bound );
+    hwwm.sock = -1;
+    hwwm.bound[0] = 0;
+    if (hwwm.live) log_message(LOG_FILE, "INFO: hwwm command channel closed - back to the comms pins.");
+    hwwm.live = 0;
+    if (!cfg.hpm_socket[0]) return;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, cfg.hpm_socket, sizeof(addr.sun_path)-1 );
+    hwwm.sock = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if (hwwm.sock != -1) {
+        unlink( addr.sun_path );
+        if (bind( hwwm.sock, (struct sockaddr *)&addr, sizeof(addr) ) == 0) {
+            strcpy( hwwm.bound, addr.sun_path );
+            sprintf( buff, "INFO: hwwm command channel on '%.80s', back to the comms pins after %d seconds silent.",
+                hwwm.bound, cfg.hwwm_timeout );
+            log_message(LOG_FILE, buff);
+            return;
+        }
+        close( hwwm.sock );
+        hwwm.sock = -1;
+    }
+    sprintf( buff, "WARNING: hwwm command channel on '%.80s' could not be set up: %s - using the comms pins only.",
+        cfg.hpm_socket, strerror(errno) );
+    log_message(LOG_FILE, buff);
+}
+
+void
+SetWriteBudget()
+{
+    char buff[150];
+    int kb = atoi( cfg.sd_budget_str );
+
+    if (kb < 0) kb = 0;
+    if (kb == cfg.sd_budget) return;
+    cfg.sd_budget = kb;
+    if (kb) sprintf( buff, "INFO: SD card write budget set to %d kB a day.", kb );
+    else sprintf( buff, "INFO: SD card write budget off - writes are only counted." );
+    log_message(LOG_FILE, buff);
+}
+
 void
 parse_config()
 {
+    static short units_set = 0;
     int i = 0;
+    int u = 0;
     float f = 0;
-    char *s, buff[150];
+    char *s, buff[200], key[MAXLEN];
     FILE *fp = fopen(CONFIG_FILE, "r");
+    cfg.shadow_sets = 0;
     if (fp == NULL) {
         log_message(LOG_FILE,"WARNING: Failed to open "CONFIG_FILE" file for reading!");
         } else {
@@ -451,32 +1119,14 @@ parse_config()
             trim (value);
 
             /* Copy into correct entry in parameters struct */
-            if (strcmp(name, "ac1cmp_sensor")==0)
-            strncpy (cfg.ac1cmp_sensor, value, MAXLEN);
-            else if (strcmp(name, "ac1cnd_sensor")==0)
-            strncpy (cfg.ac1cnd_sensor, value, MAXLEN);
-            else if (strcmp(name, "ac2cmp_sensor")==0)
-            strncpy (cfg.ac2cmp_sensor, value, MAXLEN);
-            else if (strcmp(name, "ac2cnd_sensor")==0)
-            strncpy (cfg.ac2cnd_sensor, value, MAXLEN);
+            if (strcmp(name, "units")==0)
+            strncpy (cfg.units_str, value, MAXLEN);
             else if (strcmp(name, "wi_sensor")==0)
             strncpy (cfg.wi_sensor, value, MAXLEN);
             else if (strcmp(name, "wo_sensor")==0)
             strncpy (cfg.wo_sensor, value, MAXLEN);
             else if (strcmp(name, "tenv_sensor")==0)
             strncpy (cfg.tenv_sensor, value, MAXLEN);
-            else if (strcmp(name, "ac1cmp_pin")==0)
-            strncpy (cfg.ac1cmp_pin_str, value, MAXLEN);
-            else if (strcmp(name, "ac1fan_pin")==0)
-            strncpy (cfg.ac1fan_pin_str, value, MAXLEN);
-            else if (strcmp(name, "ac1v_pin")==0)
-            strncpy (cfg.ac1v_pin_str, value, MAXLEN);
-            else if (strcmp(name, "ac2cmp_pin")==0)
-            strncpy (cfg.ac2cmp_pin_str, value, MAXLEN);
-            else if (strcmp(name, "ac2fan_pin")==0)
-            strncpy (cfg.ac2fan_pin_str, value, MAXLEN);
-            else if (strcmp(name, "ac2v_pin")==0)
-            strncpy (cfg.ac2v_pin_str, value, MAXLEN);
             else if (strcmp(name, "commspin1_pin")==0)
             strncpy (cfg.commspin1_pin_str, value, MAXLEN);
             else if (strcmp(name, "commspin2_pin")==0)
@@ -489,46 +1139,111 @@ parse_config()
             strncpy (cfg.invert_output_str, value, MAXLEN);
             else if (strcmp(name, "mode")==0)
             strncpy (cfg.mode_str, value, MAXLEN);
-            else if (strcmp(name, "use_ac1")==0)
-            strncpy (cfg.use_ac1_str, value, MAXLEN);
-            else if (strcmp(name, "use_ac2")==0)
-            strncpy (cfg.use_ac2_str, value, MAXLEN);
             else if (strcmp(name, "wicorr")==0)
             strncpy (cfg.wicorr_str, value, MAXLEN);
             else if (strcmp(name, "wocorr")==0)
             strncpy (cfg.wocorr_str, value, MAXLEN);
             else if (strcmp(name, "tenvcorr")==0)
             strncpy (cfg.tenvcorr_str, value, MAXLEN);
+            else if ((sscanf(name, "defrost_phase%d", &u)==1) && (u>=1) && (u<=DEFROST_MAXPHASES))
+            strncpy (cfg.defrost_phase_str[u-1], value, MAXLEN);
+            else if (strcmp(name, "wi_filter")==0)
+            strncpy (cfg.filter_str[SENS_WI], value, MAXLEN);
+            else if (strcmp(name, "wo_filter")==0)
+            strncpy (cfg.filter_str[SENS_WO], value, MAXLEN);
+            else if (strcmp(name, "tenv_filter")==0)
+            strncpy (cfg.filter_str[SENS_ENV], value, MAXLEN);
+            else if (strcmp(name, "stats_window")==0)
+            strncpy (cfg.stats_window_str, value, MAXLEN);
+            else if (strcmp(name, "tenv_window")==0)
+            strncpy (cfg.tenv_window_str, value, MAXLEN);
+            else if (strcmp(name, "frost_predict")==0)
+            strncpy (cfg.frost_predict_str, value, MAXLEN);
+            else if (strcmp(name, "ohp_predict")==0)
+            strncpy (cfg.ohp_predict_str, value, MAXLEN);
+            else if (strcmp(name, "flow_rate")==0)
+            strncpy (cfg.flow_rate_str, value, MAXLEN);
+            else if (strcmp(name, "flow_meter")==0)
+            strncpy (cfg.flow_meter, value, MAXLEN);
+            else if (strcmp(name, "flow_pulses")==0)
+            strncpy (cfg.flow_pulses_str, value, MAXLEN);
+            else if (strcmp(name, "hwwm_socket")==0)
+            strncpy (cfg.hwwm_socket, value, MAXLEN);
+            else if (strcmp(name, "hpm_socket")==0)
+            strncpy (cfg.hpm_socket, value, MAXLEN);
+            else if (strcmp(name, "hwwm_timeout")==0)
+            strncpy (cfg.hwwm_timeout_str, value, MAXLEN);
+            else if (strcmp(name, "sd_budget")==0)
+            strncpy (cfg.sd_budget_str, value, MAXLEN);
+            else if (strcmp(name, "shadow")==0)
+            strncpy (cfg.shadow_str, value, MAXLEN);
+            else if (strcmp(name, "shadow_core")==0)
+            strncpy (cfg.shadow_core, value, MAXLEN);
+            /* shadow.<setting> - a control setting the shadow instance has changed */
+            else if ((strncmp(name, "shadow.", 7)==0) && (cfg.shadow_sets < SHADOW_MAXSETS)) {
+                strncpy (cfg.shadow_set[cfg.shadow_sets][0], name+7, MAXLEN);
+                strncpy (cfg.shadow_set[cfg.shadow_sets][1], value, MAXLEN);
+                cfg.shadow_sets++;
+            }
+            else if (strcmp(name, "frost_spread")==0)
+            strncpy (cfg.frost_spread_str, value, MAXLEN);
+            else if (strcmp(name, "frost_below")==0)
+            strncpy (cfg.frost_below_str, value, MAXLEN);
+            /* per AC settings: use_acN, and acN<setting> with N counting from 1 */
+            else if ((sscanf(name, "use_ac%d", &u)==1) && (u>=1) && (u<=MAXUNITS))
+            strncpy (cfg.use_ac_str[u-1], value, MAXLEN);
+            else if ((sscanf(name, "ac%d%30s", &u, key)==2) && (u>=1) && (u<=MAXUNITS)) {
+                if (strcmp(key, "cmp_sensor")==0)
+                strncpy (cfg.accmp_sensor[u-1], value, MAXLEN);
+                else if (strcmp(key, "cnd_sensor")==0)
+                strncpy (cfg.accnd_sensor[u-1], value, MAXLEN);
+                else if (strcmp(key, "cmp_filter")==0)
+                strncpy (cfg.filter_str[SENS_CMP(u-1)], value, MAXLEN);
+                else if (strcmp(key, "cnd_filter")==0)
+                strncpy (cfg.filter_str[SENS_CND(u-1)], value, MAXLEN);
+                else if (strcmp(key, "cmp_pin")==0)
+                strncpy (cfg.accmp_pin_str[u-1], value, MAXLEN);
+                else if (strcmp(key, "fan_pin")==0)
+                strncpy (cfg.acfan_pin_str[u-1], value, MAXLEN);
+                else if (strcmp(key, "v_pin")==0)
+                strncpy (cfg.acv_pin_str[u-1], value, MAXLEN);
+                else if (strcmp(key, "max_temp")==0)
+                strncpy (cfg.acmax_temp_str[u-1], value, MAXLEN);
+                else if (strcmp(key, "cool_temp")==0)
+                strncpy (cfg.accool_temp_str[u-1], value, MAXLEN);
+            }
         }
         /* Close file */
         fclose (fp);
     }
 
     /* Convert strings to int */
-    strcpy( buff, cfg.ac1cmp_pin_str );
-    i = atoi( buff );
-    cfg.ac1cmp_pin = i;
-    rangecheck_GPIO_pin( cfg.ac1cmp_pin );
-    strcpy( buff, cfg.ac1fan_pin_str );
-    i = atoi( buff );
-    cfg.ac1fan_pin = i;
-    rangecheck_GPIO_pin( cfg.ac1fan_pin );
-    strcpy( buff, cfg.ac1v_pin_str );
-    i = atoi( buff );
-    cfg.ac1v_pin = i;
-    rangecheck_GPIO_pin( cfg.ac1v_pin );
-    strcpy( buff, cfg.ac2cmp_pin_str );
+    /* the number of ACs sets the GPIO pins to export - so it can only change on restart */
+    strcpy( buff, cfg.units_str );
     i = atoi( buff );
-    cfg.ac2cmp_pin = i;
-    rangecheck_GPIO_pin( cfg.ac2cmp_pin );
-    strcpy( buff, cfg.ac2fan_pin_str );
-    i = atoi( buff );
-    cfg.ac2fan_pin = i;
-    rangecheck_GPIO_pin( cfg.ac2fan_pin );
-    strcpy( buff, cfg.ac2v_pin_str );
-    i = atoi( buff );
-    cfg.ac2v_pin = i;
-    rangecheck_GPIO_pin( cfg.ac2v_pin );
+    rangecheck_units( &i );
+    if (!units_set) {
+        cfg.units = i;
+        units_set = 1;
+    }
+    else if (i != cfg.units) {
+        sprintf( buff, "WARNING: Number of ACs changed to %d in config - this needs a restart; still managing %d ACs.", i, cfg.units );
+        log_message(LOG_FILE, buff);
+    }
+    for (u=0;u<MAXUNITS;u++) {
+        strcpy( buff, cfg.accmp_pin_str[u] );
+        i = atoi( buff );
+        cfg.accmp_pin[u] = i;
+        rangecheck_GPIO_pin( cfg.accmp_pin[u] );
+        strcpy( buff, cfg.acfan_pin_str[u] );
+        i = atoi( buff );
+        cfg.acfan_pin[u] = i;
+        rangecheck_GPIO_pin( cfg.acfan_pin[u] );
+        strcpy( buff, cfg.acv_pin_str[u] );
+        i = atoi( buff );
+        cfg.acv_pin[u] = i;
+        rangecheck_GPIO_pin( cfg.acv_pin[u] );
+    }
     strcpy( buff, cfg.commspin1_pin_str );
     i = atoi( buff );
     cfg.commspin1_pin = i;
@@ -559,36 +1274,54 @@ parse_config()
     i = atoi( buff );
     cfg.mode = i;
     rangecheck_mode( cfg.mode );
-    strcpy( buff, cfg.use_ac1_str );
-    i = atoi( buff );
-    cfg.use_ac1 = i;
-    /* ^ no need for range check - 0 is OFF, non-zero is ON */
-    strcpy( buff, cfg.use_ac2_str );
-    i = atoi( buff );
-    cfg.use_ac2 = i;
-    /* ^ no need for range check - 0 is OFF, non-zero is ON */
+    for (u=0;u<MAXUNITS;u++) {
+        strcpy( buff, cfg.use_ac_str[u] );
+        i = atoi( buff );
+        cfg.use_ac[u] = i;
+        /* ^ no need for range check - 0 is OFF, non-zero is ON */
+        /* compressor temp limits are kept at their defaults unless set */
+        if (cfg.acmax_temp_str[u][0]) {
+            strcpy( buff, cfg.acmax_temp_str[u] );
+            f = atof( buff );
+            if ((f > 30) && (f < 90)) cfg.acmax_temp[u] = f;
+        }
+        if (cfg.accool_temp_str[u][0]) {
+            strcpy( buff, cfg.accool_temp_str[u] );
+            f = atof( buff );
+            if ((f > 20) && (f < cfg.acmax_temp[u])) cfg.accool_temp[u] = f;
+        }
+    }
     strcpy( buff, cfg.wicorr_str );
     f = atof( buff );
     cfg.wicorr = f;
-    scorr[5] = f;
+    scorr[SENS_WI] = f;
     strcpy( buff, cfg.wocorr_str );
     f = atof( buff );
     cfg.wocorr = f;
-    scorr[6] = f;
+    scorr[SENS_WO] = f;
     strcpy( buff, cfg.tenvcorr_str );
     f = atof( buff );
     cfg.tenvcorr = f;
-    scorr[7] = f;
+    scorr[SENS_ENV] = f;
+    /* statistics windows are kept at their defaults unless set; in seconds, up to an hour */
+    if (cfg.stats_window_str[0]) {
+        i = atoi( cfg.stats_window_str );
+        if ((i >= CYCLE_SECONDS) && (i <= STATS_MAXWINDOW*CYCLE_SECONDS)) cfg.stats_window = i;
+    }
+    if (cfg.tenv_window_str[0]) {
+        i = atoi( cfg.tenv_window_str );
+        if ((i >= CYCLE_SECONDS) && (i <= STATS_MAXWINDOW*CYCLE_SECONDS)) cfg.tenv_window = i;
+    }
+    SetStatsWindows();
+    SetSensorFilters();
 
     /* Prepare log messages with sensor paths and write them to log file */
-    sprintf( buff, "AC1 compressor temp sensor file: %s", cfg.ac1cmp_sensor );
-    log_message(LOG_FILE, buff);
-    sprintf( buff, "AC1 condenser temp sensor file: %s", cfg.ac1cnd_sensor );
-    log_message(LOG_FILE, buff);
-    sprintf( buff, "AC2 compressor temp sensor file: %s", cfg.ac2cmp_sensor );
-    log_message(LOG_FILE, buff);
-    sprintf( buff, "AC2 condenser temp sensor file: %s", cfg.ac2cnd_sensor );
-    log_message(LOG_FILE, buff);
+    for (u=0;u<cfg.units;u++) {
+        sprintf( buff, "AC%d compressor temp sensor file: %s", u+1, cfg.accmp_sensor[u] );
+        log_message(LOG_FILE, buff);
+        sprintf( buff, "AC%d condenser temp sensor file: %s", u+1, cfg.accnd_sensor[u] );
+        log_message(LOG_FILE, buff);
+    }
     sprintf( buff, "Water IN temp sensor file: %s", cfg.wi_sensor );
     log_message(LOG_FILE, buff);
     sprintf( buff, "Water OUT temp sensor file: %s", cfg.wo_sensor );
@@ -599,12 +1332,11 @@ parse_config()
     sprintf( buff, "Using COMMs GPIO pins (BCM mode) as follows: comms1: %d, comms2: %d, comms3: %d, "\
 	"comms4: %d ", cfg.commspin1_pin, cfg.commspin2_pin, cfg.commspin3_pin, cfg.commspin4_pin );
     log_message(LOG_FILE, buff);
-    sprintf( buff, "Using OUTPUT GPIO pins (BCM mode) as follows: AC1 comp: %d, AC1 fan: %d, AC1 valve: %d",
-           cfg.ac1cmp_pin, cfg.ac1fan_pin, cfg.ac1v_pin );
-    log_message(LOG_FILE, buff);
-    sprintf( buff, "Using OUTPUT GPIO pins (BCM mode) as follows: AC2 comp: %d, AC2 fan: %d, AC2 valve: %d",
-           cfg.ac2cmp_pin, cfg.ac2fan_pin, cfg.ac2v_pin );
-    log_message(LOG_FILE, buff);
+    for (u=0;u<cfg.units;u++) {
+        sprintf( buff, "Using OUTPUT GPIO pins (BCM mode) as follows: AC%d comp: %d, AC%d fan: %d, AC%d valve: %d",
+               u+1, cfg.accmp_pin[u], u+1, cfg.acfan_pin[u], u+1, cfg.acv_pin[u] );
+        log_message(LOG_FILE, buff);
+    }
     if (cfg.invert_output) {
         sprintf( buff, "OUTPUT GPIO pins controlling is INVERTED - ON is LOW (0)" );
         log_message(LOG_FILE, buff);
@@ -615,112 +1347,856 @@ parse_config()
     }
     /* Prepare log message part 1 and write it to log file */
     if (fp == NULL) {
-        sprintf( buff, "INFO: Using values: Mode=%d, use AC1=%d, use AC2=%d, corrections: water IN=%5.3f, water OUT=%5.3f, Tenv=%5.3f",
-            cfg.mode, cfg.use_ac1, cfg.use_ac2, cfg.wicorr, cfg.wocorr, cfg.tenvcorr );
+        sprintf( buff, "INFO: Using values: Mode=%d,", cfg.mode );
         } else {
-        sprintf( buff, "INFO: Read CFG file: Mode=%d, use AC1=%d, use AC2=%d, corrections: water IN=%5.3f, water OUT=%5.3f, Tenv=%5.3f",
-            cfg.mode, cfg.use_ac1, cfg.use_ac2, cfg.wicorr, cfg.wocorr, cfg.tenvcorr );
+        sprintf( buff, "INFO: Read CFG file: Mode=%d,", cfg.mode );
     }
+    for (u=0;u<cfg.units;u++) sprintf( buff + strlen(buff), " use AC%d=%d,", u+1, cfg.use_ac[u] );
+    sprintf( buff + strlen(buff), " corrections: water IN=%5.3f, water OUT=%5.3f, Tenv=%5.3f",
+        cfg.wicorr, cfg.wocorr, cfg.tenvcorr );
     log_message(LOG_FILE, buff);
+    for (u=0;u<cfg.units;u++) {
+        if ((cfg.acmax_temp[u] != 63) || (cfg.accool_temp[u] != 56)) {
+            sprintf( buff, "INFO: AC%d compressor temps: max=%5.3f, cooling=%5.3f", u+1, cfg.acmax_temp[u], cfg.accool_temp[u] );
+            log_message(LOG_FILE, buff);
+        }
+    }
     if(!cfg.mode){
         sprintf( buff, "WARNING: For some reason, hpm is configured to be OFF, i.e. the config file option \"mode\" is recognised as ZERO !!!!!" );
         log_message(LOG_FILE, buff);
     }
+
+    /* hand the control related settings over to the control core */
+    hp.mode = failsafe ? 0 : cfg.mode;
+    hp.units = cfg.units;
+    for (u=0;u<MAXUNITS;u++) {
+        hp.unit[u].use = cfg.use_ac[u];
+        hp.unit[u].comp_max_temp = cfg.acmax_temp[u];
+        hp.unit[u].comp_cool_temp = cfg.accool_temp[u];
+    }
+    SetDefrostSequence();
+    SetFrostPrediction();
+    SetOverheatPrediction();
+    SetWaterFlow();
+    SetShadow();
+    SetHwwmChannel();
+    SetWriteBudget();
 }
 
 void
-WritePersistentData() {
-    FILE *logfile;
-    char timestamp[30];
-    time_t t;
-    struct tm *t_struct;
-
-    t = time(NULL);
-    t_struct = localtime( &t );
-    strftime( timestamp, sizeof timestamp, "%F %T", t_struct );
-
-    logfile = fopen( PRSSTNC_FILE, "w" );
-    if ( !logfile ) return;
-    fprintf( logfile, "# hwwm data persistence file written %s\n", timestamp );
-    fprintf( logfile, "C1RunCs=%ld\n", C1RunCs );
-    fprintf( logfile, "C2RunCs=%ld\n", C2RunCs );
-    fclose( logfile );
+InitCounters() {
+    static char runcs_names[MAXUNITS][12];
+    short i;
+    /* only the installed ACs get persisted, compressor run cycles first */
+    for (i=0;i<cfg.units;i++) {
+        sprintf( runcs_names[i], "C%dRunCs", i+1 );
+        RegisterPersistentCounter( runcs_names[i], &AC(i).RunCs );
+    }
+    for (i=0;i<TOTALCOUNTERS;i++) {
+        sprintf( counters[i].name, "C%d%s", i/CNT_PER_AC+1, counter_kinds[i%CNT_PER_AC] );
+        counters[i].hour = counters[i].day = counters[i].life = 0;
+        counters[i].prev_hour = counters[i].prev_day = 0;
+        if (i >= cfg.units*CNT_PER_AC) continue;
+        /* idle time ticks all year round - persisting it would wake the SD card up for nothing */
+        if ((i%CNT_PER_AC) == CNT_MODE_CYCLES) continue;
+        RegisterPersistentCounter( counters[i].name, &counters[i].life );
+    }
 }
 
+/* the heat meters of the installed ACs get persisted - all but the OFF modes */
 void
-ReadPersistentData() {
-    unsigned long tmp = 0;
-    char *s, buff[150];
-    char C1RunCs_str[MAXLEN];
-    char C2RunCs_str[MAXLEN];
-    short should_write=0;
-    strcpy( C1RunCs_str, "0" );
-    strcpy( C2RunCs_str, "0" );
-    FILE *fp = fopen(PRSSTNC_FILE, "r");
-    if (fp == NULL) {
-        log_message(LOG_FILE,"WARNING: Failed to open "PRSSTNC_FILE" file for reading!");
-        should_write = 1;
-        } else {
-        /* Read next line */
-        while ((s = fgets (buff, sizeof buff, fp)) != NULL)
-        {
-            /* Skip blank lines and comments */
-            if (buff[0] == '\n' || buff[0] == '#')
-            continue;
-
-            /* Parse name/value pair from line */
-            char name[MAXLEN], value[MAXLEN];
-            s = strtok (buff, "=");
-            if (s==NULL) continue;
-            else strncpy (name, s, MAXLEN);
-            s = strtok (NULL, "=");
-            if (s==NULL) continue;
-            else strncpy (value, s, MAXLEN);
-            trim (value);
+InitHeatMeters() {
+    static char names[MAXUNITS][HEAT_PER_AC][12];
+    short i, k, n;
+    memset( heat, 0, sizeof(heat) );
+    for (i=0;i<cfg.units;i++) {
+        n = 0;
+        for (k=1;k<=4;k++) {
+            sprintf( names[i][n], "C%dheatM%d", i+1, k );
+            RegisterPersistentCounter( names[i][n++], &heat[i].mode[k] );
+        }
+        sprintf( names[i][n], "C%dheatBack", i+1 );
+        RegisterPersistentCounter( names[i][n++], &heat[i].back );
+        for (k=0;k<HEAT_BANDS;k++) {
+            sprintf( names[i][n], "C%dheatT%d", i+1, k );
+            RegisterPersistentCounter( names[i][n++], &heat[i].band[k] );
+            sprintf( names[i][n], "C%drunT%d", i+1, k );
+            RegisterPersistentCounter( names[i][n++], &heat[i].runs[k] );
+        }
+    }
+}
 
-            /* Copy data in corresponding strings */
-            if (strcmp(name, "C1RunCs")==0)
-            strncpy (C1RunCs_str, value, MAXLEN);
-            else if (strcmp(name, "C2RunCs")==0)
-            strncpy (C2RunCs_str, value, MAXLEN);
+/* litres of water that went through the loop in the last cycle; -1 if not known */
+float
+WaterFlow() {
+    unsigned long count;
+    float litres;
+    FILE *fp;
+
+    if (flow_pulses) {
+        fp = fopen( cfg.flow_meter, "r" );
+        if (fp && (fscanf( fp, "%lu", &count ) == 1)) {
+            fclose( fp );
+            /* the first count read only sets where counting starts from - and so does one
+               gone back, as after the meter restarted */
+            litres = (flow_meter_ok && (count >= flow_count)) ? (count - flow_count) / flow_pulses : -1;
+            if (!flow_meter_ok) log_message(LOG_FILE, "INFO: Flow meter read OK.");
+            flow_count = count;
+            flow_meter_ok = 1;
+            return litres;
         }
-        /* Close file */
-        fclose (fp);
+        if (fp) fclose( fp );
+        if (flow_meter_ok) {
+            log_message(LOG_FILE, flow_rate ? "WARNING: Flow meter read failed! Going by flow_rate." :
+                "WARNING: Flow meter read failed! Heat output is not estimated.");
+        }
+        flow_meter_ok = 0;
     }
+    if (flow_rate) return flow_rate * CYCLE_SECONDS / 60;
+    return -1;
+}
 
-    if (should_write) {
-        log_message(LOG_FILE, "INFO: Creating missing persistent data file...");
-        WritePersistentData();
+/* estimate the heat delivered in the last cycle, and put it on the ACs running through it;
+   called before the control step, so the devices are in the state the heat came from */
+void
+EstimateHeat() {
+    struct heat_meter *H;
+    unsigned long whole;
+    double wh;
+    float litres;
+    short i, b, n = 0;
+
+    heat_power = 0;
+    litres = WaterFlow();
+    if ((litres < 0) || just_started) return;
+    wh = (double)litres * WATER_HEAT * (Two - Twi) / 3600;
+    heat_power = wh * 3600 / CYCLE_SECONDS;
+    for (i=0;i<cfg.units;i++) {
+        if (AC(i).cmp || (AC(i).mode==4)) n++;
     }
-    else {
-        /* Convert strings to float */
-        strcpy( buff, C1RunCs_str );
-        tmp = atol( buff );
-        C1RunCs = tmp;
-        strcpy( buff, C2RunCs_str );
-        tmp = atol( buff );
-        C2RunCs = tmp;
+    if (!n) return;
+    b = (TenvAvrg < -10) ? 0 : (TenvAvrg + 10) / 5 + 1;
+    if (b >= HEAT_BANDS) b = HEAT_BANDS-1;
+    for (i=0;i<cfg.units;i++) {
+        if (!(AC(i).cmp || (AC(i).mode==4))) continue;
+        H = &heat[i];
+        if (AC(i).cmp) H->runs[b]++;
+        if (wh >= 0) {
+            H->part += wh / n;
+            whole = H->part;
+            H->part -= whole;
+            H->mode[AC(i).mode] += whole;
+            H->band[b] += whole;
+        }
+        else {
+            H->part_back -= wh / n;
+            whole = H->part_back;
+            H->part_back -= whole;
+            H->back += whole;
+        }
     }
+}
 
-    /* Prepare log message and write it to log file */
-    if (fp == NULL) {
-        sprintf( buff, "INFO: Using compressor run cycles start values: C1RunCs=%ld, C2RunCs=%ld",
-        C1RunCs, C2RunCs );
-        } else {
-        sprintf( buff, "INFO: Read compressor run cycles start values: C1RunCs=%ld, C2RunCs=%ld",
-        C1RunCs, C2RunCs );
+/* the heat delivered by every AC: per mode, and per environment temp band with the heat
+   per compressor run hour there */
+void
+WriteHeatTable() {
+    const char *band_names[HEAT_BANDS] = { "below -10", "-10..-5", "-5..0", "0..5", "5..10", "10 and up" };
+    FILE *fp;
+    double hours;
+    short i, k;
+    fp = fopen( HEAT_FILE, "w" );
+    if ( !fp ) return;
+    fprintf( fp, "water loop now: %.0f W\n\n", heat_power );
+    fprintf( fp, "%-4s %13s %13s %13s %13s %15s\n", "AC", "starting kWh", "c cooling kWh", "fins heat kWh",
+        "defrost kWh", "taken back kWh" );
+    for (i=0;i<cfg.units;i++) {
+        fprintf( fp, "AC%-2d %13.1f %13.1f %13.1f %13.1f %15.1f\n", i+1, heat[i].mode[1] / 1000.0,
+            heat[i].mode[2] / 1000.0, heat[i].mode[3] / 1000.0, heat[i].mode[4] / 1000.0, heat[i].back / 1000.0 );
     }
-    log_message(LOG_FILE, buff);
+    fprintf( fp, "\n%-4s %-12s %10s %10s %8s\n", "AC", "outdoor C", "heat kWh", "run hours", "kW");
+    for (i=0;i<cfg.units;i++) {
+        for (k=0;k<HEAT_BANDS;k++) {
+            hours = (double)heat[i].runs[k] * CYCLE_SECONDS / 3600;
+            fprintf( fp, "AC%-2d %-12s %10.1f %10.1f %8.2f\n", i+1, band_names[k], heat[i].band[k] / 1000.0,
+                hours, (hours > 0) ? heat[i].band[k] / 1000.0 / hours : 0 );
+        }
+    }
+    WriteAccount( HEAT_FILE, ftell( fp ), 0 );
+    fclose( fp );
 }
 
-int
-GPIOExport(int pin)
-{
+void
+CountEvents(short id, unsigned long n) {
+    counters[id].hour += n;
+    counters[id].day += n;
+    counters[id].life += n;
+}
+
+/* close the current hour, and the current day too if it has ended */
+void
+RollCounters(short new_day) {
+    char msg[500];
+    short i;
+    for (i=0;i<TOTALCOUNTERS;i++) {
+        counters[i].prev_hour = counters[i].hour;
+        counters[i].hour = 0;
+        if (new_day) {
+            counters[i].prev_day = counters[i].day;
+            counters[i].day = 0;
+        }
+    }
+    sprintf( msg, "Counters for last hour:" );
+    for (i=1;i<=cfg.units;i++) {
+        sprintf( msg + strlen(msg), "%s C%d starts %lu, run %lu min, defrosts %lu, OHP trips %lu (%lu pre-empted)",
+            (i>1) ? ";" : "", i, counters[CNT(i,CNT_STARTS)].prev_hour,
+            counters[CNT(i,CNT_RUN_CYCLES)].prev_hour*CYCLE_SECONDS/60,
+            counters[CNT(i,CNT_DEFROSTS)].prev_hour, counters[CNT(i,CNT_OHP_TRIPS)].prev_hour,
+            counters[CNT(i,CNT_OHP_PREEMPTS)].prev_hour );
+    }
+    sprintf( msg + strlen(msg), "." );
+    log_message(LOG_FILE, msg);
+}
+
+void
+WriteCountersTable() {
+    FILE *fp;
+    short i;
+    fp = fopen( COUNTERS_FILE, "w" );
+    if ( !fp ) return;
+    fprintf( fp, "%-16s %8s %8s %8s %8s %10s\n", "counter", "hour", "prevhour", "day", "prevday", "lifetime" );
+    for (i=0;i<cfg.units*CNT_PER_AC;i++) {
+        fprintf( fp, "%-16s %8lu %8lu %8lu %8lu %10lu\n", counters[i].name, counters[i].hour,
+            counters[i].prev_hour, counters[i].day, counters[i].prev_day, counters[i].life );
+    }
+    WriteAccount( COUNTERS_FILE, ftell( fp ), 0 );
+    fclose( fp );
+}
+
+/* the sensors statistics: the last reading, and the mean, minimum, maximum, standard
+   deviation and trend per hour over its window; and the steps and bad readings its
+   filter found */
+void
+WriteStatsTable() {
+    FILE *fp;
+    struct hpm_stats *st;
+    short i;
+    fp = fopen( STATS_FILE, "w" );
+    if ( !fp ) return;
+    fprintf( fp, "%-15s %8s %8s %8s %8s %7s %9s %7s %6s %8s\n", "sensor", "now", "mean", "min", "max", "stddev",
+        "trend/h", "window", "steps", "rejected" );
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if (!SensorInUse(i)) continue;
+        st = &sstats[i];
+        fprintf( fp, "%-15s %8.3f %8.3f %8.3f %8.3f %7.3f %9.3f %6ds %6lu %8lu\n", sensor_names[i], sensors[i], st->mean,
+            st->min, st->max, sqrt( st->var ), st->slope * 3600 / CYCLE_SECONDS, st->len * CYCLE_SECONDS,
+            sfilter[i].steps, sfilter[i].rejected );
+    }
+    WriteAccount( STATS_FILE, ftell( fp ), 0 );
+    fclose( fp );
+}
+
+void
+WriteDefrostTable() {
+    FILE *fp;
+    struct defrost_stat *d;
+    short i, k;
+    fp = fopen( DEFROST_FILE, "w" );
+    if ( !fp ) return;
+    fprintf( fp, "%-4s %5s %6s %6s %7s %6s %6s %6s %6s\n", "ac", "phase", "runs", "early", "avgcyc",
+        "mincyc", "maxcyc", "cfgmin", "cfgmax" );
+    for (i=0;i<cfg.units;i++) {
+        for (k=0;k<hp.defrost_phases;k++) {
+            d = &dstats[i][k];
+            fprintf( fp, "AC%-2d %5d %6lu %6lu %7.1f %6lu %6lu %6lu %6lu\n", i+1, k+1, d->runs, d->early,
+                d->runs ? (float)d->cycles/d->runs : 0.0, d->min, d->max,
+                hp.defrost[k].min_cycles, hp.defrost[k].max_cycles );
+        }
+    }
+    WriteAccount( DEFROST_FILE, ftell( fp ), 0 );
+    fclose( fp );
+}
+
+/* log the ACs sent to COMP COOLING ahead of overheating - once in a compressor run */
+void
+OverheatPreempts(struct hpm_outputs *out) {
+    char msg[200];
+    short i;
+    for (i=0;i<cfg.units;i++) {
+        if (!(out->ohp_preempted & (1<<i))) continue;
+        sprintf( msg, "INFO: AC%d COMP COOLING on the compressor temp trend: at %.1f C and going %+.2f C/minute.",
+            i+1, Tcmp(i), AC(i).Cslope * 60 / CYCLE_SECONDS );
+        log_message(LOG_FILE, msg);
+    }
+}
+
+/* gather the defrost phases statistics, and log every defrost when it ends */
+void
+DefrostStats(struct hpm_outputs *out, unsigned short was_defrosting) {
+    struct defrost_stat *d;
+    char msg[200];
+    short i, k;
+    for (i=0;i<cfg.units;i++) {
+        if (out->frost_started & (1<<i)) {
+            sprintf( msg, "INFO: AC%d DEFROST on the fin stack trend: fins at %.1f C, %.1f C from environment"
+                " and going %+.2f C/hour.", i+1, Tcnd(i), AC(i).Fspread, AC(i).Fslope * 3600 / CYCLE_SECONDS );
+            log_message(LOG_FILE, msg);
+        }
+        if (out->dphase_end[i]) {
+            k = out->dphase_end[i] - 1;
+            d = &dstats[i][k];
+            if (!d->runs || (out->dphase_cycles[i] < d->min)) d->min = out->dphase_cycles[i];
+            if (out->dphase_cycles[i] > d->max) d->max = out->dphase_cycles[i];
+            d->runs++;
+            d->cycles += out->dphase_cycles[i];
+            if (out->dphase_early[i]) d->early++;
+            if (strlen(dprogress[i]) < sizeof(dprogress[i])-16) {
+                sprintf( dprogress[i] + strlen(dprogress[i]), "%s%lu%s", k ? "," : "",
+                    out->dphase_cycles[i], out->dphase_early[i] ? "*" : "" );
+            }
+            dcycles[i] += out->dphase_cycles[i];
+            dlast_phase[i] = k + 1;
+        }
+        if ((was_defrosting & (1<<i)) && !(out->defrosting & (1<<i))) {
+            if (dlast_phase[i] == hp.defrost_phases) {
+                sprintf( msg, "INFO: AC%d defrost done in %lu cycles; phase cycles: %s (* - left early).",
+                    i+1, dcycles[i], dprogress[i] );
+            }
+            else {
+                sprintf( msg, "WARNING: AC%d defrost left after phase %d of %d; phase cycles: %s",
+                    i+1, dlast_phase[i], hp.defrost_phases, dprogress[i] );
+            }
+            log_message(LOG_FILE, msg);
+            dprogress[i][0] = 0;
+            dcycles[i] = 0;
+            dlast_phase[i] = 0;
+            WriteDefrostTable();
+        }
+    }
+}
+
+/* Run counters persistence:
+   PRSSTNC_FILE holds the compacted counter values, and the sequence number of the last
+   journal record folded into them; JOURNAL_FILE is an append-only list of counter deltas.
+   Every 10 minutes - less often over the SD card write budget - the deltas gathered so far
+   are appended to the journal as one record with a checksum, and flushed to the card with
+   a single fdatasync(); nothing is written if nothing changed. Once the journal grows to
+   JOURNAL_MAX_RECORDS, it gets compacted: new values are written to a temp file, which is
+   synced and renamed over PRSSTNC_FILE, and only then the journal is emptied. Power loss
+   can thus cost at most one batch. */
+
+/* table of the counters kept in the persistence file and journal */
+struct prst_counter
+{
+    const char       *name;
+    unsigned long    *value;
+    unsigned long    flushed;   /* value already recorded in the file or journal */
+};
+
+#define PRSTMAX         (MAXUNITS+TOTALCOUNTERS+MAXUNITS*HEAT_PER_AC)
+
+struct prst_counter prst[PRSTMAX];
+
+/* number of used entries in prst[] */
+unsigned short prst_count = 0;
+
+/* add a counter to the ones persisted; must be done before ReadPersistentData() */
+void
+RegisterPersistentCounter(const char *name, unsigned long *value) {
+    if (prst_count >= PRSTMAX) return;
+    prst[prst_count].name = name;
+    prst[prst_count].value = value;
+    prst[prst_count].flushed = 0;
+    prst_count++;
+}
+
+/* sequence number of the last record appended to the journal, and records count in it */
+unsigned long prst_seq = 0;
+unsigned short prst_records = 0;
+
+unsigned long
+crc32_str(const char *s, unsigned long crc) {
+    short k;
+    crc = ~crc & 0xFFFFFFFFUL;
+    while (*s) {
+        crc ^= (unsigned char)*s++;
+        for (k=0;k<8;k++) crc = (crc >> 1) ^ (0xEDB88320UL & (0UL - (crc & 1)));
+    }
+    return ~crc & 0xFFFFFFFFUL;
+}
+
+/* fold the journal into PRSSTNC_FILE and empty the journal; returns 0 on success */
+short
+CompactPersistentData() {
+    FILE *fp;
+    char line[150];
+    char timestamp[30];
+    unsigned long crc = 0;
+    time_t t;
+    struct tm *t_struct;
+    short i;
+    int fd;
+
+    t = time(NULL);
+    t_struct = localtime( &t );
+    strftime( timestamp, sizeof timestamp, "%F %T", t_struct );
+
+    fp = fopen( PRSSTNC_FILE".tmp", "w" );
+    if ( !fp ) return -1;
+    fprintf( fp, "# hpm data persistence file written %s\n", timestamp );
+    sprintf( line, "seq=%lu\n", prst_seq );
+    crc = crc32_str( line, crc );
+    fputs( line, fp );
+    for (i=0;i<prst_count;i++) {
+        sprintf( line, "%s=%lu\n", prst[i].name, *prst[i].value );
+        crc = crc32_str( line, crc );
+        fputs( line, fp );
+    }
+    fprintf( fp, "crc=%08lx\n", crc );
+    if ( fflush( fp ) || fsync( fileno( fp ) ) ) {
+        fclose( fp );
+        return -1;
+    }
+    WriteAccount( PRSSTNC_FILE, ftell( fp ), 1 );
+    if ( fclose( fp ) ) return -1;
+    if ( rename( PRSSTNC_FILE".tmp", PRSSTNC_FILE ) ) return -1;
+    /* make the rename itself durable before dropping the journal */
+    fd = open( PRSSTNC_DIR, O_RDONLY );
+    if ( fd != -1 ) { fsync( fd ); close( fd ); WriteAccount( PRSSTNC_DIR, 0, 1 ); }
+
+    for (i=0;i<prst_count;i++) prst[i].flushed = *prst[i].value;
+    fd = open( JOURNAL_FILE, O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+    if ( fd != -1 ) { fdatasync( fd ); close( fd ); WriteAccount( JOURNAL_FILE, 0, 1 ); }
+    prst_records = 0;
+    return 0;
+}
+
+/* append counter changes since the last call as one journal record */
+void
+WritePersistentData() {
+    char record[JOURNAL_RECORD_LEN];
+    unsigned long delta;
+    short i, n = 0;
+    int fd;
+
+    if ( prst_records >= JOURNAL_MAX_RECORDS ) {
+        if ( CompactPersistentData() ) log_message(LOG_FILE, "WARNING: Failed to compact "JOURNAL_FILE"!");
+        return;
+    }
+
+    sprintf( record, "%lu", prst_seq+1 );
+    for (i=0;i<prst_count;i++) {
+        delta = *prst[i].value - prst[i].flushed;
+        if ( !delta ) continue;
+        sprintf( record + strlen(record), " %s+%lu", prst[i].name, delta );
+        n++;
+    }
+    /* nothing changed - spare the SD card */
+    if ( !n ) return;
+    sprintf( record + strlen(record), " *%08lx\n", crc32_str( record, 0 ) );
+
+    fd = open( JOURNAL_FILE, O_WRONLY|O_CREAT|O_APPEND, 0644 );
+    if ( fd == -1 ) return;
+    if ( write( fd, record, strlen(record) ) != (ssize_t)strlen(record) ) {
+        close( fd );
+        return;
+    }
+    fdatasync( fd );
+    close( fd );
+    WriteAccount( JOURNAL_FILE, strlen( record ), 1 );
+
+    prst_seq++;
+    prst_records++;
+    for (i=0;i<prst_count;i++) prst[i].flushed = *prst[i].value;
+}
+
+/* apply one "name+delta" journal item; returns 0 if the name is known */
+short
+ApplyJournalItem(char *item) {
+    char *p = strchr( item, '+' );
+    short i;
+
+    if ( p == NULL ) return -1;
+    *p++ = 0;
+    for (i=0;i<prst_count;i++) {
+        if (strcmp(item, prst[i].name)==0) {
+            *prst[i].value += strtoul( p, NULL, 10 );
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void
+ReadPersistentData() {
+    char *s, *star, buff[JOURNAL_RECORD_LEN], check[JOURNAL_RECORD_LEN];
+    unsigned long base_seq = 0, seq, crc = 0, file_crc = 0;
+    char msg[200];
+    short i, have_crc = 0, base_ok = 1, bad_records = 0, applied = 0;
+    FILE *fp = fopen(PRSSTNC_FILE, "r");
+    if (fp == NULL) {
+        log_message(LOG_FILE,"WARNING: Failed to open "PRSSTNC_FILE" file for reading!");
+        base_ok = 0;
+        } else {
+        /* Read next line */
+        while ((s = fgets (buff, sizeof buff, fp)) != NULL)
+        {
+            /* Skip blank lines and comments */
+            if (buff[0] == '\n' || buff[0] == '#')
+            continue;
+
+            if (strncmp(buff, "crc=", 4)==0) {
+                file_crc = strtoul( buff+4, NULL, 16 );
+                have_crc = 1;
+                continue;
+            }
+            crc = crc32_str( buff, crc );
+
+            /* Parse name/value pair from line */
+            char name[MAXLEN], value[MAXLEN];
+            s = strtok (buff, "=");
+            if (s==NULL) continue;
+            else strncpy (name, s, MAXLEN-1);
+            name[MAXLEN-1] = 0;
+            s = strtok (NULL, "=");
+            if (s==NULL) continue;
+            else strncpy (value, s, MAXLEN-1);
+            value[MAXLEN-1] = 0;
+            trim (value);
+
+            /* Copy data in corresponding counters */
+            if (strcmp(name, "seq")==0) { base_seq = strtoul( value, NULL, 10 ); continue; }
+            for (i=0;i<prst_count;i++) {
+                if (strcmp(name, prst[i].name)==0) *prst[i].value = strtoul( value, NULL, 10 );
+            }
+        }
+        /* Close file */
+        fclose (fp);
+        /* files written before the journal was introduced have no checksum - trust them */
+        if (have_crc && (crc != file_crc)) {
+            log_message(LOG_FILE, "ALARM: "PRSSTNC_FILE" checksum mismatch! Ignoring its contents, using journal only.");
+            for (i=0;i<prst_count;i++) *prst[i].value = 0;
+            base_seq = 0;
+            base_ok = 0;
+        }
+    }
+    prst_seq = base_seq;
+
+    /* replay journal records newer than the ones already folded in PRSSTNC_FILE */
+    fp = fopen(JOURNAL_FILE, "r");
+    if (fp != NULL) {
+        while ((s = fgets (buff, sizeof buff, fp)) != NULL)
+        {
+            /* a torn or damaged record ends the usable part of the journal */
+            star = strrchr( buff, '*' );
+            if ( (star == NULL) || (star == buff) || (strchr( star, '\n' ) == NULL) ) { bad_records++; break; }
+            strncpy( check, buff, star-buff-1 );
+            check[star-buff-1] = 0;
+            if ( crc32_str( check, 0 ) != strtoul( star+1, NULL, 16 ) ) { bad_records++; break; }
+            seq = strtoul( check, &s, 10 );
+            prst_records++;
+            if ( seq <= prst_seq ) continue;
+            for (s=strtok(s, " "); s; s=strtok(NULL, " ")) ApplyJournalItem( s );
+            prst_seq = seq;
+            applied++;
+        }
+        fclose (fp);
+    }
+    for (i=0;i<prst_count;i++) prst[i].flushed = *prst[i].value;
+
+    if (bad_records) {
+        log_message(LOG_FILE, "WARNING: Found a damaged record in "JOURNAL_FILE" - the records after it are lost.");
+    }
+    /* a missing or damaged file, or a damaged journal get rewritten right away */
+    if (!base_ok || bad_records || (prst_records >= JOURNAL_MAX_RECORDS)) {
+        log_message(LOG_FILE, "INFO: Compacting persistent data file and journal...");
+        if ( CompactPersistentData() ) log_message(LOG_FILE, "WARNING: Failed to write "PRSSTNC_FILE"!");
+    }
+
+    /* Prepare log message and write it to log file */
+    sprintf( msg, "INFO: Read compressor run cycles start values:" );
+    for (i=0;i<cfg.units;i++) sprintf( msg + strlen(msg), "%s C%dRunCs=%ld", i ? "," : "", i+1, AC(i).RunCs );
+    sprintf( msg + strlen(msg), " (%d journal records applied)", applied );
+    log_message(LOG_FILE, msg);
+}
+
+/* read the kernel boot id - a snapshot taken during the same boot can trust
+   the monotonic clock, otherwise wall clock time is all we have */
+void
+GetBootId(char *boot_id, size_t len) {
+    FILE *fp;
+    strcpy( boot_id, "unknown" );
+    fp = fopen( BOOT_ID_FILE, "r" );
+    if ( !fp ) return;
+    if ( fgets( boot_id, len, fp ) == NULL ) strcpy( boot_id, "unknown" );
+    fclose( fp );
+    trim( boot_id );
+}
+
+long
+GetMonotonicSeconds() {
+    struct timespec ts;
+    if ( clock_gettime( CLOCK_MONOTONIC, &ts ) ) return 0;
+    return ts.tv_sec;
+}
+
+/* names of the per AC controls in the snapshot, and where they are kept */
+const char *snap_ctrl_names[4] = { "cmp", "fan", "fv", "mode" };
+
+short *
+SnapControl(short u, short k) {
+    switch (k) {
+        case 0: return &AC(u).cmp;
+        case 1: return &AC(u).fan;
+        case 2: return &AC(u).fv;
+        default: return &AC(u).mode;
+    }
+}
+
+unsigned long *
+SnapCycles(short u, short k) {
+    switch (k) {
+        case 0: return &AC(u).Scmp;
+        case 1: return &AC(u).Sfan;
+        case 2: return &AC(u).Sfv;
+        default: return &AC(u).Smode;
+    }
+}
+
+/* Warm restart state snapshot: written to the RAM disk at the end of every cycle
+   so a restart of the daemon can pick up where the previous instance left off.
+   Each control state change time is recorded as a wall clock + monotonic clock pair;
+   written to a temp file first and renamed over, so readers never see half of it */
+void
+WriteStateSnapshot() {
+    FILE *fp;
+    char boot_id[60];
+    time_t wall;
+    long mono;
+    short i, k;
+
+    wall = time(NULL);
+    mono = GetMonotonicSeconds();
+    GetBootId( boot_id, sizeof boot_id );
+
+    fp = fopen( STATE_FILE".tmp", "w" );
+    if ( !fp ) return;
+    fprintf( fp, "# hpm warm restart state snapshot\n" );
+    fprintf( fp, "version=%d\n", STATE_VERSION );
+    fprintf( fp, "boot_id=%s\n", boot_id );
+    fprintf( fp, "wall=%ld\n", (long)wall );
+    fprintf( fp, "mono=%ld\n", mono );
+    fprintf( fp, "HPmode=%d\n", HPmode );
+    for (i=0;i<cfg.units;i++) {
+        for (k=0;k<4;k++) {
+            fprintf( fp, "ac%d%s=%d,%ld,%ld\n", i+1, snap_ctrl_names[k], *SnapControl(i, k),
+                (long)wall - (long)(*SnapCycles(i, k)*CYCLE_SECONDS),
+                mono - (long)(*SnapCycles(i, k)*CYCLE_SECONDS) );
+        }
+    }
+    fprintf( fp, "TenvAvrg=%.3f\n", TenvAvrg );
+    /* each sensor's value and filter: the filtered value and the last three readings */
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if (!SensorInUse(i)) continue;
+        fprintf( fp, "sensor%d=%.3f,%.3f,%.3f,%.3f,%.3f,%u\n", i, sensors[i], sfilter[i].out,
+            sfilter[i].raw[0], sfilter[i].raw[1], sfilter[i].raw[2], sfilter[i].last );
+    }
+    fprintf( fp, "errors=" );
+    for (i=1;i<=TOTALSENSORS;i++) fprintf( fp, "%s%d", (i>1) ? "," : "", sensor_read_errors[i] );
+    fprintf( fp, "\n" );
+    /* today's writes, so a restart does not start the write budget over */
+    fprintf( fp, "writes_day=%ld\n", wbudget.day );
+    fprintf( fp, "writes=" );
+    for (i=0;i<WR_TIERS;i++) {
+        fprintf( fp, "%s%llu,%lu,%lu", i ? "," : "", wbudget.today[i].bytes, wbudget.today[i].writes,
+            wbudget.today[i].syncs );
+    }
+    fprintf( fp, "\n" );
+    WriteAccount( STATE_FILE, ftell( fp ), 0 );
+    if ( fclose( fp ) ) return;
+    rename( STATE_FILE".tmp", STATE_FILE );
+}
+
+/* Try to resume from a warm restart state snapshot; returns 1 if it was used.
+   Resuming is made safe like so:
+    - all compressors and fans start OFF, as they do on a cold start; the ones that were
+      running count their OFF time from the moment the snapshot was taken, the rest keep
+      counting from their last state change - so minimum OFF times carry over the restart
+    - a compressor in overheating protection stays in it, and its hold time carries over
+    - fourway valves keep their state, which is safe as all compressors are OFF
+    - the environment temp average carries over: its window starts full of it
+    - the sensors values and filters carry over, so a bad reading right after the restart
+      is taken out as it would have been, instead of becoming the new value */
+short
+ReadStateSnapshot() {
+    char *s, buff[200], msg[300], key[MAXLEN];
+    char boot_id[60], snap_boot_id[MAXLEN*2];
+    short ctrl[MAXUNITS][4] = { { 0 } };
+    long chg_wall[MAXUNITS][4] = { { 0 } }, chg_mono[MAXUNITS][4] = { { 0 } };
+    unsigned short have_ctrl[MAXUNITS] = { 0 };
+    unsigned short errs[TOTALSENSORS+1] = { 0 };
+    unsigned short have_sens[TOTALSENSORS+1] = { 0 };
+    float sval[TOTALSENSORS+1][5];
+    unsigned int slast[TOTALSENSORS+1];
+    unsigned short have = 0, hpm = HEAT;
+    long wall = 0, mono = 0, now_wall, now_mono, age, since;
+    short version = 0, same_boot, i, k;
+    int v, u;
+    float avrg = 20;
+    struct write_tier wr[WR_TIERS];
+    long wr_day = -1;
+    short have_wr = 0;
+
+    strcpy( snap_boot_id, "" );
+    FILE *fp = fopen(STATE_FILE, "r");
+    if (fp == NULL) {
+        log_message(LOG_FILE, "INFO: No warm restart state snapshot found - doing a cold start.");
+        return 0;
+    }
+    while ((s = fgets (buff, sizeof buff, fp)) != NULL)
+    {
+        /* Skip blank lines and comments */
+        if (buff[0] == '\n' || buff[0] == '#')
+        continue;
+
+        /* Parse name/value pair from line */
+        char name[MAXLEN], value[MAXLEN*2];
+        s = strtok (buff, "=");
+        if (s==NULL) continue;
+        else strncpy (name, s, MAXLEN-1);
+        name[MAXLEN-1] = 0;
+        s = strtok (NULL, "=");
+        if (s==NULL) continue;
+        else strncpy (value, s, sizeof(value)-1);
+        value[sizeof(value)-1] = 0;
+        trim (value);
+
+        if (strcmp(name, "version")==0) { version = atoi( value ); have |= 1; }
+        else if (strcmp(name, "boot_id")==0) { snprintf( snap_boot_id, sizeof snap_boot_id, "%s", value ); }
+        else if (strcmp(name, "wall")==0) { wall = atol( value ); have |= 2; }
+        else if (strcmp(name, "mono")==0) { mono = atol( value ); have |= 4; }
+        else if (strcmp(name, "HPmode")==0) { hpm = atoi( value ) ? HEAT : COOL; }
+        else if (strcmp(name, "TenvAvrg")==0) { avrg = atof( value ); have |= 8; }
+        else if (strcmp(name, "writes_day")==0) { wr_day = atol( value ); }
+        else if (strcmp(name, "writes")==0) {
+            have_wr = (sscanf( value, "%llu,%lu,%lu,%llu,%lu,%lu,%llu,%lu,%lu", &wr[0].bytes, &wr[0].writes,
+                &wr[0].syncs, &wr[1].bytes, &wr[1].writes, &wr[1].syncs, &wr[2].bytes, &wr[2].writes,
+                &wr[2].syncs ) == 3*WR_TIERS);
+        }
+        else if (strcmp(name, "errors")==0) {
+            for (k=1, s=strtok(value, ","); s && (k<=TOTALSENSORS); k++, s=strtok(NULL, ",")) {
+                v = atoi( s );
+                errs[k] = (v > 3) ? 3 : v;
+            }
+        }
+        else if ((sscanf( name, "sensor%d", &u ) == 1) && (u >= 1) && (u <= TOTALSENSORS)) {
+            have_sens[u] = (sscanf( value, "%f,%f,%f,%f,%f,%u", &sval[u][0], &sval[u][1], &sval[u][2],
+                &sval[u][3], &sval[u][4], &slast[u] ) == 6) && (slast[u] < 3);
+        }
+        else if ((sscanf( name, "ac%d%30s", &u, key ) == 2) && (u >= 1) && (u <= MAXUNITS)) {
+            for (k=0;k<4;k++) {
+                if (strcmp( key, snap_ctrl_names[k] )) continue;
+                if (sscanf( value, "%d,%ld,%ld", &v, &chg_wall[u-1][k], &chg_mono[u-1][k] ) == 3) {
+                    ctrl[u-1][k] = v;
+                    have_ctrl[u-1] |= 1 << k;
+                }
+            }
+        }
+    }
+    fclose (fp);
+
+    /* the day's writes carry over whether the rest of it is used or not */
+    if (have_wr && (wr_day == WriteDay( time(NULL), NULL ))) {
+        for (i=0;i<WR_TIERS;i++) {
+            wbudget.today[i].bytes += wr[i].bytes;
+            wbudget.today[i].writes += wr[i].writes;
+            wbudget.today[i].syncs += wr[i].syncs;
+        }
+    }
+
+    /* all fields must be there for all installed ACs, and the snapshot must be of a format we know */
+    for (i=0;i<cfg.units;i++) {
+        if (have_ctrl[i] != 0xF) have = 0;
+    }
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if (SensorInUse(i) && !have_sens[i]) have = 0;
+    }
+    if ((version != STATE_VERSION) || (have != (1|2|4|8))) {
+        log_message(LOG_FILE, "WARNING: Warm restart state snapshot is incomplete or of unknown version - doing a cold start.");
+        return 0;
+    }
+
+    now_wall = time(NULL);
+    now_mono = GetMonotonicSeconds();
+    GetBootId( boot_id, sizeof boot_id );
+    same_boot = (strcmp( boot_id, "unknown" ) && !strcmp( boot_id, snap_boot_id ) && (now_mono >= mono));
+    age = same_boot ? (now_mono - mono) : (now_wall - wall);
+    if ((age < 0) || (age > STATE_MAX_AGE)) {
+        sprintf( buff, "INFO: Warm restart state snapshot is %ld seconds old - doing a cold start.", age );
+        log_message(LOG_FILE, buff);
+        return 0;
+    }
+
+    for (i=0;i<cfg.units;i++) {
+        for (k=0;k<4;k++) {
+            since = same_boot ? (now_mono - chg_mono[i][k]) : (now_wall - chg_wall[i][k]);
+            if (since < age) since = age;
+            switch (k) {
+                case 0: case 1: /* compressor and fan */
+                    *SnapControl(i, k) = 0;
+                    *SnapCycles(i, k) = (ctrl[i][k] ? age : since) / CYCLE_SECONDS;
+                    break;
+                case 2: /* fourway valve */
+                    *SnapControl(i, k) = ctrl[i][k] ? 1 : 0;
+                    *SnapCycles(i, k) = since / CYCLE_SECONDS;
+                    break;
+                case 3: /* AC mode */
+                    if (ctrl[i][k] == 5) { /* overheating protection carries over */
+                        *SnapControl(i, k) = 5;
+                        *SnapCycles(i, k) = since / CYCLE_SECONDS;
+                    }
+                    else {
+                        *SnapControl(i, k) = 0;
+                        *SnapCycles(i, k) = (ctrl[i][k] ? age : since) / CYCLE_SECONDS;
+                    }
+                    break;
+            }
+        }
+    }
+    hpm_stats_fill( &TenvStats, avrg );
+    TenvAvrg = avrg;
+    HPmode = hpm;
+    for (i=1;i<=TOTALSENSORS;i++) sensor_read_errors[i] = errs[i];
+    /* the filters go on where they were; only a step being confirmed starts over */
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if (!SensorInUse(i)) continue;
+        sensors[i] = sval[i][0];
+        sfilter[i].out = sval[i][1];
+        for (k=0;k<3;k++) sfilter[i].raw[k] = sval[i][2+k];
+        sfilter[i].last = slast[i];
+        sfilter[i].held = 0;
+        sfilter[i].dir = 0;
+    }
+    filters_restored = 1;
+
+    sprintf( msg, "INFO: Warm restart from %ld seconds old state snapshot (%s clock):", age,
+        same_boot ? "monotonic" : "wall" );
+    for (i=0;i<cfg.units;i++) sprintf( msg + strlen(msg), " AC%d comp off for %lus,", i+1, AC(i).Scmp*CYCLE_SECONDS );
+    sprintf( msg + strlen(msg), " modes" );
+    for (i=0;i<cfg.units;i++) sprintf( msg + strlen(msg), "%s%d", i ? "/" : " ", AC(i).mode );
+    sprintf( msg + strlen(msg), ", TenvAvrg=%5.3f", TenvAvrg );
+    log_message(LOG_FILE, msg);
+    return 1;
+}
+
+int
+GPIOExport(int pin)
+{
     char buffer[BUFFER_MAX];
     ssize_t bytes_written;
     int fd;
 
-    fd = open("/sys/class/gpio/export", O_WRONLY);
+    fd = open(GPIO_ROOT"/export", O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO export for writing!");
         return(-1);
@@ -739,7 +2215,7 @@ GPIOUnexport(int pin)
     ssize_t bytes_written;
     int fd;
 
-    fd = open("/sys/class/gpio/unexport", O_WRONLY);
+    fd = open(GPIO_ROOT"/unexport", O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO unexport for writing!");
         return(-1);
@@ -756,10 +2232,10 @@ GPIODirection(int pin, int dir)
 {
     static const char s_directions_str[]  = "in\0out";
 
-    char path[DIRECTION_MAX];
+    char path[GPIO_PATH_MAX];
     int fd;
 
-    snprintf(path, DIRECTION_MAX, "/sys/class/gpio/gpio%d/direction", pin);
+    snprintf(path, GPIO_PATH_MAX, GPIO_ROOT"/gpio%d/direction", pin);
     fd = open(path, O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO direction for writing!");
@@ -778,24 +2254,29 @@ GPIODirection(int pin, int dir)
 int
 GPIORead(int pin)
 {
-    char path[VALUE_MAX];
+    char path[GPIO_PATH_MAX];
     char value_str[3];
     int fd;
 
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
+    snprintf(path, GPIO_PATH_MAX, GPIO_ROOT"/gpio%d/value", pin);
     fd = open(path, O_RDONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO value for reading!");
+        gpio_errors++;
+        HPM_TRACE2(gpio_read, pin, -1);
         return(-1);
     }
 
     if (-1 == read(fd, value_str, 3)) {
         log_message(LOG_FILE,"Failed to read GPIO value!");
+        gpio_errors++;
+        HPM_TRACE2(gpio_read, pin, -1);
         return(-1);
     }
 
     close(fd);
 
+    HPM_TRACE2(gpio_read, pin, atoi(value_str));
     return(atoi(value_str));
 }
 
@@ -804,22 +2285,27 @@ GPIOWrite(int pin, int value)
 {
     static const char s_values_str[] = "01";
 
-    char path[VALUE_MAX];
+    char path[GPIO_PATH_MAX];
     int fd;
 
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
+    snprintf(path, GPIO_PATH_MAX, GPIO_ROOT"/gpio%d/value", pin);
     fd = open(path, O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO value for writing!");
+        gpio_errors++;
+        HPM_TRACE3(gpio_write, pin, value, -1);
         return(-1);
     }
 
     if (1 != write(fd, &s_values_str[LOW == value ? 0 : 1], 1)) {
         log_message(LOG_FILE,"Failed to write GPIO value!");
+        gpio_errors++;
+        HPM_TRACE3(gpio_write, pin, value, -1);
         return(-1);
     }
 
     close(fd);
+    HPM_TRACE3(gpio_write, pin, value, 0);
     return(0);
 }
 
@@ -848,10 +2334,12 @@ sensorRead(const char* sensor)
     /* if having trouble - return -200 */
 
     /* try to open sensor file */
+    HPM_TRACE1(sensor_read_start, sensor);
     snprintf(path, VALUE_MAX, "%s", sensor);
     fd = open(path, O_RDONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Error opening sensor file. Continuing.");
+        HPM_TRACE2(sensor_read_end, sensor, -200000L);
         return temp;
     }
 
@@ -859,6 +2347,7 @@ sensorRead(const char* sensor)
     if (-1 == read(fd, value_str, 88)) {
         log_message(LOG_FILE,"Error reading from sensor file. Continuing.");
         close(fd);
+        HPM_TRACE2(sensor_read_end, sensor, -200000L);
         return temp;
     }
 
@@ -874,6 +2363,7 @@ sensorRead(const char* sensor)
     }
 
     /* return the read temperature */
+    HPM_TRACE2(sensor_read_end, sensor, result ? int_temp : -200000L);
     return temp;
 }
 
@@ -891,9 +2381,12 @@ signal_handler(int sig)
         case SIGHUP:
             log_message(LOG_FILE, "INFO: Signal SIGHUP caught. Not implemented. Continuing. *************************");
             break;
+        case SIGINT:
         case SIGTERM:
             log_message(LOG_FILE, "INFO: Terminate signal caught. Stopping. *************************");
+            SdNotify( "STOPPING=1" );
             WritePersistentData();
+            WriteStateSnapshot();
             if ( ! DisableGPIOpins() ) {
                 log_message(LOG_FILE, "WARNING: Errors disabling GPIO pins! Quitting anyway. *************************");
                 exit(14);
@@ -911,19 +2404,25 @@ daemonize()
     int i, lfp;
     char str[10];
 
-    if(getppid()==1) return; /* already a daemon */
-    i=fork();
-    if (i<0) { printf("hpm daemonize(): Fork error!\n"); exit(1); }/* fork error */
-    if (i>0) exit(0); /* parent exits */
-    /* child (daemon) continues */
-    setsid(); /* obtain a new process group */
-    for (i=getdtablesize();i>=0;--i) close(i); /* close all descriptors */
-    i=open("/dev/null",O_RDWR); dup(i); dup(i); /* handle standart I/O */
+    /* in the foreground or already a daemon, there is nothing to fork away from; the rest
+       is needed all the same */
+    if (!foreground && (getppid()!=1)) {
+        i=fork();
+        if (i<0) { printf("hpm daemonize(): Fork error!\n"); exit(1); }/* fork error */
+        if (i>0) exit(0); /* parent exits */
+        /* child (daemon) continues */
+        setsid(); /* obtain a new process group */
+        for (i=getdtablesize();i>=0;--i) close(i); /* close all descriptors */
+        i=open("/dev/null",O_RDWR); dup(i); dup(i); /* handle standart I/O */
+    }
     umask(022); /* set newly created file permissions */
     chdir(RUNNING_DIR); /* change running directory */
     lfp=open(LOCK_FILE,O_RDWR|O_CREAT,0644);
     if (lfp<0) exit(2); /* can not open */
-    if (lockf(lfp,F_TLOCK,0)<0) exit(0); /* can not lock */
+    if (lockf(lfp,F_TLOCK,0)<0) { /* can not lock */
+        if (foreground) { printf("hpm is already running!\n"); exit(2); }
+        exit(0);
+    }
     /* first instance continues */
     sprintf(str,"%d\n",getpid());
     write(lfp,str,strlen(str)); /* record pid to lockfile */
@@ -935,18 +2434,129 @@ daemonize()
     signal(SIGUSR2,signal_handler); /* catch signal USR2 */
     signal(SIGHUP,signal_handler); /* catch hangup signal */
     signal(SIGTERM,signal_handler); /* catch kill signal */
+    if (foreground) signal(SIGINT,signal_handler); /* and Ctrl-C */
+}
+
+/* tell systemd how hpm is doing, when it started hpm with a notify socket (Type=notify) -
+   see sd_notify(3); it is one datagram, so it needs no libsystemd */
+void
+SdNotify(const char *state)
+{
+    static int fd = -1;
+    struct sockaddr_un addr;
+    const char *path = getenv( "NOTIFY_SOCKET" );
+    size_t len;
+
+    if (!path || !path[0]) return;
+    len = strlen( path );
+    if (len >= sizeof(addr.sun_path)) return;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    memcpy( addr.sun_path, path, len );
+    /* an abstract socket */
+    if (addr.sun_path[0] == '@') addr.sun_path[0] = 0;
+    if (fd == -1) fd = socket( AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+    if (fd == -1) return;
+    sendto( fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, sizeof(sa_family_t) + len );
+}
+
+/* the heartbeat in shared memory - see hpm_heartbeat.h */
+struct hpm_heartbeat *heartbeat = NULL;
+
+long long
+MonotonicMs() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void
+HeartbeatOpen() {
+    int fd;
+
+    fd = open( HEARTBEAT_FILE, O_RDWR|O_CREAT|O_CLOEXEC, 0644 );
+    if ((fd == -1) || ftruncate( fd, sizeof(struct hpm_heartbeat) )) {
+        log_message(LOG_FILE, "WARNING: Cannot set up the heartbeat in "HEARTBEAT_FILE" - supervisors will not see it.");
+        if (fd != -1) close( fd );
+        return;
+    }
+    heartbeat = mmap( NULL, sizeof(struct hpm_heartbeat), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if (heartbeat == MAP_FAILED) {
+        heartbeat = NULL;
+        log_message(LOG_FILE, "WARNING: Cannot map the heartbeat in "HEARTBEAT_FILE" - supervisors will not see it.");
+        return;
+    }
+    /* a new start counts as a cycle just ended, so supervisors give the first one its time */
+    memset( heartbeat, 0, sizeof(struct hpm_heartbeat) );
+    heartbeat->magic = HPM_HB_MAGIC;
+    heartbeat->version = HPM_HB_VERSION;
+    heartbeat->pid = getpid();
+    heartbeat->started_ms = heartbeat->ended_ms = MonotonicMs();
+    heartbeat->ended_wall = time(NULL);
+    heartbeat->flags = HB_STARTING;
+}
+
+void
+HeartbeatBegin() {
+    if (!heartbeat) return;
+    heartbeat->seq++;
+    __sync_synchronize();
+    heartbeat->started_ms = MonotonicMs();
+    __sync_synchronize();
+    heartbeat->seq++;
+}
+
+/* a control cycle completed: update the heartbeat, and tell systemd */
+void
+HeartbeatEnd() {
+    static unsigned long gpio_errors_seen = 0;
+    static short ready = 0;
+    long long now = MonotonicMs();
+    unsigned int flags = 0;
+    short i;
+
+    /* the cycle just completed is counted already - the files go out from the 9th one on */
+    if ( !warm_started && (ProgramRunCycles <= 8) ) flags |= HB_STARTING;
+    if (failsafe) flags |= HB_FAILSAFE;
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if (SensorInUse(i) && (sensor_read_errors[i] > 2)) flags |= HB_SENSORS;
+    }
+    if (gpio_errors != gpio_errors_seen) flags |= HB_GPIO;
+    gpio_errors_seen = gpio_errors;
+    if (hwwm.live) flags |= HB_HWWM;
+    if (wbudget.level) flags |= HB_WRITE_BUDGET;
+
+    if (heartbeat) {
+        heartbeat->seq++;
+        __sync_synchronize();
+        heartbeat->cycle = ProgramRunCycles;
+        heartbeat->ended_ms = now;
+        heartbeat->ended_wall = time(NULL);
+        heartbeat->last_ms = now - heartbeat->started_ms;
+        if (heartbeat->last_ms > heartbeat->max_ms) heartbeat->max_ms = heartbeat->last_ms;
+        heartbeat->flags = flags;
+        __sync_synchronize();
+        heartbeat->seq++;
+    }
+    /* ready once the first cycle went through */
+    if (!ready) {
+        SdNotify( "READY=1" );
+        ready = 1;
+    }
+    SdNotify( "WATCHDOG=1" );
 }
 
 /* the following 3 functions RETURN 0 ON ERROR! (its to make the program nice to read) */
 short
 EnableGPIOpins()
 {
-    if (-1 == GPIOExport(cfg.ac1cmp_pin)) return 0;
-    if (-1 == GPIOExport(cfg.ac1fan_pin)) return 0;
-    if (-1 == GPIOExport(cfg.ac1v_pin)) return 0;
-    if (-1 == GPIOExport(cfg.ac2cmp_pin)) return 0;
-    if (-1 == GPIOExport(cfg.ac2fan_pin)) return 0;
-    if (-1 == GPIOExport(cfg.ac2v_pin)) return 0;
+    short i;
+    for (i=0;i<cfg.units;i++) {
+        if (-1 == GPIOExport(cfg.accmp_pin[i])) return 0;
+        if (-1 == GPIOExport(cfg.acfan_pin[i])) return 0;
+        if (-1 == GPIOExport(cfg.acv_pin[i])) return 0;
+    }
     if (-1 == GPIOExport(cfg.commspin1_pin)) return 0;
     if (-1 == GPIOExport(cfg.commspin2_pin)) return 0;
     if (-1 == GPIOExport(cfg.commspin3_pin)) return 0;
@@ -957,16 +2567,16 @@ EnableGPIOpins()
 short
 SetGPIODirection()
 {
+    short i;
     /* input pins */
     if (-1 == GPIODirection(cfg.commspin1_pin, IN))  return 0;
     if (-1 == GPIODirection(cfg.commspin2_pin, IN))  return 0;
     /* output pins */
-    if (-1 == GPIODirection(cfg.ac1cmp_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.ac1fan_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.ac1v_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.ac2cmp_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.ac2fan_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.ac2v_pin, OUT)) return 0;
+    for (i=0;i<cfg.units;i++) {
+        if (-1 == GPIODirection(cfg.accmp_pin[i], OUT)) return 0;
+        if (-1 == GPIODirection(cfg.acfan_pin[i], OUT)) return 0;
+        if (-1 == GPIODirection(cfg.acv_pin[i], OUT)) return 0;
+    }
     if (-1 == GPIODirection(cfg.commspin3_pin, OUT))  return 0;
     if (-1 == GPIODirection(cfg.commspin4_pin, OUT))  return 0;
     return -1;
@@ -975,12 +2585,12 @@ SetGPIODirection()
 short
 DisableGPIOpins()
 {
-    if (-1 == GPIOUnexport(cfg.ac1cmp_pin)) return 0;
-    if (-1 == GPIOUnexport(cfg.ac1fan_pin)) return 0;
-    if (-1 == GPIOUnexport(cfg.ac1v_pin)) return 0;
-    if (-1 == GPIOUnexport(cfg.ac2cmp_pin)) return 0;
-    if (-1 == GPIOUnexport(cfg.ac2fan_pin)) return 0;
-    if (-1 == GPIOUnexport(cfg.ac2v_pin)) return 0;
+    short i;
+    for (i=0;i<cfg.units;i++) {
+        if (-1 == GPIOUnexport(cfg.accmp_pin[i])) return 0;
+        if (-1 == GPIOUnexport(cfg.acfan_pin[i])) return 0;
+        if (-1 == GPIOUnexport(cfg.acv_pin[i])) return 0;
+    }
     if (-1 == GPIOUnexport(cfg.commspin1_pin)) return 0;
     if (-1 == GPIOUnexport(cfg.commspin2_pin)) return 0;
     if (-1 == GPIOUnexport(cfg.commspin3_pin)) return 0;
@@ -988,32 +2598,44 @@ DisableGPIOpins()
     return -1;
 }
 
+/* non-zero if sensor i is installed - the ones of the ACs beyond cfg.units are not */
+short
+SensorInUse(short i) {
+    short u;
+    for (u=cfg.units;u<MAXUNITS;u++) {
+        if ((i == SENS_CMP(u)) || (i == SENS_CND(u))) return 0;
+    }
+    return 1;
+}
+
 void
 ReadSensors() {
     float new_val = 0;
-    short i, k;
+    short i;
     char msg[100];
 
     for (i=1;i<=TOTALSENSORS;i++) {
+        if (!SensorInUse(i)) continue;
         new_val = sensorRead(sensor_paths[i]);
         if ( new_val != -200 ) {
             if (sensor_read_errors[i]) sensor_read_errors[i]--;
             /* Apply sensors data corrections */
             new_val += scorr[i];
-            if (just_started) { sensors_prv[i] = new_val; sensors[i] = new_val; }
-            if (just_started > 2) { for (k=0;k<12;k++) { TenvArr[k]=new_val; } }
-            if (new_val < (sensors[i]-mtd[i])) {
-                sprintf( msg, "Correcting LOW %6.3f for sensor '%s' with %6.3f.", new_val, sensor_names[i], sensors[i]-mtd[i] );
-                log_message(LOG_FILE, msg);
-                new_val = sensors[i]-mtd[i];
-            }
-            if (new_val > (sensors[i]+mtd[i])) {
-                sprintf( msg, "Correcting HIGH %6.3f for sensor '%s' with %6.3f.", new_val, sensor_names[i], sensors[i]+mtd[i] );
-                log_message(LOG_FILE, msg);
-                new_val = sensors[i]+mtd[i];
+            if (just_started && !filters_restored) { sensors[i] = new_val; hpm_filter_reset( &sfilter[i], new_val ); }
+            if (just_started > 2) hpm_stats_fill( &sstats[i], new_val );
+            /* single bad readings are taken out, real steps get through once confirmed */
+            switch (hpm_filter_add( &sfilter[i], new_val )) {
+                case FILTER_STEP:
+                    sprintf( msg, "Sensor '%s' stepped from %6.3f to %6.3f.", sensor_names[i], sensors[i], sfilter[i].out );
+                    log_message(LOG_FILE, msg);
+                    break;
+                case FILTER_SPIKE:
+                    sprintf( msg, "Rejected a spike to %6.3f for sensor '%s'.", sfilter[i].spike, sensor_names[i] );
+                    log_message(LOG_FILE, msg);
+                    break;
             }
             sensors_prv[i] = sensors[i];
-            sensors[i] = new_val;
+            sensors[i] = sfilter[i].out;
         }
         else {
             sensor_read_errors[i]++;
@@ -1026,12 +2648,15 @@ ReadSensors() {
             }
             log_message(LOG_FILE, msg);
         }
-        /* sleep a bit - 1 second is 1000000, so 50000 is 1/20th of a second */
-        usleep(50000);
+        /* sleep a bit between the sensors */
+        if (SENSOR_PAUSE) usleep(SENSOR_PAUSE);
     }
+    /* a later start over - after sensor errors or a config reload - resets them again */
+    filters_restored = 0;
     /* Allow for maximum of 4 consecutive 5 seconds intervals of missing sensor data
     on any of the sensors before quitting screaming... */
     for (i=1;i<=TOTALSENSORS;i++) {
+        if (!SensorInUse(i)) continue;
         if (sensor_read_errors[i]>4) {
             /* log the errors, clean up and bail out */
             log_message(LOG_FILE, "ALARM: Too many sensor read errors! Stopping.");
@@ -1044,19 +2669,156 @@ ReadSensors() {
     }
 }
 
+/* Command to actuation latency: every change of COMMS hpm sees is timestamped with the
+   monotonic clock - when the pins were read, or when the command came in on the command
+   channel - and so are the first relays write and the first sendBits change after it.
+   The times in between go to histograms per kind of change, kept since hpm started and
+   written to LATENCY_FILE. A change followed by another one before a relays write or a
+   sendBits change counts as having none */
+#define LAT_KINDS            8
+#define LAT_BUCKETS          19
+
+const char *lat_kind_names[LAT_KINDS] =
+    { "off->low", "off->high", "low->high", "high->low", "low->off", "high->off", "->battery", "battery->" };
+
+/* upper bounds of the histogram buckets, in ms; the last bucket has no bound */
+const long lat_bounds[LAT_BUCKETS-1] =
+    { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000 };
+
+struct latency_hist
+{
+    unsigned long   n[LAT_BUCKETS];
+    unsigned long   count;
+    unsigned long   none;           /* changes with no write of this kind after them */
+    double          sum;            /* ms */
+    double          max;
+};
+
+struct
+{
+    short               seen;       /* COMMS was read at least once */
+    unsigned short      comms;      /* as of the last change */
+    short               kind;       /* of the last change, -1 for none yet */
+    struct timespec     at;
+    short               relays_done;
+    short               answer_done;
+    unsigned short      sent;       /* sendBits as last written to the pins */
+    struct latency_hist relays[LAT_KINDS];
+    struct latency_hist answer[LAT_KINDS];
+    short               changed;    /* since the table was last written */
+}
+cmd_lat = { .kind = -1 };
+
+short
+LatencyKind(unsigned short from, unsigned short to) {
+    if (to == 3) return 6;
+    if (from == 3) return 7;
+    if (from == 0) return (to == 1) ? 0 : 1;
+    if (from == 1) return (to == 2) ? 2 : 4;
+    return (to == 1) ? 3 : 5;
+}
+
+void
+LatencyAdd(struct latency_hist *h) {
+    struct timespec now;
+    double ms;
+    short k;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    ms = (now.tv_sec - cmd_lat.at.tv_sec) * 1000.0 + (now.tv_nsec - cmd_lat.at.tv_nsec) / 1e6;
+    if (ms < 0) ms = 0;
+    for (k=0;(k<LAT_BUCKETS-1) && (ms > lat_bounds[k]);k++);
+    h->n[k]++;
+    h->count++;
+    h->sum += ms;
+    if (ms > h->max) h->max = ms;
+    cmd_lat.changed = 1;
+}
+
+/* a COMMS change, if there is one, as of the last read */
+void
+LatencyComms() {
+    if (cmd_lat.seen && (COMMS == cmd_lat.comms)) return;
+    if (cmd_lat.seen) {
+        if (cmd_lat.kind >= 0) {
+            if (!cmd_lat.relays_done) cmd_lat.relays[cmd_lat.kind].none++;
+            if (!cmd_lat.answer_done) cmd_lat.answer[cmd_lat.kind].none++;
+        }
+        cmd_lat.kind = LatencyKind( cmd_lat.comms, COMMS );
+        if (hwwm.live) cmd_lat.at = hwwm.taken;
+        else clock_gettime( CLOCK_MONOTONIC, &cmd_lat.at );
+        cmd_lat.relays_done = cmd_lat.answer_done = 0;
+        cmd_lat.changed = 1;
+    }
+    cmd_lat.seen = 1;
+    cmd_lat.comms = COMMS;
+}
+
+/* the relays got written */
+void
+LatencyRelays() {
+    if ((cmd_lat.kind < 0) || cmd_lat.relays_done) return;
+    LatencyAdd( &cmd_lat.relays[cmd_lat.kind] );
+    cmd_lat.relays_done = 1;
+}
+
+/* sendBits go to the pins */
+void
+LatencyAnswer() {
+    if (sendBits == cmd_lat.sent) return;
+    cmd_lat.sent = sendBits;
+    if ((cmd_lat.kind < 0) || cmd_lat.answer_done) return;
+    LatencyAdd( &cmd_lat.answer[cmd_lat.kind] );
+    cmd_lat.answer_done = 1;
+}
+
+void
+WriteLatencyHist(FILE *fp, const char *kind, const char *what, const struct latency_hist *h) {
+    short k;
+
+    fprintf( fp, "%-10s %-9s %6lu %6lu %9.1f %9.1f ", kind, what, h->count, h->none,
+        h->count ? h->sum / h->count : 0, h->max );
+    for (k=0;k<LAT_BUCKETS;k++) fprintf( fp, " %6lu", h->n[k] );
+    fprintf( fp, "\n" );
+}
+
+/* the histograms, when there is something new in them */
+void
+WriteLatencyTable() {
+    char bound[20];
+    FILE *fp;
+    short k;
+
+    if (!cmd_lat.changed) return;
+    fp = fopen( LATENCY_FILE, "w" );
+    if ( !fp ) return;
+    fprintf( fp, "Latency from a COMMS change to the first relays write and sendBits change after it,"
+        " in ms, since hpm started\n\n" );
+    fprintf( fp, "%-10s %-9s %6s %6s %9s %9s ", "COMMS", "to", "count", "none", "mean", "max" );
+    for (k=0;k<LAT_BUCKETS;k++) {
+        if (k < LAT_BUCKETS-1) sprintf( bound, "<=%ld", lat_bounds[k] );
+        else sprintf( bound, ">%ld", lat_bounds[k-1] );
+        fprintf( fp, " %6s", bound );
+    }
+    fprintf( fp, "\n" );
+    for (k=0;k<LAT_KINDS;k++) {
+        WriteLatencyHist( fp, lat_kind_names[k], "relays", &cmd_lat.relays[k] );
+        WriteLatencyHist( fp, lat_kind_names[k], "sendBits", &cmd_lat.answer[k] );
+    }
+    WriteAccount( LATENCY_FILE, ftell( fp ), 0 );
+    fclose( fp );
+    cmd_lat.changed = 0;
+}
+
 /* Read comms and assemble the global byte COMMS, as sent by hwwm */
 void
 ReadCommsPins() {
     unsigned short temp = 0;
-    HPL = 0;
-    HPH = 0;
     COMMS = 0;
     temp = GPIORead(cfg.commspin1_pin);
     if (temp) COMMS |= 1;
     temp = GPIORead(cfg.commspin2_pin);
     if (temp) COMMS |= 2;
-    if (COMMS==1) HPL = 1;
-    if (COMMS==2) HPH = 1;
 }
 
 /* Write comms  */
@@ -1064,28 +2826,238 @@ void
 WriteCommsPins() {
     GPIOWrite( cfg.commspin3_pin,  (sendBits&1) );
     GPIOWrite( cfg.commspin4_pin,  (sendBits&2) );
+    LatencyAnswer();
+}
+
+/* milliseconds until the next cycle is due, rounded up */
+long
+NextCycleMs() {
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ((next_cycle.tv_sec - now.tv_sec) * 1000000000L + next_cycle.tv_nsec - now.tv_nsec + 999999) / 1000000;
+}
+
+/* take one datagram from hwwm; the answer to it goes to answer[], if there is one */
+void
+HwwmMessage(char *msg, char *answer) {
+    unsigned long seq;
+    unsigned long power = 0, avoid = 0, battery = 0;
+    short cmd, has_power = 0;
+    char *tok, *save, *e = "";
+
+    answer[0] = 0;
+    tok = strtok_r( msg, " \t\r\n", &save );
+    if ((tok == NULL) || strcmp( tok, "hwwm" )) { hwwm.bad++; return; }
+    tok = strtok_r( NULL, " \t\r\n", &save );
+    if ((tok == NULL) || (strcmp( tok, "cmd" ) && strcmp( tok, "hb" ))) { hwwm.bad++; return; }
+    cmd = !strcmp( tok, "cmd" );
+    tok = strtok_r( NULL, " \t\r\n", &save );
+    if (tok != NULL) seq = strtoul( tok, &e, 10 );
+    if ((tok == NULL) || (e == tok) || *e) { hwwm.bad++; return; }
+
+    while ((tok = strtok_r( NULL, " \t\r\n", &save )) != NULL) {
+        if (!strncmp( tok, "power=", 6 )) { power = strtoul( tok+6, &e, 10 ); has_power = (e != tok+6); }
+        else if (!strncmp( tok, "avoid=", 6 )) avoid = strtoul( tok+6, &e, 0 );
+        else if (!strncmp( tok, "battery=", 8 )) battery = strtoul( tok+8, &e, 10 );
+        else {
+            hwwm.bad++;
+            sprintf( answer, "hpm nak %lu unknown %.40s\n", seq, tok );
+            return;
+        }
+        if (*e || (power > MAXUNITS) || (avoid >= (1 << MAXUNITS)) || (battery > 1)) {
+            hwwm.bad++;
+            sprintf( answer, "hpm nak %lu bad %.40s\n", seq, tok );
+            return;
+        }
+    }
+    if (cmd && !has_power) {
+        hwwm.bad++;
+        sprintf( answer, "hpm nak %lu no power\n", seq );
+        return;
+    }
+
+    if (!cmd && !hwwm.live) {
+        sprintf( answer, "hpm nak %lu no command\n", seq );
+        return;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &hwwm.heard );
+    if (!hwwm.live) log_message(LOG_FILE, "INFO: hwwm command channel is up - hwwm's commands stand instead of the comms pins.");
+    hwwm.live = 1;
+    if (cmd) {
+        if (hwwm.cmds && (seq == hwwm.seq)) hwwm.dups++;
+        else {
+            hwwm.cmds++;
+            clock_gettime( CLOCK_MONOTONIC, &hwwm.taken );
+            hwwm.seq = seq;
+            hwwm.power = power;
+            hwwm.avoid = avoid;
+            hwwm.battery = battery;
+        }
+    }
+    sprintf( answer, "hpm ack %lu %ld\n", seq, (NextCycleMs() > 0) ? NextCycleMs() : 0 );
+}
+
+/* take the datagrams hwwm sent, answering each one */
+void
+HwwmReceive() {
+    struct sockaddr_un from;
+    socklen_t fromlen;
+    char msg[200], answer[100];
+    ssize_t len;
+
+    if (!hwwm.bound[0]) return;
+    while (1) {
+        fromlen = sizeof(from);
+        len = recvfrom( hwwm.sock, msg, sizeof(msg)-1, 0, (struct sockaddr *)&from, &fromlen );
+        if (len < 0) break;
+        msg[len] = 0;
+        HwwmMessage( msg, answer );
+        /* an unbound sender can not be answered */
+        if (answer[0] && (fromlen > sizeof(sa_family_t))) {
+            sendto( hwwm.sock, answer, strlen(answer), 0, (struct sockaddr *)&from, fromlen );
+        }
+    }
+}
+
+/* COMMS as hwwm's last command has it while the command channel is up, else from the
+   comms pins */
+void
+ReadComms() {
+    struct timespec now;
+    char buff[150];
+
+    HwwmReceive();
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    if (hwwm.live && ((now.tv_sec - hwwm.heard.tv_sec) > cfg.hwwm_timeout)) {
+        hwwm.live = 0;
+        sprintf( buff, "WARNING: hwwm command channel silent for %d seconds - back to the comms pins.", cfg.hwwm_timeout );
+        log_message(LOG_FILE, buff);
+    }
+    if (!hwwm.live) {
+        ReadCommsPins();
+        return;
+    }
+    if (hwwm.battery) COMMS = 3;
+    else COMMS = (hwwm.power > 1) ? 2 : hwwm.power;
+}
+
+/* sleep until the next cycle is due, in usecs; datagrams from hwwm are taken as they come */
+void
+WaitNextCycle(long usecs) {
+    struct pollfd pfd;
+    long ms;
+
+    clock_gettime( CLOCK_MONOTONIC, &next_cycle );
+    next_cycle.tv_sec += usecs / 1000000;
+    next_cycle.tv_nsec += (usecs % 1000000) * 1000;
+    if (next_cycle.tv_nsec >= 1000000000L) {
+        next_cycle.tv_sec++;
+        next_cycle.tv_nsec -= 1000000000L;
+    }
+    if (!hwwm.bound[0]) {
+        usleep( usecs );
+        return;
+    }
+    pfd.fd = hwwm.sock;
+    pfd.events = POLLIN;
+    while ((ms = NextCycleMs()) > 0) {
+        if (poll( &pfd, 1, ms ) > 0) HwwmReceive();
+    }
+}
+
+/* Availability horizon: every cycle, next to the 2 bit answer on the comms pins, hwwm
+   gets a datagram on the UNIX socket of hwwm_socket, as one line:
+     hpm avail <seq> <sendBits> ac1=<mode>,<start in>,<stop in> ac2=...
+   with the AC mode and the seconds until its compressor could be started and stopped -
+   -1 when it can not, or it is not the case. It is sent without waiting: if hwwm is not
+   there to take it, it is gone. It goes from hpm_socket, if that is set */
+void
+WriteAvailability(const struct hpm_outputs *out) {
+    struct sockaddr_un addr;
+    char msg[200];
+    long start, stop;
+    short i;
+
+    if (!cfg.hwwm_socket[0]) return;
+    if (hwwm.sock == -1) {
+        hwwm.sock = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+        if (hwwm.sock == -1) return;
+    }
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strncpy( addr.sun_path, cfg.hwwm_socket, sizeof(addr.sun_path)-1 );
+
+    sprintf( msg, "hpm avail %lu %d", ++hwwm.avail_seq, sendBits );
+    for (i=0;i<cfg.units;i++) {
+        start = (failsafe || (out->start_in[i] < 0)) ? -1 : out->start_in[i] * CYCLE_SECONDS;
+        stop = (failsafe || (out->stop_in[i] < 0)) ? -1 : out->stop_in[i] * CYCLE_SECONDS;
+        sprintf( msg + strlen(msg), " ac%d=%d,%ld,%ld", i+1, AC(i).mode, start, stop );
+    }
+    strcat( msg, "\n" );
+    if (sendto( hwwm.sock, msg, strlen(msg), 0, (struct sockaddr *)&addr, sizeof(addr) ) == -1) {
+        if (hwwm.avail_ok) {
+            sprintf( msg, "WARNING: hwwm socket '%.80s' not taking the availability: %s.", cfg.hwwm_socket, strerror(errno) );
+            log_message(LOG_FILE, msg);
+        }
+        hwwm.avail_ok = 0;
+    }
+    else {
+        if (!hwwm.avail_ok) log_message(LOG_FILE, "INFO: hwwm socket taking the availability again.");
+        hwwm.avail_ok = 1;
+    }
 }
 
 /* Function to make GPIO state represent what is in controls[] */
 void
 ControlStateToGPIO() {
+    short i;
     /* put state on GPIO pins */
-    if (cfg.invert_output) {
-            GPIOWrite( cfg.ac1cmp_pin, !Cac1cmp );
-            GPIOWrite( cfg.ac1fan_pin, !Cac1fan );
-            GPIOWrite( cfg.ac1v_pin, !Cac1fv );
-            GPIOWrite( cfg.ac2cmp_pin, !Cac2cmp );
-            GPIOWrite( cfg.ac2fan_pin, !Cac2fan );
-            GPIOWrite( cfg.ac2v_pin, !Cac2fv );
+    for (i=0;i<cfg.units;i++) {
+        if (cfg.invert_output) {
+            GPIOWrite( cfg.accmp_pin[i], !AC(i).cmp );
+            GPIOWrite( cfg.acfan_pin[i], !AC(i).fan );
+            GPIOWrite( cfg.acv_pin[i], !AC(i).fv );
+        }
+        else {
+            GPIOWrite( cfg.accmp_pin[i], AC(i).cmp );
+            GPIOWrite( cfg.acfan_pin[i], AC(i).fan );
+            GPIOWrite( cfg.acv_pin[i], AC(i).fv );
+        }
     }
-    else {
-            GPIOWrite( cfg.ac1cmp_pin, Cac1cmp );
-            GPIOWrite( cfg.ac1fan_pin, Cac1fan );
-            GPIOWrite( cfg.ac1v_pin, Cac1fv );
-            GPIOWrite( cfg.ac2cmp_pin, Cac2cmp );
-            GPIOWrite( cfg.ac2fan_pin, Cac2fan );
-            GPIOWrite( cfg.ac2v_pin, Cac2fv );
+    LatencyRelays();
+}
+
+/* A cycle's outputs broke a safety rule: they do not go out, all devices are switched
+   OFF right away instead, and the control is stopped - so hwwm gets told that nothing
+   can change - until hpm is restarted and someone has looked at what happened */
+void
+FailSafe(struct hpm_outputs *out) {
+    char msg[150];
+    short i, k;
+    for (i=0;i<cfg.units;i++) {
+        for (k=0;k<TOTALRULES;k++) {
+            if (!(hchk.broken[i] & (1<<k))) continue;
+            sprintf( msg, "ALARM: Safety rule broken: AC%d %s! Modes %d, wanted %d, got %d.",
+                i+1, hpm_rule_name( 1<<k ), AC(i).mode, out->wanted, out->actual );
+            log_message(LOG_FILE, msg);
+        }
+    }
+    log_message(LOG_FILE, "ALARM: Going FAIL-SAFE - all ACs are OFF until hpm is restarted!");
+    failsafe = 1;
+    hp.mode = 0;
+    for (i=0;i<MAXUNITS;i++) {
+        AC(i).cmp = AC(i).fan = AC(i).fv = 0;
+        AC(i).mode = 0;
+        AC(i).Scmp = AC(i).Sfan = AC(i).Sfv = AC(i).Smode = 0;
+        AC(i).dphase = AC(i).dexit = 0;
+        AC(i).Sdphase = 0;
     }
+    out->wanted = out->actual = 0;
+    out->changed = 1;
+    out->sendBits = 0;
+    out->defrosting = 0;
+    hpm_check_init( &hchk, &hs );
 }
 
 void
@@ -1094,114 +3066,220 @@ write_log_start() {
     log_message(LOG_FILE,"Running in "RUNNING_DIR", config file "CONFIG_FILE );
     log_message(LOG_FILE,"PID written to "LOCK_FILE", writing CSV data to "DATA_FILE );
     log_message(LOG_FILE,"Writing table data for collectd to "TABLE_FILE );
-    log_message(LOG_FILE,"Persistent data file is "PRSSTNC_FILE );
+    log_message(LOG_FILE,"Writing operational counters to "COUNTERS_FILE );
+    log_message(LOG_FILE,"Writing defrost phases statistics to "DEFROST_FILE );
+    log_message(LOG_FILE,"Writing sensors statistics to "STATS_FILE );
+    log_message(LOG_FILE,"Writing command to actuation latency to "LATENCY_FILE );
+    log_message(LOG_FILE,"Persistent data file is "PRSSTNC_FILE", journal is "JOURNAL_FILE );
 }
 
 void
 LogData(short _ST_L) {
-    static char data[280];
+    static char data[1500];
+    static char last_key[60];
+    static unsigned short data_held = 0;
+    char key[60];
+    /* AC modes as logged - see hpm_core.h */
+    const char *mode_names[6] = { " off     ", "starting ", "c cooling", "fins heat", "defrost  ", "off (OHP)" };
     unsigned short diff=0;
     unsigned short RS=0; /* real state */
-    if (Cac1cmp) RS|=1;
-    if (Cac1fan) RS|=2;
-    if (Cac1fv) RS|=4;
-    if (Cac2cmp) RS|=8;
-    if (Cac2fan) RS|=16;
-    if (Cac2fv) RS|=32;
+    short i;
+    for (i=0;i<cfg.units;i++) {
+        if (AC(i).cmp) RS|=BIT_CMP(i+1);
+        if (AC(i).fan) RS|=BIT_FAN(i+1);
+        if (AC(i).fv) RS|=BIT_FV(i+1);
+    }
     diff = (_ST_L ^ RS);
 
-    sprintf( data, "AC1: %4.1f,%4.1f,%4.1f,%4.1f;  AC2:%4.1f,%4.1f,%4.1f,%4.1f;  %6.3f,%6.3f,%6.3f ",
-    Tac1cmp, Tac1cnd, 0.0, 0.0, Tac2cmp, Tac2cnd, 0.0, 0.0, Twi, Two, TenvAvrg );
+    data[0] = 0;
+    for (i=0;i<cfg.units;i++) {
+        sprintf( data + strlen(data), "AC%d:%s%4.1f,%4.1f,%4.1f,%4.1f;  ", i+1, i ? "" : " ",
+        Tcmp(i), Tcnd(i), 0.0, 0.0 );
+    }
+    sprintf( data + strlen(data), "%6.3f,%6.3f,%6.3f ", Twi, Two, TenvAvrg );
     if (HPmode==COOL) sprintf( data + strlen(data), "C " );
     else sprintf( data + strlen(data), "H " );
-    if (Cac1mode==0) sprintf( data + strlen(data), "M1: off     ");
-    if (Cac1mode==1) sprintf( data + strlen(data), "M1:starting ");
-    if (Cac1mode==2) sprintf( data + strlen(data), "M1:c cooling");
-    if (Cac1mode==3) sprintf( data + strlen(data), "M1:fins heat");
-    if (Cac1mode==4) sprintf( data + strlen(data), "M1:defrost  ");
-    if (Cac1mode==5) sprintf( data + strlen(data), "M1:off (OHP)");
-    sprintf( data + strlen(data), "(%2lu)", SCac1mode);
-    if (Cac2mode==0) sprintf( data + strlen(data), " M2: off     ");
-    if (Cac2mode==1) sprintf( data + strlen(data), " M2:starting ");
-    if (Cac2mode==2) sprintf( data + strlen(data), " M2:c cooling");
-    if (Cac2mode==3) sprintf( data + strlen(data), " M2:fins heat");
-    if (Cac2mode==4) sprintf( data + strlen(data), " M2:defrost  ");
-    if (Cac2mode==5) sprintf( data + strlen(data), " M2:off (OHP)");
-    sprintf( data + strlen(data), "(%2lu)", SCac2mode);
+    for (i=0;i<cfg.units;i++) {
+        if ((AC(i).mode>=0) && (AC(i).mode<=5))
+        sprintf( data + strlen(data), "%sM%d:%s", i ? " " : "", i+1, mode_names[AC(i).mode] );
+        sprintf( data + strlen(data), "(%2lu)", AC(i).Smode);
+    }
     if (_ST_L) {
         sprintf( data + strlen(data), "  WANTED:");
-        if (_ST_L&1) sprintf( data + strlen(data), " C1");
-        if (_ST_L&2) sprintf( data + strlen(data), " F1");
-        if (_ST_L&4) sprintf( data + strlen(data), " V1");
-        if (_ST_L&8) sprintf( data + strlen(data), " C2");
-        if (_ST_L&16) sprintf( data + strlen(data), " F2");
-        if (_ST_L&32) sprintf( data + strlen(data), " V2");
+        for (i=0;i<cfg.units;i++) {
+            if (_ST_L&BIT_CMP(i+1)) sprintf( data + strlen(data), " C%d", i+1);
+            if (_ST_L&BIT_FAN(i+1)) sprintf( data + strlen(data), " F%d", i+1);
+            if (_ST_L&BIT_FV(i+1)) sprintf( data + strlen(data), " V%d", i+1);
+        }
     } else sprintf( data + strlen(data), "   idle    ");
     if (RS) {
         sprintf( data + strlen(data), " got:");
-        if (Cac1cmp) sprintf( data + strlen(data), " C1");
-        if (Cac1fan) sprintf( data + strlen(data), " F1");
-        if (Cac1fv) sprintf( data + strlen(data), " V1");
-        if (Cac2cmp) sprintf( data + strlen(data), " C2");
-        if (Cac2fan) sprintf( data + strlen(data), " F2");
-        if (Cac2fv) sprintf( data + strlen(data), " V2");
+        for (i=0;i<cfg.units;i++) {
+            if (AC(i).cmp) sprintf( data + strlen(data), " C%d", i+1);
+            if (AC(i).fan) sprintf( data + strlen(data), " F%d", i+1);
+            if (AC(i).fv) sprintf( data + strlen(data), " V%d", i+1);
+        }
     }
     if (diff) {
         sprintf( data + strlen(data), " DIFF:");
-        if (diff&1) sprintf( data + strlen(data), " C1");
-        if (diff&2) sprintf( data + strlen(data), " F1");
-        if (diff&4) sprintf( data + strlen(data), " V1");
-        if (diff&8) sprintf( data + strlen(data), " C2");
-        if (diff&16) sprintf( data + strlen(data), " F2");
-        if (diff&32) sprintf( data + strlen(data), " V2");
+        for (i=0;i<cfg.units;i++) {
+            if (diff&BIT_CMP(i+1)) sprintf( data + strlen(data), " C%d", i+1);
+            if (diff&BIT_FAN(i+1)) sprintf( data + strlen(data), " F%d", i+1);
+            if (diff&BIT_FV(i+1)) sprintf( data + strlen(data), " V%d", i+1);
+        }
     }
     else sprintf( data + strlen(data), "    OK!  ");
     sprintf( data + strlen(data), " COMMS:%d sendBits:%d", COMMS, sendBits);
-    log_message(DATA_FILE, data);
+    if (hwwm.live) sprintf( data + strlen(data), " power:%d avoid:%d", hwwm.power, hwwm.avoid);
+    /* over the write budget, only lines with the devices state or the AC modes changed, and
+       one every so often in between; a line after cycles left out says how many, so the
+       tools reading the log back know the cycles in between went as the line before */
+    sprintf( key, "%x %x %d %d %d %d %d", _ST_L, RS, HPmode, COMMS, sendBits, hwwm.live ? hwwm.power : -1,
+        hwwm.live ? hwwm.avoid : -1 );
+    for (i=0;i<cfg.units;i++) sprintf( key + strlen(key), " %d", AC(i).mode );
+    if (!wbudget.level || strcmp( key, last_key ) || (data_held + 1 >= wr_data_every[wbudget.level])) {
+        if (data_held) sprintf( data + strlen(data), " skipped:%u", data_held );
+        log_message(DATA_FILE, data);
+        strcpy( last_key, key );
+        data_held = 0;
+    }
+    else data_held++;
     
     /* for the first 8 cycles = 40 seconds - do not create or update the files that go out to
-       other systems - sometimes there is garbage, which would be nice if is not sent at all */
-    if ( ProgramRunCycles < 8 ) return;
-
-    sprintf( data, ",AC1COMP,%5.3f\n_,AC1CND,%5.3f\n_,HE1I,%5.3f\n_,HE1O,%5.3f\n"\
-    "_,AC2COMP,%5.3f\n_,AC2CND,%5.3f\n_,HE2I,%5.3f\n_,HE2O,%5.3f\n"\
-    "_,WaterIN,%5.3f\n_,WaterOUT,%5.3f\n_,Tenv,%5.3f\n"\
-    "_,Comp1,%d\n_,Fan1,%d\n_,Valve1,%d\n_,Comp2,%d\n_,Fan2,%d\n_,Valve2,%d",\
-    Tac1cmp, Tac1cnd, 0.0, 0.0, Tac2cmp, Tac2cnd, 0.0, 0.0, Twi, Two, TenvAvrg,\
-    Cac1cmp, Cac1fan, Cac1fv, Cac2cmp, Cac2fan, Cac2fv);
+       other systems - sometimes there is garbage, which would be nice if is not sent at all;
+       a warm restart resumes with known good data, so it does not need to wait */
+    if ( !warm_started && (ProgramRunCycles < 8) ) return;
+
+    data[0] = 0;
+    for (i=0;i<cfg.units;i++) {
+        sprintf( data + strlen(data), "%sAC%dCOMP,%5.3f\n_,AC%dCND,%5.3f\n_,HE%dI,%5.3f\n_,HE%dO,%5.3f\n",
+        i ? "_," : ",", i+1, Tcmp(i), i+1, Tcnd(i), i+1, 0.0, i+1, 0.0 );
+    }
+    sprintf( data + strlen(data), "_,WaterIN,%5.3f\n_,WaterOUT,%5.3f\n_,Tenv,%5.3f\n_,HeatW,%.0f", Twi, Two, TenvAvrg,
+        heat_power );
+    for (i=0;i<cfg.units;i++) {
+        sprintf( data + strlen(data), "\n_,Comp%d,%d\n_,Fan%d,%d\n_,Valve%d,%d",
+        i+1, AC(i).cmp, i+1, AC(i).fan, i+1, AC(i).fv );
+    }
+    /* fin stack to environment temp spread and its trend per hour, the predictive defrost goes by */
+    for (i=0;i<cfg.units;i++) {
+        sprintf( data + strlen(data), "\n_,Fins%dSpread,%5.3f\n_,Fins%dTrend,%5.3f",
+        i+1, AC(i).Fspread, i+1, AC(i).Fslope * 3600 / CYCLE_SECONDS );
+    }
+    for (i=1;i<=cfg.units;i++) {
+        sprintf( data + strlen(data), "\n_,C%dStartsH,%lu\n_,C%dStartsD,%lu\n_,C%dDefrostsD,%lu\n_,C%dOHPD,%lu\n_,C%dOHPpreD,%lu",
+        i, counters[CNT(i,CNT_STARTS)].hour, i, counters[CNT(i,CNT_STARTS)].day,
+        i, counters[CNT(i,CNT_DEFROSTS)].day, i, counters[CNT(i,CNT_OHP_TRIPS)].day,
+        i, counters[CNT(i,CNT_OHP_PREEMPTS)].day );
+    }
     log_msg_ovr(TABLE_FILE, data);
 
-    sprintf( data, "{AC1COMP:%5.3f,AC1CND:%5.3f,HE1I:%5.3f,HE1O:%5.3f,"\
-    "AC2COMP:%5.3f,AC2CND:%5.3f,HE2I:%5.3f,HE2O:%5.3f,"\
-    "WaterIN:%5.3f,WaterOUT:%5.3f,Tenv:%5.3f,"\
-    "Comp1:%d,Fan1:%d,Valve1:%d,Comp2:%d,Fan2:%d,Valve2:%d}",\
-    Tac1cmp, Tac1cnd, 0.0, 0.0, Tac2cmp, Tac2cnd, 0.0, 0.0, Twi, Two, TenvAvrg,\
-    Cac1cmp, Cac1fan, Cac1fv, Cac2cmp, Cac2fan, Cac2fv);
+    sprintf( data, "{" );
+    for (i=0;i<cfg.units;i++) {
+        sprintf( data + strlen(data), "AC%dCOMP:%5.3f,AC%dCND:%5.3f,HE%dI:%5.3f,HE%dO:%5.3f,",
+        i+1, Tcmp(i), i+1, Tcnd(i), i+1, 0.0, i+1, 0.0 );
+    }
+    sprintf( data + strlen(data), "WaterIN:%5.3f,WaterOUT:%5.3f,Tenv:%5.3f,HeatW:%.0f,", Twi, Two, TenvAvrg, heat_power );
+    for (i=0;i<cfg.units;i++) {
+        sprintf( data + strlen(data), "Comp%d:%d,Fan%d:%d,Valve%d:%d,",
+        i+1, AC(i).cmp, i+1, AC(i).fan, i+1, AC(i).fv );
+    }
+    for (i=0;i<cfg.units;i++) {
+        sprintf( data + strlen(data), "Fins%dSpread:%5.3f,Fins%dTrend:%5.3f,",
+        i+1, AC(i).Fspread, i+1, AC(i).Fslope * 3600 / CYCLE_SECONDS );
+    }
+    for (i=1;i<=cfg.units;i++) {
+        sprintf( data + strlen(data), "C%dStartsH:%lu,C%dStartsD:%lu,C%dDefrostsD:%lu,C%dOHPD:%lu,C%dOHPpreD:%lu%s",
+        i, counters[CNT(i,CNT_STARTS)].hour, i, counters[CNT(i,CNT_STARTS)].day,
+        i, counters[CNT(i,CNT_DEFROSTS)].day, i, counters[CNT(i,CNT_OHP_TRIPS)].day,
+        i, counters[CNT(i,CNT_OHP_PREEMPTS)].day, (i<cfg.units) ? "," : "}" );
+    }
     log_msg_cln(JSON_FILE, data);
+
+    WriteCountersTable();
+    WriteStatsTable();
+    WriteHeatTable();
+    WriteLatencyTable();
 }
 
-/* function to calculate average temp of environment based on last minute or so data */
-void 
-CalcTenvAverage() {
-    float na = 0;
-    /* do index moving first */
-    TenvArr_lu++;
-    if (TenvArr_lu > 11) { /* if index is beyond array end - move it to first element */
-        TenvArr_lu = 0;
+/* add the cycle's readings to the sensors statistics windows, and take the average
+   environment temp from its window - the last minute or so */
+void
+UpdateSensorStats() {
+    short i;
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if (SensorInUse(i)) hpm_stats_add( &sstats[i], sensors[i] );
     }
-    /* then replace oldest value in array with last read one */
-    TenvArr[TenvArr_lu] = Tenv;
-    /* and finaly - calculate new average */
-    for (short k=0;k<12;k++) {
-        na = na + TenvArr[k];
+    TenvAvrg = TenvStats.mean;
+}
+
+/* the day's writes so far, and the previous day's */
+void
+WriteBudgetTable() {
+    const char *level_names[3] = { "all written", "over pace - data log every 30 s and on changes, journal every 30 min",
+        "90% spent - data log every 5 min and on changes, journal every hour" };
+    FILE *fp;
+    short i;
+
+    fp = fopen( WRITES_FILE, "w" );
+    if ( !fp ) return;
+    if (cfg.sd_budget) fprintf( fp, "SD card write budget %d kB a day: %s\n\n", cfg.sd_budget, level_names[wbudget.level] );
+    else fprintf( fp, "SD card write budget: off\n\n" );
+    fprintf( fp, "%-10s %12s %9s %7s %12s %9s %7s\n", "to", "today kB", "writes", "syncs", "yesterday kB",
+        "writes", "syncs" );
+    for (i=0;i<WR_TIERS;i++) {
+        fprintf( fp, "%-10s %12.1f %9lu %7lu %12.1f %9lu %7lu\n", wr_tier_names[i], wbudget.today[i].bytes / 1024.0,
+            wbudget.today[i].writes, wbudget.today[i].syncs, wbudget.yesterday[i].bytes / 1024.0,
+            wbudget.yesterday[i].writes, wbudget.yesterday[i].syncs );
     }
-    TenvAvrg = na / 12.0;
+    WriteAccount( WRITES_FILE, ftell( fp ), 0 );
+    fclose( fp );
+}
+
+/* start a new day when it is one, and see how the day's SD card writes go against the budget */
+void
+WriteBudgetCheck() {
+    unsigned long long sd, budget;
+    char msg[250];
+    time_t now = time(NULL);
+    long day, elapsed;
+    short level = 0;
+
+    day = WriteDay( now, NULL );
+    if (day != wbudget.day) {
+        if (wbudget.day != -1) {
+            memcpy( wbudget.yesterday, wbudget.today, sizeof(wbudget.today) );
+            memset( wbudget.today, 0, sizeof(wbudget.today) );
+            sprintf( msg, "INFO: Writes yesterday: %.0f kB of logs to the SD card hourly, %.0f kB straight to it"
+                " in %lu writes and %lu syncs, %.0f kB to RAM only.", wbudget.yesterday[WR_SD_HOURLY].bytes / 1024.0,
+                wbudget.yesterday[WR_SD].bytes / 1024.0, wbudget.yesterday[WR_SD].writes, wbudget.yesterday[WR_SD].syncs,
+                wbudget.yesterday[WR_RAM].bytes / 1024.0 );
+            log_message(LOG_FILE, msg);
+        }
+        wbudget.day = WriteDay( now, &wbudget.day_start );
+    }
+    sd = wbudget.today[WR_SD_HOURLY].bytes + wbudget.today[WR_SD].bytes;
+    if (cfg.sd_budget) {
+        budget = cfg.sd_budget * 1024ULL;
+        elapsed = now - wbudget.day_start;
+        /* the pace only tells something after the first hour */
+        if (sd >= budget * 9 / 10) level = 2;
+        else if ((elapsed >= 3600) && (sd * 86400 / elapsed > budget)) level = 1;
+    }
+    if (level != wbudget.level) {
+        sprintf( msg, "%s: SD card writes today %.0f kB of the %d kB budget - %s.", level ? "WARNING" : "INFO",
+            sd / 1024.0, cfg.sd_budget, level ? "cutting the data log and persistence down" : "all written again" );
+        log_message(LOG_FILE, msg);
+        wbudget.level = level;
+    }
+    WriteBudgetTable();
 }
 
 /* Function to get current time and put the hour in current_timer_hour */
 void
 GetCurrentTime() {
     static char buff[80];
+    static short counters_hour = -1;
     time_t t;
     struct tm *t_struct;
 	
@@ -1210,6 +3288,12 @@ GetCurrentTime() {
     strftime( buff, sizeof buff, "%H", t_struct );
 
     current_timer_hour = atoi( buff );
+
+    /* roll operational counters up when the hour changes */
+    if ((counters_hour != -1) && (counters_hour != current_timer_hour)) {
+        RollCounters( current_timer_hour == 0 );
+    }
+    counters_hour = current_timer_hour;
     
     strftime( buff, sizeof buff, "%m", t_struct );
     current_month = atoi( buff );
@@ -1221,600 +3305,32 @@ GetCurrentTime() {
     }
 }
 
-/* Turn ON compressor limitations:
-    1 - it must be off
-    2 - it must have been off for 10 minutes = 10*12 5 sec cycles
-    3 - it must not be too hot 
-    4 - the other compressor must not have been switched ON
-         in the last 45 seconds 
-    5 - for DEFROST - allow quick toggling */
-unsigned short CanTurnC1On() {
-    if (!cfg.use_ac1 || (Tac1cmp>COMP_MAX_TEMP)) return 0;
-    if (!Cac1cmp && (Cac1mode==4)) return 1;
-    if (!Cac1cmp && (SCac1cmp > 10*12) &&
-        ((Cac2cmp && (SCac2cmp > 9))||(!Cac2cmp))) return 1;
-    else return 0;
-}
-
-/* Turn OFF compressor 1 limitations:
-    1 - it must be ON
-    2 - it must have been ON for at least 10 minutes = 10*12 5 sec cycles
-    3 - during DEFROST cycle or power failure - can be turned off quicker */
-unsigned short CanTurnC1Off() {
-    if (Cac1cmp && ((Cac1mode>=4)||(COMMS==3))) return 1;
-    if (Cac1cmp && (SCac1cmp > 10*12)) return 1;
-    else return 0;
-}
-
-/* Turn ON/OFF fan limitations - fans can be toggled at will */
-unsigned short CanTurnF1On() {
-    return 1;
-}
-
-/* Turn ON/OFF fan limitations - fans can be toggled at will */
-unsigned short CanTurnF1Off() {
-    return 1;
-}
-
-/* Turn ON/OFF valve limitations:
-    1 - to change a valve state - the compressor must be OFF
-    2 - the compressor must have been OFF for 10 seconds = 2 cycles */
-unsigned short CanTurnV1On() {
-    if (!Cac1cmp && (SCac1cmp > 1)) return 1;
-    else return 0;
-}
-
-/* Limitations are the same between valve on and valve off */
-unsigned short CanTurnV1Off() {
-    return CanTurnV1On();
-}
-
-/* Turn ON compressor limitations:
-    1 - it must be off
-    2 - it must have been off for 10 minutes = 10*12 5 sec cycles
-    3 - it must not be too hot 
-    4 - the other compressor must not have been switched ON
-         in the last 45 seconds 
-    5 - for DEFROST - allow quick toggling */
-unsigned short CanTurnC2On() {
-    if (!cfg.use_ac2 || (Tac2cmp>COMP_MAX_TEMP)) return 0;
-    if (!Cac2cmp && (Cac2mode==4)) return 1;
-    if (!Cac2cmp && (SCac2cmp > 10*12) &&
-        ((Cac1cmp && (SCac1cmp > 9))||(!Cac1cmp))) return 1;
-    else return 0;
-}
-
-/* Turn OFF compressor 2 limitations:
-    1 - it must be ON
-    2 - it must have been ON for at least 10 minutes = 10*12 5 sec cycles
-    3 - during DEFROST cycle or power failure - can be turned off quicker */
-unsigned short CanTurnC2Off() {
-    if (Cac2cmp && ((Cac2mode>=4)||(COMMS==3))) return 1;
-    if (Cac2cmp && (SCac2cmp > 10*12)) return 1;
-    else return 0;
-}
-
-/* Turn ON/OFF fan limitations - fans can be toggled at will */
-unsigned short CanTurnF2On() {
-    return 1;
-}
-
-/* Turn ON/OFF fan limitations - fans can be toggled at will */
-unsigned short CanTurnF2Off() {
-    return 1;
-}
-
-/* Turn ON/OFF valve limitations:
-    1 - to change a valve state - the compressor must be OFF
-    2 - the compressor must have been OFF for 10 seconds = 2 cycles */
-unsigned short CanTurnV2On() {
-    if (!Cac2cmp && (SCac2cmp > 1)) return 1;
-    else return 0;
-}
-
-/* Limitations are the same between valve on and valve off */
-unsigned short CanTurnV2Off() {
-    return CanTurnV2On();
-}
-
-void TurnC1Off() { Cac1cmp = 0; SCac1cmp = 0;  }
-void TurnC1On() { Cac1cmp = 1; SCac1cmp = 0; }
-void TurnF1Off() { Cac1fan  = 0; SCac1fan = 0; }
-void TurnF1On() { Cac1fan  = 1; SCac1fan = 0; }
-void TurnV1Off() { Cac1fv  = 0; SCac1fv = 0; }
-void TurnV1On() { Cac1fv  = 1; SCac1fv = 0; }
-void TurnC2Off() { Cac2cmp = 0; SCac2cmp = 0; }
-void TurnC2On() { Cac2cmp = 1; SCac2cmp = 0; }
-void TurnF2Off() { Cac2fan  = 0; SCac2fan = 0; }
-void TurnF2On() { Cac2fan  = 1; SCac2fan = 0; }
-void TurnV2Off() { Cac2fv  = 0; SCac2fv = 0; }
-void TurnV2On() { Cac2fv  = 1; SCac2fv = 0; }
-
-short
-SelectOpMode() {
-    short StateDesired = 0;
-    short wantC1on = 0;
-    short wantF1on = 0;
-    short wantV1on = HPmode;
-    short wantC2on = 0;
-    short wantF2on = 0;
-    short wantV2on = HPmode;
-    short nrACs_running = 0;
- //   static char data[280];
-    short t = 0;
-    
-    if (Cac1mode==4) { nrACs_running++; } else { if (Cac1cmp) { nrACs_running++; } }
-    if (Cac2mode==4) { nrACs_running++; } else { if (Cac2cmp) { nrACs_running++; } }
-    if (HPL) { /* need to turn one AC on if possible */
-        switch (nrACs_running) { /* check if we already have ACs running */
-             case 0: /* both ACs are off - we need to decide which one we would want ON */
-                t = cfg.use_ac1 + cfg.use_ac2;
-                if (t==2) { /* both ACs are allowed - choose the one that has worked less */
-                    if (C1RunCs <= C2RunCs) t=1;
-                    else t=2;
-                    /* if we selected the AC that is resting, and the other one can start - switch them */
-                    if (t==1 && !CanTurnC1On() && CanTurnC2On()) t=2;
-                    if (t==2 && !CanTurnC2On() && CanTurnC1On()) t=1;
-                }
-                switch (t) {
-                    default:
-                    case 0: /* no ACs allowed? */
-                        break;
-                    case 1: /* AC1 only */
-                        wantC1on = 1;
-                        break;
-                    case 2: /* AC2 only */
-                        wantC2on = 1;
-                        break;
-                }
-                break;
-             case 1: /* exactly 1 AC is already running - find out which one it is, and keep it running */
-                if (Cac1cmp || (Cac1mode==4)) { /* its AC1 */
-                    wantC1on = 1;
-                }
-                else { /* its AC2 */
-                    wantC2on = 1;
-                }
-                break;
-             case 2: /* 2 ACs are running - we need to decide which one we want turned off - in practice we leave ON the other one*/
-                    /* keep it simple - try to turn OFF the AC that has worked more in the long run */
-                    if (C1RunCs>=C2RunCs) {
-                        wantC2on = 1;
-                    }
-                    else {
-                        wantC1on = 1;
-                    }
-                    /* make sure we turn off an AC that can be turned off */
-                    if (wantC1on && !CanTurnC2Off()) { wantC1on = 0; wantC2on = 1; }
-                    if (wantC2on && !CanTurnC1Off()) { wantC2on = 0; wantC1on = 1; }
-                break;
-        }
-    }
-    if (HPH) { /* need to turn both ACs if possible */
-        wantC1on = 1;
-        wantC2on = 1;
-    }
-    
-    /* DEFROST mode is kinda special - make it work */
-    if (Cac1mode==4) { wantC1on = 1; }
-    if (Cac2mode==4) { wantC2on = 1; }
-    
-    /* get back out of OVH protection: compressor is OFF, mode is OHP, stayed like so for 2 mins */
-    if (!Cac1cmp && (Cac1mode==5) && (SCac1mode>24)) { Cac1mode = 0; SCac1mode = 0; }
-    if (!Cac2cmp && (Cac2mode==5) && (SCac2mode>24)) { Cac2mode = 0; SCac2mode = 0; }
-    
-    if (COMMS==3) { /* hwwm is signaling power has switched to battery */
-        /* assume everything is OFF except the fourway valves */
-        wantC1on = 0;
-        wantF1on = 0;
-        wantC2on = 0;
-        wantF2on = 0;
-    }
-
-    /* Until now we alredy know which ACs we want on; check wantC_on for that.
-        Now, it is time to manage running ACs mode, so that we keep the compressors within
-        allowed working parameters */
-    /* On the other hand - we may have a compressor doing the necessary minumum time ON - 
-       manage that as well */
-    if (wantC1on || Cac1mode) { 
-        /* if AC1 is NOT needed - only do the mode clean up if turning off the compressor is possible */
-        if (!wantC1on && Cac1mode && CanTurnC1Off()) {
-            Cac1mode = 0;
-            SCac1mode = 0;
-        }
-        switch (Cac1mode) {
-            case 0: /* AC 1 is in OFF mode: */
-                    /* if we want AC1 on - check if AC1 can be turned ON and valve is ON, switch its mode to STARTING */
-                    if (wantC1on && CanTurnC1On() && Cac1fv) {
-                        Cac1mode = 1;
-                        SCac1mode = 0;
-                    }
-                break;
-            case 1: /* AC 1 is in STARTING mode: */
-                    wantF1on = 1;
-                    /* when the compressor temp reaches 56 - switch mode to COMP COOLING */
-                    if (Tac1cmp>56) { 
-                        Cac1mode = 2;
-                        SCac1mode = 0;
-                    }
-                    /* if 1 minute into starting - make mode FIN STACK HEATING */
-                    if (SCac1mode>12) {
-                        Cac1mode = 3;
-                    }
-                break;
-            case 2: /* AC 1 is in COMP COOLING mode: */
-                    /* when the compressor temp falls below 56 and fins are colder than environment - do FIN STACK HEATING */
-                    if ((Tac1cmp<56) && (SCac1mode>10) && (Tac1cnd<TenvAvrg)) {
-                        Cac1mode = 3;
-                        SCac1mode = 0;
-                    }
-                break;
-            case 3: /* AC 1 is in FIN STACK HEATING mode: */
-                    wantF1on = 1;
-                    /* when the compressor temp goes back up to 56
-                        switch mode to COMP COOLING */
-                    if ((Tac1cmp>56) && (SCac1mode>10)) {
-                        Cac1mode = 2;
-                        SCac1mode = 0;
-                    }
-                    /* DEFROST mode activations - keep in mind that DEFROST takes around 6 mins, and
-                       takes 4 (four) !! compressor toggles in those 6 mins away... so like 40 mins normal work */
-                    /* if after 20 minutes fins stack is below -10 C - switch to DEFROST */
-                    if ((SCac1mode>20*12) && (Tac1cnd<-10)) {
-                        Cac1mode = 4;
-                        SCac1mode = 0;
-                    }
-                    /* if after 30 minutes fins stack is below -8 C - switch to DEFROST */
-                    if ((SCac1mode>30*12) && (Tac1cnd<-8)) {
-                        Cac1mode = 4;
-                        SCac1mode = 0;
-                    }
-                    /* if after 50 minutes fins stack is below -3 C - switch to DEFROST */
-                    if ((SCac1mode>50*12) && (Tac1cnd<-3)) {
-                        Cac1mode = 4;
-                        SCac1mode = 0;
-                    }
-                break;
-            case 4: /* AC1 is in DEFROST mode */
-                    mtd[2]=6;
-                    switch (SCac1mode) {
-                        case 0 ... 5: /* ONLY VALVE ON */
-                            wantV1on = 1;
-                            wantC1on = 0;
-                            wantF1on = 0;
-                            break;
-                        case 6 ... 11: /* ALL OFF - this switches mode to cooling, so fins become hot */
-                            wantV1on = 0;
-                            wantC1on = 0;
-                            wantF1on = 0;
-                            break;
-                        case 12 ... 33: /* COMPRESSOR ON WITH VALVE OFF */
-                            wantV1on = 0;
-                            wantC1on = 1;
-                            wantF1on = 0;
-                            /* while heating the condenser fins - if they reach 25+ C - end heating */
-                            if (Tac1cnd>25) {
-                                SCac1mode = 33;
-                            }
-                            break;
-                        case 34 ... 49: /* ALL OFF; prep to switch back to heating */
-                            wantV1on = 0;
-                            wantC1on = 0;
-                            wantF1on = 0;
-                            break;
-                        case 50 ... 68: /* VALVE back ON */
-                            wantV1on = 1;
-                            wantC1on = 0;
-                            wantF1on = 0;
-                            break;
-                        case 69 ... 70: /* VALVE back ON + FAN */
-                            wantV1on = 1;
-                            wantC1on = 0;
-                            wantF1on = 1;
-                            break;
-                        case 71: /* make AC work in HEATING, COMP COOLING mode */
-                            wantV1on = 1;
-                            wantC1on = 1;
-                            wantF1on = 0;
-                            break;
-                    }
-                    /* if the compressor overheated - stay at current state so that getting out of defrost works as expected */
-                    if (wantC1on && (Tac1cmp>COMP_MAX_TEMP)) {
-                        SCac1mode--;
-                    }
-                    /* when DEFROST cycle is complete - switch back to COMP COOLING mode */
-                    if (SCac1mode>=72) {
-                        /* go to COMP COOLING mode */
-                        Cac1mode = 2;
-                        SCac1mode = 0;
-                        mtd[2]=2.5;
-                    }
-                break;
-        }
-    } else {
-        /* only do the mode clean up if turning off the compressor is possible */
-        if (!wantC1on && Cac1mode && CanTurnC1Off()) {
-            Cac1mode = 0;
-            SCac1mode = 0;
-        }
-    }
-    if (wantC2on || Cac2mode) { 
-        /* if AC1 is NOT needed - only do the mode clean up if turning off the compressor is possible */
-        if (!wantC2on && Cac2mode && CanTurnC2Off()) {
-            Cac2mode = 0;
-            SCac2mode = 0;
-        }
-        switch (Cac2mode) {
-            case 0: /* AC 2 is in OFF mode, but we want it ON: */
-                    /* if AC2 can be turned ON and valve is ON, switch its mode to STARTING */
-                    if (wantC2on && CanTurnC2On() && Cac2fv) {
-                        Cac2mode = 1;
-                        SCac2mode = 0;
-                    }
-                break;
-            case 1: /* AC 2 is in STARTING mode: */
-                    wantF2on = 1;
-                    /* when the compressor temp reaches 56 - switch mode to COMP COOLING */
-                    if (Tac2cmp>56) { 
-                        Cac2mode = 2;
-                        SCac2mode = 0;
-                    }
-                    /* if 1 minute into starting - make mode FIN STACK HEATING */
-                    if (SCac2mode>12) {
-                        Cac2mode = 3;
-                    }
-                break;
-            case 2: /* AC 2 is in COMP COOLING mode: */
-                    /* when the compressor temp falls below 56 and fins are colder than environment - do FIN STACK HEATING */
-                    if ((Tac2cmp<56) && (SCac2mode>10) && (Tac2cnd<TenvAvrg)) {
-                        Cac2mode = 3;
-                        SCac2mode = 0;
-                    }
-                break;
-            case 3: /* AC 2 is in FIN STACK HEATING mode: */
-                    wantF2on = 1;
-                    /* when the compressor temp goes back up to 56
-                        switch mode to COMP COOLING */
-                    if ((Tac2cmp>56) && (SCac2mode>10)) {
-                        Cac2mode = 2;
-                        SCac2mode = 0;
-                    }
-                    /* DEFROST mode activations - keep in mind that DEFROST takes around 6 mins, and
-                       takes 4 (four) !! compressor toggles in those 6 mins away... so like 40 mins normal work */
-                    /* if after 20 minutes fins stack is below -10 C - switch to DEFROST */
-                    if ((SCac2mode>20*12) && (Tac2cnd<-10)) {
-                        Cac2mode = 4;
-                        SCac2mode = 0;
-                    }
-                    /* if after 30 minutes fins stack is below -8 C - switch to DEFROST */
-                    if ((SCac2mode>30*12) && (Tac2cnd<-8)) {
-                        Cac2mode = 4;
-                        SCac2mode = 0;
-                    }
-                    /* if after 50 minutes fins stack is below -3 C - switch to DEFROST */
-                    if ((SCac2mode>50*12) && (Tac2cnd<-3)) {
-                        Cac2mode = 4;
-                        SCac2mode = 0;
-                    }
-                break;
-            case 4: /* AC2 is in DEFROST mode */
-                    mtd[4]=6;
-                    switch (SCac2mode) {
-                        case 0 ... 5: /* ONLY VALVE ON */
-                            wantV2on = 1;
-                            wantC2on = 0;
-                            wantF2on = 0;
-                            break;
-                        case 6 ... 11: /* ALL OFF - this switches mode to cooling, so fins become hot */
-                            wantV2on = 0;
-                            wantC2on = 0;
-                            wantF2on = 0;
-                            break;
-                        case 12 ... 33: /* COMPRESSOR ON WITH VALVE OFF */
-                            wantV2on = 0;
-                            wantC2on = 1;
-                            wantF2on = 0;
-                            /* while heating the condenser fins - if they reach 25+ C - end heating */
-                            if (Tac2cnd>25) {
-                                SCac2mode = 33;
-                            }
-                            break;
-                        case 34 ... 49: /* ALL OFF; prep to switch back to heating */
-                            wantV2on = 0;
-                            wantC2on = 0;
-                            wantF2on = 0;
-                            break;
-                        case 50 ... 68: /* VALVE back ON */
-                            wantV2on = 1;
-                            wantC2on = 0;
-                            wantF2on = 0;
-                            break;
-                        case 69 ... 70: /* VALVE back ON + FAN */
-                            wantV2on = 1;
-                            wantC2on = 0;
-                            wantF2on = 1;
-                            break;
-                        case 71: /* make AC work in HEATING, COMP COOLING mode */
-                            wantV2on = 1;
-                            wantC2on = 1;
-                            wantF2on = 0;
-                            break;
-                    }
-                    /* if the compressor overheated - stay at current state so that getting out of defrost works as expected */
-                    if (wantC2on && (Tac2cmp>COMP_MAX_TEMP)) {
-                        SCac2mode--;
-                    }
-                    /* when DEFROST cycle is complete - switch back to COMP COOLING mode */
-                    if (SCac2mode>=72) {
-                        /* go to COMP COOLING mode */
-                        Cac2mode = 2;
-                        SCac2mode = 0;
-                        mtd[4]=2.5;
-                    }
-                break;
-        }
-    } else {
-        /* only do the mode clean up if turning off the compressor is possible */
-        if (!wantC2on && Cac2mode && CanTurnC2Off()) {
-            Cac2mode = 0;
-            SCac2mode = 0;
-        }
-    }
-
-    /* as a final action - if an AC is not allowed to be used by config file - make sure it stays OFF */
-    if (!cfg.use_ac1) {
-        wantC1on = 0;
-        wantF1on = 0;
-        wantV1on = 0;
-    }
-    if (!cfg.use_ac2) {
-        wantC2on = 0;
-        wantF2on = 0;
-        wantV2on = 0;
-    }
-
-    /* Turning to OFF mode cleanup:
-        If an AC has been ON, but now will be turned OFF - change its mode accordingly, if possible */
-    if (Cac1mode!=4 && CanTurnC1Off()) {
-        if (Cac1cmp && !wantC1on) {
-            Cac1mode = 0;
-            SCac1mode = 0;
-        }
-    }
-    if (Cac2mode!=4 && CanTurnC2Off()) {
-        if (Cac2cmp && !wantC2on) {
-            Cac2mode = 0;
-            SCac2mode = 0;
-        }
-    }
-
-    /* compressors overheating protection: if running and hotter than 63 C */
-    if (Cac1cmp && (Tac1cmp>COMP_MAX_TEMP)) {
-        /* switch mode to OHP, turn compressor and fan OFF */
-        Cac1mode = 5;
-        SCac1mode = 0;
-        wantC1on = 0;
-        wantF1on = 0;
-    }
-    if (Cac2cmp && (Tac2cmp>COMP_MAX_TEMP)) {
-        /* switch mode to OHP, turn compressor and fan OFF */
-        Cac2mode = 5;
-        SCac2mode = 0;
-        wantC2on = 0;
-        wantF2on = 0;
-    }
-
-    if ( wantC1on) StateDesired |= 1;
-    if ( wantF1on ) StateDesired |= 2;
-    if ( wantV1on )  StateDesired |= 4;
-    if ( wantC2on )  StateDesired |= 8;
-    if ( wantF2on ) StateDesired |= 16;
-    if ( wantV2on )  StateDesired |= 32;
-    return StateDesired;
-}
-
-void
-ActivateDevicesState(const unsigned short _ST_) {
-    unsigned short current_state = 0;
-    unsigned short new_state = 0;
-
-    /* calculate current state */
-    if ( Cac1cmp ) current_state |= 1;
-    if ( Cac1fan ) current_state |= 2;
-    if ( Cac1fv ) current_state |= 4;
-    if ( Cac2cmp ) current_state |= 8;
-    if ( Cac2fan ) current_state |= 32;
-    if ( Cac2fv ) current_state |= 64;
-    /* make changes as needed */
-    /* _ST_'s bits describe the peripherals desired state:
-        bit 1  (1) - compressor 1
-        bit 2  (2) - fan 1
-        bit 3  (4) - fourway valve 1
-        bit 4  (8) - compressor 2
-        bit 5 (16) - fan 2
-        bit 6 (32) - fourway valve 2 */
-    if (_ST_ &   1)  { if (CanTurnC1On()) TurnC1On(); } else { if (CanTurnC1Off()) TurnC1Off(); }
-    if (_ST_ &   2)  { if (CanTurnF1On()) TurnF1On(); } else { if (CanTurnF1Off()) TurnF1Off(); }
-    if (_ST_ &   4)  { if (CanTurnV1On()) TurnV1On(); } else { if (CanTurnV1Off()) TurnV1Off(); }
-    if (_ST_ &   8)  { if (CanTurnC2On()) TurnC2On(); } else { if (CanTurnC2Off()) TurnC2Off(); }
-    if (_ST_ &  16) { if (CanTurnF2On()) TurnF2On(); } else { if (CanTurnF2Off()) TurnF2Off(); }
-    if (_ST_ &  32) { if (CanTurnV2On()) TurnV2On(); } else { if (CanTurnV2Off()) TurnV2Off(); }
-    
-    SCac1cmp++;
-    SCac1fan++;
-    SCac1fv++;
-    SCac1mode++;
-    SCac2cmp++;
-    SCac2fan++;
-    SCac2fv++;
-    SCac2mode++;
-
-    /* calculate desired new state */
-    if ( Cac1cmp ) { new_state |= 1; C1RunCs++; }
-    if ( Cac1fan ) new_state |= 2;
-    if ( Cac1fv ) new_state |= 4;
-    if ( Cac2cmp ) { new_state |= 8; C2RunCs++; }
-    if ( Cac2fan ) new_state |= 32;
-    if ( Cac2fv ) new_state |= 64;
-    /* if current state and new state are different... */
-    if ( current_state != new_state ) {
-        /* then put state on GPIO pins - this prevents lots of toggling at every 10s decision */
-        ControlStateToGPIO();
-    }
-}
-
-
-/* Gets called after main decision making for the cycle has taken place. This means that
-   control states can be used to make decisions. The task here is to take into account limitations, 
-   and compute an answer to return to hwwm */
-void
-ComputeSendBits() {
-    unsigned short nrACs_startable = 0;
-    unsigned short nrACs_stoppable = 0;
-    unsigned short k = 0;
-
-    /* Start by determining how many AC we can START */
-    if (CanTurnC1On() && (Cac1mode!=4)) nrACs_startable++;
-    if (CanTurnC2On() && (Cac2mode!=4)) nrACs_startable++;
-
-    /* Then determine how many AC we can STOP */
-    if (CanTurnC1Off() && (Cac1mode!=4)) nrACs_stoppable++;
-    if (CanTurnC2Off() && (Cac2mode!=4)) nrACs_stoppable++;
-    
-    /* When cfg.mode is set to OFF -  do not allow changes */
-    if (!cfg.mode) {
-        sendBits = 0;
-        return;
-    }
-
-    /* If we cannot start or stop ACs - do not allow changes */
-    if (!(nrACs_startable || nrACs_stoppable)) {
-        sendBits = 0;
-        return;
-    }
-
-    /* What follows here is the smallest possible code I came up with to give the desired 
-       results as seen in a all-possible-scenarios-blown-up table; 
-       Basically, this is magic! ;) */
-    if (nrACs_startable) { k = 1; }
-    if (nrACs_startable==nrACs_stoppable) { k = 0; }
-    if (nrACs_stoppable) {
-        k += 1 + nrACs_stoppable + nrACs_startable;
-    }
-    
-    sendBits = k;
-}
-
+/* the benchmarks build this file with their own main() */
+#ifndef HPM_NO_MAIN
 int
 main(int argc, char *argv[])
 {
     /* set iter to its max value - makes sure we get a clock reading upon start */
     unsigned short iter = 30;
     unsigned short iter_P = 0;
-    unsigned short DevicesWantedState = 0;
+    struct hpm_inputs hin;
+    struct hpm_outputs hout;
+    struct hpm_state hs_before;
     struct timeval tvalBefore, tvalAfter;
+    unsigned short was_defrosting = 0;
+    short i;
+
+    for (i=1;i<argc;i++) {
+        if (!strcmp( argv[i], "-f" )) foreground = 1;
+        else {
+            printf("Usage: hpm [-f]\n  -f  stay in the foreground - for systemd with Type=notify\n");
+            exit(1);
+        }
+    }
 
     SetDefaultCfg();
+    hpm_params_default(&hp);
+    hpm_state_init(&hs);
 
     /* before main work starts - try to open the log files to write a new line
     ...and SCREAM if there is trouble! */
@@ -1840,6 +3356,7 @@ main(int argc, char *argv[])
     }
 
     daemonize();
+    HeartbeatOpen();
 
     write_log_start();
 
@@ -1847,8 +3364,19 @@ main(int argc, char *argv[])
 
     parse_config();
 
+    InitCounters();
+
+    InitHeatMeters();
+
     ReadPersistentData();
 
+    /* resume from the state the previous instance left, if it is recent enough;
+       the first sensors read goes through the filters it left, too */
+    if ( ReadStateSnapshot() ) {
+        warm_started = 1;
+        just_started = 1;
+    }
+
     /* Enable GPIO pins */
     if ( ! EnableGPIOpins() ) {
         log_message(LOG_FILE,"ALARM: Cannot enable GPIO! Aborting run.");
@@ -1866,40 +3394,66 @@ main(int argc, char *argv[])
     inverting output setting of config file at startup, and thus avoid
     an unnecessary very short toggling of output relays on startup */
     ControlStateToGPIO();
+    hpm_check_init( &hchk, &hs );
 
     do {
         /* Do all the important stuff... */
         if ( gettimeofday( &tvalBefore, NULL ) ) {
             log_message(LOG_FILE,"WARNING: error getting tvalBefore...");
         }
+        HPM_TRACE1(cycle_start, ProgramRunCycles);
+        HeartbeatBegin();
         /* get the current hour every 5 minutes */
         if ( iter == 60 ) {
             iter = 0;
             GetCurrentTime();
+            WriteBudgetCheck();
             /* and increase counter controlling writing out persistent power use data */
             iter_P++;
-            if ( iter_P == 2) {
+            if ( iter_P >= wr_prsst_every[wbudget.level] ) {
                 iter_P = 0;
                 WritePersistentData();
             }
         }
         iter++;
         ReadSensors();
-        ReadCommsPins();
-        /* Calculate average environment temp */
-        CalcTenvAverage();
-        /* if MODE is not 0==OFF, work away */
-        if (cfg.mode) {
-            /* process sensors data here, and decide what devices should do */
-            DevicesWantedState = SelectOpMode();
-        } else {
-            DevicesWantedState = 0;
+        ReadComms();
+        LatencyComms();
+        /* Update the sensors statistics, and the average environment temp with them */
+        UpdateSensorStats();
+        EstimateHeat();
+        /* decide what devices should do and put the new state on the GPIO pins if it changed */
+        for (i=0;i<cfg.units;i++) {
+            hin.Tcmp[i] = Tcmp(i);
+            hin.Tcnd[i] = Tcnd(i);
+        }
+        hin.TenvAvrg = TenvAvrg;
+        hin.HPmode = HPmode;
+        hin.COMMS = COMMS;
+        hin.cmd = hwwm.live;
+        hin.power = hwwm.power;
+        hin.avoid = hwwm.avoid;
+        if (shadow_on) hs_before = hs;
+        hpm_step(&hs, &hin, &hp, &hout);
+        if (hpm_check(&hchk, &hs, &hin, &hp, &hout)) FailSafe(&hout);
+        if (hout.changed) ControlStateToGPIO();
+        for (i=0;i<TOTALCOUNTERS;i++) {
+            if (hout.events[i]) CountEvents( i, hout.events[i] );
         }
-        ActivateDevicesState(DevicesWantedState);
-        ComputeSendBits();
+        DefrostStats( &hout, was_defrosting );
+        OverheatPreempts( &hout );
+        was_defrosting = hout.defrosting;
+        sendBits = hout.sendBits;
         WriteCommsPins();
-        LogData(DevicesWantedState);
+        /* the shadow gets the cycle only once the relays and the comms pins are set, so
+           its lock and copies are not on their way */
+        if (shadow_on) ShadowPost(&hs_before, &hin, &hout);
+        WriteAvailability(&hout);
+        LogData(hout.wanted);
+        WriteStateSnapshot();
+        HPM_TRACE1(cycle_end, ProgramRunCycles);
         ProgramRunCycles++;
+        HeartbeatEnd();
         if ( just_started ) { just_started--; }
         if ( need_to_read_cfg ) {
             need_to_read_cfg = 0;
@@ -1918,7 +3472,7 @@ main(int argc, char *argv[])
             else {
                 /* otherwise we have valid time data - so calculate exact sleep time
                 so period between active operations is bang on 5 seconds */
-                usleep(5000000 - (((tvalAfter.tv_sec - tvalBefore.tv_sec)*1000000L \
+                WaitNextCycle(5000000 - (((tvalAfter.tv_sec - tvalBefore.tv_sec)*1000000L \
                 + tvalAfter.tv_usec) - tvalBefore.tv_usec));
             }
         }
@@ -1934,5 +3488,6 @@ main(int argc, char *argv[])
 
     return(225);
 }
+#endif
 
 /* EOF */
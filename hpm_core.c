@@ -0,0 +1,964 @@
+/*
+* hpm_core.c
+*
+* hpm control core - the decision making part of hpm, with no I/O of its own.
+* Plamen Petrov
+*
+* See hpm_core.h for how it is meant to be used.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "hpm_core.h"
+#include "hpm_trace.h"
+
+/* everything one control cycle works with */
+struct hpm_ctx
+{
+    struct hpm_state           *s;
+    const struct hpm_inputs    *in;
+    const struct hpm_params    *p;
+    struct hpm_outputs         *out;
+};
+
+/* name mappings - all of them expect a struct hpm_ctx *X in scope */
+#define   TenvAvrg           (X->in->TenvAvrg)
+#define   HPmode             (X->in->HPmode)
+#define   COMMS              (X->in->COMMS)
+#define   AVOIDED(u)         (X->in->cmd && (X->in->avoid & (1<<(u))))
+
+/* AC unit u, counting from 0 */
+#define   UNIT(u)            (&X->s->unit[(u)])
+#define   USE_AC(u)          (X->p->unit[(u)].use)
+#define   COMP_MAX_TEMP(u)   (X->p->unit[(u)].comp_max_temp)
+#define   COMP_COOL_TEMP(u)  (X->p->unit[(u)].comp_cool_temp)
+#define   Tcmp(u)            (X->in->Tcmp[(u)])
+#define   Tcnd(u)            (X->in->Tcnd[(u)])
+
+#define   CountEvent(id)     (X->out->events[(id)]++)
+
+/* The defrost sequence hpm always used; keep in mind that DEFROST takes around 6 mins,
+   and takes 4 (four) !! compressor toggles in those 6 mins away... so like 40 mins normal work.
+   The cycle DEFROST is entered in counts as the first cycle of the first phase */
+static const struct hpm_defrost_phase defrost_default[] = {
+    /* valve, cmp, fan, exit condition, exit temp, min cycles, max cycles */
+    { 1, 0, 0, DEFROST_EXIT_NONE,       0,  0,  6 },   /* ONLY VALVE ON */
+    { 0, 0, 0, DEFROST_EXIT_NONE,       0,  0,  6 },   /* ALL OFF - this switches mode to cooling, so fins become hot */
+    { 0, 1, 0, DEFROST_EXIT_CND_ABOVE, 25,  0, 22 },   /* COMPRESSOR ON WITH VALVE OFF - until the fins reach 25+ C */
+    { 0, 0, 0, DEFROST_EXIT_NONE,       0,  0, 16 },   /* ALL OFF; prep to switch back to heating */
+    { 1, 0, 0, DEFROST_EXIT_NONE,       0,  0, 19 },   /* VALVE back ON */
+    { 1, 0, 1, DEFROST_EXIT_NONE,       0,  0,  2 },   /* VALVE back ON + FAN */
+    { 1, 1, 0, DEFROST_EXIT_NONE,       0,  0,  1 },   /* make AC work in HEATING, COMP COOLING mode */
+};
+
+int
+hpm_core_abi() {
+    return HPM_CORE_ABI;
+}
+
+void
+hpm_params_default(struct hpm_params *p) {
+    int u;
+
+    p->mode = 1;
+    p->units = 2;
+    for (u=0;u<MAXUNITS;u++) {
+        p->unit[u].use = 1;
+        p->unit[u].comp_max_temp = 63;
+        p->unit[u].comp_cool_temp = 56;
+    }
+    p->min_on_cycles = 10*12;
+    p->min_off_cycles = 10*12;
+    p->stagger_cycles = 9;
+    p->valve_cycles = 1;
+    p->starting_cycles = 12;
+    p->cooling_cycles = 10;
+    p->ohp_hold_cycles = 24;
+    /* if after 20 minutes fins stack is below -10 C - switch to DEFROST */
+    p->defrost_after[0] = 20*12;
+    p->defrost_below[0] = -10;
+    /* if after 30 minutes fins stack is below -8 C - switch to DEFROST */
+    p->defrost_after[1] = 30*12;
+    p->defrost_below[1] = -8;
+    /* if after 50 minutes fins stack is below -3 C - switch to DEFROST */
+    p->defrost_after[2] = 50*12;
+    p->defrost_below[2] = -3;
+    /* if the fins are below -2 C, and in 10 minutes they will be 12 C colder than the
+       environment at the rate they are going - switch to DEFROST */
+    p->frost_horizon = 10*12;
+    p->frost_settle = 10*12;
+    p->frost_spread = -12;
+    p->frost_below = -2;
+    p->frost_alpha = 0.05;
+    p->frost_beta = 0.01;
+    /* if the compressor is going to be overheating within a minute at the rate it is
+       going - switch to COMP COOLING; the trend follows quicker in the last 5 C */
+    p->ohp_horizon = 12;
+    p->ohp_near = 5;
+    p->ohp_beta = 0.2;
+    p->ohp_beta_near = 0.5;
+    p->defrost_phases = sizeof(defrost_default) / sizeof(defrost_default[0]);
+    memcpy( p->defrost, defrost_default, sizeof(defrost_default) );
+}
+
+int
+hpm_defrost_phase_parse(const char *text, struct hpm_defrost_phase *ph) {
+    struct hpm_defrost_phase tmp;
+    char what[4], op;
+    float t;
+    int n = 0;
+
+    memset( &tmp, 0, sizeof(tmp) );
+    if (sscanf( text, " %hd , %hd , %hd , %lu , %lu%n", &tmp.valve, &tmp.cmp, &tmp.fan,
+        &tmp.min_cycles, &tmp.max_cycles, &n ) != 5) return -1;
+    text += n;
+    while (*text == ' ') text++;
+    if (*text == ',') {
+        if (sscanf( text+1, " %3[a-z] %c %f", what, &op, &t ) != 3) return -1;
+        if ((op != '>') && (op != '<')) return -1;
+        if (strcmp( what, "cnd" ) == 0) tmp.exit_on = (op == '>') ? DEFROST_EXIT_CND_ABOVE : DEFROST_EXIT_CND_BELOW;
+        else if (strcmp( what, "cmp" ) == 0) tmp.exit_on = (op == '>') ? DEFROST_EXIT_CMP_ABOVE : DEFROST_EXIT_CMP_BELOW;
+        else return -1;
+        tmp.exit_temp = t;
+    }
+    else if (*text) return -1;
+    if ((tmp.valve & ~1) || (tmp.cmp & ~1) || (tmp.fan & ~1)) return -1;
+    if (!tmp.max_cycles || (tmp.min_cycles > tmp.max_cycles)) return -1;
+    *ph = tmp;
+    return 0;
+}
+
+/* value as a number, all of it */
+static int
+params_number(const char *value, double *d) {
+    char *end;
+
+    *d = strtod( value, &end );
+    if ((end == value) || *end) return -1;
+    return 0;
+}
+
+/* the control timings hpm_params_set() knows, by their struct hpm_params names */
+static const struct {
+    const char  *name;
+    size_t       offset;
+} ctl_cycles[] = {
+    { "min_on_cycles",      offsetof(struct hpm_params, min_on_cycles) },
+    { "min_off_cycles",     offsetof(struct hpm_params, min_off_cycles) },
+    { "stagger_cycles",     offsetof(struct hpm_params, stagger_cycles) },
+    { "valve_cycles",       offsetof(struct hpm_params, valve_cycles) },
+    { "starting_cycles",    offsetof(struct hpm_params, starting_cycles) },
+    { "cooling_cycles",     offsetof(struct hpm_params, cooling_cycles) },
+    { "ohp_hold_cycles",    offsetof(struct hpm_params, ohp_hold_cycles) },
+    { "frost_horizon",      offsetof(struct hpm_params, frost_horizon) },
+    { "frost_settle",       offsetof(struct hpm_params, frost_settle) },
+    { "ohp_horizon",        offsetof(struct hpm_params, ohp_horizon) },
+};
+
+/* ...and the control temps and factors */
+static const struct {
+    const char  *name;
+    size_t       offset;
+} ctl_floats[] = {
+    { "frost_spread",       offsetof(struct hpm_params, frost_spread) },
+    { "frost_below",        offsetof(struct hpm_params, frost_below) },
+    { "frost_alpha",        offsetof(struct hpm_params, frost_alpha) },
+    { "frost_beta",         offsetof(struct hpm_params, frost_beta) },
+    { "ohp_near",           offsetof(struct hpm_params, ohp_near) },
+    { "ohp_beta",           offsetof(struct hpm_params, ohp_beta) },
+    { "ohp_beta_near",      offsetof(struct hpm_params, ohp_beta_near) },
+};
+
+int
+hpm_params_set(struct hpm_params *p, const char *name, const char *value) {
+    struct hpm_defrost_phase ph;
+    char key[32];
+    double d;
+    size_t i;
+    int u;
+
+    if (strcmp(name, "mode")==0) {
+        if (params_number( value, &d ) || (d < 0) || (d > 1)) return -1;
+        p->mode = d;
+        return 0;
+    }
+    if (strcmp(name, "units")==0) {
+        if (params_number( value, &d ) || (d < 1) || (d > MAXUNITS)) return -1;
+        p->units = d;
+        return 0;
+    }
+    for (i=0;i<sizeof(ctl_cycles)/sizeof(ctl_cycles[0]);i++) {
+        if (strcmp(name, ctl_cycles[i].name)) continue;
+        if (params_number( value, &d ) || (d < 0)) return -1;
+        *(unsigned long *)((char *)p + ctl_cycles[i].offset) = d;
+        return 0;
+    }
+    for (i=0;i<sizeof(ctl_floats)/sizeof(ctl_floats[0]);i++) {
+        if (strcmp(name, ctl_floats[i].name)) continue;
+        if (params_number( value, &d )) return -1;
+        *(float *)((char *)p + ctl_floats[i].offset) = d;
+        return 0;
+    }
+    /* hpm.cfg has the predictive defrost horizon in minutes */
+    if (strcmp(name, "frost_predict")==0) {
+        if (params_number( value, &d ) || (d < 0)) return -1;
+        p->frost_horizon = d * 60 / HPM_CYCLE_SECONDS;
+        return 0;
+    }
+    /* ...and the predictive overheating protection one in seconds */
+    if (strcmp(name, "ohp_predict")==0) {
+        if (params_number( value, &d ) || (d < 0)) return -1;
+        p->ohp_horizon = d / HPM_CYCLE_SECONDS;
+        return 0;
+    }
+    if ((sscanf(name, "defrost_after%d", &u)==1) && (u>=1) && (u<=DEFROST_TRIGGERS)) {
+        if (params_number( value, &d ) || (d < 0)) return -1;
+        p->defrost_after[u-1] = d;
+        return 0;
+    }
+    if ((sscanf(name, "defrost_below%d", &u)==1) && (u>=1) && (u<=DEFROST_TRIGGERS)) {
+        if (params_number( value, &d )) return -1;
+        p->defrost_below[u-1] = d;
+        return 0;
+    }
+    if ((sscanf(name, "use_ac%d", &u)==1) && (u>=1) && (u<=MAXUNITS)) {
+        if (params_number( value, &d ) || (d < 0) || (d > 1)) return -1;
+        p->unit[u-1].use = d;
+        return 0;
+    }
+    if ((sscanf(name, "ac%d%30s", &u, key)==2) && (u>=1) && (u<=MAXUNITS)) {
+        if (strcmp(key, "max_temp")==0) {
+            if (params_number( value, &d )) return -1;
+            p->unit[u-1].comp_max_temp = d;
+            return 0;
+        }
+        if (strcmp(key, "cool_temp")==0) {
+            if (params_number( value, &d )) return -1;
+            p->unit[u-1].comp_cool_temp = d;
+            return 0;
+        }
+        return 1;
+    }
+    /* like in hpm.cfg, defrost_phase1 starts a new sequence, and every next phase is added
+       to it - or replaces the one there, so a single phase of a sequence can be changed */
+    if ((sscanf(name, "defrost_phase%d", &u)==1) && (u>=1) && (u<=DEFROST_MAXPHASES)) {
+        if ((u > 1) && (u > p->defrost_phases + 1)) return -1;
+        if (hpm_defrost_phase_parse( value, &ph )) return -1;
+        p->defrost[u-1] = ph;
+        if ((u == 1) || (u > p->defrost_phases)) p->defrost_phases = u;
+        return 0;
+    }
+    return 1;
+}
+
+void
+hpm_state_init(struct hpm_state *s) {
+    int u;
+
+    memset( s, 0, sizeof(*s) );
+    /* compressors get to wait a bit more than 6 minutes after a cold start */
+    for (u=0;u<MAXUNITS;u++) s->unit[u].Scmp = 45;
+}
+
+/* Turn ON compressor limitations:
+    1 - it must be off
+    2 - it must have been off for 10 minutes = 10*12 5 sec cycles
+    3 - it must not be too hot
+    4 - the other compressors must not have been switched ON
+         in the last 45 seconds
+    5 - for DEFROST - allow quick toggling */
+static unsigned short
+CanTurnCmpOn(struct hpm_ctx *X, int u) {
+    struct hpm_unit *U = UNIT(u);
+    int o;
+
+    if (!USE_AC(u) || (Tcmp(u)>COMP_MAX_TEMP(u))) { HPM_TRACE2(cmp_on_denied, u+1, 1); return 0; }
+    if (!U->cmp && (U->mode==4)) return 1;
+    if (U->cmp || (U->Scmp <= X->p->min_off_cycles)) { HPM_TRACE2(cmp_on_denied, u+1, 2); return 0; }
+    for (o=0;o<X->p->units;o++) {
+        if ((o!=u) && UNIT(o)->cmp && (UNIT(o)->Scmp <= X->p->stagger_cycles)) { HPM_TRACE2(cmp_on_denied, u+1, 3); return 0; }
+    }
+    return 1;
+}
+
+/* Turn OFF compressor limitations:
+    1 - it must be ON
+    2 - it must have been ON for at least 10 minutes = 10*12 5 sec cycles
+    3 - during DEFROST cycle or power failure - can be turned off quicker */
+static unsigned short
+CanTurnCmpOff(struct hpm_ctx *X, int u) {
+    struct hpm_unit *U = UNIT(u);
+
+    if (U->cmp && ((U->mode>=4)||(COMMS==3))) return 1;
+    if (U->cmp && (U->Scmp > X->p->min_on_cycles)) return 1;
+    HPM_TRACE2(cmp_off_denied, u+1, U->cmp ? 2 : 1);
+    return 0;
+}
+
+/* Turn ON/OFF fan limitations - fans can be toggled at will */
+static unsigned short
+CanTurnFanOn(struct hpm_ctx *X, int u) {
+    return 1;
+}
+
+/* Turn ON/OFF fan limitations - fans can be toggled at will */
+static unsigned short
+CanTurnFanOff(struct hpm_ctx *X, int u) {
+    return 1;
+}
+
+/* Turn ON/OFF valve limitations:
+    1 - to change a valve state - the compressor must be OFF
+    2 - the compressor must have been OFF for 10 seconds = 2 cycles */
+static unsigned short
+CanTurnFvOn(struct hpm_ctx *X, int u) {
+    if (!UNIT(u)->cmp && (UNIT(u)->Scmp > X->p->valve_cycles)) return 1;
+    HPM_TRACE2(fv_denied, u+1, UNIT(u)->cmp ? 1 : 2);
+    return 0;
+}
+
+/* Limitations are the same between valve on and valve off */
+static unsigned short
+CanTurnFvOff(struct hpm_ctx *X, int u) {
+    return CanTurnFvOn(X, u);
+}
+
+/* fans and valves get "turned" on or off every cycle they are wanted so - count real toggles only */
+static void TurnCmpOff(struct hpm_ctx *X, int u) { UNIT(u)->cmp = 0; UNIT(u)->Scmp = 0; }
+static void TurnCmpOn(struct hpm_ctx *X, int u) { UNIT(u)->cmp = 1; UNIT(u)->Scmp = 0; CountEvent( CNT(u+1,CNT_STARTS) ); }
+static void TurnFanOff(struct hpm_ctx *X, int u) { if (UNIT(u)->fan) CountEvent( CNT(u+1,CNT_FAN_TOGGLES) ); UNIT(u)->fan = 0; UNIT(u)->Sfan = 0; }
+static void TurnFanOn(struct hpm_ctx *X, int u) { if (!UNIT(u)->fan) CountEvent( CNT(u+1,CNT_FAN_TOGGLES) ); UNIT(u)->fan = 1; UNIT(u)->Sfan = 0; }
+static void TurnFvOff(struct hpm_ctx *X, int u) { if (UNIT(u)->fv) CountEvent( CNT(u+1,CNT_VALVE_TOGGLES) ); UNIT(u)->fv = 0; UNIT(u)->Sfv = 0; }
+static void TurnFvOn(struct hpm_ctx *X, int u) { if (!UNIT(u)->fv) CountEvent( CNT(u+1,CNT_VALVE_TOGGLES) ); UNIT(u)->fv = 1; UNIT(u)->Sfv = 0; }
+
+/* count AC mode changes made by the decision making */
+static void
+CountModeChange(struct hpm_ctx *X, short ac, short old_mode, short new_mode) {
+    if (old_mode == new_mode) return;
+    HPM_TRACE3(mode_change, ac, old_mode, new_mode);
+    if (new_mode == 4) CountEvent( CNT(ac,CNT_DEFROSTS) );
+    if (new_mode == 5) CountEvent( CNT(ac,CNT_OHP_TRIPS) );
+}
+
+/* an AC counts as running if its compressor is ON, or it is in DEFROST */
+static short
+UnitRunning(struct hpm_ctx *X, int u) {
+    return (UNIT(u)->mode==4) || UNIT(u)->cmp;
+}
+
+/* Staging: we have nrACs_running ACs running, and want K; decide which ACs to keep or
+   bring in. ACs to start are picked from the allowed ones that are off - first the ones
+   that can start right now, then the ones hwwm did not ask to avoid, and then the ones
+   that have worked less in the long run. ACs to stop are picked from the running ones -
+   first the ones that can be stopped right now, the avoided ones and the ones that have
+   worked more, and if that is not enough - the last ones. */
+static void
+StageUnits(struct hpm_ctx *X, short K, short *wantC) {
+    short pick[MAXUNITS];
+    short can[MAXUNITS];
+    short n = 0;
+    short nrACs_running = 0;
+    short i, j, t;
+    int u;
+
+    for (u=0;u<X->p->units;u++) {
+        wantC[u] = UnitRunning(X, u);
+        if (wantC[u]) nrACs_running++;
+    }
+    if (nrACs_running < K) { /* need to bring some ACs in */
+        for (u=0;u<X->p->units;u++) {
+            if (wantC[u] || !USE_AC(u)) continue;
+            can[u] = CanTurnCmpOn(X, u);
+            /* insert keeping pick[] sorted: can start first, then not avoided, then less run
+               cycles, then lower number */
+            for (i=n; i>0; i--) {
+                t = pick[i-1];
+                if (can[t] > can[u]) break;
+                if ((can[t] == can[u]) && (AVOIDED(t) < AVOIDED(u))) break;
+                if ((can[t] == can[u]) && (AVOIDED(t) == AVOIDED(u)) && (UNIT(t)->RunCs <= UNIT(u)->RunCs)) break;
+                pick[i] = t;
+            }
+            pick[i] = u;
+            n++;
+        }
+        for (j=0; (j<n) && (nrACs_running<K); j++) {
+            wantC[pick[j]] = 1;
+            nrACs_running++;
+        }
+    }
+    if (nrACs_running > K) { /* need to turn some ACs off - in practice we leave ON the others */
+        for (u=0;u<X->p->units;u++) {
+            if (!wantC[u]) continue;
+            can[u] = CanTurnCmpOff(X, u);
+            /* insert keeping pick[] sorted: can stop first, then avoided, then more run
+               cycles, then lower number for the ones that can stop, and higher number for
+               the rest */
+            for (i=n; i>0; i--) {
+                t = pick[i-1];
+                if (can[t] > can[u]) break;
+                if ((can[t] == can[u]) && can[u] && (AVOIDED(t) > AVOIDED(u))) break;
+                if ((can[t] == can[u]) && can[u] && (AVOIDED(t) == AVOIDED(u)) && (UNIT(t)->RunCs >= UNIT(u)->RunCs)) break;
+                pick[i] = t;
+            }
+            pick[i] = u;
+            n++;
+        }
+        for (j=0; (j<n) && (nrACs_running>K); j++) {
+            wantC[pick[j]] = 0;
+            nrACs_running--;
+        }
+    }
+}
+
+/* Fin stack to environment temp spread tracking of AC u, one update per cycle: the spread
+   level and trend are smoothed exponentially (Holt's method), so a sensor reading or two
+   off do not move them much; the first cycle of a FIN STACK HEATING run starts it over */
+static void
+FrostTrend(struct hpm_ctx *X, int u) {
+    struct hpm_unit *U = UNIT(u);
+    float spread = Tcnd(u) - TenvAvrg;
+    float prev = U->Fspread;
+
+    if (!U->Fcycles) {
+        U->Fspread = spread;
+        U->Fslope = 0;
+    }
+    else {
+        U->Fspread = X->p->frost_alpha * spread + (1 - X->p->frost_alpha) * (prev + U->Fslope);
+        U->Fslope = X->p->frost_beta * (U->Fspread - prev) + (1 - X->p->frost_beta) * U->Fslope;
+    }
+    U->Fcycles++;
+}
+
+/* if AC u is icing up, going by the trend of its fin stack temp spread */
+static int
+FrostPredicted(struct hpm_ctx *X, int u) {
+    struct hpm_unit *U = UNIT(u);
+
+    if (!X->p->frost_horizon || (U->Fcycles <= X->p->frost_settle)) return 0;
+    return (Tcnd(u) < X->p->frost_below) && (U->Fslope < 0) &&
+        (U->Fspread + U->Fslope * X->p->frost_horizon < X->p->frost_spread);
+}
+
+static void
+StartDefrost(struct hpm_ctx *X, int u) {
+    struct hpm_unit *U = UNIT(u);
+
+    U->mode = 4;
+    U->Smode = 0;
+    U->dphase = 0;
+    U->dexit = 0;
+    U->Sdphase = 0;
+}
+
+/* Compressor temp trend of AC u, one update per cycle: the temp change from the cycle
+   before is smoothed exponentially, with more weight on it near the limit; tracking starts
+   over every time the compressor is turned ON */
+static void
+OverheatTrend(struct hpm_ctx *X, int u) {
+    struct hpm_unit *U = UNIT(u);
+    float beta = X->p->ohp_beta;
+
+    if (!U->cmp) {
+        U->Ccycles = 0;
+        U->Cslope = 0;
+        U->Cpreempted = 0;
+        return;
+    }
+    if (Tcmp(u) > COMP_MAX_TEMP(u) - X->p->ohp_near) beta = X->p->ohp_beta_near;
+    if (U->Ccycles) U->Cslope = beta * (Tcmp(u) - U->Ctemp) + (1 - beta) * U->Cslope;
+    U->Ctemp = Tcmp(u);
+    U->Ccycles++;
+}
+
+/* if the compressor of AC u is going to be overheating, going by its temp trend */
+static int
+OverheatPredicted(struct hpm_ctx *X, int u) {
+    struct hpm_unit *U = UNIT(u);
+
+    if (!X->p->ohp_horizon || !U->Ccycles || (U->Cslope <= 0)) return 0;
+    return (Tcmp(u) + U->Cslope * X->p->ohp_horizon > COMP_MAX_TEMP(u));
+}
+
+/* switch AC u to COMP COOLING ahead of time, if its compressor is going to be overheating -
+   so that the overheating protection rarely has to trip it; on a steady climb the AC goes
+   back and forth between FIN STACK HEATING and COMP COOLING, so only the first time in a
+   compressor run is counted */
+static void
+PreemptOverheat(struct hpm_ctx *X, int u, short *wantFon) {
+    struct hpm_unit *U = UNIT(u);
+
+    if (!OverheatPredicted(X, u)) return;
+    U->mode = 2;
+    U->Smode = 0;
+    *wantFon = 0;
+    if (U->Cpreempted) return;
+    U->Cpreempted = 1;
+    X->out->ohp_preempted |= 1<<u;
+    CountEvent( CNT(u+1,CNT_OHP_PREEMPTS) );
+}
+
+/* One cycle of the defrost sequence of AC u: moves on to the next phase when the current
+   one is over, sets the phase's wanted outputs and checks its exit condition; returns
+   non-zero once all phases are done */
+static short
+DefrostSequencer(struct hpm_ctx *X, int u, short *wantCon, short *wantFon, short *wantVon) {
+    struct hpm_unit *U = UNIT(u);
+    const struct hpm_defrost_phase *ph;
+    short met = 0;
+
+    while ((U->dphase < X->p->defrost_phases) &&
+           (U->dexit || (U->Sdphase >= X->p->defrost[U->dphase].max_cycles))) {
+        X->out->dphase_end[u] = U->dphase + 1;
+        X->out->dphase_early[u] = U->dexit;
+        X->out->dphase_cycles[u] = U->Sdphase;
+        U->dphase++;
+        U->dexit = 0;
+        U->Sdphase = 0;
+    }
+    if (U->dphase >= X->p->defrost_phases) return 1;
+
+    ph = &X->p->defrost[U->dphase];
+    *wantVon = ph->valve;
+    *wantCon = ph->cmp;
+    *wantFon = ph->fan;
+    if (U->Sdphase >= ph->min_cycles) {
+        switch (ph->exit_on) {
+            case DEFROST_EXIT_CND_ABOVE: met = (Tcnd(u) > ph->exit_temp); break;
+            case DEFROST_EXIT_CND_BELOW: met = (Tcnd(u) < ph->exit_temp); break;
+            case DEFROST_EXIT_CMP_ABOVE: met = (Tcmp(u) > ph->exit_temp); break;
+            case DEFROST_EXIT_CMP_BELOW: met = (Tcmp(u) < ph->exit_temp); break;
+        }
+        /* the phase still runs this cycle - the next one starts with the next phase */
+        if (met) U->dexit = 1;
+    }
+    return 0;
+}
+
+/* The per AC mode state machine: manages running AC mode, so that we keep the compressor
+   within allowed working parameters; returns the AC's devices wanted state bits */
+static unsigned short
+UnitOpMode(struct hpm_ctx *X, int u, short wantCon) {
+    struct hpm_unit *U = UNIT(u);
+    unsigned short StateDesired = 0;
+    short wantFon = 0;
+    short wantVon = HPmode;
+    short old_mode = U->mode;
+    short k = 0;
+    short done = 0;
+
+    /* DEFROST mode is kinda special - make it work */
+    if (U->mode==4) { wantCon = 1; }
+
+    OverheatTrend(X, u);
+
+    /* get back out of OVH protection: compressor is OFF, mode is OHP, stayed like so for 2 mins */
+    if (!U->cmp && (U->mode==5) && (U->Smode>X->p->ohp_hold_cycles)) { U->mode = 0; U->Smode = 0; }
+
+    if (COMMS==3) { /* hwwm is signaling power has switched to battery */
+        /* assume everything is OFF except the fourway valves */
+        wantCon = 0;
+        wantFon = 0;
+        /* a defrost is given up as well: one with its compressor running is, as that can
+           be turned off, but in a phase with it off the next phase would turn it back on */
+        if ((U->mode==4) && !U->cmp) {
+            U->mode = 0;
+            U->Smode = 0;
+        }
+    }
+
+    /* On the other hand - we may have a compressor doing the necessary minumum time ON -
+       manage that as well */
+    if (wantCon || U->mode) {
+        /* if the AC is NOT needed - only do the mode clean up if turning off the compressor is possible */
+        if (!wantCon && U->mode && CanTurnCmpOff(X, u)) {
+            U->mode = 0;
+            U->Smode = 0;
+        }
+        switch (U->mode) {
+            case 0: /* AC is in OFF mode: */
+                    /* if we want the AC on - check if it can be turned ON and valve is ON, switch its mode to STARTING */
+                    if (wantCon && CanTurnCmpOn(X, u) && U->fv) {
+                        U->mode = 1;
+                        U->Smode = 0;
+                    }
+                break;
+            case 1: /* AC is in STARTING mode: */
+                    wantFon = 1;
+                    /* when the compressor temp reaches 56 - switch mode to COMP COOLING */
+                    if (Tcmp(u)>COMP_COOL_TEMP(u)) {
+                        U->mode = 2;
+                        U->Smode = 0;
+                    }
+                    /* if 1 minute into starting - make mode FIN STACK HEATING */
+                    if (U->Smode>X->p->starting_cycles) {
+                        U->mode = 3;
+                    }
+                    /* ...or earlier, if it is heating up too fast */
+                    if (U->mode!=2) PreemptOverheat(X, u, &wantFon);
+                break;
+            case 2: /* AC is in COMP COOLING mode: */
+                    /* when the compressor temp falls below 56 and fins are colder than environment - do FIN STACK HEATING;
+                       not while it is still heating up towards overheating */
+                    if ((Tcmp(u)<COMP_COOL_TEMP(u)) && (U->Smode>X->p->cooling_cycles) && (Tcnd(u)<TenvAvrg) &&
+                        !OverheatPredicted(X, u)) {
+                        U->mode = 3;
+                        U->Smode = 0;
+                    }
+                break;
+            case 3: /* AC is in FIN STACK HEATING mode: */
+                    wantFon = 1;
+                    /* when the compressor temp goes back up to 56
+                        switch mode to COMP COOLING */
+                    if ((Tcmp(u)>COMP_COOL_TEMP(u)) && (U->Smode>X->p->cooling_cycles)) {
+                        U->mode = 2;
+                        U->Smode = 0;
+                    }
+                    /* ...or earlier, if it is heating up too fast */
+                    if (U->mode==3) PreemptOverheat(X, u, &wantFon);
+                    /* DEFROST mode activations */
+                    FrostTrend(X, u);
+                    for (k=0;k<DEFROST_TRIGGERS;k++) {
+                        if ((U->Smode>X->p->defrost_after[k]) && (Tcnd(u)<X->p->defrost_below[k])) StartDefrost(X, u);
+                    }
+                    /* ...and the predictive one, if the fixed ones have not kicked in */
+                    if ((U->mode!=4) && FrostPredicted(X, u)) {
+                        StartDefrost(X, u);
+                        X->out->frost_started |= 1<<u;
+                    }
+                break;
+            case 4: /* AC is in DEFROST mode */
+                    done = DefrostSequencer(X, u, &wantCon, &wantFon, &wantVon);
+                    /* if the compressor overheated - stay at current state so that getting out of defrost works
+                       as expected: the phase timer stands still (the decrement wraps back on the timers
+                       increment at the end of the cycle), and leaving the phase early waits as well */
+                    if (wantCon && (Tcmp(u)>COMP_MAX_TEMP(u))) {
+                        U->Sdphase--;
+                        U->dexit = 0;
+                    }
+                    /* when DEFROST cycle is complete - switch back to COMP COOLING mode */
+                    else if (done) {
+                        /* go to COMP COOLING mode */
+                        U->mode = 2;
+                        U->Smode = 0;
+                    }
+                break;
+        }
+    } else {
+        /* only do the mode clean up if turning off the compressor is possible */
+        if (!wantCon && U->mode && CanTurnCmpOff(X, u)) {
+            U->mode = 0;
+            U->Smode = 0;
+        }
+    }
+
+    /* as a final action - if an AC is not allowed to be used by config file - make sure it stays OFF */
+    if (!USE_AC(u)) {
+        wantCon = 0;
+        wantFon = 0;
+        wantVon = 0;
+    }
+
+    /* Turning to OFF mode cleanup:
+        If an AC has been ON, but now will be turned OFF - change its mode accordingly, if possible */
+    if (U->mode!=4 && CanTurnCmpOff(X, u)) {
+        if (U->cmp && !wantCon) {
+            U->mode = 0;
+            U->Smode = 0;
+        }
+    }
+
+    /* the fin stack trend is only tracked through one FIN STACK HEATING run */
+    if (U->mode!=3) U->Fcycles = 0;
+
+    /* compressor overheating protection: if running and hotter than 63 C */
+    if (U->cmp && (Tcmp(u)>COMP_MAX_TEMP(u))) {
+        /* switch mode to OHP, turn compressor and fan OFF */
+        U->mode = 5;
+        U->Smode = 0;
+        wantCon = 0;
+        wantFon = 0;
+    }
+
+    CountModeChange( X, u+1, old_mode, U->mode );
+
+    if ( wantCon ) StateDesired |= BIT_CMP(u+1);
+    if ( wantFon ) StateDesired |= BIT_FAN(u+1);
+    if ( wantVon ) StateDesired |= BIT_FV(u+1);
+    return StateDesired;
+}
+
+static unsigned short
+SelectOpMode(struct hpm_ctx *X) {
+    unsigned short StateDesired = 0;
+    short wantC[MAXUNITS];
+    int u;
+
+    /* hwwm asks for so many ACs over the command socket, */
+    if (X->in->cmd && (COMMS!=3)) {
+        if (X->in->power >= X->p->units) {
+            for (u=0;u<X->p->units;u++) wantC[u] = 1;
+        }
+        else StageUnits(X, X->in->power, wantC);
+    }
+    /* or for one AC (low mode), or for all of them (HIGH mode) on the comms pins */
+    else if (COMMS==1) {
+        StageUnits(X, 1, wantC);
+    }
+    else {
+        for (u=0;u<X->p->units;u++) wantC[u] = (COMMS==2);
+    }
+
+    /* Until now we alredy know which ACs we want on; now each AC's mode is managed */
+    for (u=0;u<X->p->units;u++) {
+        StateDesired |= UnitOpMode(X, u, wantC[u]);
+    }
+    return StateDesired;
+}
+
+/* calculate current devices state bits, as in SelectOpMode() */
+static unsigned short
+DevicesState(struct hpm_ctx *X) {
+    unsigned short state = 0;
+    int u;
+
+    for (u=0;u<X->p->units;u++) {
+        if ( UNIT(u)->cmp ) state |= BIT_CMP(u+1);
+        if ( UNIT(u)->fan ) state |= BIT_FAN(u+1);
+        if ( UNIT(u)->fv ) state |= BIT_FV(u+1);
+    }
+    return state;
+}
+
+static void
+ActivateDevicesState(struct hpm_ctx *X, const unsigned short _ST_) {
+    unsigned short current_state = DevicesState(X);
+    unsigned short new_state = 0;
+    struct hpm_unit *U;
+    int u;
+
+    /* make changes as needed */
+    /* _ST_'s bits describe the peripherals desired state, 3 bits per AC:
+        BIT_CMP(A) - compressor A
+        BIT_FAN(A) - fan A
+        BIT_FV(A)  - fourway valve A */
+    for (u=0;u<X->p->units;u++) {
+        if (_ST_ & BIT_CMP(u+1)) { if (CanTurnCmpOn(X, u)) TurnCmpOn(X, u); } else { if (CanTurnCmpOff(X, u)) TurnCmpOff(X, u); }
+        if (_ST_ & BIT_FAN(u+1)) { if (CanTurnFanOn(X, u)) TurnFanOn(X, u); } else { if (CanTurnFanOff(X, u)) TurnFanOff(X, u); }
+        if (_ST_ & BIT_FV(u+1))  { if (CanTurnFvOn(X, u)) TurnFvOn(X, u); } else { if (CanTurnFvOff(X, u)) TurnFvOff(X, u); }
+    }
+
+    for (u=0;u<X->p->units;u++) {
+        U = UNIT(u);
+        CountEvent( CNT(u+1,CNT_MODE_CYCLES+U->mode) );
+        if ( U->mode==4 ) CountEvent( CNT(u+1,CNT_DEFROST_CYCLES) );
+        U->Scmp++;
+        U->Sfan++;
+        U->Sfv++;
+        U->Smode++;
+        U->Sdphase++;
+        if ( U->cmp ) { U->RunCs++; CountEvent( CNT(u+1,CNT_RUN_CYCLES) ); }
+    }
+
+    /* calculate desired new state */
+    new_state = DevicesState(X);
+    /* if current state and new state are different - the caller puts state on GPIO pins;
+       this prevents lots of toggling at every decision */
+    X->out->actual = new_state;
+    X->out->changed = ( current_state != new_state );
+}
+
+
+/* Gets called after main decision making for the cycle has taken place. This means that
+   control states can be used to make decisions. The task here is to take into account limitations,
+   and compute an answer to return to hwwm */
+static void
+ComputeSendBits(struct hpm_ctx *X) {
+    unsigned short nrACs_startable = 0;
+    unsigned short nrACs_stoppable = 0;
+    unsigned short k = 0;
+    int u;
+
+    for (u=0;u<X->p->units;u++) {
+        if (UNIT(u)->mode==4) continue;
+        /* Start by determining how many AC we can START */
+        if (CanTurnCmpOn(X, u)) nrACs_startable++;
+        /* Then determine how many AC we can STOP */
+        if (CanTurnCmpOff(X, u)) nrACs_stoppable++;
+    }
+
+    /* When cfg.mode is set to OFF -  do not allow changes */
+    if (!X->p->mode) {
+        X->out->sendBits = 0;
+        return;
+    }
+
+    /* If we cannot start or stop ACs - do not allow changes */
+    if (!(nrACs_startable || nrACs_stoppable)) {
+        X->out->sendBits = 0;
+        return;
+    }
+
+    /* bit 1 - one more AC can be started; bit 2 - an AC can be stopped; both bits with
+       nothing to start means every AC is running and can be stopped. This is what the
+       all-possible-scenarios-blown-up table for 2 ACs says, and it extends to more ACs */
+    if (nrACs_startable) k |= 1;
+    if (nrACs_stoppable) k |= 2;
+    if (nrACs_stoppable == X->p->units) k = 3;
+
+    X->out->sendBits = k;
+}
+
+/* cycles left until a state timer gets past limit, as the Can...() limitations want it */
+static long
+CyclesPast(unsigned long timer, unsigned long limit) {
+    return (timer > limit) ? 0 : (long)(limit - timer + 1);
+}
+
+/* cycles left of the defrost sequence of AC u, if every phase takes its longest */
+static long
+DefrostLeft(struct hpm_ctx *X, int u) {
+    struct hpm_unit *U = UNIT(u);
+    long left = 0;
+    short k;
+
+    for (k=U->dphase;k<X->p->defrost_phases;k++) left += X->p->defrost[k].max_cycles;
+    if (U->dphase < X->p->defrost_phases) left -= U->Sdphase;
+    return (left > 0) ? left : 0;
+}
+
+/* Availability horizon: when each AC could be started or stopped - the waits of
+   CanTurnCmpOn() and CanTurnCmpOff(), with the overheating protection hold and the rest
+   of a defrost added, so hwwm can plan its asks instead of asking every cycle */
+static void
+ComputeAvailability(struct hpm_ctx *X) {
+    struct hpm_unit *U;
+    long t;
+    int u, o;
+
+    for (u=0;u<MAXUNITS;u++) X->out->start_in[u] = X->out->stop_in[u] = -1;
+    if (!X->p->mode) return;
+    for (u=0;u<X->p->units;u++) {
+        U = UNIT(u);
+        if (!USE_AC(u)) continue;
+        if (U->mode==4) {
+            /* a defrost is never cut short; after it the compressor runs in COMP COOLING,
+               and if the sequence restarted it, it has its minimum ON time to do */
+            t = DefrostLeft(X, u);
+            if ((X->p->defrost_phases > 0) && X->p->defrost[X->p->defrost_phases-1].cmp) t += X->p->min_on_cycles + 1;
+            X->out->stop_in[u] = (COMMS==3) ? 0 : t;
+            continue;
+        }
+        if (U->cmp) {
+            X->out->stop_in[u] = (COMMS==3) ? 0 : CyclesPast(U->Scmp, X->p->min_on_cycles);
+            continue;
+        }
+        t = CyclesPast(U->Scmp, X->p->min_off_cycles);
+        if ((U->mode==5) && (CyclesPast(U->Smode, X->p->ohp_hold_cycles) > t)) t = CyclesPast(U->Smode, X->p->ohp_hold_cycles);
+        for (o=0;o<X->p->units;o++) {
+            if ((o!=u) && UNIT(o)->cmp && (CyclesPast(UNIT(o)->Scmp, X->p->stagger_cycles) > t)) {
+                t = CyclesPast(UNIT(o)->Scmp, X->p->stagger_cycles);
+            }
+        }
+        X->out->start_in[u] = t;
+    }
+}
+
+void
+hpm_step(struct hpm_state *s, const struct hpm_inputs *in, const struct hpm_params *p,
+    struct hpm_outputs *out) {
+    struct hpm_ctx ctx = { s, in, p, out };
+    struct hpm_ctx *X = &ctx;
+    int u;
+
+    memset( out, 0, sizeof(*out) );
+    /* if MODE is not 0==OFF, work away */
+    if (p->mode) {
+        /* process sensors data here, and decide what devices should do */
+        out->wanted = SelectOpMode(X);
+    } else {
+        out->wanted = 0;
+    }
+    /* the daemon keeps the defrost statistics by these */
+    for (u=0;u<p->units;u++) {
+        if (UNIT(u)->mode==4) out->defrosting |= 1<<u;
+    }
+    ActivateDevicesState(X, out->wanted);
+    ComputeSendBits(X);
+    ComputeAvailability(X);
+}
+
+void
+hpm_check_init(struct hpm_check *c, const struct hpm_state *s) {
+    int u;
+
+    memset( c, 0, sizeof(*c) );
+    for (u=0;u<MAXUNITS;u++) {
+        c->since[u] = -(long)s->unit[u].Scmp;
+        if (s->unit[u].cmp) c->prev |= BIT_CMP(u+1);
+        if (s->unit[u].fan) c->prev |= BIT_FAN(u+1);
+        if (s->unit[u].fv) c->prev |= BIT_FV(u+1);
+    }
+}
+
+/* The rules are checked on the devices state bits alone, with the checker's own record
+   of when each compressor switched - so a mistake in the decisions or in the state
+   timers they use can not hide a broken rule. Only the exceptions are taken from the AC
+   modes. A cycle with no change is a handful of compares */
+int
+hpm_check(struct hpm_check *c, const struct hpm_state *s, const struct hpm_inputs *in,
+    const struct hpm_params *p, const struct hpm_outputs *out) {
+    struct hpm_ctx ctx = { NULL, in, p, NULL };     /* for the inputs name mappings */
+    struct hpm_ctx *X = &ctx;
+    unsigned short now = out->actual;
+    unsigned short changed = now ^ c->prev;
+    long m = c->cycle++;
+    int u, o, n = 0;
+
+    for (u=0;u<p->units;u++) {
+        c->broken[u] = 0;
+        if ((now & BIT_CMP(u+1)) && (Tcmp(u) > COMP_MAX_TEMP(u))) c->broken[u] |= RULE_MAX_TEMP;
+    }
+    if (changed) {
+        for (u=0;u<p->units;u++) {
+            if ((changed & BIT_CMP(u+1)) && (now & BIT_CMP(u+1)) && (s->unit[u].mode != 4)) {
+                if (m - c->since[u] <= (long)p->min_off_cycles) c->broken[u] |= RULE_MIN_OFF;
+                for (o=0;o<p->units;o++) {
+                    if ((o == u) || !(now & BIT_CMP(o+1))) continue;
+                    if (changed & BIT_CMP(o+1)) { if (o < u) c->broken[u] |= RULE_STAGGER; }
+                    else if (m - c->since[o] <= (long)p->stagger_cycles) c->broken[u] |= RULE_STAGGER;
+                }
+            }
+            if ((changed & BIT_CMP(u+1)) && !(now & BIT_CMP(u+1)) && (s->unit[u].mode < 4) && (COMMS != 3)) {
+                if (m - c->since[u] <= (long)p->min_on_cycles) c->broken[u] |= RULE_MIN_ON;
+            }
+            if (changed & BIT_FV(u+1)) {
+                if (((now | c->prev) & BIT_CMP(u+1)) || (m - c->since[u] <= (long)p->valve_cycles)) c->broken[u] |= RULE_VALVE;
+            }
+        }
+        for (u=0;u<p->units;u++) {
+            if (changed & BIT_CMP(u+1)) c->since[u] = m;
+        }
+        c->prev = now;
+    }
+    for (u=0;u<p->units;u++) {
+        if (c->broken[u]) n++;
+    }
+    return n;
+}
+
+const char *
+hpm_rule_name(unsigned short rule) {
+    static const char *names[TOTALRULES] = { "compressors stagger", "valve with compressor off",
+        "compressor minimum on time", "compressor minimum off time", "compressor maximum temp" };
+    int k;
+
+    for (k=0;k<TOTALRULES;k++) {
+        if (rule & (1<<k)) return names[k];
+    }
+    return "none";
+}
+
+/* EOF */
@@ -0,0 +1,277 @@
+/*
+* hpm_core.h
+*
+* hpm control core - the decision making part of hpm, with no I/O of its own.
+* Plamen Petrov
+*
+* All the state the decisions depend on is kept in struct hpm_state, and a single call
+* to hpm_step() does one control cycle: it takes the state, the cycle's inputs and the
+* parameters, and updates the state and fills in the outputs. Nothing else is touched,
+* so any number of control instances can be run side by side in one process - the daemon,
+* simulations, replays of recorded data and benchmarks all use the same code.
+*/
+
+#ifndef HPM_CORE_H
+#define HPM_CORE_H
+
+/* Bumped on every change of the structs below, so tools loading a core can check it */
+#define HPM_CORE_ABI         9
+
+/* Seconds per control cycle, the timings are counted in */
+#define HPM_CYCLE_SECONDS    5
+
+/* Maximum number of AC outdoor units that can be managed */
+#define MAXUNITS             4
+
+/* HPmode values, which use inverse to hwwm values */
+#define HEAT 1
+#define COOL 0
+
+/* Operational counter events - kept per AC; event index of kind K for AC number A
+   (counting from 1) is CNT(A,K) */
+#define CNT_STARTS           0
+#define CNT_RUN_CYCLES       1
+#define CNT_FAN_TOGGLES      2
+#define CNT_VALVE_TOGGLES    3
+#define CNT_DEFROSTS         4
+#define CNT_DEFROST_CYCLES   5
+#define CNT_OHP_TRIPS        6
+#define CNT_MODE_CYCLES      7   /* 6 counters, one per AC mode 0..5 */
+#define CNT_OHP_PREEMPTS     13  /* compressor runs that went to COMP COOLING early, on its temp trend */
+#define CNT_PER_AC           14
+#define TOTALCOUNTERS        (MAXUNITS*CNT_PER_AC)
+#define CNT(A,K)             (((A)-1)*CNT_PER_AC+(K))
+
+/* Devices state bits: every AC has 3 - compressor, fan and fourway valve; so for AC
+   number A (counting from 1) these are: */
+#define BIT_CMP(A)           (1<<(3*((A)-1)))
+#define BIT_FAN(A)           (2<<(3*((A)-1)))
+#define BIT_FV(A)            (4<<(3*((A)-1)))
+
+/* Number of the defrost activation rules in struct hpm_params */
+#define DEFROST_TRIGGERS     3
+
+/* Defrost is a sequence of phases, each with its own outputs, run for at most
+   max_cycles; a phase can be left early once it has run for min_cycles and its exit
+   condition is met, e.g. the fin stack is warm enough. The default sequence is the
+   one hpm always used - 72 cycles, about 6 minutes */
+#define DEFROST_MAXPHASES    8
+
+/* defrost phase exit conditions */
+#define DEFROST_EXIT_NONE       0
+#define DEFROST_EXIT_CND_ABOVE  1   /* fin stack temp above exit_temp */
+#define DEFROST_EXIT_CND_BELOW  2   /* fin stack temp below exit_temp */
+#define DEFROST_EXIT_CMP_ABOVE  3   /* compressor temp above exit_temp */
+#define DEFROST_EXIT_CMP_BELOW  4   /* compressor temp below exit_temp */
+
+struct hpm_defrost_phase
+{
+    short           valve;          /* wanted outputs during the phase */
+    short           cmp;
+    short           fan;
+    short           exit_on;        /* DEFROST_EXIT_* */
+    float           exit_temp;
+    unsigned long   min_cycles;
+    unsigned long   max_cycles;
+};
+
+/* Per AC outdoor unit control parameters */
+struct hpm_unit_params
+{
+    int     use;                    /* master control of the AC */
+    float   comp_max_temp;          /* compressor is considered overheating above this */
+    float   comp_cool_temp;         /* COMP COOLING mode switch temp */
+};
+
+/* Control parameters; the timing ones are in control cycles of ~5 seconds */
+struct hpm_params
+{
+    int     mode;                   /* 0=ALL OFF; 1=AUTO */
+    int     units;                  /* number of AC outdoor units installed, 1..MAXUNITS */
+    struct hpm_unit_params  unit[MAXUNITS];
+    unsigned long  min_on_cycles;   /* minimum compressor ON time */
+    unsigned long  min_off_cycles;  /* minimum compressor OFF time */
+    unsigned long  stagger_cycles;  /* the other compressors must have been ON for more than this */
+    unsigned long  valve_cycles;    /* compressor must have been OFF for more than this to move its valve */
+    unsigned long  starting_cycles; /* time in STARTING mode */
+    unsigned long  cooling_cycles;  /* minimum time in COMP COOLING or FIN STACK HEATING before switching */
+    unsigned long  ohp_hold_cycles; /* time to stay in overheating protection */
+    /* go to DEFROST after this much FIN STACK HEATING, if the fin stack is below temp */
+    unsigned long  defrost_after[DEFROST_TRIGGERS];
+    float          defrost_below[DEFROST_TRIGGERS];
+    /* predictive DEFROST: through FIN STACK HEATING the fin stack to environment temp
+       spread is tracked, smoothed by frost_alpha, with its trend smoothed by frost_beta;
+       once tracked for more than frost_settle, DEFROST starts if the fin stack is below
+       frost_below and the trend says the spread goes below frost_spread within
+       frost_horizon - ice on the fins makes them colder. frost_horizon 0 only tracks */
+    unsigned long  frost_horizon;
+    unsigned long  frost_settle;
+    float          frost_spread;
+    float          frost_below;
+    float          frost_alpha;
+    float          frost_beta;
+    /* predictive overheating protection: while the compressor runs, its temp change per
+       cycle is smoothed by ohp_beta - and by ohp_beta_near once within ohp_near of
+       comp_max_temp, so the trend follows the last readings closer where it matters; if
+       the trend says comp_max_temp is reached within ohp_horizon, the AC goes to COMP
+       COOLING early, and stays there while it does. ohp_horizon 0 only tracks */
+    unsigned long  ohp_horizon;
+    float          ohp_near;
+    float          ohp_beta;
+    float          ohp_beta_near;
+    /* the defrost sequence */
+    int                        defrost_phases;
+    struct hpm_defrost_phase   defrost[DEFROST_MAXPHASES];
+};
+
+/* One control cycle inputs */
+struct hpm_inputs
+{
+    float           Tcmp[MAXUNITS];     /* filtered compressor temperatures */
+    float           Tcnd[MAXUNITS];     /* filtered fin stack temperatures */
+    float           TenvAvrg;           /* average environment temp */
+    unsigned short  HPmode;
+    unsigned short  COMMS;              /* as sent by hwwm */
+    /* what hwwm asked for over the command socket, used instead of COMMS 0..2 when cmd
+       is set; COMMS 3 - on battery - stands either way */
+    unsigned short  cmd;
+    unsigned short  power;              /* ACs wanted running */
+    unsigned short  avoid;              /* bit u: AC u+1 is the last to start, the first to stop */
+};
+
+/* AC mode states:
+            0 - off;
+            1 - starting;
+            2 - compressor cooling;
+            3 - fin stack heating up;
+            4 - defrost;
+            5 - off after overheating protection */
+
+/* One AC outdoor unit control state */
+struct hpm_unit
+{
+    short           cmp;        /* compressor, fan and fourway valve states */
+    short           fan;
+    short           fv;
+    short           mode;       /* AC mode */
+    unsigned long   Scmp;       /* state cycles of the above - zeroed on change to state */
+    unsigned long   Sfan;
+    unsigned long   Sfv;
+    unsigned long   Smode;
+    unsigned long   RunCs;      /* compressor run cycles, for wear balancing */
+    short           dphase;     /* current defrost phase, and if it is to be left early */
+    short           dexit;
+    unsigned long   Sdphase;    /* defrost phase cycles - stand still while the compressor is too hot to start */
+    float           Fspread;    /* fin stack to environment temp spread, smoothed, and its trend per cycle */
+    float           Fslope;
+    unsigned long   Fcycles;    /* cycles tracked - zeroed when FIN STACK HEATING ends */
+    float           Ctemp;      /* compressor temp the cycle before, and its trend per cycle */
+    float           Cslope;
+    unsigned long   Ccycles;    /* cycles tracked - zeroed when the compressor is OFF */
+    short           Cpreempted; /* went to COMP COOLING on the trend in this compressor run */
+};
+
+/* Control state - everything the decisions depend on, that carries over between cycles */
+struct hpm_state
+{
+    struct hpm_unit  unit[MAXUNITS];
+};
+
+/* One control cycle outputs */
+struct hpm_outputs
+{
+    unsigned short  wanted;         /* devices wanted state bits, see BIT_CMP() and co. */
+    unsigned short  actual;         /* devices state bits after the limitations are applied */
+    unsigned short  changed;        /* non-zero if the devices state changed this cycle */
+    unsigned short  sendBits;       /* the answer to hwwm */
+    unsigned short  defrosting;     /* bit N set if AC N+1 is in DEFROST */
+    unsigned short  frost_started;  /* bit N set if AC N+1 went to DEFROST on the fin stack trend */
+    unsigned short  ohp_preempted;  /* bit N set if AC N+1 went to COMP COOLING on the compressor temp trend, the first time in its run */
+    unsigned short  events[TOTALCOUNTERS];  /* operational counter events this cycle */
+    /* cycles until the compressor of every AC could be started, if it is OFF, and stopped,
+       if it is running - 0 if it can be right now, -1 if not at all or it is not the case;
+       the ones that depend on the compressor temp count as if it stays as it is */
+    long            start_in[MAXUNITS];
+    long            stop_in[MAXUNITS];
+    /* defrost phases ended this cycle, per AC: phase number counting from 1 (0 if none),
+       the phase cycles it took, and if it was left early on its exit condition */
+    short           dphase_end[MAXUNITS];
+    short           dphase_early[MAXUNITS];
+    unsigned long   dphase_cycles[MAXUNITS];
+};
+
+/* Safety rules the devices state is checked against by hpm_check(), whatever the
+   decisions that led to it:
+    RULE_STAGGER  - a compressor does not start while another one is on, and started
+                    stagger_cycles or less ago; two starting in the same cycle count
+                    against the higher numbered AC
+    RULE_VALVE    - a fourway valve only moves with its compressor off for more than
+                    valve_cycles
+    RULE_MIN_ON   - a compressor runs for more than min_on_cycles
+    RULE_MIN_OFF  - a compressor stays off for more than min_off_cycles
+    RULE_MAX_TEMP - a compressor is never on above comp_max_temp
+   DEFROST starts compressors regardless of the stagger and minimum off time, and
+   DEFROST, overheating protection and running on battery stop them regardless of the
+   minimum on time */
+#define RULE_STAGGER         1
+#define RULE_VALVE           2
+#define RULE_MIN_ON          4
+#define RULE_MIN_OFF         8
+#define RULE_MAX_TEMP        16
+#define TOTALRULES           5
+
+/* Safety rules checker state */
+struct hpm_check
+{
+    long            cycle;              /* number of the cycle checked next */
+    unsigned short  prev;               /* devices state bits after the previous cycle */
+    long            since[MAXUNITS];    /* cycle the compressor last switched in */
+    unsigned short  broken[MAXUNITS];   /* RULE_* bits broken in the last cycle, per AC */
+};
+
+void
+hpm_params_default(struct hpm_params *p);
+
+/* cold start state: everything OFF, compressors can start after the usual start up delay */
+void
+hpm_state_init(struct hpm_state *s);
+
+/* do one control cycle */
+void
+hpm_step(struct hpm_state *s, const struct hpm_inputs *in, const struct hpm_params *p,
+    struct hpm_outputs *out);
+
+/* parse a defrost phase from its text form "valve,cmp,fan,min,max[,exit]", where exit is
+   "cnd>T", "cnd<T", "cmp>T" or "cmp<T"; returns 0 on success, -1 on error */
+int
+hpm_defrost_phase_parse(const char *text, struct hpm_defrost_phase *ph);
+
+/* set a control parameter named as in hpm.cfg (mode, units, use_acN, acNmax_temp,
+   acNcool_temp, defrost_phaseN, frost_predict, frost_spread, frost_below, ohp_predict) or
+   as in struct hpm_params for the ones not in it (min_on_cycles, ..., ohp_hold_cycles,
+   defrost_afterN, defrost_belowN with N from 1, frost_horizon, ..., ohp_beta_near), by name;
+   returns 0 if set, 1 if the name is not one of these, -1 if the value is not valid */
+int
+hpm_params_set(struct hpm_params *p, const char *name, const char *value);
+
+/* start checking the safety rules from the given control state */
+void
+hpm_check_init(struct hpm_check *c, const struct hpm_state *s);
+
+/* check a cycle's devices state, as hpm_step() left it, against the safety rules;
+   returns the number of ACs that broke any, with the rules in c->broken[] */
+int
+hpm_check(struct hpm_check *c, const struct hpm_state *s, const struct hpm_inputs *in,
+    const struct hpm_params *p, const struct hpm_outputs *out);
+
+/* name of a RULE_* bit */
+const char *
+hpm_rule_name(unsigned short rule);
+
+/* so tools loading a core dynamically can tell if its structs match theirs */
+int
+hpm_core_abi();
+
+#endif
+
+/* EOF */
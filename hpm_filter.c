@@ -0,0 +1,87 @@
+/*
+* hpm_filter.c
+*
+* Sensor readings filter.
+* Plamen Petrov
+*
+* See hpm_filter.h for how it works.
+*/
+
+#include <math.h>
+#include "hpm_filter.h"
+
+static float
+median3(float a, float b, float c) {
+    float t;
+
+    if (a > b) { t = a; a = b; b = t; }
+    if (b > c) b = c;
+    return (a > b) ? a : b;
+}
+
+void
+hpm_filter_reset(struct hpm_filter *f, float x) {
+    f->raw[0] = f->raw[1] = f->raw[2] = x;
+    f->last = 2;
+    f->out = x;
+    f->held = 0;
+    f->dir = 0;
+}
+
+int
+hpm_filter_add(struct hpm_filter *f, float x) {
+    float p = f->raw[f->last];
+    float pp = f->raw[(f->last + 2) % 3];
+    float m, d;
+    short dir;
+
+    f->last = (f->last + 1) % 3;
+    f->raw[f->last] = x;
+    if (f->gate <= 0) {
+        f->out = x;
+        return FILTER_OK;
+    }
+    /* the reading before this one was a single bad one, if it was out of the gate from
+       the ones on both sides of it, the same way - the median took it out */
+    if ((fabsf( p - pp ) > f->gate) && (fabsf( p - x ) > f->gate) && ((p - pp) * (p - x) > 0)) f->rejected++;
+
+    m = median3( f->raw[0], f->raw[1], f->raw[2] );
+    d = m - f->out;
+    if (fabsf( d ) <= f->gate) {
+        f->out = m;
+        f->dir = 0;
+        if (!f->held) return FILTER_OK;
+        f->held = 0;
+        f->rejected++;
+        return FILTER_SPIKE;
+    }
+    dir = (d > 0) ? 1 : -1;
+    /* a confirmed step still going on */
+    if (dir == f->dir) {
+        f->out = m;
+        return FILTER_OK;
+    }
+    /* the median lags a reading behind, so it only confirms a step with the reading
+       itself out of the gate too - else the ones held back were a spike */
+    if ((x - f->out) * dir <= f->gate) {
+        if (!f->held) return FILTER_OK;
+        f->held = 0;
+        f->rejected++;
+        return FILTER_SPIKE;
+    }
+    /* the ones held back going the other way were a spike */
+    if (f->held && (((f->spike > f->out) ? 1 : -1) != dir)) {
+        f->held = 0;
+        f->rejected++;
+    }
+    if (!f->held || (fabsf( d ) > fabsf( f->spike - f->out ))) f->spike = m;
+    f->held++;
+    if (f->held < f->confirm) return FILTER_HELD;
+    f->out = m;
+    f->held = 0;
+    f->dir = dir;
+    f->steps++;
+    return FILTER_STEP;
+}
+
+/* EOF */
@@ -0,0 +1,54 @@
+/*
+* hpm_filter.h
+*
+* Sensor readings filter - takes out the odd bad reading, but lets a real change of
+* temperature through within a reading or two.
+* Plamen Petrov
+*
+* Every reading goes through two stages:
+*   median of 3 - the middle one of the last three readings is taken, so a single bad
+*       reading never gets through, however far off it is;
+*   spike gate  - a median more than gate away from the filtered value is held back,
+*       until confirm medians in a row are out of the gate in the same direction; then
+*       the step is taken as real. While it keeps going the same way - a fin stack
+*       warming up in defrost, say - every next median is taken as it is. A held back
+*       median that is not confirmed was a spike, and is dropped.
+* With the default confirm of 2, a real step shows two readings after it happened, and
+* a bad reading has to come three times in a row to get through. A gate of 0 turns the
+* filter off - every reading is taken as it is.
+*/
+
+#ifndef HPM_FILTER_H
+#define HPM_FILTER_H
+
+/* what happened to a reading */
+#define FILTER_OK            0   /* taken */
+#define FILTER_HELD          1   /* out of the gate, waiting to be confirmed */
+#define FILTER_STEP          2   /* a step got confirmed, and taken */
+#define FILTER_SPIKE         3   /* the held back readings were a spike, and got dropped */
+
+struct hpm_filter
+{
+    float           gate;           /* settings */
+    unsigned short  confirm;
+    float           raw[3];         /* the last three readings, */
+    unsigned short  last;           /* the newest of them */
+    float           out;            /* the filtered value */
+    unsigned short  held;           /* medians held back in a row */
+    short           dir;            /* -1 or 1 while a step is being followed, else 0 */
+    float           spike;          /* the furthest of the medians held back */
+    unsigned long   rejected;       /* readings the median took out, and spikes dropped */
+    unsigned long   steps;          /* steps confirmed */
+};
+
+/* start over, with a filtered value of x as if it was read three times */
+void
+hpm_filter_reset(struct hpm_filter *f, float x);
+
+/* filter a reading; returns FILTER_*, with the filtered value in f->out */
+int
+hpm_filter_add(struct hpm_filter *f, float x);
+
+#endif
+
+/* EOF */
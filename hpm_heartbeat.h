@@ -0,0 +1,50 @@
+/*
+* hpm_heartbeat.h
+*
+* The heartbeat hpm keeps in shared memory, for supervisors to tell it is alive and well.
+* Plamen Petrov
+*
+* HEARTBEAT_FILE - /run/shm/hpm_heartbeat - holds one struct hpm_heartbeat. hpm maps it and
+* updates it in place at the start and end of every control cycle, with no system calls;
+* a reader maps it or just reads it, as it likes, and gets the last completed cycle, when
+* it ended on the CLOCK_MONOTONIC clock - which is the same for every process - how long
+* it took, and the health flags. seq is odd while hpm is updating it; a reader that saw
+* an odd seq, or a different one after it read the rest, reads it again.
+* tools/hpm-alive is such a reader, for monit and the like.
+*/
+
+#ifndef HPM_HEARTBEAT_H
+#define HPM_HEARTBEAT_H
+
+#include <stdint.h>
+
+#define HPM_HB_MAGIC         0x68706d68     /* "hpmh" */
+#define HPM_HB_VERSION       1
+
+/* health flags */
+#define HB_STARTING          0x01   /* in the first cycles, the files for other systems not written yet */
+#define HB_FAILSAFE          0x02   /* the failsafe took over - all devices off */
+#define HB_SENSORS           0x04   /* a sensor in use failed its last reads */
+#define HB_GPIO              0x08   /* a GPIO read or write failed in the last cycle */
+#define HB_HWWM              0x10   /* hwwm's command channel, not the comms pins, is in use */
+#define HB_WRITE_BUDGET      0x20   /* writes cut down, over the SD card write budget */
+
+struct hpm_heartbeat
+{
+    uint32_t            magic;
+    uint32_t            version;
+    volatile uint32_t   seq;
+    int32_t             pid;
+    uint64_t            cycle;          /* control cycles completed */
+    int64_t             started_ms;     /* CLOCK_MONOTONIC ms the cycle going on started at, */
+    int64_t             ended_ms;       /* and the last completed one ended at */
+    int64_t             ended_wall;     /* the same as time() */
+    uint32_t            last_ms;        /* how long the last completed cycle took, */
+    uint32_t            max_ms;         /* and the longest since hpm started */
+    uint32_t            flags;          /* HB_* */
+    uint32_t            reserved;
+};
+
+#endif
+
+/* EOF */
@@ -0,0 +1,166 @@
+/*
+* hpm_log.c
+*
+* Reading hpm data logs back - see hpm_log.h.
+* Plamen Petrov
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#include "hpm_log.h"
+
+const char *hpm_log_mode_names[6] = { " off     ", "starting ", "c cooling", "fins heat", "defrost  ", "off (OHP)" };
+
+FILE *
+hpm_log_open(const char *file, pid_t *pid) {
+    size_t l = strlen(file);
+    int fd, p[2];
+
+    *pid = 0;
+    if ((l < 3) || strcmp( file + l - 3, ".gz" )) return fopen( file, "r" );
+    fd = open( file, O_RDONLY );
+    if (fd < 0) return NULL;
+    if (pipe(p)) { close(fd); return NULL; }
+    *pid = fork();
+    if (*pid < 0) { close(fd); close(p[0]); close(p[1]); return NULL; }
+    if (!*pid) {
+        dup2( fd, 0 );
+        dup2( p[1], 1 );
+        close( fd ); close( p[0] ); close( p[1] );
+        execlp( "gzip", "gzip", "-dc", (char *)NULL );
+        _exit(127);
+    }
+    close( fd );
+    close( p[1] );
+    return fdopen( p[0], "r" );
+}
+
+int
+hpm_log_close(FILE *fp, pid_t pid) {
+    int status = 0;
+
+    fclose( fp );
+    if (pid > 0) {
+        waitpid( pid, &status, 0 );
+        return !WIFEXITED(status) || WEXITSTATUS(status);
+    }
+    return 0;
+}
+
+/* " C1 F1 V1 V2" -> devices state bits; stops at the first word that is not a device */
+static char *
+parse_devices(char *p, unsigned short *bits) {
+    int a;
+
+    *bits = 0;
+    while (1) {
+        while (*p == ' ') p++;
+        if (((*p != 'C') && (*p != 'F') && (*p != 'V')) || !isdigit((unsigned char)p[1])) break;
+        a = p[1] - '0';
+        if ((a < 1) || (a > MAXUNITS)) break;
+        if (*p == 'C') *bits |= BIT_CMP(a);
+        if (*p == 'F') *bits |= BIT_FAN(a);
+        if (*p == 'V') *bits |= BIT_FV(a);
+        p += 2;
+    }
+    return p;
+}
+
+int
+hpm_log_parse(char *p, struct hpm_log_line *d) {
+    char *e;
+    int u, k;
+
+    memset( d, 0, sizeof(*d) );
+    for (u=0; u<MAXUNITS; u++) {
+        while (*p == ' ') p++;
+        if ((p[0] != 'A') || (p[1] != 'C') || (p[2] != '1'+u) || (p[3] != ':')) break;
+        p += 4;
+        d->in.Tcmp[u] = strtod( p, &e ); if ((e == p) || (*e != ',')) return -1; p = e+1;
+        d->in.Tcnd[u] = strtod( p, &e ); if ((e == p) || (*e != ',')) return -1; p = e+1;
+        strtod( p, &e ); if ((e == p) || (*e != ',')) return -1; p = e+1;
+        strtod( p, &e ); if ((e == p) || (*e != ';')) return -1; p = e+1;
+    }
+    if (!u) return -1;
+    d->units = u;
+    /* water in, water out and the average environment temp */
+    strtod( p, &e ); if ((e == p) || (*e != ',')) return -1; p = e+1;
+    strtod( p, &e ); if ((e == p) || (*e != ',')) return -1; p = e+1;
+    d->in.TenvAvrg = strtod( p, &e ); if (e == p) return -1; p = e;
+    while (*p == ' ') p++;
+    if (*p == 'H') d->in.HPmode = HEAT;
+    else if (*p == 'C') d->in.HPmode = COOL;
+    else return -1;
+    p++;
+    for (u=0; u<d->units; u++) {
+        while (*p == ' ') p++;
+        if ((p[0] != 'M') || (p[1] != '1'+u) || (p[2] != ':')) return -1;
+        p += 3;
+        for (k=0; k<6; k++) if (!strncmp( p, hpm_log_mode_names[k], 9 )) break;
+        if (k == 6) return -1;
+        d->mode[u] = k;
+        p += 9;
+        if (*p != '(') return -1;
+        d->Smode[u] = strtoul( p+1, &e, 10 );
+        if (*e != ')') return -1;
+        p = e+1;
+    }
+    while (*p == ' ') p++;
+    if (!strncmp( p, "WANTED:", 7 )) p = parse_devices( p+7, &d->wanted );
+    else if (!strncmp( p, "idle", 4 )) p += 4;
+    else return -1;
+    while (*p == ' ') p++;
+    if (!strncmp( p, "got:", 4 )) p = parse_devices( p+4, &d->actual );
+    /* the DIFF part is worked out from the two above */
+    e = strstr( p, "COMMS:" );
+    if (e == NULL) return -1;
+    if (sscanf( e, "COMMS:%hu sendBits:%hu", &d->in.COMMS, &d->sendBits ) != 2) return -1;
+    e = strstr( e, "power:" );
+    d->in.cmd = (e != NULL);
+    if (d->in.cmd && (sscanf( e, "power:%hu avoid:%hu", &d->in.power, &d->in.avoid ) != 2)) return -1;
+    e = strstr( p, "skipped:" );
+    if (e && (sscanf( e, "skipped:%lu", &d->skipped ) != 1)) return -1;
+    return 0;
+}
+
+/* the day start is only worked out when the day changes - mktime() is slow */
+time_t
+hpm_log_time(struct hpm_log_clock *c, const char *s) {
+    struct tm tm;
+    int h, m, sec;
+
+    if (sscanf( s+11, "%2d:%2d:%2d", &h, &m, &sec ) != 3) return 0;
+    if (strncmp( s, c->day, 10 )) {
+        memset( &tm, 0, sizeof(tm) );
+        if (sscanf( s, "%4d-%2d-%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday ) != 3) return 0;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        c->day_start = mktime( &tm );
+        memcpy( c->day, s, 10 );
+    }
+    return c->day_start + h*3600 + m*60 + sec;
+}
+
+void
+hpm_log_devices(char *s, unsigned short bits, int units) {
+    int u;
+
+    s[0] = 0;
+    for (u=1;u<=units;u++) {
+        if (bits & BIT_CMP(u)) sprintf( s + strlen(s), " C%d", u );
+        if (bits & BIT_FAN(u)) sprintf( s + strlen(s), " F%d", u );
+        if (bits & BIT_FV(u)) sprintf( s + strlen(s), " V%d", u );
+    }
+    if (!s[0]) strcpy( s, " none" );
+}
+
+/* EOF */
@@ -0,0 +1,80 @@
+/*
+* hpm_log.h
+*
+* Reading hpm data logs back, for the tools that re-run recorded history through the
+* control core.
+* Plamen Petrov
+*
+* A data line is what LogData() in hpm.c writes every cycle: the compressor and fin stack
+* temps, average environment temp, HPmode, the AC modes, the wanted and actual devices
+* state, COMMS and sendBits, and what hwwm asked for over the command socket if it did -
+* after the "YYYY-MM-DD HH:MM:SS " timestamp. A line of "***" instead marks a daemon start.
+* Over its SD card write budget hpm leaves out lines with nothing but the temps changed;
+* the next line then ends with "skipped:<cycles>" - the cycles left out went with the
+* line before's decisions and COMMS, at temps not known.
+*/
+
+#ifndef HPM_LOG_H
+#define HPM_LOG_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "hpm_core.h"
+
+/* length of the timestamp a log line starts with, with the space after it */
+#define LOG_STAMP_LEN        20
+
+/* the temps are logged with one decimal */
+#define LOG_ROUNDING         0.05
+
+/* AC modes as logged by hpm, 9 characters each */
+extern const char *hpm_log_mode_names[6];
+
+/* One data line */
+struct hpm_log_line
+{
+    int             units;
+    struct hpm_inputs in;
+    short           mode[MAXUNITS];
+    unsigned long   Smode[MAXUNITS];
+    unsigned short  wanted;
+    unsigned short  actual;
+    unsigned short  sendBits;
+    unsigned long   skipped;        /* cycles left out of the log right before this line */
+};
+
+/* The day the last timestamp was on, so the day start is only worked out when the day
+   changes - one per reader */
+struct hpm_log_clock
+{
+    char            day[11];
+    time_t          day_start;
+};
+
+/* open a log for reading; .gz ones are read through gzip, and *pid is set to its pid */
+FILE *
+hpm_log_open(const char *file, pid_t *pid);
+
+/* close a log opened with hpm_log_open(); returns non-zero if gzip failed */
+int
+hpm_log_close(FILE *fp, pid_t pid);
+
+/* parse the part of a data line after the timestamp; returns 0 on success, -1 if it is
+   not a data line */
+int
+hpm_log_parse(char *p, struct hpm_log_line *d);
+
+/* the line timestamp in local time; 0 if there is none. This is the wall clock time of
+   the day, which is what the gaps between the lines are checked with */
+time_t
+hpm_log_time(struct hpm_log_clock *c, const char *s);
+
+/* " C1 F1 V1 V2" from devices state bits, " none" if there are none */
+void
+hpm_log_devices(char *s, unsigned short bits, int units);
+
+#endif
+
+/* EOF */
@@ -0,0 +1,298 @@
+/*
+* hpm_sim.c
+*
+* hpm plant simulator - a lumped thermal model of what hpm controls, driven by the real
+* control core.
+* Plamen Petrov
+*
+* See hpm_sim.h for what is modelled, and how.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include "hpm_sim.h"
+
+/* Heat to melt a kg of ice, kJ */
+#define ICE_MELT_HEAT        334
+
+/* the simulation parameters hpm_sim_set() knows, by name */
+static const struct {
+    const char  *name;
+    size_t       offset;
+} sim_floats[] = {
+    { "tout_mean",          offsetof(struct hpm_sim_params, tout_mean) },
+    { "tout_season_depth",  offsetof(struct hpm_sim_params, tout_season_depth) },
+    { "tout_season_days",   offsetof(struct hpm_sim_params, tout_season_days) },
+    { "tout_daily_swing",   offsetof(struct hpm_sim_params, tout_daily_swing) },
+    { "tout_step",          offsetof(struct hpm_sim_params, tout_step) },
+    { "humidity",           offsetof(struct hpm_sim_params, humidity) },
+    { "cmp_rise_fan",       offsetof(struct hpm_sim_params, cmp_rise_fan) },
+    { "cmp_rise_nofan",     offsetof(struct hpm_sim_params, cmp_rise_nofan) },
+    { "cmp_rise_reverse",   offsetof(struct hpm_sim_params, cmp_rise_reverse) },
+    { "cmp_tau_on",         offsetof(struct hpm_sim_params, cmp_tau_on) },
+    { "cmp_tau_off",        offsetof(struct hpm_sim_params, cmp_tau_off) },
+    { "cnd_drop_fan",       offsetof(struct hpm_sim_params, cnd_drop_fan) },
+    { "cnd_drop_nofan",     offsetof(struct hpm_sim_params, cnd_drop_nofan) },
+    { "cnd_rise_reverse",   offsetof(struct hpm_sim_params, cnd_rise_reverse) },
+    { "cnd_tau",            offsetof(struct hpm_sim_params, cnd_tau) },
+    { "cnd_capacity",       offsetof(struct hpm_sim_params, cnd_capacity) },
+    { "ice_rate",           offsetof(struct hpm_sim_params, ice_rate) },
+    { "ice_max",            offsetof(struct hpm_sim_params, ice_max) },
+    { "ice_drop",           offsetof(struct hpm_sim_params, ice_drop) },
+    { "ice_penalty",        offsetof(struct hpm_sim_params, ice_penalty) },
+    { "heat_nominal",       offsetof(struct hpm_sim_params, heat_nominal) },
+    { "heat_slope",         offsetof(struct hpm_sim_params, heat_slope) },
+    { "heat_nofan",         offsetof(struct hpm_sim_params, heat_nofan) },
+    { "heat_reverse",       offsetof(struct hpm_sim_params, heat_reverse) },
+    { "plate_capacity",     offsetof(struct hpm_sim_params, plate_capacity) },
+    { "plate_ua",           offsetof(struct hpm_sim_params, plate_ua) },
+    { "water_capacity",     offsetof(struct hpm_sim_params, water_capacity) },
+    { "radiators_ua",       offsetof(struct hpm_sim_params, radiators_ua) },
+    { "house_capacity",     offsetof(struct hpm_sim_params, house_capacity) },
+    { "house_ua",           offsetof(struct hpm_sim_params, house_ua) },
+    { "water_set",          offsetof(struct hpm_sim_params, water_set) },
+    { "water_hyst",         offsetof(struct hpm_sim_params, water_hyst) },
+    { "water_band",         offsetof(struct hpm_sim_params, water_band) },
+    { "hot_temp",           offsetof(struct hpm_sim_params, hot_temp) },
+    { "tenv_window",        offsetof(struct hpm_sim_params, tenv_window) },
+};
+
+void
+hpm_sim_params_default(struct hpm_sim_params *sp) {
+    memset( sp, 0, sizeof(*sp) );
+    /* a winter going from 8 C down to -4 C and back up, in 4 months */
+    sp->tout_mean = 8;
+    sp->tout_season_depth = 12;
+    sp->tout_season_days = 120;
+    sp->tout_daily_swing = 4;
+    sp->tout_step = 1;
+    sp->humidity = 0.85;
+    sp->cmp_rise_fan = 52;
+    sp->cmp_rise_nofan = 30;
+    sp->cmp_rise_reverse = 50;
+    sp->cmp_tau_on = 900;
+    sp->cmp_tau_off = 1800;
+    sp->cnd_drop_fan = 5;
+    sp->cnd_drop_nofan = 16;
+    sp->cnd_rise_reverse = 45;
+    sp->cnd_tau = 60;
+    sp->cnd_capacity = 8;
+    sp->ice_rate = 0.0015;
+    sp->ice_max = 4;
+    sp->ice_drop = 10;
+    sp->ice_penalty = 0.5;
+    sp->heat_nominal = 8;
+    sp->heat_slope = 0.12;
+    sp->heat_nofan = 0.5;
+    sp->heat_reverse = 3;
+    sp->plate_capacity = 15;
+    sp->plate_ua = 1.5;
+    sp->water_capacity = 1500;
+    sp->radiators_ua = 0.4;
+    sp->house_capacity = 30000;
+    sp->house_ua = 0.25;
+    sp->water_set = 40;
+    sp->water_hyst = 2;
+    sp->water_band = 5;
+    sp->hot_temp = 60;
+    sp->tenv_window = 60;
+}
+
+/* value as a number, all of it */
+static int
+sim_number(const char *value, double *d) {
+    char *end;
+
+    *d = strtod( value, &end );
+    if ((end == value) || *end) return -1;
+    return 0;
+}
+
+int
+hpm_sim_set(struct hpm_sim_params *sp, struct hpm_params *cp, const char *name, const char *value) {
+    double d;
+    size_t i;
+
+    for (i=0;i<sizeof(sim_floats)/sizeof(sim_floats[0]);i++) {
+        if (strcmp(name, sim_floats[i].name)) continue;
+        if (sim_number( value, &d )) return -1;
+        *(float *)((char *)sp + sim_floats[i].offset) = d;
+        return 0;
+    }
+    if (strcmp(name, "start_hour")==0) {
+        if (sim_number( value, &d ) || (d < 0)) return -1;
+        sp->start_hour = d;
+        return 0;
+    }
+
+    return hpm_params_set( cp, name, value );
+}
+
+float
+hpm_sim_tout(const struct hpm_sim_params *sp, unsigned long cycle) {
+    double hours = sp->start_hour + (double)cycle * SIM_CYCLE_SECONDS / 3600;
+    double day, pos;
+    unsigned long i;
+
+    if (sp->tout_points && sp->tout_n) {
+        pos = hours / sp->tout_step;
+        i = (unsigned long)pos;
+        pos -= i;
+        return sp->tout_points[i % sp->tout_n] * (1 - pos) + sp->tout_points[(i+1) % sp->tout_n] * pos;
+    }
+    day = fmod( hours / 24, sp->tout_season_days );
+    return sp->tout_mean - sp->tout_season_depth * sin( M_PI * day / sp->tout_season_days )
+        - sp->tout_daily_swing * cos( 2 * M_PI * (fmod( hours, 24 ) - 5) / 24 );
+}
+
+void
+hpm_sim_init(struct hpm_sim *sim, const struct hpm_sim_params *sp, const struct hpm_params *cp) {
+    float t = hpm_sim_tout( sp, 0 );
+    int u;
+
+    memset( sim, 0, sizeof(*sim) );
+    sim->sp = sp;
+    sim->cp = cp;
+    hpm_state_init( &sim->state );
+    hpm_check_init( &sim->check, &sim->state );
+    for (u=0;u<MAXUNITS;u++) {
+        sim->unit[u].Tcmp = t;
+        sim->unit[u].Tcnd = t;
+        sim->unit[u].Tplate = sp->water_set;
+    }
+    hpm_stats_init( &sim->Tenv, sp->tenv_window / SIM_CYCLE_SECONDS );
+    hpm_stats_fill( &sim->Tenv, t );
+    sim->in.TenvAvrg = t;
+    sim->in.HPmode = HEAT;
+    sim->Tout = t;
+    sim->Twater = sp->water_set;
+    sim->Thouse = 20;
+    sim->Twater_min = sim->Twater;
+    sim->Thouse_min = sim->Thouse;
+    sim->k_cmp_on = 1 - exp( -SIM_CYCLE_SECONDS / sp->cmp_tau_on );
+    sim->k_cmp_off = 1 - exp( -SIM_CYCLE_SECONDS / sp->cmp_tau_off );
+    sim->k_cnd = 1 - exp( -SIM_CYCLE_SECONDS / sp->cnd_tau );
+}
+
+/* the hwwm stand-in: what to ask hpm for, by the water loop temp */
+static unsigned short
+sim_comms(const struct hpm_sim *sim) {
+    const struct hpm_sim_params *sp = sim->sp;
+    unsigned short c = sim->in.COMMS;
+
+    if (sim->Twater > sp->water_set + sp->water_hyst) c = 0;
+    else if ((c == 2) && (sim->Twater > sp->water_set)) c = 1;
+    else if ((c < 2) && (sim->Twater < sp->water_set - sp->water_band)) c = 2;
+    else if ((c == 0) && (sim->Twater < sp->water_set - sp->water_hyst)) c = 1;
+    return c;
+}
+
+/* one cycle of AC u, with the devices as the control left them; returns the heat flow
+   from its plates heat exchanger to the water, kW */
+static float
+sim_unit(struct hpm_sim *sim, int u) {
+    const struct hpm_sim_params *sp = sim->sp;
+    const struct hpm_unit *U = &sim->state.unit[u];
+    struct hpm_sim_unit *P = &sim->unit[u];
+    float iced = P->ice / sp->ice_max;
+    float cmp_eq = sim->Tout;
+    float cnd_eq = sim->Tout;
+    float k_cmp = sim->k_cmp_off;
+    float q = 0;
+    float flow;
+
+    if (U->cmp) {
+        k_cmp = sim->k_cmp_on;
+        if (U->fv) { /* heating */
+            cmp_eq += U->fan ? sp->cmp_rise_fan : sp->cmp_rise_nofan;
+            cnd_eq -= (U->fan ? sp->cnd_drop_fan : sp->cnd_drop_nofan) + iced * sp->ice_drop;
+            q = (sp->heat_nominal + sp->heat_slope * (sim->Tout - 7)) * (1 - iced * sp->ice_penalty);
+            if (!U->fan) q *= sp->heat_nofan;
+            if (q < 0) q = 0;
+            if (U->fan && (P->Tcnd < 0)) {
+                P->ice += sp->ice_rate * sp->humidity * SIM_CYCLE_SECONDS;
+                if (P->ice > sp->ice_max) P->ice = sp->ice_max;
+            }
+        }
+        else { /* running reversed - cooling, or defrost */
+            cmp_eq += sp->cmp_rise_reverse;
+            cnd_eq += sp->cnd_rise_reverse;
+            q = -sp->heat_reverse;
+        }
+    }
+    P->Tcmp += (cmp_eq - P->Tcmp) * k_cmp;
+    if (P->Tcmp > sp->hot_temp) P->hot_cycles++;
+    P->Tcnd += (cnd_eq - P->Tcnd) * sim->k_cnd;
+    /* the ice melts at 0 C, and keeps the fin stack there until it is gone */
+    if ((P->ice > 0) && (P->Tcnd > 0)) {
+        P->ice -= P->Tcnd * sp->cnd_capacity / ICE_MELT_HEAT;
+        P->Tcnd = 0;
+        if (P->ice < 0) {
+            P->Tcnd = -P->ice * ICE_MELT_HEAT / sp->cnd_capacity;
+            P->ice = 0;
+        }
+    }
+    flow = sp->plate_ua * (P->Tplate - sim->Twater);
+    P->Tplate += (q - flow) * SIM_CYCLE_SECONDS / sp->plate_capacity;
+    if (flow > 0) P->heat += flow * SIM_CYCLE_SECONDS;
+    else P->heat_back -= flow * SIM_CYCLE_SECONDS;
+    return flow;
+}
+
+void
+hpm_sim_inputs(struct hpm_sim *sim) {
+    int u;
+
+    sim->Tout = hpm_sim_tout( sim->sp, sim->cycles );
+
+    /* the inputs, as hpm would have them */
+    hpm_stats_add( &sim->Tenv, sim->Tout );
+    sim->in.TenvAvrg = sim->Tenv.mean;
+    sim->in.HPmode = (sim->in.TenvAvrg > 25.5) ? COOL : HEAT;
+    sim->in.COMMS = sim_comms( sim );
+    for (u=0;u<MAXUNITS;u++) {
+        sim->in.Tcmp[u] = sim->unit[u].Tcmp;
+        sim->in.Tcnd[u] = sim->unit[u].Tcnd;
+    }
+}
+
+void
+hpm_sim_plant(struct hpm_sim *sim) {
+    const struct hpm_sim_params *sp = sim->sp;
+    float flow = 0;
+    float rad;
+    int u, k;
+
+    for (k=0;k<TOTALCOUNTERS;k++) sim->counters[k] += sim->out.events[k];
+
+    /* the plant, with the devices as the control left them */
+    for (u=0;u<sim->cp->units;u++) flow += sim_unit( sim, u );
+    rad = sp->radiators_ua * (sim->Twater - sim->Thouse);
+    sim->Twater += (flow - rad) * SIM_CYCLE_SECONDS / sp->water_capacity;
+    sim->Thouse += (rad - sp->house_ua * (sim->Thouse - sim->Tout)) * SIM_CYCLE_SECONDS / sp->house_capacity;
+
+    sim->comms_cycles[sim->in.COMMS & 3]++;
+    if (sim->Twater < sp->water_set - sp->water_band) sim->cold_cycles++;
+    if (sim->Twater < sim->Twater_min) sim->Twater_min = sim->Twater;
+    if (sim->Thouse < sim->Thouse_min) sim->Thouse_min = sim->Thouse;
+    sim->Twater_sum += sim->Twater;
+    sim->Thouse_sum += sim->Thouse;
+    sim->Tout_sum += sim->Tout;
+    sim->cycles++;
+}
+
+int
+hpm_sim_step(struct hpm_sim *sim) {
+    int broken;
+
+    hpm_sim_inputs( sim );
+    hpm_step( &sim->state, &sim->in, sim->cp, &sim->out );
+    broken = hpm_check( &sim->check, &sim->state, &sim->in, sim->cp, &sim->out );
+    hpm_sim_plant( sim );
+    return broken;
+}
+
+/* EOF */
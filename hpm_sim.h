@@ -0,0 +1,170 @@
+/*
+* hpm_sim.h
+*
+* hpm plant simulator - a lumped thermal model of what hpm controls, driven by the real
+* control core.
+* Plamen Petrov
+*
+* Every part of the plant is a single thermal mass: the compressor and the fin stack of
+* every AC outdoor unit, its brazed plates heat exchanger, the water loop and the house it
+* heats. The fin stacks ice up while heating in the cold, and the ice has to be melted by a
+* defrost. A simple hwwm stand-in asks for one or all ACs by the water loop temperature.
+* One control cycle of 5 seconds is a handful of additions and multiplications, so a whole
+* season runs in seconds.
+*
+* The numbers are nowhere near an exact model of a real heat pump - they only need to make
+* the control go through the same situations as the real thing. All of them can be changed
+* by name with hpm_sim_set(), which takes the hpm.cfg control settings as well.
+*
+* Like the control core, nothing here does I/O, and all of a simulation's state is in its
+* struct hpm_sim, so any number of simulations can be run side by side.
+*/
+
+#ifndef HPM_SIM_H
+#define HPM_SIM_H
+
+#include "hpm_core.h"
+#include "hpm_stats.h"
+
+/* Seconds per simulated control cycle */
+#define SIM_CYCLE_SECONDS    HPM_CYCLE_SECONDS
+
+/* Plant and climate parameters; temperatures in C, time constants in seconds, heat in kW,
+   heat capacities in kJ/K, ice in kg */
+struct hpm_sim_params
+{
+    /* outdoor temperature: the mean, lowered by up to season_depth in the middle of a
+       season of season_days, swinging daily by daily_swing around it - coldest at 5 in
+       the morning */
+    float           tout_mean;
+    float           tout_season_depth;
+    float           tout_season_days;
+    float           tout_daily_swing;
+    /* ...or a recorded profile instead: tout_points temps, tout_step hours apart, repeated */
+    const float    *tout_points;
+    unsigned long   tout_n;
+    float           tout_step;
+    float           humidity;           /* relative air humidity 0..1, the fin stacks ice up quicker with more */
+    unsigned long   start_hour;         /* hour of the day the simulation starts at */
+    /* compressor: settles this much above outdoor temp while running - heating with the
+       fan on, heating with the fan off, and with the fourway valve reversed */
+    float           cmp_rise_fan;
+    float           cmp_rise_nofan;
+    float           cmp_rise_reverse;
+    float           cmp_tau_on;
+    float           cmp_tau_off;
+    /* fin stack: settles this much below outdoor temp while heating, with the fan on and
+       off, and this much above it with the fourway valve reversed */
+    float           cnd_drop_fan;
+    float           cnd_drop_nofan;
+    float           cnd_rise_reverse;
+    float           cnd_tau;
+    float           cnd_capacity;
+    /* ice on the fin stack: grows at ice_rate kg/s at full humidity while heating with the
+       fan on and the fin stack below 0 C, up to ice_max; a fully iced fin stack is ice_drop
+       C colder, and gives ice_penalty less heat. The ice melts at 0 C: while there is some,
+       the heat that would warm the fin stack above 0 C goes into melting it */
+    float           ice_rate;
+    float           ice_max;
+    float           ice_drop;
+    float           ice_penalty;
+    /* heat given to the plates heat exchanger by a running AC at 7 C outside, and its
+       change per C of outdoor temp; the part of it left with the fan off; and the heat
+       taken back from the water while running reversed */
+    float           heat_nominal;
+    float           heat_slope;
+    float           heat_nofan;
+    float           heat_reverse;
+    /* plates heat exchanger, water loop, radiators and house */
+    float           plate_capacity;
+    float           plate_ua;
+    float           water_capacity;
+    float           radiators_ua;
+    float           house_capacity;
+    float           house_ua;
+    /* the hwwm stand-in: asks for one AC below water_set - water_hyst, for all of them
+       below water_set - water_band, goes back to one AC above water_set, and stops them
+       all above water_set + water_hyst */
+    float           water_set;
+    float           water_hyst;
+    float           water_band;
+    float           hot_temp;           /* the time compressors are hotter than this is counted */
+    float           tenv_window;        /* seconds the environment temp is averaged over, as in hpm.cfg */
+};
+
+/* One AC outdoor unit plant state */
+struct hpm_sim_unit
+{
+    float           Tcmp;
+    float           Tcnd;
+    float           Tplate;
+    float           ice;
+    double          heat;               /* kJ given to the water, and taken back from it */
+    double          heat_back;
+    unsigned long   hot_cycles;         /* cycles the compressor was hotter than hot_temp */
+};
+
+/* A simulation */
+struct hpm_sim
+{
+    const struct hpm_sim_params  *sp;
+    const struct hpm_params      *cp;
+    struct hpm_state    state;          /* the control core's own */
+    struct hpm_inputs   in;
+    struct hpm_outputs  out;            /* of the last cycle */
+    struct hpm_check    check;          /* the safety rules checker, see hpm_core.h */
+    struct hpm_sim_unit unit[MAXUNITS];
+    float           Tout;
+    float           Twater;
+    float           Thouse;
+    struct hpm_stats Tenv;              /* environment temp average, as hpm does it */
+    unsigned long   cycles;
+    /* the time constants as per cycle factors, worked out once */
+    float           k_cmp_on;
+    float           k_cmp_off;
+    float           k_cnd;
+    /* totals */
+    unsigned long   counters[TOTALCOUNTERS];   /* control core events */
+    unsigned long   comms_cycles[4];           /* cycles hwwm asked for each COMMS value */
+    unsigned long   cold_cycles;               /* cycles the water was below water_set - water_band */
+    double          Twater_sum;
+    double          Thouse_sum;
+    double          Tout_sum;
+    float           Twater_min;
+    float           Thouse_min;
+};
+
+void
+hpm_sim_params_default(struct hpm_sim_params *sp);
+
+/* set a simulation parameter, or a control parameter as hpm_params_set() does, by name;
+   returns 0 if set, 1 if the name is not one of these, -1 if the value is not valid */
+int
+hpm_sim_set(struct hpm_sim_params *sp, struct hpm_params *cp, const char *name, const char *value);
+
+/* start a simulation of the given plant and control parameters, which must stay in place
+   while it runs: the ACs at outdoor temp, the water at its set temp and the house at 20 C */
+void
+hpm_sim_init(struct hpm_sim *sim, const struct hpm_sim_params *sp, const struct hpm_params *cp);
+
+/* run one control cycle; returns the number of ACs that broke a safety rule in it, with
+   the rules in sim->check.broken[] - a simulation must not go on after that */
+int
+hpm_sim_step(struct hpm_sim *sim);
+
+/* the two halves of hpm_sim_step(), for driving the plant with a control other than the
+   one linked in: the cycle's inputs into sim->in, and then - with sim->state and
+   sim->out as the control left them - the plant's response */
+void
+hpm_sim_inputs(struct hpm_sim *sim);
+
+void
+hpm_sim_plant(struct hpm_sim *sim);
+
+/* outdoor temp at the given simulation cycle */
+float
+hpm_sim_tout(const struct hpm_sim_params *sp, unsigned long cycle);
+
+#endif
+
+/* EOF */
@@ -0,0 +1,103 @@
+/*
+* hpm_stats.c
+*
+* Rolling window statistics of a series of samples.
+* Plamen Petrov
+*
+* See hpm_stats.h for how it is meant to be used.
+*/
+
+#include <string.h>
+#include "hpm_stats.h"
+
+void
+hpm_stats_init(struct hpm_stats *st, unsigned short len) {
+    memset( st, 0, sizeof(*st) );
+    if (len < 1) len = 1;
+    if (len > STATS_MAXWINDOW) len = STATS_MAXWINDOW;
+    st->len = len;
+}
+
+void
+hpm_stats_fill(struct hpm_stats *st, float x) {
+    unsigned short k;
+
+    hpm_stats_init( st, st->len );
+    for (k=0;k<st->len;k++) hpm_stats_add( st, x );
+}
+
+float
+hpm_stats_sample(const struct hpm_stats *st, unsigned short k) {
+    return st->v[(st->head + k) % st->len];
+}
+
+/* the sums, worked out from scratch */
+static void
+stats_resum(struct hpm_stats *st) {
+    double x;
+    unsigned short k;
+
+    st->sum = st->sum2 = st->sumxy = 0;
+    for (k=0;k<st->n;k++) {
+        x = hpm_stats_sample( st, k );
+        st->sum += x;
+        st->sum2 += x * x;
+        st->sumxy += x * k;
+    }
+    st->fresh = 0;
+}
+
+void
+hpm_stats_add(struct hpm_stats *st, float x) {
+    unsigned short len = st->len;
+    unsigned short slot;
+    double old, n, sxx;
+
+    if (st->n == len) {
+        /* the oldest sample leaves the window, and the others move a place down */
+        slot = st->head;
+        old = st->v[slot];
+        if (st->minqn && (st->minq[st->minqh] == slot)) {
+            st->minqh = (st->minqh + 1) % len;
+            st->minqn--;
+        }
+        if (st->maxqn && (st->maxq[st->maxqh] == slot)) {
+            st->maxqh = (st->maxqh + 1) % len;
+            st->maxqn--;
+        }
+        st->sum -= old;
+        st->sum2 -= old * old;
+        st->sumxy -= st->sum;
+        st->head = (st->head + 1) % len;
+        st->n--;
+    }
+    else slot = (st->head + st->n) % len;
+
+    st->v[slot] = x;
+    st->sumxy += (double)x * st->n;
+    st->sum += x;
+    st->sum2 += (double)x * x;
+    st->n++;
+    /* a new sample puts the ones before it out of the running for the minimum, if they
+       are not below it - and for the maximum, if they are not above it */
+    while (st->minqn && (st->v[st->minq[(st->minqh + st->minqn - 1) % len]] >= x)) st->minqn--;
+    st->minq[(st->minqh + st->minqn) % len] = slot;
+    st->minqn++;
+    while (st->maxqn && (st->v[st->maxq[(st->maxqh + st->maxqn - 1) % len]] <= x)) st->maxqn--;
+    st->maxq[(st->maxqh + st->maxqn) % len] = slot;
+    st->maxqn++;
+    if (++st->fresh >= len) stats_resum( st );
+
+    n = st->n;
+    st->mean = st->sum / n;
+    st->min = st->v[st->minq[st->minqh]];
+    st->max = st->v[st->maxq[st->maxqh]];
+    st->var = st->sum2 / n - (st->sum / n) * (st->sum / n);
+    if (st->var < 0) st->var = 0;
+    /* the places in the window are 0..n-1, so their mean is (n-1)/2 and the sum of their
+       squared differences from it n(n*n-1)/12 */
+    sxx = n * (n * n - 1) / 12;
+    st->slope = (n > 1) ? (st->sumxy - st->sum * (n - 1) / 2) / sxx : 0;
+}
+
+/* EOF */
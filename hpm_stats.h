@@ -0,0 +1,64 @@
+/*
+* hpm_stats.h
+*
+* Rolling window statistics of a series of samples - a sensor's readings, one per cycle:
+* mean, minimum, maximum, variance and trend over the last so many samples.
+* Plamen Petrov
+*
+* Adding a sample is O(1) whatever the window length: the sums the mean, variance and
+* trend come from are kept up to date as samples come in and leave the window, and the
+* minimum and maximum come from queues of the samples that can still become one. The sums
+* are worked out from scratch once every window length samples, so rounding errors do not
+* pile up - which keeps adding O(1) on average. The statistics are worked out on every
+* sample added, so they are there to read in the struct, with nothing more to call.
+*/
+
+#ifndef HPM_STATS_H
+#define HPM_STATS_H
+
+/* Longest window - an hour of 5 second cycles */
+#define STATS_MAXWINDOW      720
+
+struct hpm_stats
+{
+    unsigned short  len;                    /* window length, in samples */
+    unsigned short  n;                      /* samples in the window - len, once it filled up */
+    unsigned short  head;                   /* slot of the oldest sample */
+    unsigned short  fresh;                  /* samples added since the sums were worked out from scratch */
+    double          sum;                    /* of the samples, */
+    double          sum2;                   /* their squares, */
+    double          sumxy;                  /* and of every sample by its place in the window, 0 the oldest */
+    /* slots of the samples which can still become the minimum (rising values) and the
+       maximum (falling values), oldest first, as queues starting at qh */
+    unsigned short  minq[STATS_MAXWINDOW];
+    unsigned short  maxq[STATS_MAXWINDOW];
+    unsigned short  minqh, minqn;
+    unsigned short  maxqh, maxqn;
+    float           v[STATS_MAXWINDOW];
+    /* the statistics of the window, as of the last sample added */
+    float           mean;
+    float           min;
+    float           max;
+    float           var;                    /* population variance */
+    float           slope;                  /* least squares trend, per sample */
+};
+
+/* start an empty window of len samples, 1..STATS_MAXWINDOW */
+void
+hpm_stats_init(struct hpm_stats *st, unsigned short len);
+
+/* start the window over, full of samples of value x */
+void
+hpm_stats_fill(struct hpm_stats *st, float x);
+
+/* add a sample; the oldest one leaves the window, if it is full */
+void
+hpm_stats_add(struct hpm_stats *st, float x);
+
+/* sample k of the window, 0 the oldest */
+float
+hpm_stats_sample(const struct hpm_stats *st, unsigned short k);
+
+#endif
+
+/* EOF */
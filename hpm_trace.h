@@ -0,0 +1,44 @@
+/*
+* hpm_trace.h
+*
+* Static tracepoints (USDT) at hpm's decision and I/O points, to see what hpm does on the
+* Pi with bpftrace, instead of strace slowing every system call down.
+* Plamen Petrov
+*
+* They are only built in with HPM_USDT defined - build.sh does so when sys/sdt.h is there,
+* from the systemtap-sdt-dev package - and even then a tracepoint is a single nop, with its
+* arguments left where they already are, until a tracer attaches to it. Without HPM_USDT
+* they are not there at all.
+*
+* Provider hpm, tracepoints and their arguments:
+*   cycle_start(cycle), cycle_end(cycle)
+*   sensor_read_start(path), sensor_read_end(path, temp in 1/1000 C - -200000 on errors)
+*   gpio_read(pin, value), gpio_write(pin, value, result)
+*   mode_change(AC, old mode, new mode)
+*   cmp_on_denied(AC, reason)   1 - not to be used or too hot, 2 - running or within its
+*                               minimum OFF time, 3 - another AC started too recently
+*   cmp_off_denied(AC, reason)  1 - not running, 2 - within its minimum ON time
+*   fv_denied(AC, reason)       1 - compressor running, 2 - compressor stopped too recently
+*   log_write(file, message)
+* The Can*() checks are also asked while picking which AC to start or stop and for the
+* sendBits answer, so a denial is not always a decision that went the other way. Example
+* bpftrace scripts are in scripts/bpftrace.
+*/
+
+#ifndef HPM_TRACE_H
+#define HPM_TRACE_H
+
+#ifdef HPM_USDT
+#include <sys/sdt.h>
+#define HPM_TRACE1(name, a)         DTRACE_PROBE1(hpm, name, a)
+#define HPM_TRACE2(name, a, b)      DTRACE_PROBE2(hpm, name, a, b)
+#define HPM_TRACE3(name, a, b, c)   DTRACE_PROBE3(hpm, name, a, b, c)
+#else
+#define HPM_TRACE1(name, a)         do { } while (0)
+#define HPM_TRACE2(name, a, b)      do { } while (0)
+#define HPM_TRACE3(name, a, b, c)   do { } while (0)
+#endif
+
+#endif
+
+/* EOF */
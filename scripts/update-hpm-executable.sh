@@ -5,6 +5,16 @@ daemon_backup=hpm_backup
 daemon_pid=/run/$daemon.pid
 log_file=/run/shm/$daemon.log
 
+# monit checks hpm with hpm-alive, so both go in or neither
+for f in /home/pi/$daemon/$daemon /home/pi/$daemon/tools/$daemon-alive
+do
+    if [ ! -x $f ]
+    then
+        echo "ERROR: $f is missing - run ./build.sh first! Nothing replaced."
+        exit 1
+    fi
+done
+
 echo "Trying to kill running daemon $daemon..."
 if [ ! -e $daemon_pid ]
 then
@@ -17,6 +27,7 @@ sleep 1
 /etc/cron.hourly/move-hpm-log
 echo "Replacing /usr/sbin/$daemon with the one from /home/pi/$daemon..."
 cp /home/pi/$daemon/$daemon /usr/sbin
+cp /home/pi/$daemon/tools/$daemon-alive /usr/sbin
 echo "Replacing $daemon-reload and $daemon-restart in /usr/sbin with ones from /home/pi/$daemon/scripts/..."
 cp /home/pi/$daemon/scripts/$daemon-reload /usr/sbin
 cp /home/pi/$daemon/scripts/$daemon-restart /usr/sbin
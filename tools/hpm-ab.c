@@ -0,0 +1,638 @@
+/*
+* hpm-ab.c
+*
+* Runs two builds of the hpm control core side by side over the same inputs, and reports
+* every cycle they decide differently in - so what a new build changes is known before it
+* goes on the Pi.
+* Plamen Petrov
+*
+* Usage: hpm-ab [-j threads] [-c config file] [-s name=value]... [-m max diffs] [-q]
+*               [-d days] [-p outdoor temps file] A.so B.so [data log]...
+*
+*   A.so, B.so  the two control cores: hpm_core.so, as "./build.sh tools" makes it, of
+*       the running build (A) and of the new one (B); both must be of this ABI version
+*   -j  shards worked on at a time, one per CPU core by default
+*   -c  a file of name=value lines, like /etc/hpm.cfg, for both cores; and for the
+*       simulation too, when simulating - as for hpm-sim
+*   -s  set one control setting or simulation parameter; these go after the config file
+*   -m  print at most this many differing cycles, 1000 by default; all of them are counted
+*   -q  print only the summary
+*   -d  with no data logs, simulate this many days, 120 by default
+*   -p  with no data logs, the outdoor temps to simulate with, as for hpm-sim
+*
+* With data logs (hpm_data.log, .gz ones too), both cores get the logged inputs of every
+* cycle. Without, the plant simulator makes them, and core A's decisions drive the plant.
+*
+* A differing cycle is printed as
+*     <log file> <timestamp>, or sim day <day> <time of day>
+*     WANTED A: C1 F1 B: C1;  GOT A: ... B: ...;  AC1 A: Starting B: ON;  sendBits A: ... B: ...
+* with only the parts that differ; then core B takes over core A's state, so one change in
+* behaviour is reported at the cycle it shows in, and not again for every cycle after it.
+* A difference which goes on (a longer timer, say) is printed once, followed by the number
+* of cycles it went on for.
+*
+* The corpus is cut in shards, worked on in parallel: a compressed log is one shard, and
+* an uncompressed one a shard per SHARD_BYTES of it; a simulation is a shard per
+* SHARD_DAYS, each starting at the outdoor temps of its days, with the water at its set
+* temp. Both cores start from their initial state at the start of each shard - as after a
+* daemon start, which is also what they do at a "***" line or a gap in the log. The cycles
+* hpm left out of the log over its SD card write budget - the line after them says how
+* many - are stepped with the inputs of the line before them.
+*
+* Exit code is 0 if the cores never differ, 1 if they do, and 2 on errors.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "hpm_sim.h"
+#include "hpm_log.h"
+
+#define CYCLES_PER_DAY       (24*3600/SIM_CYCLE_SECONDS)
+
+/* a longer gap between two data lines means hpm was not running in between */
+#define MAX_GAP              60
+
+#define SHARD_BYTES          (8L<<20)
+#define SHARD_DAYS           7
+
+/* settings are applied in the order given, after all of them are read */
+#define MAXSETTINGS          200
+char *settings[MAXSETTINGS];
+int nr_settings = 0;
+
+/* A control core build, loaded */
+struct core
+{
+    const char     *file;
+    void          (*params_default)(struct hpm_params *p);
+    void          (*state_init)(struct hpm_state *s);
+    void          (*step)(struct hpm_state *s, const struct hpm_inputs *in, const struct hpm_params *p,
+                        struct hpm_outputs *out);
+    struct hpm_params p;
+};
+
+/* A piece of the corpus, and what came of it */
+struct shard
+{
+    const char     *file;           /* the data log, NULL for a simulation */
+    off_t           from;           /* bytes of the log: lines starting from..to-1 */
+    off_t           to;             /* 0 for the end of the log */
+    unsigned long   day;            /* the days of a simulation */
+    unsigned long   days;
+    unsigned long   lines;
+    unsigned long   bad;            /* lines which are not data lines nor "***" */
+    unsigned long   compared;
+    unsigned long   starts;         /* cold starts of both cores */
+    unsigned long   held;           /* cycles left out of the log, stepped with the inputs before them */
+    unsigned long   differ;
+    unsigned long   wanted;
+    unsigned long   actual;
+    unsigned long   modes;
+    unsigned long   sendBits;
+    char           *out;            /* the differing cycles to print */
+    size_t          out_len;
+    size_t          out_size;
+    unsigned long   out_lines;
+    char            last[1000];     /* the last difference printed, and how many cycles */
+    unsigned long   repeat;         /* right after it differed in the same way */
+    int             cut;            /* some were not printed */
+    int             failed;
+};
+
+struct core A, B;
+struct hpm_sim_params base_sp;
+unsigned long days = 120;
+unsigned long max_diffs = 1000;
+int quiet = 0;
+
+struct shard *shards;
+unsigned long nr_shards = 0;
+unsigned long next_shard = 0;
+
+/* trim leading and trailing white space */
+static char *
+trim(char *s) {
+    char *e;
+
+    while (isspace((unsigned char)*s)) s++;
+    e = s + strlen(s);
+    while ((e > s) && isspace((unsigned char)e[-1])) e--;
+    *e = 0;
+    return s;
+}
+
+static int
+add_setting(const char *s) {
+    if (nr_settings >= MAXSETTINGS) {
+        fprintf( stderr, "Too many settings, skipping '%s'.\n", s );
+        return -1;
+    }
+    settings[nr_settings++] = strdup(s);
+    return 0;
+}
+
+/* name=value lines of a config file: blank lines and comments are skipped */
+static int
+read_config(const char *file) {
+    char buff[200];
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open config file %s for reading!\n", file );
+        return -1;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        if (buff[0] == '\n' || buff[0] == '#') continue;
+        if (strchr( buff, '=' ) == NULL) continue;
+        add_setting( trim(buff) );
+    }
+    fclose (fp);
+    return 0;
+}
+
+/* apply a name=value setting to both cores' parameters; the ones not known are only
+   reported when asked for explicitly */
+static int
+apply_setting(char *s, int explicit) {
+    char *name, *value;
+    int r;
+
+    value = strchr( s, '=' );
+    if (value == NULL) {
+        fprintf( stderr, "Bad setting '%s' - should be name=value.\n", s );
+        return -1;
+    }
+    *value++ = 0;
+    name = trim(s);
+    value = trim(value);
+    r = hpm_sim_set( &base_sp, &A.p, name, value );
+    if (!r) hpm_sim_set( &base_sp, &B.p, name, value );
+    if (r < 0) fprintf( stderr, "Bad value '%s' for %s.\n", value, name );
+    if ((r > 0) && explicit) fprintf( stderr, "Unknown setting %s.\n", name );
+    return (r < 0) || ((r > 0) && explicit) ? -1 : 0;
+}
+
+/* outdoor temps file: one temp per line, lines which are not a number are skipped */
+static float *
+read_profile(const char *file, unsigned long *n) {
+    char buff[200], *end, *s;
+    float *t = NULL, *nt;
+    unsigned long size = 0;
+    double d;
+    FILE *fp = fopen(file, "r");
+
+    *n = 0;
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open outdoor temps file %s for reading!\n", file );
+        return NULL;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        s = trim(buff);
+        d = strtod( s, &end );
+        if ((end == s) || *end) continue;
+        if (*n == size) {
+            size = size ? 2*size : 1024;
+            nt = realloc( t, size * sizeof(*t) );
+            if (nt == NULL) break;
+            t = nt;
+        }
+        t[(*n)++] = d;
+    }
+    fclose (fp);
+    if (!*n) fprintf( stderr, "No outdoor temps in %s!\n", file );
+    return t;
+}
+
+/* load a core build; it must have been built against the same structures as this */
+static int
+load_core(struct core *c, const char *file) {
+    int (*abi)();
+    char path[1000];
+    void *h;
+
+    /* dlopen() only looks in the current dir when told to */
+    snprintf( path, sizeof path, "%s%s", strchr( file, '/' ) ? "" : "./", file );
+    h = dlopen( path, RTLD_NOW | RTLD_LOCAL );
+    if (h == NULL) {
+        fprintf( stderr, "Failed to load %s: %s\n", file, dlerror() );
+        return -1;
+    }
+    c->file = file;
+    abi = (int (*)())dlsym( h, "hpm_core_abi" );
+    c->params_default = (void (*)(struct hpm_params *))dlsym( h, "hpm_params_default" );
+    c->state_init = (void (*)(struct hpm_state *))dlsym( h, "hpm_state_init" );
+    c->step = (void (*)(struct hpm_state *, const struct hpm_inputs *, const struct hpm_params *,
+        struct hpm_outputs *))dlsym( h, "hpm_step" );
+    if ((abi == NULL) || (c->params_default == NULL) || (c->state_init == NULL) || (c->step == NULL)) {
+        fprintf( stderr, "%s is not an hpm control core!\n", file );
+        return -1;
+    }
+    if (abi() != HPM_CORE_ABI) {
+        fprintf( stderr, "%s is of core ABI %d, hpm-ab of %d - rebuild them from the same tree.\n",
+            file, abi(), HPM_CORE_ABI );
+        return -1;
+    }
+    c->params_default( &c->p );
+    return 0;
+}
+
+static void
+add_out(struct shard *sh, const char *s) {
+    size_t l = strlen( s );
+    char *n;
+
+    if (sh->out_len + l + 1 > sh->out_size) {
+        sh->out_size = sh->out_size ? 2*sh->out_size + l : 64*1024;
+        n = realloc( sh->out, sh->out_size );
+        if (n == NULL) {
+            sh->failed = 1;
+            return;
+        }
+        sh->out = n;
+    }
+    memcpy( sh->out + sh->out_len, s, l + 1 );
+    sh->out_len += l;
+}
+
+/* the end of a run of cycles differing in the same way */
+static void
+end_run(struct shard *sh) {
+    char msg[100];
+
+    if (sh->repeat) {
+        snprintf( msg, sizeof msg, "    ...and the same for %lu more cycles\n", sh->repeat );
+        add_out( sh, msg );
+    }
+    sh->repeat = 0;
+    sh->last[0] = 0;
+}
+
+/* compare the decisions of the two cores in a cycle; returns 1 if they differ */
+static int
+compare(struct shard *sh, const char *where, int units, const struct hpm_state *sa,
+        const struct hpm_outputs *oa, const struct hpm_state *sb, const struct hpm_outputs *ob) {
+    char msg[sizeof(sh->last)], a[40], b[40];
+    size_t l = 0;
+    int u, modes = 0;
+
+    for (u=0;u<units;u++) if (sa->unit[u].mode != sb->unit[u].mode) modes = 1;
+    if ((oa->wanted == ob->wanted) && (oa->actual == ob->actual) && (oa->sendBits == ob->sendBits) && !modes) {
+        end_run( sh );
+        return 0;
+    }
+    sh->differ++;
+    if (oa->wanted != ob->wanted) sh->wanted++;
+    if (oa->actual != ob->actual) sh->actual++;
+    if (oa->sendBits != ob->sendBits) sh->sendBits++;
+    if (modes) sh->modes++;
+    if (quiet) return 1;
+
+    msg[0] = 0;
+    if (oa->wanted != ob->wanted) {
+        hpm_log_devices( a, oa->wanted, units );
+        hpm_log_devices( b, ob->wanted, units );
+        l += snprintf( msg+l, sizeof(msg)-l, "  WANTED A:%s B:%s;", a, b );
+    }
+    if (oa->actual != ob->actual) {
+        hpm_log_devices( a, oa->actual, units );
+        hpm_log_devices( b, ob->actual, units );
+        l += snprintf( msg+l, sizeof(msg)-l, "  GOT A:%s B:%s;", a, b );
+    }
+    for (u=0;u<units;u++) {
+        if (sa->unit[u].mode == sb->unit[u].mode) continue;
+        l += snprintf( msg+l, sizeof(msg)-l, "  AC%d A: %s B: %s;", u+1, hpm_log_mode_names[sa->unit[u].mode],
+            hpm_log_mode_names[sb->unit[u].mode] );
+    }
+    if (oa->sendBits != ob->sendBits) {
+        hpm_log_devices( a, oa->sendBits, units );
+        hpm_log_devices( b, ob->sendBits, units );
+        snprintf( msg+l, sizeof(msg)-l, "  sendBits A:%s B:%s;", a, b );
+    }
+    /* a setting change makes the same difference for many cycles in a row: it is
+       printed once, with the number of cycles it went on for */
+    if (!strcmp( msg, sh->last )) {
+        sh->repeat++;
+        return 1;
+    }
+    end_run( sh );
+    /* the ones printed are cut at the end, but each shard must have enough of them */
+    if (sh->out_lines >= max_diffs) {
+        sh->cut = 1;
+        return 1;
+    }
+    sh->out_lines++;
+    strcpy( sh->last, msg );
+    add_out( sh, where );
+    add_out( sh, msg );
+    add_out( sh, "\n" );
+    return 1;
+}
+
+/* both cores over the logged inputs of the lines starting in the shard */
+static void
+run_log(struct shard *sh) {
+    struct hpm_log_clock log_clock = { "", 0 };
+    struct hpm_log_line d;
+    struct hpm_state sa, sb;
+    struct hpm_outputs oa, ob;
+    struct hpm_params pa = A.p, pb = B.p;
+    struct hpm_inputs last_in;
+    char buff[2000], where[300];
+    off_t pos = sh->from;
+    time_t t, last_t = 0;
+    unsigned long k;
+    long gap;
+    int units = 0;
+    size_t l;
+    pid_t pid;
+    int c;
+    FILE *fp = hpm_log_open( sh->file, &pid );
+
+    if (fp == NULL) {
+        sh->failed = 1;
+        return;
+    }
+    if (sh->from) {
+        /* the line going on at the start of the shard is the one before's */
+        if (fseeko( fp, sh->from - 1, SEEK_SET )) {
+            fprintf( stderr, "Failed to seek in %s!\n", sh->file );
+            sh->failed = 1;
+            hpm_log_close( fp, pid );
+            return;
+        }
+        pos = sh->from - 1;
+        while (((c = fgetc( fp )) != EOF) && (pos++, c != '\n'));
+    }
+    while ((!sh->to || (pos < sh->to)) && (fgets( buff, sizeof buff, fp ) != NULL)) {
+        l = strlen( buff );
+        pos += l;
+        if (l && (buff[l-1] != '\n')) {
+            while (((c = fgetc( fp )) != EOF) && (pos++, c != '\n'));
+        }
+        sh->lines++;
+        if ((l < LOG_STAMP_LEN) || !(t = hpm_log_time( &log_clock, buff ))) {
+            sh->bad++;
+            continue;
+        }
+        if (!strncmp( buff+LOG_STAMP_LEN, "***", 3 )) {
+            /* hpm started here: so do the cores, at the next data line */
+            units = 0;
+            continue;
+        }
+        if (hpm_log_parse( buff+LOG_STAMP_LEN, &d )) {
+            sh->bad++;
+            continue;
+        }
+        snprintf( where, sizeof where, "%s %.19s", sh->file, buff );
+        /* the time between the lines, less the cycles hpm left out of the log between them
+           over its write budget */
+        gap = (long)(t - last_t) - (long)d.skipped * SIM_CYCLE_SECONDS;
+        if ((d.units != units) || (t < last_t) || (gap > MAX_GAP) || (gap < -MAX_GAP)) {
+            units = d.units;
+            pa.units = pb.units = units;
+            A.state_init( &sa );
+            B.state_init( &sb );
+            sh->starts++;
+        }
+        else {
+            /* the cycles left out went as the line before, so they get its inputs */
+            for (k=0;k<d.skipped;k++) {
+                A.step( &sa, &last_in, &pa, &oa );
+                B.step( &sb, &last_in, &pb, &ob );
+                sh->compared++;
+                sh->held++;
+                if (compare( sh, where, units, &sa, &oa, &sb, &ob )) sb = sa;
+            }
+        }
+        last_t = t;
+        last_in = d.in;
+        A.step( &sa, &d.in, &pa, &oa );
+        B.step( &sb, &d.in, &pb, &ob );
+        sh->compared++;
+        if (compare( sh, where, units, &sa, &oa, &sb, &ob )) sb = sa;
+    }
+    end_run( sh );
+    if (hpm_log_close( fp, pid )) {
+        fprintf( stderr, "Failed to read %s!\n", sh->file );
+        sh->failed = 1;
+    }
+}
+
+/* the plant driven by core A, with core B getting the same inputs */
+static void
+run_sim(struct shard *sh) {
+    struct hpm_sim_params sp = base_sp;
+    struct hpm_state sb;
+    struct hpm_outputs ob;
+    struct hpm_sim *sim = malloc( sizeof(*sim) );
+    unsigned long c, s;
+    char where[100];
+
+    if (sim == NULL) {
+        sh->failed = 1;
+        return;
+    }
+    sp.start_hour += sh->day * 24;
+    hpm_sim_init( sim, &sp, &A.p );
+    A.state_init( &sim->state );
+    B.state_init( &sb );
+    sh->starts++;
+    for (c=0;c<sh->days*CYCLES_PER_DAY;c++) {
+        hpm_sim_inputs( sim );
+        A.step( &sim->state, &sim->in, &A.p, &sim->out );
+        B.step( &sb, &sim->in, &B.p, &ob );
+        sh->compared++;
+        s = (base_sp.start_hour * 3600 + c * SIM_CYCLE_SECONDS) % (24*3600);
+        snprintf( where, sizeof where, "sim day %lu %02lu:%02lu:%02lu",
+            sh->day + (base_sp.start_hour * 3600 + c * SIM_CYCLE_SECONDS) / (24*3600) + 1,
+            s / 3600, s / 60 % 60, s % 60 );
+        if (compare( sh, where, A.p.units, &sim->state, &sim->out, &sb, &ob )) sb = sim->state;
+        hpm_sim_plant( sim );
+    }
+    end_run( sh );
+    free( sim );
+}
+
+static void *
+worker(void *arg) {
+    unsigned long s;
+
+    while ((s = __sync_fetch_and_add( &next_shard, 1 )) < nr_shards) {
+        if (shards[s].file) run_log( &shards[s] );
+        else run_sim( &shards[s] );
+    }
+    return NULL;
+}
+
+static int
+add_shard(const char *file, off_t from, off_t to, unsigned long day, unsigned long n) {
+    struct shard *ns = realloc( shards, (nr_shards+1) * sizeof(*shards) );
+
+    if (ns == NULL) return -1;
+    shards = ns;
+    memset( &shards[nr_shards], 0, sizeof(*shards) );
+    shards[nr_shards].file = file;
+    shards[nr_shards].from = from;
+    shards[nr_shards].to = to;
+    shards[nr_shards].day = day;
+    shards[nr_shards].days = n;
+    nr_shards++;
+    return 0;
+}
+
+/* a compressed log can only be read from its start, so it is one shard */
+static int
+add_log(const char *file) {
+    struct stat st;
+    size_t l = strlen( file );
+    off_t o;
+
+    if (stat( file, &st )) {
+        fprintf( stderr, "Failed to open log %s for reading!\n", file );
+        return -1;
+    }
+    if (((l > 3) && !strcmp( file + l - 3, ".gz" )) || (st.st_size <= SHARD_BYTES))
+        return add_shard( file, 0, 0, 0, 0 );
+    for (o=0;o<st.st_size;o+=SHARD_BYTES) {
+        if (add_shard( file, o, (o + SHARD_BYTES < st.st_size) ? o + SHARD_BYTES : 0, 0, 0 )) return -1;
+    }
+    return 0;
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hpm-ab [-j threads] [-c config file] [-s name=value]... [-m max diffs] [-q]\n"
+        "              [-d days] [-p outdoor temps file] A.so B.so [data log]...\n" );
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct shard sum;
+    struct timespec t0, t1;
+    pthread_t *threads;
+    long nr_threads = sysconf( _SC_NPROCESSORS_ONLN );
+    unsigned long cmdline_from = 0;
+    unsigned long s, printed = 0;
+    int cut = 0;
+    float *profile = NULL;
+    char *profile_file = NULL;
+    char *p, *e;
+    int bad = 0, failed = 0;
+    int i, opt;
+
+    hpm_sim_params_default(&base_sp);
+
+    /* the config file settings go first, whatever the order of the options */
+    while ((opt = getopt( argc, argv, "j:c:s:m:qd:p:" )) != -1) {
+        switch (opt) {
+            case 'j': nr_threads = atol( optarg ); break;
+            case 'c': if (read_config( optarg )) exit(2); break;
+            case 's': break;
+            case 'm': max_diffs = atol( optarg ); break;
+            case 'q': quiet = 1; break;
+            case 'd': days = atol( optarg ); if (!days) usage(); break;
+            case 'p': profile_file = optarg; break;
+            default: usage();
+        }
+    }
+    if (argc - optind < 2) usage();
+    if (nr_threads < 1) nr_threads = 1;
+    if (load_core( &A, argv[optind] ) || load_core( &B, argv[optind+1] )) exit(2);
+    cmdline_from = nr_settings;
+    optind = 1;
+    while ((opt = getopt( argc, argv, "j:c:s:m:qd:p:" )) != -1) {
+        if (opt == 's') add_setting( optarg );
+    }
+    for (i=0;i<nr_settings;i++) {
+        if (apply_setting( settings[i], i >= cmdline_from )) bad++;
+    }
+    if (bad) exit(2);
+    if (profile_file) {
+        profile = read_profile( profile_file, &base_sp.tout_n );
+        if (profile == NULL || !base_sp.tout_n) exit(2);
+        base_sp.tout_points = profile;
+    }
+
+    for (i=optind+2;i<argc;i++) {
+        if (add_log( argv[i] )) exit(2);
+    }
+    if (optind + 2 == argc) {
+        for (s=0;s<days;s+=SHARD_DAYS) {
+            if (add_shard( NULL, 0, 0, s, (days - s < SHARD_DAYS) ? days - s : SHARD_DAYS )) exit(2);
+        }
+    }
+    if ((long)nr_shards < nr_threads) nr_threads = nr_shards;
+    threads = calloc( nr_threads, sizeof(*threads) );
+    if (threads == NULL) {
+        fprintf( stderr, "Out of memory!\n" );
+        exit(2);
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    for (i=0;i<nr_threads;i++) {
+        if (pthread_create( &threads[i], NULL, worker, NULL )) {
+            nr_threads = i;
+            break;
+        }
+    }
+    if (!nr_threads) worker( NULL );
+    for (i=0;i<nr_threads;i++) pthread_join( threads[i], NULL );
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+    /* the differing cycles in corpus order, and the sums */
+    memset( &sum, 0, sizeof(sum) );
+    for (s=0;s<nr_shards;s++) {
+        for (p = shards[s].out; p && *p; p = e + 1) {
+            e = strchr( p, '\n' );
+            /* the "...and the same" lines are not differences of their own */
+            if (!strncmp( p, "    ...", 7 )) {
+                if (printed <= max_diffs) fwrite( p, 1, e - p + 1, stdout );
+                continue;
+            }
+            if (++printed <= max_diffs) fwrite( p, 1, e - p + 1, stdout );
+            else cut = 1;
+        }
+        if (shards[s].cut) cut = 1;
+        sum.lines += shards[s].lines;
+        sum.bad += shards[s].bad;
+        sum.compared += shards[s].compared;
+        sum.starts += shards[s].starts;
+        sum.held += shards[s].held;
+        sum.differ += shards[s].differ;
+        sum.wanted += shards[s].wanted;
+        sum.actual += shards[s].actual;
+        sum.modes += shards[s].modes;
+        sum.sendBits += shards[s].sendBits;
+        if (shards[s].failed) failed++;
+        free( shards[s].out );
+    }
+    if (cut) printf( "...more - only the first %lu are printed.\n", max_diffs );
+    if (optind + 2 < argc) printf( "%lu log lines, %lu not data lines; ", sum.lines, sum.bad );
+    else printf( "Simulated %lu days of %d ACs; ", days, A.p.units );
+    printf( "%lu cycles compared in %lu shards on %ld threads in %.2f seconds, with %lu cold starts.\n",
+        sum.compared, nr_shards, nr_threads ? nr_threads : 1,
+        (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, sum.starts );
+    if (sum.held) printf( "%lu of them were left out of the logs over hpm's write budget, and stepped with the"
+        " inputs of the line before them.\n", sum.held );
+    printf( "%lu cycles differ (%.3f%%): WANTED in %lu, actual in %lu, AC modes in %lu, sendBits in %lu.\n",
+        sum.differ, sum.compared ? 100.0 * sum.differ / sum.compared : 0.0, sum.wanted, sum.actual,
+        sum.modes, sum.sendBits );
+    if (failed) fprintf( stderr, "%d shards failed!\n", failed );
+
+    free( profile );
+    free( shards );
+    free( threads );
+    if (failed) return 2;
+    return sum.differ ? 1 : 0;
+}
+
+/* EOF */
@@ -0,0 +1,119 @@
+/*
+* hpm-alive.c
+*
+* Tells from hpm's heartbeat in shared memory if it is alive, and how it is doing - for
+* monit and the like, and for a look by hand.
+* Plamen Petrov
+*
+* Usage: hpm-alive [-f heartbeat file] [-a max age] [-u flags] [-q]
+*
+*   -f  the heartbeat file, /run/shm/hpm_heartbeat by default
+*   -a  seconds since the last completed control cycle for hpm to count as alive, 30 by
+*       default
+*   -u  health flags - the sum of the ones below - that count as unhealthy, none by default
+*   -q  print nothing, only exit with the status
+*
+* Prints a line like
+*   alive: pid 812, cycle 10234 ended 2.1 s ago, took 1250 ms (max 3410 ms), flags sensors
+* and exits with
+*   0   alive, with none of the -u flags
+*   1   not alive: no cycle completed for too long, or its process is gone
+*   2   no heartbeat: the file is not there, or not hpm's
+*   3   alive, but with some of the -u flags
+* Health flags: 1 starting, 2 failsafe, 4 sensors, 8 gpio, 16 hwwm, 32 write budget - see
+* hpm_heartbeat.h.
+*
+* For monit, in place of watching a file hpm writes:
+*   check program hpm_alive with path "/usr/sbin/hpm-alive -q -a 30"
+*     if status = 1 then restart
+*     if status != 0 then alert
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include "hpm_heartbeat.h"
+
+static const char *flag_names[6] = { "starting", "failsafe", "sensors", "gpio", "hwwm", "write budget" };
+
+/* a consistent copy of the heartbeat; returns 0 on success */
+static int
+read_heartbeat(const char *path, struct hpm_heartbeat *hb) {
+    uint32_t seq;
+    int fd, tries;
+
+    fd = open( path, O_RDONLY );
+    if (fd == -1) return -1;
+    for (tries=0;tries<100;tries++) {
+        if (pread( fd, hb, sizeof(*hb), 0 ) != sizeof(*hb)) break;
+        seq = hb->seq;
+        /* seq is read again by itself, after the rest of it */
+        if (!(seq & 1) && (pread( fd, &seq, sizeof(seq), offsetof(struct hpm_heartbeat, seq) ) == sizeof(seq))
+            && (seq == hb->seq)) {
+            close( fd );
+            return (hb->magic == HPM_HB_MAGIC) && (hb->version == HPM_HB_VERSION) ? 0 : -1;
+        }
+        usleep( 1000 );
+    }
+    close( fd );
+    return -1;
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hpm-alive [-f heartbeat file] [-a max age] [-u flags] [-q]\n" );
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct hpm_heartbeat hb;
+    struct timespec ts;
+    const char *path = "/run/shm/hpm_heartbeat";
+    double max_age = 30, age;
+    unsigned int unhealthy = 0;
+    short quiet = 0, alive, i;
+    char flags[100];
+    int opt;
+
+    while ((opt = getopt( argc, argv, "f:a:u:q" )) != -1) {
+        switch (opt) {
+            case 'f': path = optarg; break;
+            case 'a': max_age = atof( optarg ); break;
+            case 'u': unhealthy = strtoul( optarg, NULL, 0 ); break;
+            case 'q': quiet = 1; break;
+            default: usage();
+        }
+    }
+    if ((optind < argc) || (max_age <= 0)) usage();
+
+    if (read_heartbeat( path, &hb )) {
+        if (!quiet) printf( "no heartbeat in %s\n", path );
+        return 2;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    age = (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 - hb.ended_ms) / 1000.0;
+    alive = (age <= max_age) && ((kill( hb.pid, 0 ) == 0) || (errno == EPERM));
+
+    flags[0] = 0;
+    for (i=0;i<6;i++) {
+        if (hb.flags & (1 << i)) sprintf( flags + strlen(flags), "%s%s", flags[0] ? ", " : "", flag_names[i] );
+    }
+    if (!quiet) {
+        printf( "%s: pid %d, cycle %llu ended %.1f s ago, took %u ms (max %u ms), flags %s\n",
+            alive ? "alive" : "NOT ALIVE", hb.pid, (unsigned long long)hb.cycle, age, hb.last_ms, hb.max_ms,
+            flags[0] ? flags : "none" );
+    }
+    if (!alive) return 1;
+    if (hb.flags & unhealthy) return 3;
+    return 0;
+}
+
+/* EOF */
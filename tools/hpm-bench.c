@@ -0,0 +1,550 @@
+/*
+* hpm-bench.c
+*
+* Micro-benchmarks of what hpm does every cycle: reading and parsing the sensors, logging,
+* the environment temp average, the control core decisions, GPIO writes and reading the
+* config file. The daemon's own code is built in, with its files and the sysfs trees
+* moved to fixtures in a tmpfs directory, so nothing real is touched.
+* Plamen Petrov
+*
+* Usage: hpm-bench [-n scale] [-u units] [-o json file] [name]...
+*
+*   -n  run scale times more (or less, if below 1) iterations of every benchmark
+*   -u  number of ACs in the fixture config, 2 by default
+*   -o  write the results there instead of the standard output
+*   names or parts of them pick the benchmarks to run, all of them by default
+*
+* Every benchmark is timed over 5 runs and the median one is reported as ns/op. The
+* system calls per op are counted in a separate, shorter run under ptrace - they are null
+* if the process can not be traced. The allocations per op are the malloc(), calloc() and
+* realloc() calls, stdio's included - they are null if not built with glibc.
+*/
+
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/* the fixtures directory, and all of hpm's files in it */
+#define FIXTURE_DIR     "/dev/shm/hpm-bench"
+#include "hpm_whitebox.h"
+
+#define REPEATS         5
+
+/* Allocations counting: glibc's malloc() and co. are replaced with ones that count the
+   calls and pass them on - stdio's internal ones go through these too */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+unsigned long allocs = 0;
+
+void *malloc(size_t size) { allocs++; return __libc_malloc(size); }
+void *calloc(size_t n, size_t size) { allocs++; return __libc_calloc(n, size); }
+void *realloc(void *p, size_t size) { allocs++; return __libc_realloc(p, size); }
+void free(void *p) { __libc_free(p); }
+#define COUNTING_ALLOCS 1
+#else
+unsigned long allocs = 0;
+#define COUNTING_ALLOCS 0
+#endif
+
+/* A benchmark: setup() is run once before every timed run, op() is what gets timed */
+struct bench
+{
+    const char     *name;
+    unsigned long   iters;
+    void          (*setup)(void);
+    void          (*op)(void);
+    /* results */
+    double          ns;
+    double          syscalls;
+    double          allocs;
+};
+
+/* a sensor reading as the w1 driver gives it - temp in 1/1000 C after "t=" */
+static const char *w1_fmt = "29 01 55 05 7f a5 a5 66 b3 : crc=b3 YES\n29 01 55 05 7f a5 a5 66 b3 t=%ld\n";
+
+/* sensor temps the fixtures have, per sensor number: ACs running in the cold */
+static const float fixture_temps[TOTALSENSORS+1] =
+    { 0, 48.5, -6.25, 47.125, -5.875, 38.25, 42.5, 1.125, 46.75, -6.5, 49.25, -5.5 };
+
+static int units = 2;
+
+static int
+write_file(const char *path, const char *s) {
+    FILE *fp = fopen( path, "w" );
+
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to create fixture %s!\n", path );
+        return -1;
+    }
+    fputs( s, fp );
+    fclose( fp );
+    return 0;
+}
+
+static int
+write_sensor(short i, float t) {
+    char path[100], s[100];
+
+    sprintf( path, SENSORS_DIR"/28-%012d", i );
+    mkdir( path, 0755 );
+    strcat( path, "/w1_slave" );
+    sprintf( s, w1_fmt, (long)(t*1000) );
+    return write_file( path, s );
+}
+
+/* the fixtures directory: sensor files, a GPIO sysfs tree of every pin, and a config file
+   which uses them */
+static int
+make_fixtures() {
+    char path[100], s[4000];
+    short i;
+    int p;
+
+    mkdir( FIXTURE_DIR, 0755 );
+    mkdir( SENSORS_DIR, 0755 );
+    mkdir( GPIO_ROOT, 0755 );
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if (write_sensor( i, fixture_temps[i] )) return -1;
+    }
+    if (write_file( GPIO_ROOT"/export", "" ) || write_file( GPIO_ROOT"/unexport", "" )) return -1;
+    for (p=4;p<=27;p++) {
+        sprintf( path, GPIO_ROOT"/gpio%d", p );
+        mkdir( path, 0755 );
+        sprintf( path, GPIO_ROOT"/gpio%d/value", p );
+        if (write_file( path, "0\n" )) return -1;
+        sprintf( path, GPIO_ROOT"/gpio%d/direction", p );
+        if (write_file( path, "out\n" )) return -1;
+    }
+    /* the example config file settings, for as many ACs as asked for */
+    sprintf( s, "# hpm-bench fixture\nmode=1\nunits=%d\ninvert_output=1\n"
+        "commspin1_pin=17\ncommspin2_pin=18\ncommspin3_pin=27\ncommspin4_pin=22\n"
+        "wicorr=2.125\nwocorr=0.125\ntenvcorr=1.25\n", units );
+    for (i=0;i<units;i++) {
+        sprintf( s + strlen(s), "\n# AC%d\nuse_ac%d=1\nac%dmax_temp=63\nac%dcool_temp=56\n"
+            "ac%dcmp_pin=%d\nac%dfan_pin=%d\nac%dv_pin=%d\n"
+            "ac%dcmp_sensor="SENSORS_DIR"/28-%012d/w1_slave\nac%dcnd_sensor="SENSORS_DIR"/28-%012d/w1_slave\n",
+            i+1, i+1, i+1, i+1, i+1, cfg.accmp_pin[i], i+1, cfg.acfan_pin[i], i+1, cfg.acv_pin[i],
+            i+1, SENS_CMP(i), i+1, SENS_CND(i) );
+    }
+    sprintf( s + strlen(s), "\nwi_sensor="SENSORS_DIR"/28-%012d/w1_slave\nwo_sensor="SENSORS_DIR"/28-%012d/w1_slave\n"
+        "tenv_sensor="SENSORS_DIR"/28-%012d/w1_slave\n", 5, 6, 7 );
+    return write_file( CONFIG_FILE, s );
+}
+
+/* the files hpm appends to are started anew for every run */
+static void
+clear_logs() {
+    unlink( LOG_FILE );
+    unlink( DATA_FILE );
+}
+
+/* The benchmarks */
+
+static float sink;
+
+static void
+op_sensorRead() {
+    sink += sensorRead( sensor_paths[1] );
+}
+
+/* all sensors read as they are - a normal cycle */
+static void
+setup_ReadSensors() {
+    short i;
+
+    clear_logs();
+    for (i=1;i<=TOTALSENSORS;i++) {
+        sensors[i] = sensors_prv[i] = fixture_temps[i] + scorr[i];
+        hpm_filter_reset( &sfilter[i], sensors[i] );
+        sensor_read_errors[i] = 0;
+    }
+    just_started = 0;
+}
+
+static void
+op_ReadSensors() {
+    ReadSensors();
+}
+
+/* every sensor stepped a reading ago, so every one gets its step confirmed and logged */
+static void
+op_ReadSensors_step() {
+    struct hpm_filter *f;
+    short i;
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        f = &sfilter[i];
+        sensors[i] = fixture_temps[i] + scorr[i] + 10;
+        hpm_filter_reset( f, sensors[i] );
+        f->raw[f->last] = f->spike = fixture_temps[i] + scorr[i];
+        f->held = 1;
+    }
+    ReadSensors();
+}
+
+static void
+setup_LogData() {
+    clear_logs();
+    setup_ReadSensors();
+    /* past the start-up cycles, so all of the output files get written */
+    ProgramRunCycles = 100;
+    AC(0).cmp = AC(0).fan = 1;
+    AC(0).mode = 1;
+    AC(0).Smode = 42;
+    COMMS = 1;
+    sendBits = 3;
+}
+
+static void
+op_LogData() {
+    LogData( BIT_CMP(1)|BIT_FAN(1) );
+}
+
+static void
+op_UpdateSensorStats() {
+    UpdateSensorStats();
+    Tenv += 0.125;
+    if (Tenv > 10) Tenv = -10;
+}
+
+/* Control core decisions: a cycle from every one of these states */
+static struct hpm_state state0;
+static struct hpm_inputs in0;
+
+static void
+set_inputs(unsigned short comms) {
+    int u;
+
+    hpm_state_init( &state0 );
+    memset( &in0, 0, sizeof in0 );
+    for (u=0;u<MAXUNITS;u++) {
+        in0.Tcmp[u] = fixture_temps[SENS_CMP(u)];
+        in0.Tcnd[u] = fixture_temps[SENS_CND(u)];
+        state0.unit[u].Scmp = state0.unit[u].Sfan = state0.unit[u].Sfv = state0.unit[u].Smode = 1000;
+    }
+    in0.TenvAvrg = fixture_temps[SENS_ENV];
+    in0.HPmode = HEAT;
+    in0.COMMS = comms;
+}
+
+static void
+set_running(int u) {
+    state0.unit[u].cmp = state0.unit[u].fan = 1;
+    state0.unit[u].mode = 1;
+}
+
+static void
+setup_step_idle() {
+    set_inputs( 0 );
+    for (int u=0;u<MAXUNITS;u++) {
+        in0.Tcmp[u] = in0.Tcnd[u] = fixture_temps[SENS_ENV];
+    }
+}
+
+static void
+setup_step_start() {
+    set_inputs( 1 );
+    for (int u=0;u<MAXUNITS;u++) {
+        in0.Tcmp[u] = in0.Tcnd[u] = fixture_temps[SENS_ENV];
+    }
+}
+
+static void
+setup_step_one() {
+    set_inputs( 1 );
+    set_running( 0 );
+}
+
+static void
+setup_step_all() {
+    set_inputs( 2 );
+    for (int u=0;u<units;u++) set_running( u );
+}
+
+static void
+setup_step_defrost() {
+    set_inputs( 2 );
+    for (int u=0;u<units;u++) set_running( u );
+    state0.unit[0].mode = 4;
+    state0.unit[0].fan = 0;
+    state0.unit[0].dphase = 2;
+    state0.unit[0].Sdphase = 5;
+}
+
+static void
+setup_step_ohp() {
+    set_inputs( 1 );
+    set_running( 0 );
+    in0.Tcmp[0] = hp.unit[0].comp_max_temp + 1;
+}
+
+static void
+op_hpm_step() {
+    struct hpm_state s = state0;
+    struct hpm_outputs out;
+
+    hpm_step( &s, &in0, &hp, &out );
+    sink += out.actual;
+}
+
+/* what shadow mode costs production per cycle: handing the cycle over to the shadow
+   thread, which is running and deciding the same */
+static struct hpm_outputs out0;
+
+static void
+setup_ShadowPost() {
+    struct hpm_state s;
+
+    setup_step_one();
+    s = state0;
+    hpm_step( &s, &in0, &hp, &out0 );
+    /* the AC modes production left are taken from the daemon's state */
+    hs = s;
+    if (!shadow_started) {
+        strcpy( cfg.shadow_str, "1" );
+        SetShadow();
+        cfg.shadow_str[0] = 0;
+    }
+}
+
+static void
+op_ShadowPost() {
+    ShadowPost( &state0, &in0, &out0 );
+}
+
+static void
+setup_parse_config() {
+    clear_logs();
+}
+
+static void
+op_parse_config() {
+    parse_config();
+}
+
+static void
+op_GPIOWrite() {
+    static int v = 0;
+
+    GPIOWrite( cfg.accmp_pin[0], v );
+    v = !v;
+}
+
+static struct bench benches[] = {
+    { "sensorRead",             20000,   NULL,                op_sensorRead },
+    { "ReadSensors",            2000,    setup_ReadSensors,   op_ReadSensors },
+    { "ReadSensors(step)",      2000,    setup_ReadSensors,   op_ReadSensors_step },
+    { "LogData",                10000,   setup_LogData,       op_LogData },
+    { "UpdateSensorStats",      5000000, NULL,                op_UpdateSensorStats },
+    { "hpm_step(idle)",         2000000, setup_step_idle,     op_hpm_step },
+    { "hpm_step(starting)",     2000000, setup_step_start,    op_hpm_step },
+    { "hpm_step(one AC)",       2000000, setup_step_one,      op_hpm_step },
+    { "hpm_step(all ACs)",      2000000, setup_step_all,      op_hpm_step },
+    { "hpm_step(defrost)",      2000000, setup_step_defrost,  op_hpm_step },
+    { "hpm_step(overheating)",  2000000, setup_step_ohp,      op_hpm_step },
+    { "parse_config",           2000,    setup_parse_config,  op_parse_config },
+    { "GPIOWrite",              20000,   NULL,                op_GPIOWrite },
+    { "ShadowPost",             200000,  setup_ShadowPost,    op_ShadowPost },
+};
+
+#define NR_BENCHES  (sizeof(benches)/sizeof(benches[0]))
+
+static double
+now() {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* system calls of iters ops, made by a traced child between two SIGUSR1 stops - so the
+   setup is not counted; -1 if the child can not be traced */
+static long
+traced_syscalls(const struct bench *b, unsigned long iters) {
+    unsigned long i;
+    long stops = 0;
+    int status, marks = 0, sig;
+    pid_t pid;
+
+    fflush( NULL );
+    pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        if (ptrace( PTRACE_TRACEME, 0, NULL, NULL ) == -1) _exit(2);
+        raise( SIGSTOP );
+        if (b->setup) b->setup();
+        raise( SIGUSR1 );
+        for (i=0;i<iters;i++) b->op();
+        raise( SIGUSR1 );
+        _exit(0);
+    }
+    if ((waitpid( pid, &status, 0 ) != pid) || !WIFSTOPPED(status)) return -1;
+    ptrace( PTRACE_SETOPTIONS, pid, NULL, (void *)(PTRACE_O_TRACESYSGOOD|PTRACE_O_EXITKILL) );
+    ptrace( PTRACE_SYSCALL, pid, NULL, NULL );
+    while (waitpid( pid, &status, 0 ) == pid) {
+        if (!WIFSTOPPED(status)) break;
+        sig = WSTOPSIG(status);
+        /* a system call entry or exit stop */
+        if (sig == (SIGTRAP|0x80)) {
+            if (marks == 1) stops++;
+            sig = 0;
+        }
+        else if (sig == SIGUSR1) {
+            marks++;
+            sig = 0;
+        }
+        ptrace( PTRACE_SYSCALL, pid, NULL, (void *)(long)sig );
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) || (marks != 2)) return -1;
+    /* every system call stops on entry and on exit */
+    return stops / 2;
+}
+
+/* system calls per op: the ones of a short run less the ones of the markers themselves */
+static double
+count_syscalls(const struct bench *b) {
+    static long markers = -2;
+    unsigned long iters = b->iters < 1000 ? b->iters : 1000;
+    long n;
+
+    if (markers == -2) markers = traced_syscalls( b, 0 );
+    if (markers < 0) return -1;
+    n = traced_syscalls( b, iters );
+    if (n < 0) return -1;
+    return (double)(n - markers) / iters;
+}
+
+static void
+run_bench(struct bench *b, double scale) {
+    double t[REPEATS], t0;
+    unsigned long iters = b->iters * scale;
+    unsigned long i, a;
+    int r;
+
+    if (!iters) iters = 1;
+    /* warm the caches up */
+    if (b->setup) b->setup();
+    for (i=0;i<iters/10;i++) b->op();
+    for (r=0;r<REPEATS;r++) {
+        if (b->setup) b->setup();
+        a = allocs;
+        t0 = now();
+        for (i=0;i<iters;i++) b->op();
+        t[r] = (now() - t0) / iters;
+        if (!r) b->allocs = (double)(allocs - a) / iters;
+    }
+    qsort( t, REPEATS, sizeof t[0], cmp_double );
+    b->ns = t[REPEATS/2];
+    b->iters = iters;
+    b->syscalls = count_syscalls( b );
+}
+
+static void
+json_number(FILE *fp, double d, int valid) {
+    if (valid) fprintf( fp, "%.3f", d );
+    else fprintf( fp, "null" );
+}
+
+static void
+write_json(FILE *fp, int *picked) {
+    char host[100] = "";
+    time_t t = time(NULL);
+    char date[30];
+    size_t i;
+    int first = 1;
+
+    gethostname( host, sizeof host );
+    strftime( date, sizeof date, "%FT%T%z", localtime( &t ) );
+    fprintf( fp, "{\n  \"version\": \"%s\",\n  \"core_abi\": %d,\n  \"host\": \"%s\",\n  \"date\": \"%s\",\n"
+        "  \"units\": %d,\n  \"benchmarks\": [\n", PGMVER, hpm_core_abi(), host, date, cfg.units );
+    for (i=0;i<NR_BENCHES;i++) {
+        if (!picked[i]) continue;
+        fprintf( fp, "%s    { \"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": ",
+            first ? "" : ",\n", benches[i].name, benches[i].iters );
+        json_number( fp, benches[i].ns, 1 );
+        fprintf( fp, ", \"syscalls_per_op\": " );
+        json_number( fp, benches[i].syscalls, benches[i].syscalls >= 0 );
+        fprintf( fp, ", \"allocs_per_op\": " );
+        json_number( fp, benches[i].allocs, COUNTING_ALLOCS );
+        fprintf( fp, " }" );
+        first = 0;
+    }
+    fprintf( fp, "\n  ]\n}\n" );
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hpm-bench [-n scale] [-u units] [-o json file] [name]...\n" );
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int picked[NR_BENCHES];
+    char *out_file = NULL;
+    double scale = 1;
+    FILE *fp = stdout;
+    size_t i;
+    int k, opt;
+
+    while ((opt = getopt( argc, argv, "n:u:o:" )) != -1) {
+        switch (opt) {
+            case 'n': scale = atof( optarg ); if (scale <= 0) usage(); break;
+            case 'u': units = atoi( optarg ); if ((units < 1) || (units > MAXUNITS)) usage(); break;
+            case 'o': out_file = optarg; break;
+            default: usage();
+        }
+    }
+    for (i=0;i<NR_BENCHES;i++) {
+        picked[i] = (optind == argc);
+        for (k=optind;k<argc;k++) {
+            if (strstr( benches[i].name, argv[k] )) picked[i] = 1;
+        }
+    }
+
+    /* start up as the daemon does, from the fixtures */
+    SetDefaultCfg();
+    hpm_params_default(&hp);
+    hpm_state_init(&hs);
+    if (make_fixtures()) exit(2);
+    parse_config();
+    InitCounters();
+
+    for (i=0;i<NR_BENCHES;i++) {
+        if (!picked[i]) continue;
+        fprintf( stderr, "%-24s", benches[i].name );
+        run_bench( &benches[i], scale );
+        fprintf( stderr, "%12.1f ns/op %8.2f syscalls/op %8.2f allocs/op\n",
+            benches[i].ns, benches[i].syscalls, benches[i].allocs );
+    }
+
+    if (out_file) {
+        fp = fopen( out_file, "w" );
+        if (fp == NULL) {
+            fprintf( stderr, "Failed to open %s for writing!\n", out_file );
+            exit(3);
+        }
+    }
+    write_json( fp, picked );
+    if (fp != stdout) fclose( fp );
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,440 @@
+/*
+* hpm-replay.c
+*
+* Re-runs recorded hpm data logs through the control core, and reports every cycle where
+* the decisions differ from the logged ones - so a new build can be checked against real
+* history before it goes on the Pi.
+* Plamen Petrov
+*
+* Usage: hpm-replay [-c config file] [-s name=value]... [-m max diffs] [-q] [-x] data log...
+*
+*   -c  the config file hpm ran with, for its control settings - see hpm-sim
+*   -s  set one control setting, after the config file
+*   -m  print at most this many differences, 1000 by default; all are counted anyway
+*   -q  print only the summary
+*   -x  also print the differences that go away with the logged temps rounding taken into
+*       account - see below
+*
+* The logs go in the order they were written - oldest first, e.g.
+*     hpm-replay hpm_data.log.3.gz hpm_data.log.2.gz hpm_data.log.1 hpm_data.log
+* and the .gz ones are read through gzip. Every data line gives the cycle's inputs - the
+* compressor and fin stack temps, average environment temp, HPmode and COMMS - and what
+* was decided: the wanted and actual devices state, the ACs modes and sendBits.
+*
+* The log does not have all of the control state: after a start of the log, a daemon
+* restart ("***") or a gap in the data, the replay follows the logged state until the
+* control timers that are not logged are known to be past their limits. The same is done
+* after a difference is found, so one difference is reported once, and not for every
+* cycle after it. While an AC is in DEFROST the replay cannot pick up where the log is in
+* the sequence, so it also follows the log until the defrost is over.
+*
+* Over its SD card write budget, hpm leaves lines with nothing but the temps changed out
+* of the log, and the next line says how many cycles it left out; those cycles are stepped
+* with the inputs of the line before them, and counted in the summary. A difference in one
+* of them is printed with the line after it.
+*
+* The logged temps are rounded to 0.1 C, so a decision right at a temp limit can come out
+* different: such a cycle is tried again with each temp nudged up and down by the rounding,
+* and if that gives the logged decisions, it is only counted. The AC wear balancing run
+* cycles are not logged at all, so which AC is started first may differ without a change
+* in the control.
+*
+* The logs are read a line at a time, so memory use does not depend on their size.
+*
+* The replay's decisions are checked against the control safety rules, and the replay
+* stops with exit code 3 at the first one broken. Otherwise the exit code is 0 if all
+* decisions came out as logged, 1 if some differ, and 2 on errors.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hpm_sim.h"
+#include "hpm_log.h"
+
+/* seconds without a data line, after which the control state is not known anymore */
+#define MAX_GAP              60
+
+struct hpm_params hp;
+
+/* the replay's control state, and the one worked out from the log */
+struct hpm_state rs;
+struct hpm_state ls;
+
+/* the safety rules checker of the replay's decisions */
+struct hpm_check rc;
+
+/* cycles the log has been followed since the state was last unknown */
+unsigned long follow_cycles = 0;
+/* ...and how many are needed for the unlogged timers to be past their limits */
+unsigned long settle_cycles = 0;
+short synced = 0;
+
+unsigned long nr_lines = 0, nr_data = 0, nr_bad = 0, nr_compared = 0, nr_followed = 0;
+unsigned long nr_diffs = 0, nr_rounding = 0, nr_reseeds = 0, nr_held = 0;
+unsigned long max_diffs = 1000;
+short quiet = 0;
+short exact = 0;
+
+/* trim leading and trailing white space */
+static char *
+trim(char *s) {
+    char *e;
+
+    while (isspace((unsigned char)*s)) s++;
+    e = s + strlen(s);
+    while ((e > s) && isspace((unsigned char)e[-1])) e--;
+    *e = 0;
+    return s;
+}
+
+/* the control state is not known anymore: follow the log until it is */
+static void
+reseed() {
+    int u;
+
+    hpm_state_init( &ls );
+    /* until a compressor is seen to switch, it has been in its state for long enough;
+       its state is not known before the first data line */
+    for (u=0;u<MAXUNITS;u++) {
+        ls.unit[u].cmp = -1;
+        ls.unit[u].Scmp = settle_cycles;
+    }
+    follow_cycles = 0;
+    synced = 0;
+    nr_reseeds++;
+}
+
+/* update the control state worked out from the log with a data line */
+static void
+follow_log(const struct hpm_log_line *d) {
+    struct hpm_unit *L;
+    short cmp;
+    int u;
+
+    for (u=0;u<d->units;u++) {
+        L = &ls.unit[u];
+        cmp = (d->actual & BIT_CMP(u+1)) != 0;
+        /* switching zeroes the timer, and the cycle's end counts one */
+        if ((L->cmp != -1) && (cmp != L->cmp)) L->Scmp = 1; else L->Scmp++;
+        L->cmp = cmp;
+        L->fan = (d->actual & BIT_FAN(u+1)) != 0;
+        L->fv = (d->actual & BIT_FV(u+1)) != 0;
+        L->Sfan = 1;
+        L->Sfv = 1;
+        L->mode = d->mode[u];
+        L->Smode = d->Smode[u];
+        if (cmp) L->RunCs++;
+    }
+}
+
+/* take over the state worked out from the log; the defrost sequence position is not in
+   it - it is only known to the replay if it went into the defrost itself */
+static void
+take_log_state(int units) {
+    int u;
+
+    for (u=0;u<units;u++) {
+        ls.unit[u].dphase = rs.unit[u].dphase;
+        ls.unit[u].dexit = rs.unit[u].dexit;
+        ls.unit[u].Sdphase = rs.unit[u].Sdphase;
+    }
+    rs = ls;
+}
+
+/* non-zero if the decisions of a cycle differ from the logged ones */
+static int
+differs(const struct hpm_log_line *d, const struct hpm_state *s, const struct hpm_outputs *out) {
+    int u;
+
+    if ((d->wanted != out->wanted) || (d->actual != out->actual) || (d->sendBits != out->sendBits)) return 1;
+    for (u=0;u<d->units;u++) {
+        if (d->mode[u] != s->unit[u].mode) return 1;
+    }
+    return 0;
+}
+
+/* the logged temps are rounded: non-zero if the logged decisions come out of the cycle
+   with one of the temps nudged by up to the rounding - e.g. a compressor at 56.04 C is
+   logged at 56.0 C, and is hotter than the 56 C COMP COOLING limit */
+static int
+within_rounding(const struct hpm_state *before, const struct hpm_log_line *d) {
+    struct hpm_state s;
+    struct hpm_inputs in;
+    struct hpm_outputs out;
+    float *t;
+    int k, dir;
+
+    for (k=0;k<2*d->units;k++) {
+        for (dir=-1;dir<=1;dir+=2) {
+            in = d->in;
+            t = (k < d->units) ? &in.Tcmp[k] : &in.Tcnd[k - d->units];
+            *t += dir * LOG_ROUNDING;
+            s = *before;
+            hpm_step( &s, &in, &hp, &out );
+            if (!differs( d, &s, &out )) return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+report(const char *file, unsigned long line, const char *stamp, const struct hpm_log_line *d,
+    const struct hpm_outputs *out, short held) {
+    char msg[1000], a[40], b[40];
+    int u;
+
+    sprintf( msg, "%s:%lu %.19s%s", file, line, stamp, held ? " (a cycle left out before it)" : "" );
+    if (d->wanted != out->wanted) {
+        hpm_log_devices( a, d->wanted, d->units );
+        hpm_log_devices( b, out->wanted, d->units );
+        sprintf( msg + strlen(msg), "  WANTED:%s, replay:%s;", a, b );
+    }
+    if (d->actual != out->actual) {
+        hpm_log_devices( a, d->actual, d->units );
+        hpm_log_devices( b, out->actual, d->units );
+        sprintf( msg + strlen(msg), "  got:%s, replay:%s;", a, b );
+    }
+    for (u=0;u<d->units;u++) {
+        if (d->mode[u] == rs.unit[u].mode) continue;
+        sprintf( msg + strlen(msg), "  M%d: %s, replay: %s;", u+1,
+            trim(strcpy( a, hpm_log_mode_names[d->mode[u]] )), trim(strcpy( b, hpm_log_mode_names[rs.unit[u].mode] )) );
+    }
+    if (d->sendBits != out->sendBits) {
+        sprintf( msg + strlen(msg), "  sendBits: %d, replay: %d;", d->sendBits, out->sendBits );
+    }
+    printf( "%s\n", msg );
+}
+
+/* a broken safety rule stops the replay - a control change must never get past one */
+static void
+safety_break(const char *file, unsigned long line, const char *stamp) {
+    int u, k;
+
+    for (u=0;u<hp.units;u++) {
+        for (k=0;k<TOTALRULES;k++) {
+            if (rc.broken[u] & (1<<k))
+                fprintf( stderr, "%s:%lu %.19s  Safety rule broken by the replay: AC%d %s!\n",
+                    file, line, stamp, u+1, hpm_rule_name( 1<<k ) );
+        }
+    }
+    exit(3);
+}
+
+/* one cycle: compared with the log when the control state is known, else followed */
+static void
+step_line(const struct hpm_log_line *d, const char *file, unsigned long line, const char *stamp, short held) {
+    struct hpm_outputs out;
+    struct hpm_state before;
+    int u, in_defrost;
+
+    if (synced) {
+        before = rs;
+        hpm_step( &rs, &d->in, &hp, &out );
+        if (hpm_check( &rc, &rs, &d->in, &hp, &out )) safety_break( file, line, stamp );
+        nr_compared++;
+        follow_log( d );
+        if (differs( d, &rs, &out )) {
+            if (within_rounding( &before, d )) {
+                nr_rounding++;
+                if (exact && !quiet) report( file, line, stamp, d, &out, held );
+            }
+            else {
+                nr_diffs++;
+                if (!quiet && (nr_diffs <= max_diffs)) report( file, line, stamp, d, &out, held );
+            }
+            /* go on from the logged state */
+            take_log_state( d->units );
+            hpm_check_init( &rc, &rs );
+            for (u=0;u<d->units;u++) {
+                if ((d->mode[u] == 4) && !(out.defrosting & (1<<u))) synced = 0;
+            }
+            if (!synced) follow_cycles = settle_cycles;
+        }
+        return;
+    }
+    /* following the log: the replay's state is the log's */
+    nr_followed++;
+    follow_log( d );
+    follow_cycles++;
+    in_defrost = 0;
+    for (u=0;u<d->units;u++) if (d->mode[u] == 4) in_defrost = 1;
+    rs = ls;
+    if ((follow_cycles >= settle_cycles) && !in_defrost) {
+        synced = 1;
+        hpm_check_init( &rc, &rs );
+    }
+}
+
+/* cycles left out of the log right before a line went with the decisions and COMMS of the
+   line before - else they would have been logged - so they are stepped with its inputs.
+   Their temps are not known, but none of them crossed a limit the decisions go by */
+static void
+step_held(const struct hpm_log_line *prev, unsigned long n, const char *file, unsigned long line,
+    const char *stamp) {
+    struct hpm_log_line h = *prev;
+    unsigned long k;
+    int u;
+
+    for (k=0;k<n;k++) {
+        for (u=0;u<h.units;u++) h.Smode[u]++;
+        nr_held++;
+        step_line( &h, file, line, stamp, 1 );
+    }
+}
+
+/* replay one log; returns 0 on success, -1 if it could not be read */
+static int
+replay(const char *file) {
+    static time_t last_t = 0;
+    static int units = 0;
+    static struct hpm_log_clock log_clock;
+    static struct hpm_log_line prev;
+    struct hpm_log_line d;
+    char buff[2000];
+    unsigned long line = 0, held;
+    long gap;
+    time_t t;
+    pid_t pid;
+    int c;
+    FILE *fp = hpm_log_open( file, &pid );
+
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open %s for reading!\n", file );
+        return -1;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        line++;
+        nr_lines++;
+        /* a line too long for the buffer is none of hpm's - skip the rest of it */
+        if (!strchr( buff, '\n' ) && !feof(fp)) {
+            while (((c = fgetc(fp)) != EOF) && (c != '\n'));
+        }
+        if ((strlen(buff) < LOG_STAMP_LEN) || !(t = hpm_log_time( &log_clock, buff ))) { nr_bad++; continue; }
+        /* a daemon (re)start */
+        if (!strncmp( buff+LOG_STAMP_LEN, "***", 3 )) { reseed(); continue; }
+        if (hpm_log_parse( buff+LOG_STAMP_LEN, &d )) { nr_bad++; continue; }
+        nr_data++;
+        /* the time between the lines, less the cycles left out of the log between them */
+        gap = (long)(t - last_t) - (long)d.skipped * HPM_CYCLE_SECONDS;
+        held = d.skipped;
+        if ((d.units != units) || (gap > MAX_GAP) || (gap < -MAX_GAP) || (t < last_t)) {
+            if (units && (d.units != units))
+                fprintf( stderr, "%s:%lu: number of ACs changed from %d to %d.\n", file, line, units, d.units );
+            units = d.units;
+            hp.units = units;
+            reseed();
+            held = 0;
+        }
+        last_t = t;
+
+        if (held) step_held( &prev, held, file, line, buff );
+        prev = d;
+        step_line( &d, file, line, buff, 0 );
+    }
+    if (hpm_log_close( fp, pid )) {
+        fprintf( stderr, "Failed to decompress %s!\n", file );
+        return -1;
+    }
+    return 0;
+}
+
+/* apply a name=value control setting */
+static int
+apply_setting(struct hpm_sim_params *sp, char *s) {
+    char *name, *value;
+    int r;
+
+    value = strchr( s, '=' );
+    if (value == NULL) return -1;
+    *value++ = 0;
+    name = trim(s);
+    value = trim(value);
+    r = hpm_sim_set( sp, &hp, name, value );
+    if (r < 0) fprintf( stderr, "Bad value '%s' for %s.\n", value, name );
+    return r;
+}
+
+/* the control settings of a config file; everything else in it is skipped */
+static int
+read_config(struct hpm_sim_params *sp, const char *file) {
+    char buff[200];
+    int bad = 0;
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open config file %s for reading!\n", file );
+        return -1;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        if (buff[0] == '\n' || buff[0] == '#') continue;
+        if (strchr( buff, '=' ) == NULL) continue;
+        if (apply_setting( sp, buff ) < 0) bad++;
+    }
+    fclose (fp);
+    return bad ? -1 : 0;
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hpm-replay [-c config file] [-s name=value]... [-m max diffs] [-q] [-x] data log...\n" );
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct hpm_sim_params sp;
+    unsigned long k;
+    int bad = 0;
+    int i, opt;
+
+    hpm_sim_params_default(&sp);
+    hpm_params_default(&hp);
+    /* the config file settings go first, whatever the order of the options */
+    while ((opt = getopt( argc, argv, "c:s:m:qx" )) != -1) {
+        switch (opt) {
+            case 'c': if (read_config( &sp, optarg )) exit(2); break;
+            case 's': break;
+            case 'm': max_diffs = atol( optarg ); break;
+            case 'q': quiet = 1; break;
+            case 'x': exact = 1; break;
+            default: usage();
+        }
+    }
+    if (optind >= argc) usage();
+    optind = 1;
+    while ((opt = getopt( argc, argv, "c:s:m:qx" )) != -1) {
+        if ((opt == 's') && apply_setting( &sp, optarg )) {
+            fprintf( stderr, "Bad control setting '%s'.\n", optarg );
+            exit(2);
+        }
+    }
+
+    /* every limit the unlogged compressor timer is compared with */
+    settle_cycles = hp.min_on_cycles;
+    if (hp.min_off_cycles > settle_cycles) settle_cycles = hp.min_off_cycles;
+    if (hp.stagger_cycles > settle_cycles) settle_cycles = hp.stagger_cycles;
+    if (hp.valve_cycles > settle_cycles) settle_cycles = hp.valve_cycles;
+    settle_cycles += 2;
+
+    for (i=optind;i<argc;i++) {
+        if (replay( argv[i] )) bad++;
+    }
+
+    k = nr_compared ? nr_compared : 1;
+    printf( "%s%lu lines, %lu data lines, %lu not parsed; %lu cycles compared, %lu followed the log after %lu"
+        " restarts or gaps; %lu cycles differ (%.3f%%), %lu more only within the logged temps rounding.\n",
+        (nr_diffs && !quiet) ? "\n" : "", nr_lines, nr_data, nr_bad, nr_compared, nr_followed, nr_reseeds,
+        nr_diffs, 100.0*nr_diffs/k, nr_rounding );
+    if (nr_held) printf( "%lu of the cycles were left out of the logs over hpm's write budget, and stepped with the"
+        " inputs of the line before them.\n", nr_held );
+    if (bad) return 2;
+    return nr_diffs ? 1 : 0;
+}
+
+/* EOF */
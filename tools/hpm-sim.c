@@ -0,0 +1,286 @@
+/*
+* hpm-sim.c
+*
+* Runs the hpm control core against the plant simulator in hpm_sim.c, faster than real
+* time, and reports how the ACs did: compressor starts, defrosts, overheating protection
+* trips and heat delivered.
+* Plamen Petrov
+*
+* Usage: hpm-sim [-d days] [-c config file] [-p outdoor temps file] [-s name=value]... [-v]
+*
+*   -d  days to simulate, 120 by default
+*   -c  a file of name=value lines, like /etc/hpm.cfg: hpm.cfg's control settings and the
+*       simulation parameters in hpm_sim.h are used, everything else is skipped; so the
+*       real config file can be simulated as it is
+*   -p  outdoor temps to use instead of the made up winter, one per line, an hour apart
+*       (or tout_step hours apart, if set)
+*   -s  set one control setting or simulation parameter; these go after the config file
+*   -v  also print a line per simulated day
+*
+* Every cycle is checked against the control safety rules, and the simulation stops with
+* exit code 4 at the first one broken.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hpm_sim.h"
+
+#define MAXLEN 80
+
+#define CYCLES_PER_DAY       (24*3600/SIM_CYCLE_SECONDS)
+
+/* settings are applied in the order given, after all of them are read */
+#define MAXSETTINGS          200
+char *settings[MAXSETTINGS];
+int nr_settings = 0;
+
+/* trim leading and trailing white space */
+static char *
+trim(char *s) {
+    char *e;
+
+    while (isspace((unsigned char)*s)) s++;
+    e = s + strlen(s);
+    while ((e > s) && isspace((unsigned char)e[-1])) e--;
+    *e = 0;
+    return s;
+}
+
+static int
+add_setting(const char *s) {
+    if (nr_settings >= MAXSETTINGS) {
+        fprintf( stderr, "Too many settings, skipping '%s'.\n", s );
+        return -1;
+    }
+    settings[nr_settings++] = strdup(s);
+    return 0;
+}
+
+/* name=value lines of a config file: blank lines and comments are skipped */
+static int
+read_config(const char *file) {
+    char buff[200];
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open config file %s for reading!\n", file );
+        return -1;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        if (buff[0] == '\n' || buff[0] == '#') continue;
+        if (strchr( buff, '=' ) == NULL) continue;
+        add_setting( trim(buff) );
+    }
+    fclose (fp);
+    return 0;
+}
+
+/* apply a name=value setting; the ones not known are only reported when asked for
+   explicitly - a config file has lots of settings which are not for the simulation */
+static int
+apply_setting(struct hpm_sim_params *sp, struct hpm_params *cp, char *s, int explicit) {
+    char *name, *value;
+    int r;
+
+    value = strchr( s, '=' );
+    if (value == NULL) {
+        fprintf( stderr, "Bad setting '%s' - should be name=value.\n", s );
+        return -1;
+    }
+    *value++ = 0;
+    name = trim(s);
+    value = trim(value);
+    r = hpm_sim_set( sp, cp, name, value );
+    if (r < 0) fprintf( stderr, "Bad value '%s' for %s.\n", value, name );
+    if ((r > 0) && explicit) fprintf( stderr, "Unknown setting %s.\n", name );
+    return (r < 0) || ((r > 0) && explicit) ? -1 : 0;
+}
+
+/* outdoor temps file: one temp per line, lines which are not a number are skipped */
+static float *
+read_profile(const char *file, unsigned long *n) {
+    char buff[200], *end, *s;
+    float *t = NULL, *nt;
+    unsigned long size = 0;
+    double d;
+    FILE *fp = fopen(file, "r");
+
+    *n = 0;
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open outdoor temps file %s for reading!\n", file );
+        return NULL;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        s = trim(buff);
+        d = strtod( s, &end );
+        if ((end == s) || *end) continue;
+        if (*n == size) {
+            size = size ? 2*size : 1024;
+            nt = realloc( t, size * sizeof(*t) );
+            if (nt == NULL) break;
+            t = nt;
+        }
+        t[(*n)++] = d;
+    }
+    fclose (fp);
+    if (!*n) fprintf( stderr, "No outdoor temps in %s!\n", file );
+    return t;
+}
+
+static unsigned long
+total(const struct hpm_sim *sim, short kind) {
+    unsigned long n = 0;
+    int u;
+
+    for (u=0;u<sim->cp->units;u++) n += sim->counters[CNT(u+1,kind)];
+    return n;
+}
+
+static double
+total_heat(const struct hpm_sim *sim) {
+    double h = 0;
+    int u;
+
+    for (u=0;u<sim->cp->units;u++) h += sim->unit[u].heat - sim->unit[u].heat_back;
+    return h;
+}
+
+static void
+report(const struct hpm_sim *sim, double secs) {
+    const struct hpm_sim_params *sp = sim->sp;
+    double n = sim->cycles ? sim->cycles : 1;
+    double hours = (double)sim->cycles * SIM_CYCLE_SECONDS / 3600;
+    unsigned long hot = 0;
+    int u;
+
+    printf( "Simulated %.1f days of %d ACs, %lu cycles in %.2f seconds - %.0f times real time.\n",
+        hours/24, sim->cp->units, sim->cycles, secs, secs > 0 ? hours*3600/secs : 0 );
+    printf( "Outdoor: avg %.1f C; water: avg %.1f C, min %.1f C, below %.1f C for %.1f hours;"
+        " house: avg %.1f C, min %.1f C.\n",
+        sim->Tout_sum/n, sim->Twater_sum/n, sim->Twater_min, sp->water_set - sp->water_band,
+        (double)sim->cold_cycles * SIM_CYCLE_SECONDS / 3600, sim->Thouse_sum/n, sim->Thouse_min );
+    printf( "hwwm asked for: no ACs %.1f%%, one AC %.1f%%, all ACs %.1f%% of the time.\n",
+        100*sim->comms_cycles[0]/n, 100*sim->comms_cycles[1]/n, 100*sim->comms_cycles[2]/n );
+    printf( "\n      starts   run hours  defrosts  defrost hours  OHP trips  pre-empted  hot hours  heat kWh  taken back kWh\n" );
+    for (u=0;u<sim->cp->units;u++) {
+        printf( "AC%d  %7lu  %10.1f  %8lu  %13.1f  %9lu  %10lu  %9.1f  %8.1f  %14.1f\n", u+1,
+            sim->counters[CNT(u+1,CNT_STARTS)],
+            (double)sim->counters[CNT(u+1,CNT_RUN_CYCLES)] * SIM_CYCLE_SECONDS / 3600,
+            sim->counters[CNT(u+1,CNT_DEFROSTS)],
+            (double)sim->counters[CNT(u+1,CNT_DEFROST_CYCLES)] * SIM_CYCLE_SECONDS / 3600,
+            sim->counters[CNT(u+1,CNT_OHP_TRIPS)], sim->counters[CNT(u+1,CNT_OHP_PREEMPTS)],
+            (double)sim->unit[u].hot_cycles * SIM_CYCLE_SECONDS / 3600,
+            sim->unit[u].heat / 3600, sim->unit[u].heat_back / 3600 );
+        hot += sim->unit[u].hot_cycles;
+    }
+    printf( "all  %7lu  %10.1f  %8lu  %13.1f  %9lu  %10lu  %9.1f  %8.1f\n",
+        total(sim, CNT_STARTS), (double)total(sim, CNT_RUN_CYCLES) * SIM_CYCLE_SECONDS / 3600,
+        total(sim, CNT_DEFROSTS), (double)total(sim, CNT_DEFROST_CYCLES) * SIM_CYCLE_SECONDS / 3600,
+        total(sim, CNT_OHP_TRIPS), total(sim, CNT_OHP_PREEMPTS), (double)hot * SIM_CYCLE_SECONDS / 3600,
+        total_heat(sim) / 3600 );
+    printf( "(hot hours - compressor above %.1f C)\n", sp->hot_temp );
+}
+
+/* a broken safety rule stops the simulation - a control change must never get past one */
+static void
+safety_break(const struct hpm_sim *sim) {
+    int u, k;
+
+    for (u=0;u<sim->cp->units;u++) {
+        for (k=0;k<TOTALRULES;k++) {
+            if (sim->check.broken[u] & (1<<k))
+                fprintf( stderr, "Safety rule broken at cycle %lu (day %lu): AC%d %s!\n", sim->cycles,
+                    sim->cycles / CYCLES_PER_DAY + 1, u+1, hpm_rule_name( 1<<k ) );
+        }
+    }
+    exit(4);
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hpm-sim [-d days] [-c config file] [-p outdoor temps file] [-s name=value]... [-v]\n" );
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct hpm_sim_params sp;
+    struct hpm_params cp;
+    struct hpm_sim sim;
+    struct timespec t0, t1;
+    unsigned long days = 120;
+    unsigned long d, c;
+    unsigned long starts = 0, defrosts = 0, ohps = 0;
+    unsigned long cmdline_from = 0;
+    double heat = 0, tout = 0;
+    float *profile = NULL;
+    char *profile_file = NULL;
+    int verbose = 0;
+    int bad = 0;
+    int i, opt;
+
+    hpm_sim_params_default(&sp);
+    hpm_params_default(&cp);
+
+    /* the config file settings go first, whatever the order of the options */
+    while ((opt = getopt( argc, argv, "d:c:p:s:v" )) != -1) {
+        switch (opt) {
+            case 'd': days = atol( optarg ); if (!days) usage(); break;
+            case 'c': if (read_config( optarg )) exit(2); break;
+            case 'p': profile_file = optarg; break;
+            case 's': break;
+            case 'v': verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (optind < argc) usage();
+    cmdline_from = nr_settings;
+    optind = 1;
+    while ((opt = getopt( argc, argv, "d:c:p:s:v" )) != -1) {
+        if (opt == 's') add_setting( optarg );
+    }
+    for (i=0;i<nr_settings;i++) {
+        if (apply_setting( &sp, &cp, settings[i], i >= cmdline_from )) bad++;
+    }
+    if (bad) exit(2);
+    if (profile_file) {
+        profile = read_profile( profile_file, &sp.tout_n );
+        if (profile == NULL || !sp.tout_n) exit(3);
+        sp.tout_points = profile;
+    }
+
+    hpm_sim_init( &sim, &sp, &cp );
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    if (verbose) printf( "  day  outdoor C  water C  house C  starts  defrosts  OHP trips  heat kWh\n" );
+    for (d=0;d<days;d++) {
+        for (c=0;c<CYCLES_PER_DAY;c++) {
+            if (hpm_sim_step( &sim )) safety_break( &sim );
+            tout += sim.Tout;
+        }
+        if (verbose) {
+            printf( "%5lu  %9.1f  %7.1f  %7.1f  %6lu  %8lu  %9lu  %8.1f\n", d+1,
+                tout / CYCLES_PER_DAY, sim.Twater, sim.Thouse,
+                total(&sim, CNT_STARTS) - starts, total(&sim, CNT_DEFROSTS) - defrosts,
+                total(&sim, CNT_OHP_TRIPS) - ohps, (total_heat(&sim) - heat) / 3600 );
+            starts = total(&sim, CNT_STARTS);
+            defrosts = total(&sim, CNT_DEFROSTS);
+            ohps = total(&sim, CNT_OHP_TRIPS);
+            heat = total_heat(&sim);
+            tout = 0;
+        }
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    if (verbose) printf( "\n" );
+    report( &sim, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9 );
+
+    free( profile );
+    return 0;
+}
+
+/* EOF */
@@ -0,0 +1,536 @@
+/*
+* hpm-sweep.c
+*
+* Runs the plant simulator, or hpm-replay over recorded logs, for every combination of a
+* set of control settings or simulation parameters, on all CPU cores, and puts what came
+* out of each run in a CSV table - to see how the hand picked limits do against others.
+* Plamen Petrov
+*
+* Usage: hpm-sweep [-j threads] [-d days] [-c config file] [-p outdoor temps file]
+*                  [-s name=value]... [-r data log]... [-o CSV file] sweep...
+*
+*   -j  number of runs at a time, by default one per CPU core
+*   -d, -c, -p, -s  as for hpm-sim: the settings every run starts from
+*   -r  replay these data logs with hpm-replay instead of simulating - the logs go in
+*       the order they were written, and hpm-replay must be next to hpm-sweep
+*   -o  where to write the table, standard output by default
+*
+* Every sweep is name=values: the values are either from:to:step, or a list separated by
+* spaces; more names joined with '+' all get the same value. For example
+*     hpm-sweep 'ac1max_temp+ac2max_temp=60:66:1' 'min_on_cycles=60 120 180'
+* runs 21 simulations. The runs are handed out to the threads one at a time, as each
+* thread gets done with its previous one, so slow and quick runs even out.
+*
+* A simulation gives compressor starts per hour, the part of the AC time spent defrosting,
+* hours with the compressors hotter than hot_temp (60 C by default), OHP trips, heat
+* delivered and the water and house temps; a replay gives the number of cycles whose
+* decisions differ from the logged ones.
+*
+* A simulation breaking one of the control safety rules stops the whole sweep with exit
+* code 6, and so does a replay that does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "hpm_sim.h"
+
+#define CYCLES_PER_DAY       (24*3600/SIM_CYCLE_SECONDS)
+
+#define MAXSETTINGS          200
+#define MAXSWEEPS            16
+#define MAXNAMES             8
+#define MAXVALUES            1000
+#define MAXRUNS              1000000
+#define MAXLOGS              100
+
+/* one swept setting: all of its names get each of its values in turn */
+struct sweep
+{
+    char           *label;
+    char           *names[MAXNAMES];
+    int             nr_names;
+    char           *values[MAXVALUES];
+    int             nr_values;
+    unsigned long   stride;         /* runs between two consecutive values of this one */
+};
+
+/* what came out of a run */
+struct result
+{
+    short           failed;
+    /* simulations */
+    double          hours;
+    unsigned long   starts;
+    double          run_hours;
+    unsigned long   defrosts;
+    double          defrost_fraction;
+    double          hot_hours;
+    unsigned long   ohp_trips;
+    double          heat_kwh;
+    double          cold_hours;
+    double          water_avg;
+    double          house_min;
+    /* replays */
+    unsigned long   compared;
+    unsigned long   differ;
+    unsigned long   rounding;
+};
+
+char *settings[MAXSETTINGS];
+int nr_settings = 0;
+unsigned long cmdline_from = 0;
+struct sweep sweeps[MAXSWEEPS];
+int nr_sweeps = 0;
+char *logs[MAXLOGS];
+int nr_logs = 0;
+char *config_file = NULL;
+char replay_path[1000] = "hpm-replay";
+
+struct hpm_sim_params base_sp;
+struct hpm_params base_cp;
+unsigned long days = 120;
+
+struct result *results;
+unsigned long nr_runs = 1;
+unsigned long next_run = 0;
+
+/* trim leading and trailing white space */
+static char *
+trim(char *s) {
+    char *e;
+
+    while (isspace((unsigned char)*s)) s++;
+    e = s + strlen(s);
+    while ((e > s) && isspace((unsigned char)e[-1])) e--;
+    *e = 0;
+    return s;
+}
+
+static int
+add_setting(const char *s) {
+    if (nr_settings >= MAXSETTINGS) {
+        fprintf( stderr, "Too many settings, skipping '%s'.\n", s );
+        return -1;
+    }
+    settings[nr_settings++] = strdup(s);
+    return 0;
+}
+
+/* name=value lines of a config file: blank lines and comments are skipped */
+static int
+read_config(const char *file) {
+    char buff[200];
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open config file %s for reading!\n", file );
+        return -1;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        if (buff[0] == '\n' || buff[0] == '#') continue;
+        if (strchr( buff, '=' ) == NULL) continue;
+        add_setting( trim(buff) );
+    }
+    fclose (fp);
+    return 0;
+}
+
+/* apply a name=value setting; unknown ones are only reported when asked for explicitly */
+static int
+apply_setting(struct hpm_sim_params *sp, struct hpm_params *cp, const char *setting, int explicit) {
+    char s[200], *name, *value;
+    int r;
+
+    strncpy( s, setting, sizeof(s)-1 );
+    s[sizeof(s)-1] = 0;
+    value = strchr( s, '=' );
+    if (value == NULL) {
+        fprintf( stderr, "Bad setting '%s' - should be name=value.\n", s );
+        return -1;
+    }
+    *value++ = 0;
+    name = trim(s);
+    value = trim(value);
+    r = hpm_sim_set( sp, cp, name, value );
+    if (r < 0) fprintf( stderr, "Bad value '%s' for %s.\n", value, name );
+    if ((r > 0) && explicit) fprintf( stderr, "Unknown setting %s.\n", name );
+    return (r < 0) || ((r > 0) && explicit) ? -1 : 0;
+}
+
+/* outdoor temps file: one temp per line, lines which are not a number are skipped */
+static float *
+read_profile(const char *file, unsigned long *n) {
+    char buff[200], *end, *s;
+    float *t = NULL, *nt;
+    unsigned long size = 0;
+    double d;
+    FILE *fp = fopen(file, "r");
+
+    *n = 0;
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open outdoor temps file %s for reading!\n", file );
+        return NULL;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        s = trim(buff);
+        d = strtod( s, &end );
+        if ((end == s) || *end) continue;
+        if (*n == size) {
+            size = size ? 2*size : 1024;
+            nt = realloc( t, size * sizeof(*t) );
+            if (nt == NULL) break;
+            t = nt;
+        }
+        t[(*n)++] = d;
+    }
+    fclose (fp);
+    if (!*n) fprintf( stderr, "No outdoor temps in %s!\n", file );
+    return t;
+}
+
+/* "name[+name...]=from:to:step" or "name[+name...]=value value..." */
+static int
+parse_sweep(const char *arg) {
+    struct sweep *w = &sweeps[nr_sweeps];
+    char *s, *v, *n, *save;
+    double from, to, step, x;
+    char buff[40];
+
+    if (nr_sweeps >= MAXSWEEPS) return -1;
+    s = strdup( arg );
+    v = strchr( s, '=' );
+    if (v == NULL) return -1;
+    *v++ = 0;
+    w->label = strdup( trim(s) );
+    for (n = strtok_r( s, "+", &save ); n != NULL; n = strtok_r( NULL, "+", &save )) {
+        if (w->nr_names >= MAXNAMES) return -1;
+        w->names[w->nr_names++] = strdup( trim(n) );
+    }
+    if (!w->nr_names) return -1;
+    if ((sscanf( v, "%lf:%lf:%lf", &from, &to, &step ) == 3) && !strchr( v, ' ' )) {
+        if ((step <= 0) || (to < from)) return -1;
+        /* the small extra makes sure "to" is in, with steps like 0.1 */
+        for (x = from; x <= to + step/1000; x += step) {
+            if (w->nr_values >= MAXVALUES) return -1;
+            snprintf( buff, sizeof buff, "%g", x );
+            w->values[w->nr_values++] = strdup( buff );
+        }
+    }
+    else {
+        for (n = strtok_r( v, " ", &save ); n != NULL; n = strtok_r( NULL, " ", &save )) {
+            if (w->nr_values >= MAXVALUES) return -1;
+            w->values[w->nr_values++] = strdup( n );
+        }
+    }
+    if (!w->nr_values) return -1;
+    nr_sweeps++;
+    return 0;
+}
+
+/* the settings of run r, as name=value */
+static int
+run_settings(unsigned long r, char set[][200]) {
+    struct sweep *w;
+    int i, k, n = 0;
+
+    for (i=0;i<nr_sweeps;i++) {
+        w = &sweeps[i];
+        for (k=0;k<w->nr_names;k++) {
+            snprintf( set[n++], 200, "%s=%s", w->names[k], w->values[(r / w->stride) % w->nr_values] );
+        }
+    }
+    return n;
+}
+
+/* a broken safety rule stops the whole sweep - a control change must never get past one,
+   whatever the settings */
+static void
+safety_break(unsigned long r, const struct hpm_sim *sim) {
+    char set[MAXSWEEPS*MAXNAMES][200];
+    int i, n, u, k;
+
+    n = run_settings( r, set );
+    for (u=0;u<sim->cp->units;u++) {
+        for (k=0;k<TOTALRULES;k++) {
+            if (!(sim->check.broken[u] & (1<<k))) continue;
+            fprintf( stderr, "Safety rule broken at cycle %lu: AC%d %s, with", sim->cycles, u+1, hpm_rule_name( 1<<k ) );
+            for (i=0;i<n;i++) fprintf( stderr, " %s", set[i] );
+            fprintf( stderr, "!\n" );
+        }
+    }
+    exit(6);
+}
+
+static void
+simulate(unsigned long r, struct result *res) {
+    struct hpm_sim_params sp = base_sp;
+    struct hpm_params cp = base_cp;
+    struct hpm_sim *sim;
+    char set[MAXSWEEPS*MAXNAMES][200];
+    unsigned long c, cycles = days * CYCLES_PER_DAY;
+    unsigned long defrost_cycles = 0, run_cycles = 0, hot = 0;
+    double heat = 0;
+    int i, n, u;
+
+    n = run_settings( r, set );
+    for (i=0;i<n;i++) {
+        if (apply_setting( &sp, &cp, set[i], 1 )) { res->failed = 1; return; }
+    }
+    sim = malloc( sizeof(*sim) );
+    if (sim == NULL) { res->failed = 1; return; }
+    hpm_sim_init( sim, &sp, &cp );
+    for (c=0;c<cycles;c++) {
+        if (hpm_sim_step( sim )) safety_break( r, sim );
+    }
+
+    for (u=0;u<cp.units;u++) {
+        res->starts += sim->counters[CNT(u+1,CNT_STARTS)];
+        res->defrosts += sim->counters[CNT(u+1,CNT_DEFROSTS)];
+        res->ohp_trips += sim->counters[CNT(u+1,CNT_OHP_TRIPS)];
+        defrost_cycles += sim->counters[CNT(u+1,CNT_DEFROST_CYCLES)];
+        run_cycles += sim->counters[CNT(u+1,CNT_RUN_CYCLES)];
+        hot += sim->unit[u].hot_cycles;
+        heat += sim->unit[u].heat - sim->unit[u].heat_back;
+    }
+    res->hours = (double)cycles * SIM_CYCLE_SECONDS / 3600;
+    res->run_hours = (double)run_cycles * SIM_CYCLE_SECONDS / 3600;
+    res->defrost_fraction = (double)defrost_cycles / cycles / cp.units;
+    res->hot_hours = (double)hot * SIM_CYCLE_SECONDS / 3600;
+    res->heat_kwh = heat / 3600;
+    res->cold_hours = (double)sim->cold_cycles * SIM_CYCLE_SECONDS / 3600;
+    res->water_avg = sim->Twater_sum / cycles;
+    res->house_min = sim->Thouse_min;
+    free( sim );
+}
+
+static void
+replay(unsigned long r, struct result *res) {
+    char set[MAXSWEEPS*MAXNAMES][200];
+    char *argv[2*MAXSETTINGS + 2*MAXSWEEPS*MAXNAMES + MAXLOGS + 8];
+    char buff[1000], *s;
+    int a = 0, i, n, p[2], status;
+    pid_t pid;
+    FILE *fp;
+
+    n = run_settings( r, set );
+    argv[a++] = replay_path;
+    argv[a++] = "-q";
+    if (config_file) { argv[a++] = "-c"; argv[a++] = config_file; }
+    for (i=cmdline_from;i<nr_settings;i++) { argv[a++] = "-s"; argv[a++] = settings[i]; }
+    for (i=0;i<n;i++) { argv[a++] = "-s"; argv[a++] = set[i]; }
+    for (i=0;i<nr_logs;i++) argv[a++] = logs[i];
+    argv[a] = NULL;
+
+    res->failed = 1;
+    if (pipe(p)) return;
+    pid = fork();
+    if (pid < 0) { close(p[0]); close(p[1]); return; }
+    if (!pid) {
+        dup2( p[1], 1 );
+        close( p[0] ); close( p[1] );
+        execvp( argv[0], argv );
+        _exit(127);
+    }
+    close( p[1] );
+    fp = fdopen( p[0], "r" );
+    if (fp == NULL) { close(p[0]); waitpid( pid, &status, 0 ); return; }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        if ((s = strstr( buff, "cycles compared" )) == NULL) continue;
+        /* the summary line: "...; N cycles compared, ... ; N cycles differ (...), N more only..." */
+        while ((s > buff) && (s[-1] == ' ')) s--;
+        while ((s > buff) && isdigit((unsigned char)s[-1])) s--;
+        res->compared = strtoul( s, NULL, 10 );
+        if ((s = strstr( buff, "restarts or gaps; " )) != NULL) res->differ = strtoul( s+18, NULL, 10 );
+        if ((s = strstr( buff, "), " )) != NULL) res->rounding = strtoul( s+3, NULL, 10 );
+        res->failed = 0;
+    }
+    fclose( fp );
+    waitpid( pid, &status, 0 );
+    /* hpm-replay exits with 1 if there are differences, 2 on errors, and 3 if a safety
+       rule got broken - it says which one itself */
+    if (WIFEXITED(status) && (WEXITSTATUS(status) == 3)) {
+        fprintf( stderr, "hpm-replay broke a safety rule with" );
+        for (i=0;i<n;i++) fprintf( stderr, " %s", set[i] );
+        fprintf( stderr, "!\n" );
+        exit(6);
+    }
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) > 1)) res->failed = 1;
+}
+
+static void *
+worker(void *arg) {
+    unsigned long r;
+
+    while ((r = __sync_fetch_and_add( &next_run, 1 )) < nr_runs) {
+        if (nr_logs) replay( r, &results[r] );
+        else simulate( r, &results[r] );
+    }
+    return NULL;
+}
+
+/* a CSV field, quoted if it has to be */
+static void
+csv_field(FILE *fp, const char *s) {
+    if (!strpbrk( s, ",\" " )) { fprintf( fp, "%s,", s ); return; }
+    fputc( '"', fp );
+    for (; *s; s++) {
+        if (*s == '"') fputc( '"', fp );
+        fputc( *s, fp );
+    }
+    fprintf( fp, "\"," );
+}
+
+static void
+write_table(FILE *fp) {
+    struct result *res;
+    unsigned long r;
+    int i;
+
+    for (i=0;i<nr_sweeps;i++) csv_field( fp, sweeps[i].label );
+    if (nr_logs) fprintf( fp, "cycles_compared,cycles_differ,cycles_within_rounding\n" );
+    else fprintf( fp, "hours,starts,starts_per_hour,run_hours,defrosts,defrost_fraction,hot_hours,"
+        "ohp_trips,heat_kwh,cold_hours,water_avg,house_min\n" );
+    for (r=0;r<nr_runs;r++) {
+        res = &results[r];
+        for (i=0;i<nr_sweeps;i++) csv_field( fp, sweeps[i].values[(r / sweeps[i].stride) % sweeps[i].nr_values] );
+        if (res->failed) {
+            fprintf( fp, "failed\n" );
+            continue;
+        }
+        if (nr_logs) {
+            fprintf( fp, "%lu,%lu,%lu\n", res->compared, res->differ, res->rounding );
+            continue;
+        }
+        fprintf( fp, "%.1f,%lu,%.4f,%.1f,%lu,%.5f,%.2f,%lu,%.1f,%.2f,%.2f,%.2f\n",
+            res->hours, res->starts, res->starts / res->hours, res->run_hours, res->defrosts,
+            res->defrost_fraction, res->hot_hours, res->ohp_trips, res->heat_kwh, res->cold_hours,
+            res->water_avg, res->house_min );
+    }
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hpm-sweep [-j threads] [-d days] [-c config file] [-p outdoor temps file]\n"
+        "                 [-s name=value]... [-r data log]... [-o CSV file] name[+name...]=from:to:step|'value value...'...\n" );
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct hpm_sim_params sp;
+    struct hpm_params cp;
+    struct timespec t0, t1;
+    pthread_t *threads;
+    char *out_file = NULL;
+    char *profile_file = NULL;
+    float *profile = NULL;
+    long nr_threads = sysconf( _SC_NPROCESSORS_ONLN );
+    unsigned long r;
+    int bad = 0, failed = 0;
+    int i, k, opt;
+    FILE *fp = stdout;
+
+    hpm_sim_params_default(&base_sp);
+    hpm_params_default(&base_cp);
+
+    /* the config file settings go first, whatever the order of the options */
+    while ((opt = getopt( argc, argv, "j:d:c:p:s:r:o:" )) != -1) {
+        switch (opt) {
+            case 'j': nr_threads = atol( optarg ); break;
+            case 'd': days = atol( optarg ); if (!days) usage(); break;
+            case 'c': if (read_config( optarg )) exit(2); config_file = optarg; break;
+            case 'p': profile_file = optarg; break;
+            case 's': break;
+            case 'r': if (nr_logs < MAXLOGS) logs[nr_logs++] = optarg; break;
+            case 'o': out_file = optarg; break;
+            default: usage();
+        }
+    }
+    for (i=optind;i<argc;i++) {
+        if (parse_sweep( argv[i] )) {
+            fprintf( stderr, "Bad sweep '%s'.\n", argv[i] );
+            exit(2);
+        }
+    }
+    if (!nr_sweeps) usage();
+    if (nr_threads < 1) nr_threads = 1;
+    cmdline_from = nr_settings;
+    optind = 1;
+    while ((opt = getopt( argc, argv, "j:d:c:p:s:r:o:" )) != -1) {
+        if (opt == 's') add_setting( optarg );
+    }
+    for (i=0;i<nr_settings;i++) {
+        if (apply_setting( &base_sp, &base_cp, settings[i], i >= cmdline_from )) bad++;
+    }
+    if (profile_file) {
+        profile = read_profile( profile_file, &base_sp.tout_n );
+        if (profile == NULL || !base_sp.tout_n) exit(3);
+        base_sp.tout_points = profile;
+    }
+    /* every swept value must be good, before anything is run */
+    for (i=0;i<nr_sweeps;i++) {
+        sweeps[i].stride = nr_runs;
+        nr_runs *= sweeps[i].nr_values;
+        if (nr_runs > MAXRUNS) {
+            fprintf( stderr, "More than %d runs - sweep less.\n", MAXRUNS );
+            exit(2);
+        }
+        for (r=0;r<sweeps[i].nr_values;r++) {
+            for (k=0;k<sweeps[i].nr_names;k++) {
+                char set[200];
+                sp = base_sp;
+                cp = base_cp;
+                snprintf( set, sizeof set, "%s=%s", sweeps[i].names[k], sweeps[i].values[r] );
+                if (apply_setting( &sp, &cp, set, 1 )) bad++;
+            }
+        }
+    }
+    if (bad) exit(2);
+    if (nr_logs && strchr( argv[0], '/' )) {
+        /* hpm-replay next to us */
+        snprintf( replay_path, sizeof replay_path, "%s", argv[0] );
+        *strrchr( replay_path, '/' ) = 0;
+        strncat( replay_path, "/hpm-replay", sizeof(replay_path) - strlen(replay_path) - 1 );
+    }
+
+    results = calloc( nr_runs, sizeof(*results) );
+    threads = calloc( nr_threads, sizeof(*threads) );
+    if ((results == NULL) || (threads == NULL)) {
+        fprintf( stderr, "Out of memory!\n" );
+        exit(4);
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    for (i=0;i<nr_threads;i++) {
+        if (pthread_create( &threads[i], NULL, worker, NULL )) {
+            nr_threads = i;
+            break;
+        }
+    }
+    if (!nr_threads) worker( NULL );
+    for (i=0;i<nr_threads;i++) pthread_join( threads[i], NULL );
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+    if (out_file && ((fp = fopen( out_file, "w" )) == NULL)) {
+        fprintf( stderr, "Failed to open %s for writing!\n", out_file );
+        exit(5);
+    }
+    write_table( fp );
+    if (fp != stdout) fclose( fp );
+    for (r=0;r<nr_runs;r++) if (results[r].failed) failed++;
+    fprintf( stderr, "%lu %s on %ld threads in %.2f seconds%s.\n", nr_runs, nr_logs ? "replays" : "simulations",
+        nr_threads ? nr_threads : 1, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+        failed ? ", some failed" : "" );
+    free( profile );
+    return failed ? 1 : 0;
+}
+
+/* EOF */
@@ -0,0 +1,61 @@
+/*
+* hpm_whitebox.h
+*
+* Builds the daemon into a tool: hpm.c is included with main() left out and all of its
+* files and sysfs trees moved under FIXTURE_DIR, which the tool defines before including
+* this - so nothing real is touched. Such a tool is white-box: it works on hpm's own
+* globals and static functions, and none of its own names may be one of them.
+* Plamen Petrov
+*
+* A file hpm.c gets goes here too, once, for all of the tools. hpm.c's warnings are left
+* to the daemon build, instead of being shown once more for every tool.
+*/
+
+#ifndef HPM_WHITEBOX_H
+#define HPM_WHITEBOX_H
+
+#ifndef FIXTURE_DIR
+#error "FIXTURE_DIR must be defined before hpm_whitebox.h is included"
+#endif
+
+#define HPM_PATHS_SET
+#define RUNNING_DIR     FIXTURE_DIR
+#define LOCK_FILE       FIXTURE_DIR"/hpm.pid"
+#define LOG_FILE        FIXTURE_DIR"/hpm.log"
+#define DATA_FILE       FIXTURE_DIR"/hpm_data.log"
+#define TABLE_FILE      FIXTURE_DIR"/hpm_current"
+#define JSON_FILE       FIXTURE_DIR"/hpm_current_json"
+#define CFG_TABLE_FILE  FIXTURE_DIR"/hpm_cur_cfg"
+#define COUNTERS_FILE   FIXTURE_DIR"/hpm_counters"
+#define DEFROST_FILE    FIXTURE_DIR"/hpm_defrost"
+#define STATS_FILE      FIXTURE_DIR"/hpm_stats"
+#define HEAT_FILE       FIXTURE_DIR"/hpm_heat"
+#define SHADOW_FILE     FIXTURE_DIR"/hpm_shadow"
+#define LATENCY_FILE    FIXTURE_DIR"/hpm_latency"
+#define WRITES_FILE     FIXTURE_DIR"/hpm_writes"
+#define HEARTBEAT_FILE  FIXTURE_DIR"/hpm_heartbeat"
+#define CONFIG_FILE     FIXTURE_DIR"/hpm.cfg"
+#define PRSSTNC_DIR     FIXTURE_DIR
+#define PRSSTNC_FILE    PRSSTNC_DIR"/hpm_prsstnc"
+#define JOURNAL_FILE    PRSSTNC_DIR"/hpm_prsstnc.jrnl"
+#define STATE_FILE      FIXTURE_DIR"/hpm_state"
+#define BOOT_ID_FILE    FIXTURE_DIR"/boot_id"
+#define GPIO_ROOT       FIXTURE_DIR"/gpio"
+#define SENSORS_DIR     FIXTURE_DIR"/w1"
+
+/* the sensors are read back to back */
+#define SENSOR_PAUSE    0
+
+#define HPM_NO_MAIN
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wstringop-truncation"
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#include "hpm.c"
+#pragma GCC diagnostic pop
+
+#endif
+
+/* EOF */
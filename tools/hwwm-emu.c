@@ -0,0 +1,535 @@
+/*
+* hwwm-emu.c
+*
+* Emulates hwwm on the other end of the comms pins, for end-to-end tests of the hwwm <-->
+* hpm protocol without the two boards wired together: hwwm asks for ACs on comms pins 1
+* and 2, and reads hpm's answer - sendBits - back from pins 3 and 4, all through a GPIO
+* sysfs tree of plain files; hpm's side is hpm's own ReadComms() and WriteCommsPins(), built
+* in, with the control core and the plant simulator of hpm-sim behind them. Cycles run
+* back to back, so thousands of hours go in a minute or so.
+* Plamen Petrov
+*
+* Usage: hwwm-emu [-h hours] [-b water|random|script file] [-i] [-w minutes]
+*                 [-o outage hours] [-r seed] [-c config file] [-s name=value]... [-v]
+*
+*   -h  hours to emulate, 1000 by default
+*   -b  what hwwm wants:
+*         water   one AC or all of them by the water loop temp, as hpm-sim's stand-in -
+*                 the default
+*         random  no ACs, one or all, changing at random every -w minutes on average
+*         script  the lines of a file, "<minutes> <request>" each, one after the other
+*                 and over again; request is 0 (no ACs), 1 (one), 2 (all) or 3 (battery)
+*   -i  hwwm ignores sendBits; by default it asks for more ACs only when hpm says one can
+*       be started (bit 1), and for less only when one can be stopped (bit 2)
+*   -w  average minutes between random requests, 10 by default
+*   -o  average hours between power outages, when hwwm says power went to battery for
+*       1 to 60 minutes; 100 by default, 0 for none
+*   -r  random numbers seed, 1 by default - the same seed gives the same run
+*   -c  a config file for the control settings and simulation parameters, as hpm-sim's
+*   -s  set one of them, after the config file
+*   -v  print every request change, and how long it took to be fulfilled
+*
+* A request is fulfilled when as many ACs run as asked for - or as many as there are to
+* use - or, for less ACs, when no more than asked for run; on battery, when no compressor
+* does. An AC in DEFROST counts as running, whether its compressor is on or not. The
+* time it took is counted from the cycle hpm read the request on the pins; a request
+* changed before it got fulfilled is counted as superseded.
+*
+* Every cycle is checked against the protocol rules:
+*   battery     - with hwwm on battery, no compressor runs after the cycle
+*   not asked   - no compressor starts while as many ACs as asked for already run
+*   can start   - sendBits are not 1 - an AC can be started - while every AC to use runs;
+*                 3 is then "all of them running, and can be stopped"
+*   can stop    - sendBits bit 2 is not set while no AC runs
+* and against the control safety rules, as in hpm-sim. The exit code is 0 if no rule was
+* broken, 1 if a protocol rule was, 2 on errors and 4 on a broken safety rule, which stops
+* the run right away.
+*/
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+
+/* the fixtures directory, and all of hpm's files in it */
+#define FIXTURE_DIR     "/dev/shm/hwwm-emu"
+
+/* before hpm.c, whose sensor name macros would otherwise rename the simulation's fields */
+#include "hpm_sim.h"
+
+#include "hpm_whitebox.h"
+
+#define CYCLES_PER_HOUR      (3600/SIM_CYCLE_SECONDS)
+
+/* longest fulfilment time told apart, in cycles - an hour; longer ones are counted in it */
+#define MAXLATENCY           CYCLES_PER_HOUR
+
+/* broken protocol rules printed, of each */
+#define MAXREPORTED          5
+
+#define BEHAVE_WATER         0
+#define BEHAVE_RANDOM        1
+#define BEHAVE_SCRIPT        2
+
+/* settings are applied in the order given, after all of them are read */
+#define MAXSETTINGS          200
+char *emu_settings[MAXSETTINGS];
+int nr_emu_settings = 0;
+
+/* the script: minutes and request of every step */
+#define MAXSTEPS             1000
+float script_minutes[MAXSTEPS];
+unsigned short script_request[MAXSTEPS];
+int script_steps = 0;
+
+/* Fulfilment times of one kind of request */
+struct latency
+{
+    const char     *name;
+    unsigned long   requests;
+    unsigned long   fulfilled;
+    unsigned long   superseded;
+    unsigned long   hist[MAXLATENCY+1];     /* fulfilled requests, by cycles they took */
+};
+
+struct latency lat[3] = { { "more ACs" }, { "less ACs" }, { "battery" } };
+
+/* Protocol rules */
+#define RULE_BATTERY         0
+#define RULE_NOT_ASKED       1
+#define RULE_CAN_START       2
+#define RULE_CAN_STOP        3
+#define TOTALPROTORULES      4
+
+const char *proto_rule_names[TOTALPROTORULES] = { "battery", "not asked", "can start", "can stop" };
+unsigned long proto_broken[TOTALPROTORULES];
+
+static int
+add_setting(const char *s) {
+    if (nr_emu_settings >= MAXSETTINGS) {
+        fprintf( stderr, "Too many settings, skipping '%s'.\n", s );
+        return -1;
+    }
+    emu_settings[nr_emu_settings++] = strdup(s);
+    return 0;
+}
+
+/* name=value lines of a config file: blank lines and comments are skipped; trim() is
+   hpm's own */
+static int
+read_config(const char *file) {
+    char buff[200];
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open config file %s for reading!\n", file );
+        return -1;
+    }
+    while (fgets( buff, sizeof buff, fp ) != NULL) {
+        if (buff[0] == '\n' || buff[0] == '#') continue;
+        if (strchr( buff, '=' ) == NULL) continue;
+        add_setting( trim(buff) );
+    }
+    fclose (fp);
+    return 0;
+}
+
+/* apply a name=value setting; the ones not known are only reported when asked for
+   explicitly - a config file has lots of settings which are not for the emulation */
+static int
+apply_setting(struct hpm_sim_params *sp, struct hpm_params *cp, char *s, int explicit) {
+    char *name, *value;
+    int r;
+
+    value = strchr( s, '=' );
+    if (value == NULL) {
+        fprintf( stderr, "Bad setting '%s' - should be name=value.\n", s );
+        return -1;
+    }
+    *value++ = 0;
+    name = trim(s);
+    value = trim(value);
+    r = hpm_sim_set( sp, cp, name, value );
+    if (r < 0) fprintf( stderr, "Bad value '%s' for %s.\n", value, name );
+    if ((r > 0) && explicit) fprintf( stderr, "Unknown setting %s.\n", name );
+    return (r < 0) || ((r > 0) && explicit) ? -1 : 0;
+}
+
+/* script file: "<minutes> <request>" lines, the others are skipped */
+static int
+read_script(const char *file) {
+    char buff[200];
+    float m;
+    unsigned short r;
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf( stderr, "Failed to open script file %s for reading!\n", file );
+        return -1;
+    }
+    while ((script_steps < MAXSTEPS) && (fgets( buff, sizeof buff, fp ) != NULL)) {
+        if ((sscanf( buff, "%f %hu", &m, &r ) != 2) || (m <= 0) || (r > 3)) continue;
+        script_minutes[script_steps] = m;
+        script_request[script_steps] = r;
+        script_steps++;
+    }
+    fclose (fp);
+    if (!script_steps) {
+        fprintf( stderr, "No steps in script file %s!\n", file );
+        return -1;
+    }
+    return 0;
+}
+
+/* hwwm's side of the pins - its own plain file reads and writes, not hpm's */
+static int
+pin_write(int pin, int value) {
+    char path[100];
+    FILE *fp;
+
+    sprintf( path, GPIO_ROOT"/gpio%d/value", pin );
+    fp = fopen( path, "w" );
+    if (fp == NULL) return -1;
+    fputs( value ? "1\n" : "0\n", fp );
+    fclose( fp );
+    return 0;
+}
+
+static int
+pin_read(int pin) {
+    char path[100];
+    int c;
+    FILE *fp;
+
+    sprintf( path, GPIO_ROOT"/gpio%d/value", pin );
+    fp = fopen( path, "r" );
+    if (fp == NULL) return -1;
+    c = fgetc( fp );
+    fclose( fp );
+    return c == '1';
+}
+
+/* the GPIO sysfs tree of the comms pins */
+static int
+make_pins() {
+    char path[100];
+    int pins[4] = { cfg.commspin1_pin, cfg.commspin2_pin, cfg.commspin3_pin, cfg.commspin4_pin };
+    short i;
+
+    mkdir( FIXTURE_DIR, 0755 );
+    mkdir( GPIO_ROOT, 0755 );
+    unlink( LOG_FILE );
+    for (i=0;i<4;i++) {
+        sprintf( path, GPIO_ROOT"/gpio%d", pins[i] );
+        mkdir( path, 0755 );
+        if (pin_write( pins[i], 0 )) {
+            fprintf( stderr, "Failed to create GPIO fixture %s!\n", path );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* random time to the next event, exponential with the given average, in cycles */
+static unsigned long
+random_cycles(double minutes) {
+    double u = (random() + 1.0) / ((double)RAND_MAX + 2.0);
+
+    return 1 + (unsigned long)(-log( u ) * minutes * 60 / SIM_CYCLE_SECONDS);
+}
+
+/* ACs running, as the protocol counts them */
+static short
+running(const struct hpm_state *s, const struct hpm_params *p) {
+    short n = 0;
+    int u;
+
+    for (u=0;u<p->units;u++) {
+        if (s->unit[u].cmp || (s->unit[u].mode == 4)) n++;
+    }
+    return n;
+}
+
+/* compressors running - a defrost can be in a phase with its compressor off */
+static short
+compressors(const struct hpm_state *s, const struct hpm_params *p) {
+    short n = 0;
+    int u;
+
+    for (u=0;u<p->units;u++) n += (s->unit[u].cmp != 0);
+    return n;
+}
+
+static short
+usable(const struct hpm_params *p) {
+    short n = 0;
+    int u;
+
+    for (u=0;u<p->units;u++) n += (p->unit[u].use != 0);
+    return n;
+}
+
+/* ACs a request asks for */
+static short
+asked(unsigned short request, const struct hpm_params *p) {
+    if (request == 1) return 1;
+    if (request == 2) return p->units;
+    return 0;
+}
+
+static void
+proto_break(short rule, unsigned long cycle, const char *what) {
+    if (proto_broken[rule]++ < MAXREPORTED) {
+        printf( "Protocol rule '%s' broken at hour %.2f: %s\n", proto_rule_names[rule],
+            (double)cycle / CYCLES_PER_HOUR, what );
+    }
+}
+
+/* cycles below which the given part of a latency histogram's requests got fulfilled */
+static double
+percentile(const struct latency *l, double part) {
+    unsigned long n = 0;
+    unsigned long k;
+
+    if (!l->fulfilled) return 0;
+    for (k=0;k<=MAXLATENCY;k++) {
+        n += l->hist[k];
+        if (n >= part * l->fulfilled) return k;
+    }
+    return MAXLATENCY;
+}
+
+static void
+report(const struct hpm_sim *sim, const char *behaviour, int ignore, double secs) {
+    double hours = (double)sim->cycles / CYCLES_PER_HOUR;
+    double n = sim->cycles ? sim->cycles : 1;
+    unsigned long broken = 0;
+    short k;
+
+    printf( "Emulated %.1f hours of hwwm (%s, %s sendBits) and %d ACs, %lu cycles in %.2f seconds.\n",
+        hours, behaviour, ignore ? "ignoring" : "reacting to", sim->cp->units, sim->cycles, secs );
+    printf( "hwwm asked for: no ACs %.1f%%, one AC %.1f%%, all ACs %.1f%%, on battery %.1f%% of the time.\n",
+        100*sim->comms_cycles[0]/n, 100*sim->comms_cycles[1]/n, 100*sim->comms_cycles[2]/n,
+        100*sim->comms_cycles[3]/n );
+    printf( "\n            requests  fulfilled  superseded  median s  90%% s  99%% s  longest s\n" );
+    for (k=0;k<3;k++) {
+        printf( "%-10s  %8lu  %9lu  %10lu  %8.0f  %5.0f  %5.0f  %9.0f\n", lat[k].name,
+            lat[k].requests, lat[k].fulfilled, lat[k].superseded,
+            percentile( &lat[k], 0.5 ) * SIM_CYCLE_SECONDS, percentile( &lat[k], 0.9 ) * SIM_CYCLE_SECONDS,
+            percentile( &lat[k], 0.99 ) * SIM_CYCLE_SECONDS, percentile( &lat[k], 1 ) * SIM_CYCLE_SECONDS );
+    }
+    printf( "(times from hpm reading the request to it being fulfilled, in %d second steps)\n\n", SIM_CYCLE_SECONDS );
+    printf( "Protocol rules broken:" );
+    for (k=0;k<TOTALPROTORULES;k++) {
+        printf( "%s %s %lu", k ? "," : "", proto_rule_names[k], proto_broken[k] );
+        broken += proto_broken[k];
+    }
+    printf( " - %s.\n", broken ? "FAILED" : "all kept" );
+}
+
+/* a broken safety rule stops the emulation - as in hpm-sim */
+static void
+safety_break(const struct hpm_sim *sim) {
+    int u, k;
+
+    for (u=0;u<sim->cp->units;u++) {
+        for (k=0;k<TOTALRULES;k++) {
+            if (sim->check.broken[u] & (1<<k))
+                fprintf( stderr, "Safety rule broken at hour %.2f: AC%d %s!\n",
+                    (double)sim->cycles / CYCLES_PER_HOUR, u+1, hpm_rule_name( 1<<k ) );
+        }
+    }
+    exit(4);
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hwwm-emu [-h hours] [-b water|random|script file] [-i] [-w minutes]\n"
+        "                [-o outage hours] [-r seed] [-c config file] [-s name=value]... [-v]\n" );
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct hpm_sim_params sp;
+    struct hpm_params cp;
+    static struct hpm_sim sim;
+    struct hpm_state before;
+    struct timespec t0, t1;
+    double hours = 1000, wait_minutes = 10, outage_hours = 100;
+    const char *behaviour = "water";
+    unsigned long cycles, c;
+    unsigned long next_random = 0, next_step = 0, next_outage = 0, outage_end = 0;
+    unsigned long since = 0;            /* cycle the pending request was read by hpm */
+    unsigned long cmdline_from = 0;
+    unsigned int seed = 1;
+    unsigned short desire = 0;          /* what hwwm would like */
+    unsigned short request = 0;         /* what it asks for on the pins */
+    unsigned short last_read = 0;       /* the request hpm read the cycle before */
+    unsigned short written = 0;         /* the request on the pins */
+    unsigned short bits = 0;            /* sendBits, as hwwm read them */
+    short behave = BEHAVE_WATER;
+    short pending = -1;                 /* the kind of request not fulfilled yet, -1 for none */
+    short ignore = 0, verbose = 0;
+    short on_battery = 0;
+    short step = 0, n, want, done, u;
+    char what[100];
+    int bad = 0;
+    int i, opt;
+
+    hpm_sim_params_default(&sp);
+    hpm_params_default(&cp);
+
+    /* the config file settings go first, whatever the order of the options */
+    while ((opt = getopt( argc, argv, "h:b:iw:o:r:c:s:v" )) != -1) {
+        switch (opt) {
+            case 'h': hours = atof( optarg ); if (hours <= 0) usage(); break;
+            case 'b': behaviour = optarg; break;
+            case 'i': ignore = 1; break;
+            case 'w': wait_minutes = atof( optarg ); if (wait_minutes <= 0) usage(); break;
+            case 'o': outage_hours = atof( optarg ); if (outage_hours < 0) usage(); break;
+            case 'r': seed = strtoul( optarg, NULL, 10 ); break;
+            case 'c': if (read_config( optarg )) exit(2); break;
+            case 's': break;
+            case 'v': verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (!strcmp( behaviour, "water" )) behave = BEHAVE_WATER;
+    else if (!strcmp( behaviour, "random" )) behave = BEHAVE_RANDOM;
+    else if (!strcmp( behaviour, "script" ) && (optind < argc)) {
+        behave = BEHAVE_SCRIPT;
+        if (read_script( argv[optind++] )) exit(2);
+    }
+    else usage();
+    if (optind < argc) usage();
+    cmdline_from = nr_emu_settings;
+    optind = 1;
+    while ((opt = getopt( argc, argv, "h:b:iw:o:r:c:s:v" )) != -1) {
+        if (opt == 's') add_setting( optarg );
+    }
+    for (i=0;i<nr_emu_settings;i++) {
+        if (apply_setting( &sp, &cp, emu_settings[i], i >= cmdline_from )) bad++;
+    }
+    if (bad) exit(2);
+
+    /* hpm's side: its default comms pins, on the emulated GPIO tree */
+    SetDefaultCfg();
+    cfg.units = cp.units;
+    if (make_pins()) exit(2);
+    srandom( seed );
+    if (outage_hours > 0) next_outage = random_cycles( outage_hours * 60 );
+
+    hpm_sim_init( &sim, &sp, &cp );
+    cycles = hours * CYCLES_PER_HOUR;
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    for (c=0;c<cycles;c++) {
+        /* hwwm: what it would like, */
+        switch (behave) {
+            case BEHAVE_WATER:
+                /* the stand-in keeps its own hysteresis in in.COMMS */
+                sim.in.COMMS = desire;
+                hpm_sim_inputs( &sim );
+                desire = sim.in.COMMS;
+                break;
+            case BEHAVE_RANDOM:
+                if (c >= next_random) {
+                    desire = random() % 3;
+                    next_random = c + random_cycles( wait_minutes );
+                }
+                hpm_sim_inputs( &sim );
+                break;
+            case BEHAVE_SCRIPT:
+                if (c >= next_step) {
+                    desire = script_request[step];
+                    next_step = c + script_minutes[step] * 60 / SIM_CYCLE_SECONDS;
+                    step = (step + 1) % script_steps;
+                }
+                hpm_sim_inputs( &sim );
+                break;
+        }
+        /* power outages, */
+        if (next_outage && (c >= next_outage)) {
+            on_battery = 1;
+            outage_end = c + 1 + random() % (3600 / SIM_CYCLE_SECONDS);
+            next_outage = outage_end + random_cycles( outage_hours * 60 );
+        }
+        if (on_battery && (c >= outage_end)) on_battery = 0;
+        /* and what it asks for - only as sendBits allow, if it minds them */
+        if (on_battery) request = 3;
+        else if ((request == 3) || ignore) request = desire;
+        else if ((asked( desire, &cp ) > asked( request, &cp )) && (bits & 1)) request = desire;
+        else if ((asked( desire, &cp ) < asked( request, &cp )) && (bits & 2)) request = desire;
+        else if (asked( desire, &cp ) == asked( request, &cp )) request = desire;
+        /* the pins hold their level, so they are only written on a change */
+        if (request != written) {
+            pin_write( cfg.commspin1_pin, request & 1 );
+            pin_write( cfg.commspin2_pin, request & 2 );
+            written = request;
+        }
+
+        /* hpm: reads the pins, decides, and answers on the other two */
+        ReadComms();
+        sim.in.COMMS = COMMS;
+        before = sim.state;
+        hpm_step( &sim.state, &sim.in, sim.cp, &sim.out );
+        if (hpm_check( &sim.check, &sim.state, &sim.in, sim.cp, &sim.out )) safety_break( &sim );
+        sendBits = sim.out.sendBits;
+        WriteCommsPins();
+
+        /* the protocol rules */
+        n = running( &sim.state, &cp );
+        want = asked( COMMS, &cp );
+        if ((COMMS == 3) && compressors( &sim.state, &cp )) {
+            sprintf( what, "%d compressors running on battery", compressors( &sim.state, &cp ) );
+            proto_break( RULE_BATTERY, c, what );
+        }
+        for (u=0;u<cp.units;u++) {
+            if (!before.unit[u].cmp && sim.state.unit[u].cmp && (before.unit[u].mode != 4) &&
+                (sim.state.unit[u].mode != 4) && (running( &before, &cp ) >= want)) {
+                sprintf( what, "AC%d started with %d ACs running and %d asked for", u+1, running( &before, &cp ), want );
+                proto_break( RULE_NOT_ASKED, c, what );
+            }
+        }
+        /* 3 with every AC running is "all running, and can be stopped" */
+        if ((sendBits == 1) && (n >= usable( &cp ))) proto_break( RULE_CAN_START, c, "sendBits say an AC can start, with all running" );
+        if ((sendBits & 2) && !n) proto_break( RULE_CAN_STOP, c, "sendBits say an AC can stop, with none running" );
+
+        /* the request's fulfilment */
+        if (COMMS != last_read) {
+            if (pending >= 0) lat[pending].superseded++;
+            pending = (COMMS == 3) ? 2 : (want > asked( last_read, &cp )) ? 0 : 1;
+            if ((last_read == 3) && (COMMS != 3)) pending = want ? 0 : -1;
+            if (pending >= 0) lat[pending].requests++;
+            since = c;
+            last_read = COMMS;
+        }
+        if (pending == 0) done = (n >= ((want < usable( &cp )) ? want : usable( &cp )));
+        else if (pending == 2) done = !compressors( &sim.state, &cp );
+        else done = (pending > 0) && (n <= want);
+        if (done) {
+            lat[pending].fulfilled++;
+            lat[pending].hist[(c - since < MAXLATENCY) ? c - since : MAXLATENCY]++;
+            if (verbose) printf( "hour %9.2f: %-8s (COMMS %d) fulfilled in %lu s\n",
+                (double)c / CYCLES_PER_HOUR, lat[pending].name, COMMS, (c - since) * SIM_CYCLE_SECONDS );
+            pending = -1;
+        }
+
+        hpm_sim_plant( &sim );
+        /* hwwm reads the answer for its next move */
+        bits = (pin_read( cfg.commspin3_pin ) == 1) | ((pin_read( cfg.commspin4_pin ) == 1) << 1);
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    report( &sim, behaviour, ignore, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9 );
+
+    for (i=0;i<TOTALPROTORULES;i++) {
+        if (proto_broken[i]) return 1;
+    }
+    return 0;
+}
+
+/* EOF */
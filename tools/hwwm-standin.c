@@ -0,0 +1,217 @@
+/*
+* hwwm-standin.c
+*
+* Stands in for hwwm on hpm's command channel, so it can be tried out without the real
+* one: sends hpm the commands typed in, and heartbeats, and prints what hpm sends back.
+* Plamen Petrov
+*
+* Usage: hwwm-standin [-s hpm socket] [-l own socket] [-b heartbeat seconds] [-r resend ms]
+*
+*   -s  hpm's hpm_socket, /run/hpm.sock by default
+*   -l  the socket to take hpm's answers and availability on - hpm's hwwm_socket,
+*       /run/hwwm.sock by default
+*   -b  seconds between heartbeats, 5 by default
+*   -r  milliseconds to wait for an answer before sending a command again, 1000 by
+*       default; it is sent at most 5 times
+*
+* Commands, one per line on the standard input:
+*   power N [avoid M] [battery 1]   ask for N ACs running, AC u avoided if bit u-1 of M
+*                                   is set, and say power went to battery
+*   quiet                           stop the heartbeats - hpm should go back to the comms
+*                                   pins after its hwwm_timeout
+*   talk                            start them again
+*   quit                            or the end of the input
+* Every line hpm sends is printed as it comes in, after the seconds since the start; an
+* answer to a command also gets the time it took to come, in milliseconds. When hpm
+* answers a heartbeat with "no command" - it went back to the comms pins - the last
+* command is sent again, as hwwm does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAXSENDS             5
+
+struct sockaddr_un hpm_addr;
+int sock = -1;
+
+unsigned long seq = 0;
+
+/* the last command given, */
+unsigned int power = 0, avoid = 0, battery = 0;
+short given = 0;
+
+/* and the one waiting for an answer */
+char pending[200];
+unsigned long pending_seq = 0;
+short sends = 0;
+double sent_at = 0;
+double first_sent_at = 0;
+
+static double
+now() {
+    struct timespec t;
+
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+send_line(const char *msg) {
+    if (sendto( sock, msg, strlen(msg), 0, (struct sockaddr *)&hpm_addr, sizeof(hpm_addr) ) == -1) {
+        perror( "hwwm-standin: sending to hpm" );
+    }
+}
+
+static void
+send_pending() {
+    sent_at = now();
+    if (!sends) first_sent_at = sent_at;
+    sends++;
+    send_line( pending );
+}
+
+static void
+send_command() {
+    sprintf( pending, "hwwm cmd %lu power=%u avoid=%u battery=%u\n", ++seq, power, avoid, battery );
+    pending_seq = seq;
+    sends = 0;
+    given = 1;
+    send_pending();
+}
+
+/* a line typed in; returns -1 to quit */
+static int
+command(char *line, short *talk) {
+    char w1[20] = "", w2[20] = "";
+    unsigned int p, v1 = 0, v2 = 0;
+    int n;
+
+    n = sscanf( line, "power %u %19s %u %19s %u", &p, w1, &v1, w2, &v2 );
+    if (n >= 1) {
+        power = p;
+        avoid = battery = 0;
+        if (!strcmp( w1, "avoid" )) avoid = v1;
+        if (!strcmp( w1, "battery" )) battery = v1;
+        if (!strcmp( w2, "avoid" )) avoid = v2;
+        if (!strcmp( w2, "battery" )) battery = v2;
+        send_command();
+        return 0;
+    }
+    if (!strncmp( line, "quiet", 5 )) *talk = 0;
+    else if (!strncmp( line, "talk", 4 )) *talk = 1;
+    else if (!strncmp( line, "quit", 4 )) return -1;
+    else if (line[0] != '\n') fprintf( stderr, "power N [avoid M] [battery 1], quiet, talk or quit\n" );
+    return 0;
+}
+
+static void
+received(char *msg, double start) {
+    unsigned long s;
+
+    msg[strcspn( msg, "\n" )] = 0;
+    if ((sscanf( msg, "hpm ack %lu", &s ) == 1) || (sscanf( msg, "hpm nak %lu", &s ) == 1)) {
+        if (sends && (s == pending_seq)) {
+            printf( "%9.3f %s  (%.1f ms, %d sent)\n", now() - start, msg, (now() - first_sent_at) * 1000, sends );
+            sends = 0;
+            fflush( stdout );
+            return;
+        }
+    }
+    printf( "%9.3f %s\n", now() - start, msg );
+    fflush( stdout );
+    if (given && !sends && (sscanf( msg, "hpm nak %lu", &s ) == 1) && strstr( msg, "no command" )) send_command();
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hwwm-standin [-s hpm socket] [-l own socket] [-b heartbeat seconds] [-r resend ms]\n" );
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_un own;
+    struct pollfd pfd[2];
+    const char *hpm_path = "/run/hpm.sock";
+    const char *own_path = "/run/hwwm.sock";
+    double beat = 5, resend = 1.0;
+    double start, next_beat, wait;
+    char line[200], msg[300], hb[60];
+    short talk = 1;
+    ssize_t len;
+    int opt;
+
+    while ((opt = getopt( argc, argv, "s:l:b:r:" )) != -1) {
+        switch (opt) {
+            case 's': hpm_path = optarg; break;
+            case 'l': own_path = optarg; break;
+            case 'b': beat = atof( optarg ); break;
+            case 'r': resend = atof( optarg ) / 1000; break;
+            default: usage();
+        }
+    }
+    if ((optind < argc) || (beat <= 0) || (resend <= 0)) usage();
+
+    memset( &hpm_addr, 0, sizeof(hpm_addr) );
+    hpm_addr.sun_family = AF_UNIX;
+    strncpy( hpm_addr.sun_path, hpm_path, sizeof(hpm_addr.sun_path)-1 );
+    memset( &own, 0, sizeof(own) );
+    own.sun_family = AF_UNIX;
+    strncpy( own.sun_path, own_path, sizeof(own.sun_path)-1 );
+    sock = socket( AF_UNIX, SOCK_DGRAM, 0 );
+    unlink( own.sun_path );
+    if ((sock == -1) || bind( sock, (struct sockaddr *)&own, sizeof(own) )) {
+        perror( "hwwm-standin: own socket" );
+        return 2;
+    }
+
+    start = now();
+    next_beat = start;
+    while (1) {
+        if (talk && (now() >= next_beat)) {
+            sprintf( hb, "hwwm hb %lu\n", ++seq );
+            send_line( hb );
+            next_beat = now() + beat;
+        }
+        if (sends && (now() - sent_at >= resend)) {
+            if (sends < MAXSENDS) send_pending();
+            else {
+                printf( "%9.3f no answer to command %lu\n", now() - start, pending_seq );
+                fflush( stdout );
+                sends = 0;
+            }
+        }
+        wait = talk ? next_beat - now() : 1;
+        if (sends && (sent_at + resend - now() < wait)) wait = sent_at + resend - now();
+        if (wait < 0) wait = 0;
+
+        pfd[0].fd = sock;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = 0;
+        pfd[1].events = POLLIN;
+        if (poll( pfd, 2, (int)(wait * 1000) + 1 ) <= 0) continue;
+        if (pfd[0].revents & POLLIN) {
+            len = recv( sock, msg, sizeof(msg)-1, 0 );
+            if (len > 0) {
+                msg[len] = 0;
+                received( msg, start );
+            }
+        }
+        if (pfd[1].revents & (POLLIN | POLLHUP)) {
+            if ((fgets( line, sizeof(line), stdin ) == NULL) || (command( line, &talk ) == -1)) break;
+        }
+    }
+    close( sock );
+    unlink( own.sun_path );
+    return 0;
+}
+
+/* EOF */